@@ -29,675 +29,3056 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "spiflash.h"
 
-#define DECR_WAIT(_ms) ( (1 * (_ms) / 2) == 0 ? 1 : (1 * (_ms) / 2) )
+#ifdef SPIFLASH_CONST_HEADER
+#include SPIFLASH_CONST_HEADER
+#endif
+
+// config and command table, compile time constants if so built
+#ifdef SPIFLASH_CFG_CONST
+#define _CFG(_spi)    ((void)(_spi), &(SPIFLASH_CFG_CONST))
+#else
+#define _CFG(_spi)    ((_spi)->cfg)
+#endif
+#ifdef SPIFLASH_CMD_CONST
+#define _CMD(_spi)    ((void)(_spi), &(SPIFLASH_CMD_CONST))
+#else
+#define _CMD(_spi)    ((_spi)->cmd_tbl)
+#endif
+
+#define DECR_WAIT(_us) ( (1 * (_us) / 2) < 1000 ? 1000 : (1 * (_us) / 2000) * 1000 )
 #define BCW_IDLE    0
 #define BCW_WAIT    1
 #define BCW_READ_SR 2
 #define BCW_CHECK   3
+#define BCW_READY   4
+#define QE_OFF      0
+#define QE_ON       1
+#define QE_VERIFY   2
+#define XIP_OFF       0
+#define XIP_ARMED     1
+#define XIP_ACTIVE    2
+#define XIP_MAPPED    3
+#define XIP_UNMAPPED  4
+#define SUS_IDLE    0
+#define SUS_CMD     1
+#define SUS_CHECK   2
+#define SUS_WAIT    3
+#define SUS_READ    4
+#define SUS_RESUME  5
+#define SUS_POLL_US 20
+#define TM_SR_WRITE       0
+#define TM_PAGE_PROGRAM   1
+#define TM_BLOCK_ERASE_4  2
+#define TM_CHIP_ERASE     7
+#define TM_NONE           0xff
+#define BUS_NO_WAIT   0
+#define BUS_WAIT_OP   1
+#define BUS_WAIT_BCW  2
+#define SEQ_NONE            0
+#define SEQ_ERASE_PRESERVE  1
+#define SEQ_UPDATE          2
+#define SEQ_APPEND          3
+#define SEQ_VERIFY          4
+#define SEQ_CRC32           5
+#define UPD_READ      0
+#define UPD_CHECK     1
+#define UPD_PROGRAM   2
+#define UPD_ERASED    3
+#define UPD_NEXT      4
+#define ADDR_3B_END   0x1000000
 
 static const uint8_t MultiplyDeBruijnBitPosition[32] = {
-  32, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+  0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
   31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
 };
 
-static uint8_t _spiflash_clz(uint32_t v) {
+static uint8_t _spiflash_ctz(uint32_t v) {
   // stolen from https://graphics.stanford.edu/~seander/bithacks.html#ZerosOnRightMultLookup
+  if (v == 0) return 32;
   return MultiplyDeBruijnBitPosition[((uint32_t)((v & -v) * 0x077CB531U)) >> 27];
 }
 
 static int _spiflash_is_hwbusy(spiflash_t *spi, uint8_t sr) {
-  return (sr & spi->cmd_tbl->sr_busy_bit);
+  return (sr & _CMD(spi)->sr_busy_bit);
+}
+
+static uint8_t _spiflash_addr_4b(spiflash_t *spi, uint32_t addr, uint32_t len) {
+  // with 3 byte addresses, 4 byte commands are needed beyond 16 MB
+  return _CFG(spi)->addr_sz < 4 && _CFG(spi)->sz > ADDR_3B_END &&
+      addr + len > ADDR_3B_END;
+}
+
+static uint8_t _spiflash_is_4b(spiflash_t *spi) {
+  // current transaction uses 4 byte commands, known at compile time for
+  // small constant configs
+  return _CFG(spi)->addr_sz < 4 && _CFG(spi)->sz > ADDR_3B_END && spi->ctx->addr_4b;
+}
+
+static uint8_t _spiflash_addr_sz(spiflash_t *spi) {
+  // address bytes of current transaction
+  return _spiflash_is_4b(spi) ? 4 : _CFG(spi)->addr_sz;
+}
+
+static uint8_t _spiflash_addr_len(spiflash_t *spi) {
+  // address and address dummy bytes of current transaction
+  return _spiflash_addr_sz(spi) + _CFG(spi)->addr_dummy_sz;
 }
 
 static void _spiflash_compose_address(spiflash_t *spi, uint32_t addr, uint8_t *buf) {
   uint8_t i;
-  for (i = 0; i < spi->cfg->addr_sz; i++) {
-    buf[i] = (spi->cfg->addr_endian ?
-        ( addr >> (8*((spi->cfg->addr_sz - 1) - i)) ) :
+  uint8_t addr_sz = _spiflash_addr_sz(spi);
+  for (i = 0; i < addr_sz; i++) {
+    buf[i] = (_CFG(spi)->addr_endian ?
+        ( addr >> (8*((addr_sz - 1) - i)) ) :
         ( addr >> (8*i) )
         ) & 0xff;
   }
 }
 
-static void _spiflash_finalize(spiflash_t *spi) {
-  spi->wait_period_ms = 0;
-  spi->busy_pre_check = 0;
-  spi->busy_check_wait = BCW_IDLE;
+static uint8_t _spiflash_get_lanes(spiflash_t *spi) {
+  if (spi->hal->_spiflash_spi_txrx_lanes == 0) return 1;
+  if (_CFG(spi)->lanes >= 4 && (_CMD(spi)->qe_bit == 0 || spi->quad_en == QE_ON)) return 4;
+  if (_CFG(spi)->lanes >= 2) return 2;
+  return 1;
 }
 
-static uint16_t _spiflash_get_supported_block_mask(spiflash_t *spi) {
-  // bit 0:256 1:512 2:1K 3:2K 4:4K 5:8K 6:16K 7:32K 8:64K etc
-  uint16_t bm = 0 |
-      (spi->cmd_tbl->block_erase_4 ? (1<<4) : 0) |
-      (spi->cmd_tbl->block_erase_8 ? (1<<5) : 0) |
-      (spi->cmd_tbl->block_erase_16 ? (1<<6) : 0) |
-      (spi->cmd_tbl->block_erase_32 ? (1<<7) : 0) |
-      (spi->cmd_tbl->block_erase_64 ? (1<<8) : 0);
-  return bm;
+static uint8_t _spiflash_get_multi_read_cmd(spiflash_t *spi, uint8_t four,
+    uint8_t *addr_lanes, uint8_t *data_lanes, uint8_t *dummy) {
+  const spiflash_cmd_tbl_t *cmd = _CMD(spi);
+  uint8_t lanes = _spiflash_get_lanes(spi);
+  uint8_t quad_io = four ? cmd->read_data_quad_io_4b : cmd->read_data_quad_io;
+  uint8_t quad_out = four ? cmd->read_data_quad_out_4b : cmd->read_data_quad_out;
+  uint8_t dual_io = four ? cmd->read_data_dual_io_4b : cmd->read_data_dual_io;
+  uint8_t dual_out = four ? cmd->read_data_dual_out_4b : cmd->read_data_dual_out;
+  // with a burst wrap set, quad i/o reads wrap and are only used for lines
+  if (lanes >= 4 && quad_io && (!spi->wrap || (spi->ctx && spi->ctx->rd_wrap))) {
+    *addr_lanes = 4; *data_lanes = 4; *dummy = cmd->read_data_quad_io_dummy;
+    return quad_io;
+  } else if (lanes >= 4 && quad_out) {
+    *addr_lanes = 1; *data_lanes = 4; *dummy = cmd->read_data_quad_out_dummy;
+    return quad_out;
+  } else if (lanes >= 2 && dual_io) {
+    *addr_lanes = 2; *data_lanes = 2; *dummy = cmd->read_data_dual_io_dummy;
+    return dual_io;
+  } else if (lanes >= 2 && dual_out) {
+    *addr_lanes = 1; *data_lanes = 2; *dummy = cmd->read_data_dual_out_dummy;
+    return dual_out;
+  }
+  return 0;
 }
 
-static uint32_t _spiflash_get_largest_erase_area(spiflash_t *spi, uint32_t addr, uint32_t len) {
-  uint32_t res = 0;
-  uint16_t bm = _spiflash_get_supported_block_mask(spi);
-  uint8_t bm_lz = _spiflash_clz(bm);
-  uint8_t addr_lz = _spiflash_clz(addr);
-
-  bm >>= bm_lz;
-  bm_lz += 8; // block mask starts at 256 bytes
+static int _spiflash_compose_multi_read(spiflash_t *spi, uint8_t xip, uint32_t addr,
+    uint32_t len, spiflash_xfer_t *xfer) {
+  uint8_t *buf = &spi->ctx->tx_internal_buf[0];
+  uint8_t cmd;
+  memset(xfer, 0, sizeof(spiflash_xfer_t));
+  // in continuous read mode the command cannot change, so the address
+  // size is decided by the size of the flash
+  spi->ctx->addr_4b = xip != XIP_OFF ? _spiflash_addr_4b(spi, 0, _CFG(spi)->sz) :
+      _spiflash_addr_4b(spi, addr, len);
+  cmd = _spiflash_get_multi_read_cmd(spi, _spiflash_is_4b(spi),
+      &xfer->addr_lanes, &xfer->data_lanes, &xfer->dummy_cycles);
+  if (cmd == 0x00) return SPIFLASH_ERR_BAD_CONFIG;
+  xfer->hdr = buf;
+  xfer->cmd_lanes = 1;
+  if (xip != XIP_ACTIVE) {
+    // in continuous read mode, the command is omitted
+    *buf++ = cmd;
+    xfer->cmd_len = 1;
+  }
+  _spiflash_compose_address(spi, addr, buf);
+  xfer->addr_len = _spiflash_addr_len(spi);
+  if (xip == XIP_ARMED || xip == XIP_ACTIVE || xip == XIP_MAPPED) {
+    // mode bits are clocked on the address lanes, eating from the dummy cycles
+    uint8_t mode_cycles = 8 / xfer->addr_lanes;
+    if (xfer->addr_lanes == 1 || xfer->dummy_cycles < mode_cycles) {
+      return SPIFLASH_ERR_BAD_CONFIG;
+    }
+    buf[xfer->addr_len] = _CMD(spi)->xip_mode_bits;
+    xfer->mode_len = 1;
+    xfer->dummy_cycles -= mode_cycles;
+  }
+  return SPIFLASH_OK;
+}
 
-  // check length against smallest erase block
-  if ((len & ((1 << bm_lz) - 1)) != 0) return 0;
+static int _spiflash_xip_exit_txrx(spiflash_t *spi) {
+  // mode bit reset: all ones over address and mode bits
+  spiflash_xfer_t xfer;
+  int res = _spiflash_compose_multi_read(spi, spi->xip, 0, 0, &xfer);
+  if (res != SPIFLASH_OK) return res;
+  memset(&spi->ctx->tx_internal_buf[0], 0xff, xfer.addr_len + 1);
+  xfer.cmd_len = 0;
+  xfer.mode_len = 1;
+  xfer.dummy_cycles = 0;
+  spi->hal->_spiflash_spi_cs(spi, 1);
+  res = spi->hal->_spiflash_spi_txrx_lanes(spi, &xfer);
+  return res;
+}
 
-  while (bm != 0) {
-    if (addr_lz >= bm_lz && len >= (uint32_t)(1 << bm_lz)) {
-      res = 1 << bm_lz;
+static void _spiflash_xip_remap(spiflash_t *spi) {
+  spiflash_xfer_t xfer;
+  if (spi->xip != XIP_UNMAPPED) return;
+  spi->xip = XIP_ARMED;
+  if (_spiflash_compose_multi_read(spi, spi->xip, 0, 0, &xfer) == SPIFLASH_OK) {
+    spi->xip = XIP_MAPPED;
+    if (spi->hal->_spiflash_xip_map(spi, &xfer) != SPIFLASH_OK) {
+      // keep on reading through the driver
+      spi->xip = XIP_ARMED;
     }
+  }
+}
+
+static uint8_t _spiflash_get_quad_program_cmd(spiflash_t *spi, uint8_t *addr_lanes) {
+  if (_spiflash_get_lanes(spi) < 4) return 0;
+  if (_spiflash_is_4b(spi)) {
+    *addr_lanes = 1;
+    return _CMD(spi)->page_program_quad_in_4b;
+  } else if (_CMD(spi)->page_program_quad_io) {
+    *addr_lanes = 4;
+    return _CMD(spi)->page_program_quad_io;
+  } else if (_CMD(spi)->page_program_quad_in) {
+    *addr_lanes = 1;
+    return _CMD(spi)->page_program_quad_in;
+  }
+  return 0;
+}
 
-    bm >>= 1;
-    bm_lz++;
+static spiflash_req_t *_spiflash_q_at(spiflash_t *spi, uint8_t ix) {
+  return &spi->q->reqs[(spi->q->head + ix) % spi->q->cap];
+}
 
-    uint8_t new_bm_lz = _spiflash_clz(bm);
-    if (new_bm_lz == 32) new_bm_lz =0 ;
-    bm >>= new_bm_lz;
-    bm_lz += new_bm_lz;
+static void _spiflash_queue_remove(spiflash_t *spi, uint8_t ix, spiflash_req_t *req) {
+  *req = *_spiflash_q_at(spi, ix);
+  while (ix > 0) {
+    *_spiflash_q_at(spi, ix) = *_spiflash_q_at(spi, ix - 1);
+    ix--;
   }
+  spi->q->head = (spi->q->head + 1) % spi->q->cap;
+  spi->q->len--;
+}
 
-  return res;
+static void _spiflash_queue_insert(spiflash_t *spi, const spiflash_req_t *req,
+    uint8_t ahead_of_equal) {
+  uint8_t ix = spi->q->len;
+  // never move the request being run, nor the read served during its suspend
+  uint8_t first = spi->q_run ? (spi->ctx->susp && spi->ctx->susp->q ? 2 : 1) : 0;
+  while (ix > first) {
+    spiflash_req_t *prev = _spiflash_q_at(spi, ix - 1);
+    if (prev->prio > req->prio || (prev->prio == req->prio && !ahead_of_equal)) break;
+    *_spiflash_q_at(spi, ix) = *prev;
+    ix--;
+  }
+  *_spiflash_q_at(spi, ix) = *req;
+  spi->q->len++;
 }
 
-static uint8_t _spiflash_get_erase_cmd(spiflash_t *spi, uint32_t len) {
-  if (len == 4*1024 && spi->cmd_tbl->block_erase_4)
-    return spi->cmd_tbl->block_erase_4;
-  else if (len == 8*1024 && spi->cmd_tbl->block_erase_8)
-    return spi->cmd_tbl->block_erase_8;
-  else if (len == 16*1024 && spi->cmd_tbl->block_erase_16)
-    return spi->cmd_tbl->block_erase_16;
-  else if (len == 32*1024 && spi->cmd_tbl->block_erase_32)
-    return spi->cmd_tbl->block_erase_32;
-  else if (len == 64*1024 && spi->cmd_tbl->block_erase_64)
-    return spi->cmd_tbl->block_erase_64;
-  else
-    return 0;
+static void _spiflash_queue_finish(spiflash_t *spi, uint8_t ix, int res) {
+  // copy, as the slot may be reused from the callback
+  spiflash_req_t req;
+  if (ix == 0) spi->q_run = 0;
+  _spiflash_queue_remove(spi, ix, &req);
+  if (req.cb) {
+    req.cb(spi, &req, res);
+  }
 }
 
-static uint32_t _spiflash_get_erase_time(spiflash_t *spi, uint32_t len) {
-  if (len == 4*1024)
-    return spi->cfg->block_erase_4_ms;
-  else if (len == 8*1024)
-    return spi->cfg->block_erase_8_ms;
-  else if (len == 16*1024)
-    return spi->cfg->block_erase_16_ms;
-  else if (len == 32*1024)
-    return spi->cfg->block_erase_32_ms;
-  else if (len == 64*1024)
-    return spi->cfg->block_erase_64_ms;
-  else
-    return 0;
+static void _spiflash_queue_requeue(spiflash_t *spi) {
+  // put preempted request back, still in front of later ones of its priority
+  spiflash_req_t req;
+  spi->q_run = 0;
+  spi->q->preempt = 0;
+  _spiflash_queue_remove(spi, 0, &req);
+  _spiflash_queue_insert(spi, &req, 1);
 }
 
-static int _spiflash_begin_async(spiflash_t *spi) {
+static int _spiflash_queue_preempt(spiflash_t *spi) {
+  return spi->q_run && spi->q->len > 1 &&
+      _spiflash_q_at(spi, 1)->prio > _spiflash_q_at(spi, 0)->prio;
+}
+
+static spiflash_op_t _spiflash_get_fast_read_op(spiflash_t *spi) {
+  uint8_t addr_lanes, data_lanes, dummy;
+  if (_spiflash_get_multi_read_cmd(spi, 0, &addr_lanes, &data_lanes, &dummy)) {
+    return SPIFLASH_OP_QUAD_READ;
+  } else {
+    return _CMD(spi)->read_data_fast ? SPIFLASH_OP_FAST_READ : SPIFLASH_OP_READ;
+  }
+}
+
+static void _spiflash_critical(spiflash_t *spi, uint8_t enter) {
+  if (spi->async && spi->hal->_spiflash_critical) {
+    spi->hal->_spiflash_critical(spi, enter);
+  }
+}
+
+static int _spiflash_enter(spiflash_t *spi) {
+  // attach an operation context for the call, unless one is attached
   int res = SPIFLASH_OK;
+  uint8_t i;
+  _spiflash_critical(spi, 1);
+  if (spi->ctx == 0 && spi->pool == 0) {
+    res = SPIFLASH_ERR_BAD_CONFIG;
+  } else if (spi->ctx == 0) {
+    for (i = 0; i < spi->pool->cnt && spi->pool->ctxs[i].spi; i++);
+    if (i < spi->pool->cnt) {
+      spi->ctx = &spi->pool->ctxs[i];
+      spi->ctx->spi = spi;
+    } else {
+      res = SPIFLASH_ERR_BUSY;
+    }
+  }
+  if (res == SPIFLASH_OK) spi->nest++;
+  _spiflash_critical(spi, 0);
+  return res;
+}
 
-  if (spi->op == SPIFLASH_OP_IDLE) {
-    return SPIFLASH_ERR_BAD_STATE;
+static int _spiflash_leave(spiflash_t *spi, int res) {
+  // give the operation context back once the outermost call returns and
+  // nothing runs, passing on res
+  spiflash_op_ctx_t *ctx = spi->ctx;
+  _spiflash_critical(spi, 1);
+  if (--spi->nest == 0 && spi->op == SPIFLASH_OP_IDLE && !spi->q_run &&
+      ctx->seq == SEQ_NONE && ctx->bus_wait == BUS_NO_WAIT &&
+      (ctx->susp == 0 || ctx->susp->op == SPIFLASH_OP_IDLE) &&
+      (ctx->st == 0 || (!ctx->st->run && !ctx->st->paused && ctx->st->filled == 0))) {
+    ctx->st = 0;
+    ctx->pr = 0;
+    ctx->spi = 0;
+    spi->ctx = 0;
   }
-  
-  if (spi->busy_pre_check) {
-    // busy check: issue read sr
-    SPIF_DBG("precheck...\n");
-    spi->hal->_spiflash_spi_cs(spi, 1);
-    res = spi->hal->_spiflash_spi_txrx(spi, &spi->cmd_tbl->read_sr, 1, &spi->sr_data, 1);
-    return res;
+  _spiflash_critical(spi, 0);
+  return res;
+}
+
+static int _spiflash_bus_request(spiflash_t *spi) {
+  int res;
+  if (spi->hal->_spiflash_bus == 0 || spi->ctx->bus_held) return SPIFLASH_OK;
+  res = spi->hal->_spiflash_bus(spi, 1);
+  if (res == SPIFLASH_OK) {
+    spi->ctx->bus_held = 1;
+  } else if (res == SPIFLASH_BUS_QUEUED && !spi->async) {
+    res = SPIFLASH_ERR_BUSY;
   }
-  
-  switch (spi->op) {
-  case SPIFLASH_OP_WRITE_sWREN: {
-    // write: issue write enable
-    SPIF_DBG("write - enable...\n");
-    spi->hal->_spiflash_spi_cs(spi, 1);
-    res = spi->hal->_spiflash_spi_txrx(spi, &spi->cmd_tbl->write_enable, 1, 0, 0);
-    return res;
+  return res;
+}
+
+static void _spiflash_bus_release(spiflash_t *spi) {
+  if (spi->ctx->bus_held) {
+    spi->ctx->bus_held = 0;
+    spi->hal->_spiflash_bus(spi, 0);
   }
-  case SPIFLASH_OP_WRITE_sADDR: {
-    // write: issue write address
-    SPIF_DBG("write - address...\n");
-    spi->hal->_spiflash_spi_cs(spi, 1);
-    spi->tx_internal_buf[0] = spi->cmd_tbl->page_program;
-    _spiflash_compose_address(spi, spi->addr, &spi->tx_internal_buf[1]);
-    res = spi->hal->_spiflash_spi_txrx(spi,
-        &spi->tx_internal_buf[0],
-        1 + spi->cfg->addr_sz + spi->cfg->addr_dummy_sz,
-        0, 0);
-    return res;
+}
+
+#if SPIFLASH_STATS || SPIFLASH_TRACE
+static uint32_t _spiflash_now(spiflash_t *spi) {
+  return spi->hal->_spiflash_time_us ? spi->hal->_spiflash_time_us(spi) : 0;
+}
+#endif
+
+#if SPIFLASH_TRACE
+static void _spiflash_trace(spiflash_t *spi, uint8_t ev, int res) {
+  spiflash_trace_t *t;
+  if (spi->tr == 0) return;
+  t = &spi->tr[spi->tr_head];
+  if (++spi->tr_head == spi->tr_cnt) spi->tr_head = 0;
+  t->ts = _spiflash_now(spi);
+  t->addr = spi->ctx->addr;
+  t->len = spi->ctx->rd_len;
+  t->ev = ev;
+  t->op = spi->op;
+  t->bcw = spi->ctx->busy_check_wait;
+  if (res == SPIFLASH_OK) {
+    t->err = 0;
+  } else if (res < _SPIFLASH_ERR_BASE && res > _SPIFLASH_ERR_BASE - 0xff) {
+    t->err = _SPIFLASH_ERR_BASE - res;
+  } else {
+    t->err = 0xff;
   }
-  case SPIFLASH_OP_WRITE_sDATA: {
-    // write: data ordered in pages
-    uint32_t rem_pg_sz = spi->cfg->page_sz - (spi->addr & (spi->cfg->page_sz - 1));
-    uint32_t wr_sz = spi->wr_len < rem_pg_sz ? spi->wr_len : rem_pg_sz;
-    SPIF_DBG("write - data %i of %i wait...\n", wr_sz, spi->wr_len);
-    const uint8_t *wr_buf = spi->wr_buf;
-    spi->wr_buf += wr_sz;
-    spi->wr_len -= wr_sz;
-    spi->addr += wr_sz;
-    spi->wait_period_ms = spi->cfg->page_program_ms;
-    spi->busy_check_wait = BCW_WAIT;
-    res = spi->hal->_spiflash_spi_txrx(spi, wr_buf, wr_sz, 0, 0);
-    return res;
+}
+#else
+#define _spiflash_trace(_spi, _ev, _res)
+#endif
+
+#if SPIFLASH_STATS
+
+static uint32_t _spiflash_stats_len(spiflash_t *spi) {
+  // bytes of the operation about to start, including following segments
+  uint32_t len, i;
+  switch (spi->op) {
+  case SPIFLASH_OP_READ:
+  case SPIFLASH_OP_FAST_READ:
+  case SPIFLASH_OP_QUAD_READ:
+  case SPIFLASH_OP_READ_SFDP:
+  case SPIFLASH_OP_CRC32:
+    len = spi->ctx->rd_len;
+    if (spi->ctx->st && spi->ctx->st->run) len += spi->ctx->st->left;
+    break;
+  case SPIFLASH_OP_WRITE_sWREN:
+    len = spi->ctx->wr_len;
+    if (spi->ctx->pr) len += spi->ctx->pr->left;
+    break;
+  case SPIFLASH_OP_ERASE_BLOCK_sWREN:
+    return spi->ctx->erase_len;
+  case SPIFLASH_OP_ERASE_CHIP_sWREN:
+    return _CFG(spi)->sz;
+  default:
+    return 0;
   }
+  for (i = 0; i < spi->ctx->iov_cnt; i++) {
+    len += spi->ctx->iov[i].len;
+  }
+  return len;
+}
 
-  case SPIFLASH_OP_ERASE_BLOCK_sWREN: {
-    // erase: issue write enable
-    SPIF_DBG("erase - enable...\n");
-    spi->hal->_spiflash_spi_cs(spi, 1);
-    res = spi->hal->_spiflash_spi_txrx(spi, &spi->cmd_tbl->write_enable, 1, 0, 0);
-    return res;
+static void _spiflash_stats_start(spiflash_t *spi) {
+  if (spi->stats == 0) return;
+  spi->ctx->stats_op = spi->op;
+  spi->ctx->stats_t0 = _spiflash_now(spi);
+  spi->stats->op[spi->op].bytes += _spiflash_stats_len(spi);
+}
+
+static void _spiflash_stats_end(spiflash_t *spi) {
+  spiflash_op_stats_t *st;
+  uint32_t us;
+  if (spi->stats == 0 || spi->ctx->stats_op == SPIFLASH_OP_IDLE) return;
+  st = &spi->stats->op[spi->ctx->stats_op];
+  us = _spiflash_now(spi) - spi->ctx->stats_t0;
+  spi->ctx->stats_op = SPIFLASH_OP_IDLE;
+  st->count++;
+  st->total_us += us;
+  if (st->count == 1 || us < st->min_us) st->min_us = us;
+  if (us > st->max_us) st->max_us = us;
+}
+#else
+#define _spiflash_stats_start(_spi)
+#define _spiflash_stats_end(_spi)
+#endif
+
+static void _spiflash_finalize(spiflash_t *spi) {
+  _spiflash_stats_end(spi);
+  spi->ctx->wait_period_us = 0;
+  spi->ctx->busy_pre_check = 0;
+  spi->ctx->busy_check_wait = BCW_IDLE;
+  spi->ctx->xip_pre_exit = 0;
+  spi->ctx->sus = SUS_IDLE;
+  spi->ctx->iov_cnt = 0;
+  spi->ctx->seg_cont = 0;
+  spi->ctx->rd_wrap = 0;
+  spi->ctx->pr = 0;
+  if (spi->ctx->sq) spi->ctx->sq->vf_len = 0;
+  if (spi->ctx->susp && spi->ctx->susp->q) {
+    // queued read is left in queue
+    spi->ctx->susp->q = 0;
+    spi->ctx->susp->op = SPIFLASH_OP_IDLE;
   }
-  case SPIFLASH_OP_ERASE_BLOCK_sERAS: {
-    // erase: issue write address
-    uint32_t era_sz = _spiflash_get_largest_erase_area(spi, spi->addr, spi->erase_len);
-    SPIF_DBG("erase - address %08x size %08x wait...\n", spi->addr, era_sz);
-    spi->hal->_spiflash_spi_cs(spi, 1);
-    uint8_t cmd = _spiflash_get_erase_cmd(spi, era_sz);
-    uint32_t era_time =_spiflash_get_erase_time(spi, era_sz);
-    if (cmd == 0x00) return SPIFLASH_ERR_BAD_CONFIG;
-    spi->tx_internal_buf[0] = cmd;
-    _spiflash_compose_address(spi, spi->addr, &spi->tx_internal_buf[1]);
-    spi->addr += era_sz;
-    spi->erase_len -= era_sz;
-    spi->wait_period_ms = era_time;
-    spi->busy_check_wait = BCW_WAIT;
-    res = spi->hal->_spiflash_spi_txrx(spi,
-        &spi->tx_internal_buf[0],
-        1 + spi->cfg->addr_sz + spi->cfg->addr_dummy_sz,
-        0, 0);
-    return res;
+  _spiflash_xip_remap(spi);
+  _spiflash_bus_release(spi);
+}
+
+static int _spiflash_sus_overlaps(spiflash_t *spi, uint32_t addr, uint32_t len) {
+  // if a read touches the block being erased or the page being programmed,
+  // spi->ctx->addr is already past it. Erases below 4k are taken as 4k
+  uint32_t sz, end;
+  if (spi->op == SPIFLASH_OP_ERASE_BLOCK_sERAS) {
+    sz = (4*1024) << (spi->ctx->tm - TM_BLOCK_ERASE_4);
+    end = spi->ctx->addr;
+  } else {
+    sz = _CFG(spi)->page_sz;
+    end = ((spi->ctx->addr - 1) & ~(sz - 1)) + sz;
   }
+  return addr < end && addr + len > end - sz;
+}
 
-  case SPIFLASH_OP_WRITE_SR_sWREN: {
-    // write_sr: issue write enable
-    SPIF_DBG("write_sr - enable...\n");
-    spi->hal->_spiflash_spi_cs(spi, 1);
-    res = spi->hal->_spiflash_spi_txrx(spi, &spi->cmd_tbl->write_enable, 1, 0, 0);
-    return res;
+static int _spiflash_get_pending_read(spiflash_t *spi) {
+  spiflash_req_t *req = 0;
+  spiflash_req_t tmp;
+  uint8_t ix;
+  if (spi->ctx->susp->op != SPIFLASH_OP_IDLE) {
+    return !_spiflash_sus_overlaps(spi, spi->ctx->susp->addr, spi->ctx->susp->len);
   }
-  case SPIFLASH_OP_WRITE_SR_sDATA: {
-    // write_sr: data
-    SPIF_DBG("write_sr - data wait...\n");
-    spi->tx_internal_buf[1] = spi->sr_data;
-    spi->tx_internal_buf[0] = spi->cmd_tbl->write_sr;
-    spi->hal->_spiflash_spi_cs(spi, 1);
-    spi->wait_period_ms = spi->cfg->sr_write_ms;
-    spi->busy_check_wait = BCW_WAIT;
-    res = spi->hal->_spiflash_spi_txrx(spi, &spi->tx_internal_buf[0], 2, 0, 0);
-    return res;
+  if (!_spiflash_queue_preempt(spi)) return 0;
+  // first of the more urgent reads not overlapping the erase or program, the
+  // others stay queued until it is done
+  for (ix = 1; ix < spi->q->len; ix++) {
+    req = _spiflash_q_at(spi, ix);
+    if (req->prio <= _spiflash_q_at(spi, 0)->prio ||
+        (req->type != SPIFLASH_REQ_READ && req->type != SPIFLASH_REQ_FAST_READ)) {
+      return 0;
+    }
+    if (!_spiflash_sus_overlaps(spi, req->addr, req->len)) break;
   }
+  if (ix == spi->q->len) return 0;
+  // served from slot 1
+  tmp = *req;
+  for (; ix > 1; ix--) {
+    *_spiflash_q_at(spi, ix) = *_spiflash_q_at(spi, ix - 1);
+  }
+  req = _spiflash_q_at(spi, 1);
+  *req = tmp;
+  spi->ctx->susp->addr = req->addr;
+  spi->ctx->susp->len = req->len;
+  spi->ctx->susp->buf = req->rd_buf;
+  spi->ctx->susp->op = req->type == SPIFLASH_REQ_READ ? SPIFLASH_OP_READ : _spiflash_get_fast_read_op(spi);
+  spi->ctx->susp->q = 1;
+  return 1;
+}
 
-  case SPIFLASH_OP_ERASE_CHIP_sWREN: {
-    // erase chip: issue write enable
-    SPIF_DBG("erase chip - enable...\n");
-    spi->hal->_spiflash_spi_cs(spi, 1);
-    res = spi->hal->_spiflash_spi_txrx(spi, &spi->cmd_tbl->write_enable, 1, 0, 0);
-    return res;
+static uint8_t *_spiflash_cache_mem(spiflash_t *spi, uint16_t ix) {
+  return &spi->cache->mem[(uint32_t)ix * spi->cache->line_sz];
+}
+
+static int _spiflash_cache_find(spiflash_t *spi, uint32_t line_addr) {
+  uint16_t ix;
+  for (ix = 0; ix < spi->cache->cnt; ix++) {
+    if (spi->cache->lines[ix].addr == line_addr) return ix;
   }
-  case SPIFLASH_OP_ERASE_CHIP_sERAS: {
-    // erase chip: cmd
-    SPIF_DBG("erase chip - command wait...\n");
-    spi->hal->_spiflash_spi_cs(spi, 1);
-    spi->tx_internal_buf[0] = spi->cmd_tbl->chip_erase;
-    spi->wait_period_ms = spi->cfg->chip_erase_ms;
-    spi->busy_check_wait = BCW_WAIT;
-    res = spi->hal->_spiflash_spi_txrx(spi, &spi->tx_internal_buf[0], 1, 0, 0);
-    return res;
+  return -1;
+}
+
+static uint16_t _spiflash_cache_victim(spiflash_t *spi) {
+  // free line, or least recently used
+  uint16_t ix, lru = 0;
+  for (ix = 0; ix < spi->cache->cnt; ix++) {
+    if (spi->cache->lines[ix].addr == SPIFLASH_CACHE_NO_LINE) return ix;
+    if (spi->cache->lines[ix].used < spi->cache->lines[lru].used) lru = ix;
   }
+  return lru;
+}
 
-  case SPIFLASH_OP_READ: {
-    // read: issue address and read
-    SPIF_DBG("read - address and data...\n");
-    spi->hal->_spiflash_spi_cs(spi, 1);
-    spi->tx_internal_buf[0] = spi->cmd_tbl->read_data;
-    _spiflash_compose_address(spi, spi->addr, &spi->tx_internal_buf[1]);
+static int _spiflash_cache_lookup(spiflash_t *spi, uint32_t addr, uint32_t len,
+    uint8_t *buf) {
+  uint32_t mask = spi->cache->line_sz - 1;
+  uint32_t a;
+  // all lines must be cached
+  for (a = addr & ~mask; a < addr + len; a += spi->cache->line_sz) {
+    if (_spiflash_cache_find(spi, a) < 0) return 0;
+  }
+  while (len > 0) {
+    uint16_t ix = (uint16_t)_spiflash_cache_find(spi, addr & ~mask);
+    uint32_t o = addr & mask;
+    uint32_t n = spi->cache->line_sz - o < len ? spi->cache->line_sz - o : len;
+    memcpy(buf, _spiflash_cache_mem(spi, ix) + o, n);
+    spi->cache->lines[ix].used = ++spi->cache->used;
+    buf += n;
+    addr += n;
+    len -= n;
+  }
+  return 1;
+}
 
-    res = spi->hal->_spiflash_spi_txrx(spi,
-        &spi->tx_internal_buf[0],
-        1 + spi->cfg->addr_sz + spi->cfg->addr_dummy_sz,
-        spi->rd_buf, spi->rd_len);
-    return res;
+static void _spiflash_cache_apply(spiflash_t *spi, uint32_t addr, uint32_t len,
+    const uint8_t *data) {
+  // programming only clears bits, erasing (data NULL) sets them
+  uint16_t ix;
+  if (spi->cache == 0) return;
+  for (ix = 0; ix < spi->cache->cnt; ix++) {
+    uint32_t la = spi->cache->lines[ix].addr;
+    uint32_t a0, a1;
+    uint8_t *mem;
+    if (la == SPIFLASH_CACHE_NO_LINE) continue;
+    a0 = addr > la ? addr : la;
+    a1 = addr + len < la + spi->cache->line_sz ? addr + len : la + spi->cache->line_sz;
+    if (a0 >= a1) continue;
+    mem = _spiflash_cache_mem(spi, ix);
+    if (data) {
+      uint32_t a;
+      for (a = a0; a < a1; a++) {
+        mem[a - la] &= data[a - addr];
+      }
+    } else {
+      memset(&mem[a0 - la], 0xff, a1 - a0);
+    }
   }
+}
 
-  case SPIFLASH_OP_FAST_READ: {
-    // fast read: issue address and read
-    SPIF_DBG("read fast - address and data...\n");
-    spi->hal->_spiflash_spi_cs(spi, 1);
-    spi->tx_internal_buf[0] = spi->cmd_tbl->read_data_fast;
-    _spiflash_compose_address(spi, spi->addr, &spi->tx_internal_buf[1]);
-    spi->tx_internal_buf[1 + spi->cfg->addr_sz + 1] = 0; // dummy for fast read
-    res = spi->hal->_spiflash_spi_txrx(spi,
-        &spi->tx_internal_buf[0],
-        1 + spi->cfg->addr_sz + 1 + spi->cfg->addr_dummy_sz,
-        spi->rd_buf, spi->rd_len);
-    return res;
+static void _spiflash_cache_end(spiflash_t *spi, int res) {
+  if (spi->cache == 0) {
+    return;
+  } else if (res != SPIFLASH_OK) {
+    // cannot tell what was altered
+    spi->cache->fill = 0;
+    SPIFLASH_cache_invalidate(spi);
+  } else if (spi->cache->fill) {
+    uint16_t ix = spi->cache->fill - 1;
+    spi->cache->fill = 0;
+    spi->cache->lines[ix].addr = spi->cache->fill_addr;
+    spi->cache->lines[ix].used = ++spi->cache->used;
+    memcpy(spi->ctx->rd_dst, _spiflash_cache_mem(spi, ix) +
+        (spi->ctx->rd_dst_addr - spi->cache->fill_addr), spi->ctx->rd_dst_len);
   }
+}
 
-  case SPIFLASH_OP_READ_JEDEC: {
-    // read_jedec
-    SPIF_DBG("read_jedec...\n");
-    spi->hal->_spiflash_spi_cs(spi, 1);
-    res = spi->hal->_spiflash_spi_txrx(spi, &spi->cmd_tbl->jedec_id, 1, (uint8_t *)spi->id_dst, 3);
-    return res;
+static void _spiflash_wbuf_overlay(spiflash_t *spi, uint32_t addr, uint32_t len,
+    uint8_t *buf) {
+  // pending data will be programmed, so it can only clear bits
+  uint32_t a0, a1, a;
+  if (spi->wb == 0) return;
+  a0 = addr > spi->wb->addr ? addr : spi->wb->addr;
+  a1 = addr + len < spi->wb->addr + spi->wb->len ?
+      addr + len : spi->wb->addr + spi->wb->len;
+  for (a = a0; a < a1; a++) {
+    buf[a - addr] &= spi->wb->buf[a - spi->wb->addr];
   }
+}
 
-  case SPIFLASH_OP_READ_PRODUCT: {
-    // read_jedec
-    SPIF_DBG("read_prod...\n");
-    spi->hal->_spiflash_spi_cs(spi, 1);
-    res = spi->hal->_spiflash_spi_txrx(spi, &spi->cmd_tbl->device_id, 1, (uint8_t *)spi->id_dst, 3);
-    return res;
+static void _spiflash_wbuf_end(spiflash_t *spi, int res) {
+  if (spi->wb && spi->wb->flushing) {
+    spi->wb->flushing = 0;
+    if (res == SPIFLASH_OK) spi->wb->len = 0;
+  }
+  if (spi->ctx->rd_dst && spi->ctx->rd_dst_v) {
+    if (res == SPIFLASH_OK) {
+      uint32_t i;
+      for (i = 0; i < spi->ctx->rd_dst_len; i++) {
+        const spiflash_iov_t *iov = &spi->ctx->rd_dst_iov[i];
+        _spiflash_wbuf_overlay(spi, iov->addr, iov->len, iov->buf);
+      }
+    }
+    spi->ctx->rd_dst = 0;
+    spi->ctx->rd_dst_v = 0;
+  } else if (spi->ctx->rd_dst) {
+    if (res == SPIFLASH_OK) {
+      _spiflash_wbuf_overlay(spi, spi->ctx->rd_dst_addr, spi->ctx->rd_dst_len, spi->ctx->rd_dst);
+    }
+    spi->ctx->rd_dst = 0;
   }
+}
 
-  case SPIFLASH_OP_READ_SR:
-  case SPIFLASH_OP_READ_SR_BUSY: {
-    // read_sr
-    SPIF_DBG("read_sr...\n");
-    spi->hal->_spiflash_spi_cs(spi, 1);
-    res = spi->hal->_spiflash_spi_txrx(spi, &spi->cmd_tbl->read_sr, 1, (uint8_t *)spi->sr_dst, 1);
-    return res;
+static void _spiflash_finish_now(spiflash_t *spi) {
+  // operation finished without spi communication
+  if (spi->q_run) {
+    _spiflash_queue_finish(spi, 0, SPIFLASH_OK);
+  } else if (spi->async && spi->async_cb) {
+    spi->async_cb(spi, SPIFLASH_OP_IDLE, SPIFLASH_OK);
   }
+}
 
-  case SPIFLASH_OP_READ_REG: {
-    // read_reg
-    SPIF_DBG("read_reg...\n");
-    spi->hal->_spiflash_spi_cs(spi, 1);
-    res = spi->hal->_spiflash_spi_txrx(spi, &spi->reg_nbr, 1, (uint8_t *)spi->reg_dst, 1);
-    return res;
+static int _spiflash_can_suspend(spiflash_t *spi) {
+  return spi->ctx->susp && _CMD(spi)->suspend && _CMD(spi)->resume &&
+      (spi->op == SPIFLASH_OP_ERASE_BLOCK_sERAS || spi->op == SPIFLASH_OP_WRITE_sDATA);
+}
+
+static void _spiflash_set_wait(spiflash_t *spi, uint8_t tm, uint32_t typ_us) {
+  spiflash_timing_t *t = spi->timing;
+  spi->ctx->tm = tm;
+  if (t) t->waited_us = 0;
+  if (typ_us == 0 || tm == TM_NONE || t == 0) {
+    spi->ctx->wait_period_us = typ_us;
+    return;
   }
+  if (t->est_us[tm] == 0) {
+    t->est_us[tm] = typ_us;
+  }
+  spi->ctx->wait_period_us = t->est_us[tm] - t->est_us[tm] / 8;
+}
 
-  case SPIFLASH_OP_WRITE_REG_sWREN: {
-    // write_reg: issue write enable
-    SPIF_DBG("write_reg - enable...\n");
-    spi->hal->_spiflash_spi_cs(spi, 1);
-    res = spi->hal->_spiflash_spi_txrx(spi, &spi->cmd_tbl->write_enable, 1, 0, 0);
-    return res;
+static void _spiflash_set_poll_wait(spiflash_t *spi) {
+  if (spi->ctx->tm == TM_NONE || spi->timing == 0) {
+    spi->ctx->wait_period_us = DECR_WAIT(spi->ctx->wait_period_us);
+  } else {
+    spi->ctx->wait_period_us = spi->timing->est_us[spi->ctx->tm] / 16;
+    if (spi->ctx->wait_period_us == 0) spi->ctx->wait_period_us = 1;
   }
-  case SPIFLASH_OP_WRITE_REG_DATA:
-  case SPIFLASH_OP_WRITE_REG_sDATAWAIT: {
-    // write_reg: data
-    SPIF_DBG("write_reg - data%s...\n", spi->op == SPIFLASH_OP_WRITE_REG_DATA ? "" : " wait");
-    spi->hal->_spiflash_spi_cs(spi, 1);
-    spi->busy_check_wait = spi->op == SPIFLASH_OP_WRITE_REG_DATA ? BCW_IDLE : BCW_WAIT;
-    res = spi->hal->_spiflash_spi_txrx(spi, &spi->tx_internal_buf[0], 2, 0, 0);
-    return res;
+}
+
+static void _spiflash_update_timing(spiflash_t *spi) {
+  // estimate moves a quarter towards how long the operation was waited for
+  spiflash_timing_t *t = spi->timing;
+  uint32_t est;
+  if (spi->ctx->tm == TM_NONE || t == 0 || t->waited_us == 0) return;
+  est = t->est_us[spi->ctx->tm];
+  if (t->waited_us > est) {
+    est += (t->waited_us - est) / 4;
+  } else {
+    est -= (est - t->waited_us) / 4;
   }
+  t->est_us[spi->ctx->tm] = est ? est : 1;
+}
 
-  case SPIFLASH_OP_IDLE:
-  default:
-    res = SPIFLASH_ERR_INTERNAL;
-    break;
-  } // switch (spi->op)
+static int _spiflash_split_wait(spiflash_t *spi) {
+  return spi->async && _CFG(spi)->suspend_poll_ms && _spiflash_can_suspend(spi);
+}
 
-  return res;
+static int _spiflash_wait_ready(spiflash_t *spi) {
+  spiflash_poll_t poll;
+  poll.cmd = _CMD(spi)->read_sr;
+  poll.mask = _CMD(spi)->sr_busy_bit;
+  poll.match = 0;
+  poll.typ_us = (spi->ctx->tm == TM_NONE || spi->timing == 0) ?
+      spi->ctx->wait_period_us : spi->timing->est_us[spi->ctx->tm];
+  poll.interval_us = poll.typ_us ? poll.typ_us / 16 : 1000;
+  if (poll.interval_us == 0) poll.interval_us = 1;
+  return spi->hal->_spiflash_wait_ready(spi, &poll);
 }
 
+static void _spiflash_busy_wait(spiflash_t *spi) {
+  uint32_t us = spi->ctx->wait_period_us;
+  if (us > _CFG(spi)->suspend_poll_ms * 1000 && _spiflash_split_wait(spi)) {
+    // split the wait, so pending reads need not wait for all of it
+    us = _CFG(spi)->suspend_poll_ms * 1000;
+  }
+  // let others use the bus meanwhile
+  _spiflash_bus_release(spi);
+  if (us == 0) {
+    // busy pin
+    spi->hal->_spiflash_wait(spi, 0);
+    return;
+  }
+  if (spi->hal->_spiflash_wait_us == 0) {
+    // rounded up to whole milliseconds
+    us = (us + 999) / 1000 * 1000;
+  }
+  if (spi->timing) spi->timing->waited_us += us;
+#if SPIFLASH_STATS
+  if (spi->stats) spi->stats->op[spi->ctx->stats_op].wait_us += us;
+#endif
+  if (spi->hal->_spiflash_wait_us) {
+    spi->hal->_spiflash_wait_us(spi, us);
+  } else {
+    spi->hal->_spiflash_wait(spi, us / 1000);
+  }
+}
 
+static uint16_t _spiflash_get_supported_block_mask(spiflash_t *spi, uint8_t four) {
+  // bit 0:256 1:512 2:1K 3:2K 4:4K 5:8K 6:16K 7:32K 8:64K etc
+  if (four) {
+    return 0 |
+        (_CMD(spi)->block_erase_4_4b ? (1<<4) : 0) |
+        (_CMD(spi)->block_erase_32_4b ? (1<<7) : 0) |
+        (_CMD(spi)->block_erase_64_4b ? (1<<8) : 0);
+  }
+  uint16_t bm = 0 |
+      (_CMD(spi)->block_erase_4 ? (1<<4) : 0) |
+      (_CMD(spi)->block_erase_8 ? (1<<5) : 0) |
+      (_CMD(spi)->block_erase_16 ? (1<<6) : 0) |
+      (_CMD(spi)->block_erase_32 ? (1<<7) : 0) |
+      (_CMD(spi)->block_erase_64 ? (1<<8) : 0);
+  return bm;
+}
 
-static int _spiflash_end_async(spiflash_t *spi, int res) {
-  // handle early termination
-  if (res != SPIFLASH_OK) {
-    _spiflash_finalize(spi);
-    return res;
+static uint8_t _spiflash_get_erase_cmd(spiflash_t *spi, uint32_t len) {
+  if (_spiflash_is_4b(spi)) {
+    return len == 4*1024 ? _CMD(spi)->block_erase_4_4b :
+        len == 32*1024 ? _CMD(spi)->block_erase_32_4b :
+        len == 64*1024 ? _CMD(spi)->block_erase_64_4b : 0;
   }
-  
-  // handle busy pre check
-  if (spi->busy_pre_check) {
-    if (_spiflash_is_hwbusy(spi, spi->sr_data)) {
-      spi->hal->_spiflash_spi_cs(spi, 0);
-      SPIF_DBG("precheck busy\n");
-      return SPIFLASH_ERR_HW_BUSY;
-    } else {
-      SPIF_DBG("precheck ok\n");
-      spi->busy_pre_check = 0;
-      return _spiflash_begin_async(spi);
-    }
+  if (len == 4*1024 && _CMD(spi)->block_erase_4)
+    return _CMD(spi)->block_erase_4;
+  else if (len == 8*1024 && _CMD(spi)->block_erase_8)
+    return _CMD(spi)->block_erase_8;
+  else if (len == 16*1024 && _CMD(spi)->block_erase_16)
+    return _CMD(spi)->block_erase_16;
+  else if (len == 32*1024 && _CMD(spi)->block_erase_32)
+    return _CMD(spi)->block_erase_32;
+  else if (len == 64*1024 && _CMD(spi)->block_erase_64)
+    return _CMD(spi)->block_erase_64;
+  else
+    return 0;
+}
+
+static uint8_t _spiflash_get_erase_tm(uint32_t len) {
+  uint8_t tm = TM_BLOCK_ERASE_4;
+  while (len > 4*1024 && tm < TM_CHIP_ERASE - 1) {
+    len >>= 1;
+    tm++;
   }
-  
+  return tm;
+}
+
+static uint32_t _spiflash_get_erase_time(spiflash_t *spi, uint32_t len) {
+  if (len == 4*1024)
+    return _CFG(spi)->block_erase_4_ms;
+  else if (len == 8*1024)
+    return _CFG(spi)->block_erase_8_ms;
+  else if (len == 16*1024)
+    return _CFG(spi)->block_erase_16_ms;
+  else if (len == 32*1024)
+    return _CFG(spi)->block_erase_32_ms;
+  else if (len == 64*1024)
+    return _CFG(spi)->block_erase_64_ms;
+  else
+    return 0;
+}
+
+static int _spiflash_data_txrx(spiflash_t *spi, uint8_t lanes,
+    const uint8_t *tx, uint32_t tx_len, uint8_t *rx, uint32_t rx_len) {
+  if (lanes > 1) {
+    spiflash_xfer_t xfer;
+    memset(&xfer, 0, sizeof(xfer));
+    xfer.data_lanes = lanes;
+    xfer.tx_data = tx;
+    xfer.tx_len = tx_len;
+    xfer.rx_data = rx;
+    xfer.rx_len = rx_len;
+    return spi->hal->_spiflash_spi_txrx_lanes(spi, &xfer);
+  } else {
+    return spi->hal->_spiflash_spi_txrx(spi, tx, tx_len, rx, rx_len);
+  }
+}
+
+static uint8_t _spiflash_seg_cont(spiflash_t *spi, uint32_t end, uint32_t addr,
+    uint32_t len) {
+  // segment continues the transaction ending at end, unless it would read
+  // beyond 16 MB on 3 byte addresses, or wraps to the start of the line
+  if (spi->ctx->rd_wrap && end % spi->wrap == 0 && addr == end - spi->wrap) return 1;
+  return addr == end && (_spiflash_is_4b(spi) || !_spiflash_addr_4b(spi, addr, len));
+}
+
+static int _spiflash_first_seg(spiflash_t *spi, const spiflash_iov_t **iov,
+    uint32_t *iovcnt) {
+  // skips leading empty segments, as _spiflash_peek_seg does between segments
+  if (*iov == 0 && *iovcnt) return SPIFLASH_ERR_BAD_CONFIG;
+  while (*iovcnt && (*iov)->len == 0) {
+    (*iov)++;
+    (*iovcnt)--;
+  }
+  if (*iovcnt == 0) {
+    // nothing to do
+    _spiflash_finish_now(spi);
+  }
+  return SPIFLASH_OK;
+}
+
+static const spiflash_iov_t *_spiflash_peek_seg(spiflash_t *spi) {
+  uint32_t i;
+  for (i = 0; i < spi->ctx->iov_cnt; i++) {
+    if (spi->ctx->iov[i].len) return &spi->ctx->iov[i];
+  }
+  return 0;
+}
+
+static uint8_t *_spiflash_stream_buf(spiflash_t *spi, uint8_t ix) {
+  return &spi->ctx->st->bufs[((spi->ctx->st->head + ix) % spi->ctx->st->cnt) * spi->ctx->st->sz];
+}
+
+static int _spiflash_stream_next(spiflash_t *spi) {
+  // hand over filled buffer, continue into next free one
+  uint32_t n;
+  spi->ctx->st->filled++;
+  _spiflash_wbuf_overlay(spi, spi->ctx->addr, spi->ctx->rd_len, spi->ctx->rd_buf);
+  spi->ctx->st->cb(spi, spi->ctx->rd_buf, spi->ctx->rd_len);
+  if (spi->ctx->st->left == 0) {
+    SPIF_DBG("stream - done\n");
+    spi->ctx->st->run = 0;
+    return 0;
+  }
+  if (spi->ctx->st->filled >= spi->ctx->st->cnt) {
+    SPIF_DBG("stream - pause at %08x\n", spi->ctx->st->addr);
+    spi->ctx->st->run = 0;
+    spi->ctx->st->paused = 1;
+    return 0;
+  }
+  n = spi->ctx->st->left < spi->ctx->st->sz ? spi->ctx->st->left : spi->ctx->st->sz;
+  spi->ctx->seg_cont = _spiflash_seg_cont(spi, spi->ctx->st->addr, spi->ctx->st->addr, n);
+  spi->ctx->addr = spi->ctx->st->addr;
+  spi->ctx->rd_buf = _spiflash_stream_buf(spi, spi->ctx->st->filled);
+  spi->ctx->rd_len = n;
+  spi->ctx->st->addr += n;
+  spi->ctx->st->left -= n;
+  return 1;
+}
+
+static int _spiflash_produce(spiflash_t *spi) {
+  // have next page produced into the buffer not programmed from
+  int res;
+  uint32_t rem_pg_sz = _CFG(spi)->page_sz - (spi->ctx->pr->addr & (_CFG(spi)->page_sz - 1));
+  uint32_t n = spi->ctx->pr->left < rem_pg_sz ? spi->ctx->pr->left : rem_pg_sz;
+  uint8_t *buf = &spi->ctx->pr->bufs[spi->ctx->pr->ix * _CFG(spi)->page_sz];
+  if (spi->ctx->pr->ready || spi->ctx->pr->left == 0) return SPIFLASH_OK;
+  SPIF_DBG("write - produce %08x %i\n", spi->ctx->pr->addr, n);
+  res = spi->ctx->pr->cb(spi, spi->ctx->pr->addr, buf, n);
+  if (res != SPIFLASH_OK) return res;
+  _spiflash_cache_apply(spi, spi->ctx->pr->addr, n, buf);
+  spi->ctx->pr->ready = 1;
+  return SPIFLASH_OK;
+}
+
+static int _spiflash_produce_next(spiflash_t *spi) {
+  // program from the produced page
+  uint32_t rem_pg_sz = _CFG(spi)->page_sz - (spi->ctx->pr->addr & (_CFG(spi)->page_sz - 1));
+  uint32_t n = spi->ctx->pr->left < rem_pg_sz ? spi->ctx->pr->left : rem_pg_sz;
+  if (spi->ctx->pr->left == 0) return 0;
+  spi->ctx->pr->res = _spiflash_produce(spi);
+  if (spi->ctx->pr->res != SPIFLASH_OK) return 0;
+  spi->ctx->seg_cont = 0;
+  spi->ctx->addr = spi->ctx->pr->addr;
+  spi->ctx->wr_buf = &spi->ctx->pr->bufs[spi->ctx->pr->ix * _CFG(spi)->page_sz];
+  spi->ctx->wr_len = n;
+  spi->ctx->pr->ix ^= 1;
+  spi->ctx->pr->ready = 0;
+  spi->ctx->pr->addr += n;
+  spi->ctx->pr->left -= n;
+  return 1;
+}
+
+static int _spiflash_next_seg(spiflash_t *spi, uint32_t end) {
+  // load next non empty segment, check if it continues the previous one
+  // which ended at given address
+  const spiflash_iov_t *iov = _spiflash_peek_seg(spi);
+  if (iov == 0) {
+    spi->ctx->iov_cnt = 0;
+    if (spi->ctx->st && spi->ctx->st->run) return _spiflash_stream_next(spi);
+    if (spi->ctx->pr) return _spiflash_produce_next(spi);
+    return 0;
+  }
+  spi->ctx->iov_cnt -= iov - spi->ctx->iov + 1;
+  spi->ctx->iov = iov + 1;
+  spi->ctx->seg_cont = _spiflash_seg_cont(spi, end, iov->addr, iov->len);
+  spi->ctx->addr = iov->addr;
+  spi->ctx->rd_buf = iov->buf;
+  spi->ctx->rd_len = iov->len;
+  return 1;
+}
+
+static uint32_t _spiflash_get_erase_cost(spiflash_t *spi, uint32_t sz) {
+  // cost of erasing one block, the running estimate if there is one
+  uint8_t tm = _spiflash_get_erase_tm(sz);
+  if (spi->timing && spi->timing->est_us[tm]) return spi->timing->est_us[tm];
+  return _spiflash_get_erase_time(spi, sz) * 1000;
+}
+
+static uint32_t _spiflash_get_block_cost(spiflash_t *spi, uint16_t bm,
+    uint32_t sz, uint32_t min_sz) {
+  // cheapest way of erasing an aligned block, as one or as two halves
+  uint32_t split = sz > min_sz ? 2 * _spiflash_get_block_cost(spi, bm, sz / 2, min_sz) : 0xffffffff;
+  if (bm & (sz >> 8)) {
+    uint32_t cost = _spiflash_get_erase_cost(spi, sz);
+    return cost <= split ? cost : split;
+  }
+  return split;
+}
+
+static uint32_t _spiflash_get_erase_area(spiflash_t *spi, uint32_t addr, uint32_t len) {
+  // returns size of the block to erase first at addr, in the cheapest way
+  // of erasing the range, or 0 if range is unaligned
+  uint16_t bm = _spiflash_get_supported_block_mask(spi, _spiflash_addr_4b(spi, addr, 1));
+  uint32_t min_sz, sz;
+  if (bm == 0) return 0;
+  min_sz = 256 << _spiflash_ctz(bm);
+  if (len == 0 || ((addr | len) & (min_sz - 1)) != 0) return 0;
+
+  // largest aligned block within range
+  sz = 256;
+  while ((bm >> 1) >= (sz >> 8)) sz <<= 1;
+  while (sz > min_sz && ((addr & (sz - 1)) != 0 || sz > len)) sz >>= 1;
+
+  // as long as it is cheaper, erase halves instead
+  while (sz > min_sz && ((bm & (sz >> 8)) == 0 ||
+      2 * _spiflash_get_block_cost(spi, bm, sz / 2, min_sz) < _spiflash_get_erase_cost(spi, sz))) {
+    sz >>= 1;
+  }
+  return sz;
+}
+
+static uint32_t _spiflash_get_min_erase_sz(spiflash_t *spi) {
+  uint16_t bm = _spiflash_get_supported_block_mask(spi, 0);
+  return bm ? 256 << _spiflash_ctz(bm) : 0;
+}
+
+static int _spiflash_is_chip_erase_cheaper(spiflash_t *spi, uint32_t addr, uint32_t len) {
+  uint32_t cost = 0;
+  uint32_t chip_cost;
+  if (addr != 0 || len != _CFG(spi)->sz || _CMD(spi)->chip_erase == 0x00) return 0;
+  chip_cost = spi->timing && spi->timing->est_us[TM_CHIP_ERASE] ?
+      spi->timing->est_us[TM_CHIP_ERASE] : _CFG(spi)->chip_erase_ms * 1000;
+  while (len > 0 && cost < chip_cost) {
+    uint32_t sz = _spiflash_get_erase_area(spi, addr, len);
+    if (sz == 0) break;
+    cost += _spiflash_get_erase_cost(spi, sz);
+    addr += sz;
+    len -= sz;
+  }
+  return chip_cost <= cost || len > 0;
+}
+
+static int _spiflash_compose_read(spiflash_t *spi, spiflash_op_t op, uint8_t xip,
+    uint32_t addr, uint32_t len, spiflash_xfer_t *xfer) {
+  uint8_t cmd;
+  if (op == SPIFLASH_OP_QUAD_READ) {
+    return _spiflash_compose_multi_read(spi, xip, addr, len, xfer);
+  }
+  memset(xfer, 0, sizeof(spiflash_xfer_t));
+  spi->ctx->addr_4b = _spiflash_addr_4b(spi, addr, len);
+  xfer->hdr = &spi->ctx->tx_internal_buf[0];
+  xfer->cmd_len = 1;
+  xfer->addr_len = _spiflash_addr_len(spi);
+  xfer->cmd_lanes = 1;
+  xfer->addr_lanes = 1;
+  xfer->data_lanes = 1;
+  _spiflash_compose_address(spi, addr, &spi->ctx->tx_internal_buf[1]);
+  switch (op) {
+  case SPIFLASH_OP_READ:
+    cmd = _spiflash_is_4b(spi) ? _CMD(spi)->read_data_4b : _CMD(spi)->read_data;
+    break;
+  case SPIFLASH_OP_FAST_READ:
+    cmd = _spiflash_is_4b(spi) ? _CMD(spi)->read_data_fast_4b : _CMD(spi)->read_data_fast;
+    spi->ctx->tx_internal_buf[1 + xfer->addr_len] = 0; // dummy for fast read
+    xfer->addr_len++;
+    break;
+  default:
+    return SPIFLASH_ERR_INTERNAL;
+  }
+  if (cmd == 0x00) return SPIFLASH_ERR_BAD_CONFIG;
+  spi->ctx->tx_internal_buf[0] = cmd;
+  return SPIFLASH_OK;
+}
+
+static int _spiflash_read_txrx(spiflash_t *spi, spiflash_op_t op, uint8_t xip,
+    uint32_t addr, uint8_t *buf, uint32_t len) {
+  int res;
+  spiflash_xfer_t xfer;
+  SPIF_DBG("read%s - address and data%s...\n",
+      op == SPIFLASH_OP_READ ? "" : op == SPIFLASH_OP_FAST_READ ? " fast" : " quad",
+      xip == XIP_ACTIVE ? " xip" : "");
+  res = _spiflash_compose_read(spi, op, xip, addr, len, &xfer);
+  if (res != SPIFLASH_OK) return res;
+  spi->hal->_spiflash_spi_cs(spi, 1);
+  if (op == SPIFLASH_OP_QUAD_READ) {
+    xfer.rx_data = buf;
+    xfer.rx_len = len;
+    res = spi->hal->_spiflash_spi_txrx_lanes(spi, &xfer);
+  } else {
+    res = spi->hal->_spiflash_spi_txrx(spi, xfer.hdr, xfer.cmd_len + xfer.addr_len,
+        buf, len);
+  }
+  return res;
+}
+
+static int _spiflash_crc_txrx(spiflash_t *spi, uint32_t addr, uint32_t len) {
+  // read without storing, the hal runs the data through the crc
+  int res;
+  spiflash_xfer_t xfer;
+  SPIF_DBG("crc - address and data...\n");
+  res = _spiflash_compose_read(spi, _spiflash_get_fast_read_op(spi), XIP_OFF,
+      addr, len, &xfer);
+  if (res != SPIFLASH_OK) return res;
+  xfer.rx_len = len;
+  spi->ctx->sq->crc = 0;
+  spi->hal->_spiflash_spi_cs(spi, 1);
+  return spi->hal->_spiflash_spi_rx_crc32(spi, &xfer, &spi->ctx->sq->crc);
+}
+
+static uint32_t _spiflash_vf_chunk(spiflash_t *spi) {
+  // bytes of the programmed page to read back next
+  if (spi->hal->_spiflash_spi_rx_crc32) return spi->ctx->sq->vf_len;
+  return spi->ctx->sq->vf_len < SPIFLASH_CHUNK_SZ ? spi->ctx->sq->vf_len : SPIFLASH_CHUNK_SZ;
+}
+
+static void _spiflash_chain_data(spiflash_xfer_t *xfer, uint8_t lanes) {
+  memset(xfer, 0, sizeof(spiflash_xfer_t));
+  xfer->cmd_lanes = 1;
+  xfer->addr_lanes = 1;
+  xfer->data_lanes = lanes;
+}
+
+static int _spiflash_read_chain(spiflash_t *spi) {
+  // read current and all continuing segments in one transfer
+  spiflash_xfer_t xfer[SPIFLASH_CHAIN_MAX];
+  uint8_t addr_lanes, data_lanes = 1, dummy;
+  uint8_t n = 0;
+  int res;
+  if (spi->op == SPIFLASH_OP_QUAD_READ) {
+    _spiflash_get_multi_read_cmd(spi, _spiflash_is_4b(spi), &addr_lanes, &data_lanes, &dummy);
+  }
+  if (spi->ctx->seg_cont) {
+    SPIF_DBG("read chain - continue...\n");
+    _spiflash_chain_data(&xfer[0], data_lanes);
+  } else {
+    SPIF_DBG("read chain - address and data...\n");
+    res = _spiflash_compose_read(spi, spi->op, spi->xip, spi->ctx->addr, spi->ctx->rd_len, &xfer[0]);
+    if (res != SPIFLASH_OK) return res;
+    if (spi->op == SPIFLASH_OP_QUAD_READ) data_lanes = xfer[0].data_lanes;
+  }
+  xfer[0].rx_data = spi->ctx->rd_buf;
+  xfer[0].rx_len = spi->ctx->rd_len;
+  while (n + 1 < SPIFLASH_CHAIN_MAX) {
+    const spiflash_iov_t *next = _spiflash_peek_seg(spi);
+    if (next == 0 || !_spiflash_seg_cont(spi, spi->ctx->addr + spi->ctx->rd_len, next->addr, next->len)) break;
+    _spiflash_next_seg(spi, spi->ctx->addr + spi->ctx->rd_len);
+    n++;
+    _spiflash_chain_data(&xfer[n], data_lanes);
+    xfer[n].rx_data = spi->ctx->rd_buf;
+    xfer[n].rx_len = spi->ctx->rd_len;
+    xfer[n - 1].next = &xfer[n];
+  }
+  spi->hal->_spiflash_spi_cs(spi, 1);
+  return spi->hal->_spiflash_spi_txrx_chain(spi, &xfer[0]);
+}
+
+static uint32_t _spiflash_count_ff(const uint8_t *buf, uint32_t len) {
+  // number of leading 0xff bytes, a word at a time
+  uint32_t n = 0;
+  uint32_t w;
+  while (n + sizeof(w) <= len) {
+    memcpy(&w, &buf[n], sizeof(w));
+    if (w != 0xffffffff) break;
+    n += sizeof(w);
+  }
+  while (n < len && buf[n] == 0xff) n++;
+  return n;
+}
+
+static uint32_t _spiflash_count_ff_rev(const uint8_t *buf, uint32_t len) {
+  // number of trailing 0xff bytes, a word at a time
+  uint32_t n = 0;
+  uint32_t w;
+  while (n + sizeof(w) <= len) {
+    memcpy(&w, &buf[len - n - sizeof(w)], sizeof(w));
+    if (w != 0xffffffff) break;
+    n += sizeof(w);
+  }
+  while (n < len && buf[len - n - 1] == 0xff) n++;
+  return n;
+}
+
+static int _spiflash_write_skip(spiflash_t *spi) {
+  // skip data that needs no programming up to next page program, returns 1
+  // if there is nothing left to program
+  while (1) {
+    while (spi->ctx->wr_len) {
+      uint32_t rem_pg_sz = _CFG(spi)->page_sz - (spi->ctx->addr & (_CFG(spi)->page_sz - 1));
+      uint32_t wr_sz = spi->ctx->wr_len < rem_pg_sz ? spi->ctx->wr_len : rem_pg_sz;
+      uint32_t ff = _spiflash_count_ff(spi->ctx->wr_buf, wr_sz);
+      if (ff < wr_sz && _CFG(spi)->write_skip != SPIFLASH_WRITE_SKIP_BYTES) ff = 0;
+      if (ff == 0) return 0;
+      SPIF_DBG("write - skip %i\n", ff);
+      spi->ctx->wr_buf += ff;
+      spi->ctx->wr_len -= ff;
+      spi->ctx->addr += ff;
+      if (ff < wr_sz) return 0;
+    }
+    if (!_spiflash_next_seg(spi, spi->ctx->addr)) return 1;
+  }
+}
+
+static int _spiflash_write_piece(spiflash_t *spi, const uint8_t **buf, uint32_t *len) {
+  // take data for page program from current segment, returns 1 if the next
+  // segment is to continue the same page program
+  uint32_t rem_pg_sz = _CFG(spi)->page_sz - (spi->ctx->addr & (_CFG(spi)->page_sz - 1));
+  uint32_t wr_sz = spi->ctx->wr_len < rem_pg_sz ? spi->ctx->wr_len : rem_pg_sz;
+  uint32_t addr = spi->ctx->addr;
+  SPIF_DBG("write - data %i of %i...\n", wr_sz, spi->ctx->wr_len);
+  *buf = spi->ctx->wr_buf;
+  *len = wr_sz;
+  spi->ctx->wr_buf += wr_sz;
+  spi->ctx->wr_len -= wr_sz;
+  spi->ctx->addr += wr_sz;
+  const spiflash_iov_t *next = spi->ctx->wr_len == 0 ? _spiflash_peek_seg(spi) : 0;
+  if (next && next->addr == spi->ctx->addr && wr_sz < rem_pg_sz &&
+      !_CFG(spi)->write_verify) {
+    spi->ctx->busy_check_wait = BCW_IDLE;
+    return 1;
+  } else {
+    if (_CFG(spi)->write_skip == SPIFLASH_WRITE_SKIP_BYTES) {
+      // leave out trailing bytes needing no programming
+      *len -= _spiflash_count_ff_rev(*buf, *len);
+    }
+    if (_CFG(spi)->write_verify) {
+      // read back once programmed
+      spi->ctx->sq->vf_addr = addr;
+      spi->ctx->sq->vf_src = *buf;
+      spi->ctx->sq->vf_len = *len;
+    }
+    _spiflash_set_wait(spi, TM_PAGE_PROGRAM, _CFG(spi)->page_program_us ?
+        _CFG(spi)->page_program_us : _CFG(spi)->page_program_ms * 1000);
+    spi->ctx->busy_check_wait = BCW_WAIT;
+    return 0;
+  }
+}
+
+static int _spiflash_write_chain(spiflash_t *spi, spiflash_xfer_t *xfer) {
+  // feed current and all continuing segments of the page program in one
+  // transfer, xfer[0] may hold command and address
+  uint8_t n = 0;
+  while (_spiflash_write_piece(spi, &xfer[n].tx_data, &xfer[n].tx_len) &&
+      n + 1 < SPIFLASH_CHAIN_MAX) {
+    _spiflash_next_seg(spi, spi->ctx->addr);
+    n++;
+    _spiflash_chain_data(&xfer[n], xfer[0].data_lanes);
+    xfer[n - 1].next = &xfer[n];
+  }
+  return spi->hal->_spiflash_spi_txrx_chain(spi, &xfer[0]);
+}
+
+static spiflash_op_t _spiflash_write_next(spiflash_t *spi) {
+  // page program done: finish, give way to a queued request or go on
+  if (spi->ctx->wr_len == 0 || (_CFG(spi)->write_skip && _spiflash_write_skip(spi))) {
+    SPIF_DBG("write - data ok, finish\n");
+    return SPIFLASH_OP_IDLE;
+  } else if (_spiflash_queue_preempt(spi)) {
+    SPIF_DBG("write - data ok, preempted\n");
+    spiflash_req_t *req = _spiflash_q_at(spi, 0);
+    req->addr = spi->ctx->addr;
+    req->len = spi->ctx->wr_len;
+    req->wr_buf = spi->ctx->wr_buf;
+    spi->q->preempt = 1;
+    return SPIFLASH_OP_IDLE;
+  }
+  SPIF_DBG("write - data ok, new chunk\n");
+  return SPIFLASH_OP_WRITE_sWREN;
+}
+
+static int _spiflash_begin_suspend(spiflash_t *spi) {
+  int res = SPIFLASH_OK;
+  switch (spi->ctx->sus) {
+  case SUS_CMD:
+    SPIF_DBG("suspend...\n");
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    res = spi->hal->_spiflash_spi_txrx(spi, &_CMD(spi)->suspend, 1, 0, 0);
+    return res;
+  case SUS_CHECK:
+    SPIF_DBG("suspend - check...\n");
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    res = spi->hal->_spiflash_spi_txrx(spi, &_CMD(spi)->read_sr, 1, &spi->ctx->sr_data, 1);
+    return res;
+  case SUS_READ:
+    SPIF_DBG("suspend - read...\n");
+    // never enter continuous read mode while suspended
+    return _spiflash_read_txrx(spi, spi->ctx->susp->op, XIP_OFF,
+        spi->ctx->susp->addr, spi->ctx->susp->buf, spi->ctx->susp->len);
+  case SUS_RESUME:
+    SPIF_DBG("resume...\n");
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    res = spi->hal->_spiflash_spi_txrx(spi, &_CMD(spi)->resume, 1, 0, 0);
+    return res;
+  default:
+    return SPIFLASH_ERR_INTERNAL;
+  }
+}
+
+static int _spiflash_end_suspend(spiflash_t *spi) {
+  switch (spi->ctx->sus) {
+  case SUS_CMD:
+    SPIF_DBG("suspend ok\n");
+    spi->hal->_spiflash_spi_cs(spi, 0);
+    spi->ctx->sus = SUS_CHECK;
+    break;
+  case SUS_CHECK:
+    spi->hal->_spiflash_spi_cs(spi, 0);
+    if (_spiflash_is_hwbusy(spi, spi->ctx->sr_data)) {
+      SPIF_DBG("suspend - busy, wait\n");
+      spi->ctx->sus = SUS_WAIT;
+      // suspending takes some tens of microseconds
+      if (spi->hal->_spiflash_wait_us) {
+        spi->hal->_spiflash_wait_us(spi, SUS_POLL_US);
+      } else {
+        spi->hal->_spiflash_wait(spi, 1);
+      }
+      return SPIFLASH_OK;
+    }
+    SPIF_DBG("suspend - check ok\n");
+    spi->ctx->sus = SUS_READ;
+    break;
+  case SUS_WAIT:
+    spi->ctx->sus = SUS_CHECK;
+    break;
+  case SUS_READ: {
+    spiflash_op_t op = spi->ctx->susp->op;
+    SPIF_DBG("suspend - read ok\n");
+    spi->hal->_spiflash_spi_cs(spi, 0);
+    spi->ctx->susp->op = SPIFLASH_OP_IDLE;
+    spi->ctx->sus = SUS_RESUME;
+    _spiflash_wbuf_overlay(spi, spi->ctx->susp->addr, spi->ctx->susp->len, spi->ctx->susp->buf);
+    if (spi->ctx->susp->q) {
+      spi->ctx->susp->q = 0;
+      _spiflash_queue_finish(spi, 1, SPIFLASH_OK);
+    } else if (spi->async_cb) {
+      spi->async_cb(spi, op, SPIFLASH_OK);
+    }
+    break;
+  }
+  case SUS_RESUME:
+    SPIF_DBG("resume ok\n");
+    spi->hal->_spiflash_spi_cs(spi, 0);
+    spi->ctx->sus = SUS_IDLE;
+    // give the resumed operation some time before next suspend
+    spi->ctx->busy_check_wait = BCW_READ_SR;
+    _spiflash_busy_wait(spi);
+    return SPIFLASH_OK;
+  default:
+    return SPIFLASH_ERR_INTERNAL;
+  }
+  return _spiflash_begin_suspend(spi);
+}
+
+static int _spiflash_begin_async(spiflash_t *spi) {
+  int res = SPIFLASH_OK;
+
+  _spiflash_trace(spi, SPIFLASH_TRACE_BEGIN, SPIFLASH_OK);
+
+  if (spi->op == SPIFLASH_OP_IDLE) {
+    return SPIFLASH_ERR_BAD_STATE;
+  }
+  
+  if (spi->ctx->sus != SUS_IDLE) {
+    return _spiflash_begin_suspend(spi);
+  }
+
+  if (spi->ctx->xip_pre_exit) {
+    // leave continuous read mode before anything else
+    SPIF_DBG("xip exit...\n");
+    return _spiflash_xip_exit_txrx(spi);
+  }
+
+  if (spi->ctx->busy_pre_check) {
+    // busy check: issue read sr
+    SPIF_DBG("precheck...\n");
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    res = spi->hal->_spiflash_spi_txrx(spi, &_CMD(spi)->read_sr, 1, &spi->ctx->sr_data, 1);
+    return res;
+  }
+  
+  switch (spi->op) {
+  case SPIFLASH_OP_WRITE_sWREN: {
+    if (_CFG(spi)->write_skip && _spiflash_write_skip(spi)) {
+      // write: nothing to program, just read sr to finish
+      SPIF_DBG("write - all skipped...\n");
+      spi->hal->_spiflash_spi_cs(spi, 1);
+      res = spi->hal->_spiflash_spi_txrx(spi, &_CMD(spi)->read_sr, 1, &spi->ctx->sr_data, 1);
+      return res;
+    }
+    // write: issue write enable
+    SPIF_DBG("write - enable...\n");
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    res = spi->hal->_spiflash_spi_txrx(spi, &_CMD(spi)->write_enable, 1, 0, 0);
+    return res;
+  }
+  case SPIFLASH_OP_WRITE_sADDR: {
+    // write: issue write address
+    spiflash_xfer_t xfer[SPIFLASH_CHAIN_MAX];
+    _spiflash_chain_data(&xfer[0], 1);
+    spi->ctx->addr_4b = _spiflash_addr_4b(spi, spi->ctx->addr, 1);
+    uint8_t cmd = _spiflash_get_quad_program_cmd(spi, &xfer[0].addr_lanes);
+    SPIF_DBG("write - address%s...\n", cmd ? " quad" : "");
+    spi->ctx->tx_internal_buf[0] = cmd ? cmd :
+        _spiflash_is_4b(spi) ? _CMD(spi)->page_program_4b : _CMD(spi)->page_program;
+    if (spi->ctx->tx_internal_buf[0] == 0x00) return SPIFLASH_ERR_BAD_CONFIG;
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    _spiflash_compose_address(spi, spi->ctx->addr, &spi->ctx->tx_internal_buf[1]);
+    xfer[0].hdr = &spi->ctx->tx_internal_buf[0];
+    xfer[0].cmd_len = 1;
+    xfer[0].addr_len = _spiflash_addr_len(spi);
+    xfer[0].data_lanes = cmd ? 4 : 1;
+    if (spi->hal->_spiflash_spi_txrx_chain) {
+      // command, address and data in one go
+      spi->op = SPIFLASH_OP_WRITE_sDATA;
+      res = _spiflash_write_chain(spi, xfer);
+    } else if (cmd) {
+      res = spi->hal->_spiflash_spi_txrx_lanes(spi, &xfer[0]);
+    } else {
+      res = spi->hal->_spiflash_spi_txrx(spi,
+          &spi->ctx->tx_internal_buf[0],
+          1 + _spiflash_addr_len(spi),
+          0, 0);
+    }
+    return res;
+  }
+  case SPIFLASH_OP_WRITE_sDATA: {
+    // write: data ordered in pages
+    uint8_t addr_lanes;
+    uint8_t lanes = _spiflash_get_quad_program_cmd(spi, &addr_lanes) ? 4 : 1;
+    if (spi->hal->_spiflash_spi_txrx_chain) {
+      spiflash_xfer_t xfer[SPIFLASH_CHAIN_MAX];
+      _spiflash_chain_data(&xfer[0], lanes);
+      return _spiflash_write_chain(spi, xfer);
+    }
+    const uint8_t *wr_buf;
+    uint32_t wr_sz;
+    _spiflash_write_piece(spi, &wr_buf, &wr_sz);
+    res = _spiflash_data_txrx(spi, lanes, wr_buf, wr_sz, 0, 0);
+    return res;
+  }
+  case SPIFLASH_OP_WRITE_sVERIFY: {
+    // write: read back programmed page
+    SPIF_DBG("write - verify %08x %i...\n", spi->ctx->sq->vf_addr, _spiflash_vf_chunk(spi));
+    if (spi->hal->_spiflash_spi_rx_crc32) {
+      return _spiflash_crc_txrx(spi, spi->ctx->sq->vf_addr, spi->ctx->sq->vf_len);
+    }
+    return _spiflash_read_txrx(spi, _spiflash_get_fast_read_op(spi), XIP_OFF,
+        spi->ctx->sq->vf_addr, spi->ctx->sq->chunk, _spiflash_vf_chunk(spi));
+  }
+
+  case SPIFLASH_OP_ERASE_BLOCK_sWREN: {
+    // erase: issue write enable
+    SPIF_DBG("erase - enable...\n");
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    res = spi->hal->_spiflash_spi_txrx(spi, &_CMD(spi)->write_enable, 1, 0, 0);
+    return res;
+  }
+  case SPIFLASH_OP_ERASE_BLOCK_sERAS: {
+    // erase: issue write address
+    uint32_t era_sz = _spiflash_get_erase_area(spi, spi->ctx->addr, spi->ctx->erase_len);
+    SPIF_DBG("erase - address %08x size %08x wait...\n", spi->ctx->addr, era_sz);
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    spi->ctx->addr_4b = _spiflash_addr_4b(spi, spi->ctx->addr, 1);
+    uint8_t cmd = _spiflash_get_erase_cmd(spi, era_sz);
+    uint32_t era_time =_spiflash_get_erase_time(spi, era_sz);
+    if (cmd == 0x00) return SPIFLASH_ERR_BAD_CONFIG;
+    spi->ctx->tx_internal_buf[0] = cmd;
+    _spiflash_compose_address(spi, spi->ctx->addr, &spi->ctx->tx_internal_buf[1]);
+    spi->ctx->addr += era_sz;
+    spi->ctx->erase_len -= era_sz;
+    _spiflash_set_wait(spi, _spiflash_get_erase_tm(era_sz), era_time * 1000);
+    spi->ctx->busy_check_wait = BCW_WAIT;
+    res = spi->hal->_spiflash_spi_txrx(spi,
+        &spi->ctx->tx_internal_buf[0],
+        1 + _spiflash_addr_len(spi),
+        0, 0);
+    return res;
+  }
+
+  case SPIFLASH_OP_WRITE_SR_sWREN: {
+    // write_sr: issue write enable
+    SPIF_DBG("write_sr - enable...\n");
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    res = spi->hal->_spiflash_spi_txrx(spi, &_CMD(spi)->write_enable, 1, 0, 0);
+    return res;
+  }
+  case SPIFLASH_OP_WRITE_SR_sDATA: {
+    // write_sr: data
+    SPIF_DBG("write_sr - data wait...\n");
+    spi->ctx->tx_internal_buf[1] = spi->ctx->sr_data;
+    spi->ctx->tx_internal_buf[0] = _CMD(spi)->write_sr;
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    _spiflash_set_wait(spi, TM_SR_WRITE, _CFG(spi)->sr_write_ms * 1000);
+    spi->ctx->busy_check_wait = BCW_WAIT;
+    res = spi->hal->_spiflash_spi_txrx(spi, &spi->ctx->tx_internal_buf[0], 2, 0, 0);
+    return res;
+  }
+
+  case SPIFLASH_OP_ERASE_CHIP_sWREN: {
+    // erase chip: issue write enable
+    SPIF_DBG("erase chip - enable...\n");
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    res = spi->hal->_spiflash_spi_txrx(spi, &_CMD(spi)->write_enable, 1, 0, 0);
+    return res;
+  }
+  case SPIFLASH_OP_ERASE_CHIP_sERAS: {
+    // erase chip: cmd
+    SPIF_DBG("erase chip - command wait...\n");
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    spi->ctx->tx_internal_buf[0] = _CMD(spi)->chip_erase;
+    _spiflash_set_wait(spi, TM_CHIP_ERASE, _CFG(spi)->chip_erase_ms * 1000);
+    spi->ctx->busy_check_wait = BCW_WAIT;
+    res = spi->hal->_spiflash_spi_txrx(spi, &spi->ctx->tx_internal_buf[0], 1, 0, 0);
+    return res;
+  }
+
+  case SPIFLASH_OP_READ:
+  case SPIFLASH_OP_FAST_READ:
+  case SPIFLASH_OP_QUAD_READ: {
+    if (spi->hal->_spiflash_spi_txrx_chain) {
+      return _spiflash_read_chain(spi);
+    }
+    if (spi->ctx->seg_cont) {
+      // read: continue data phase with next segment
+      uint8_t addr_lanes, data_lanes = 1, dummy;
+      SPIF_DBG("read - continue...\n");
+      if (spi->op == SPIFLASH_OP_QUAD_READ) {
+        _spiflash_get_multi_read_cmd(spi, _spiflash_is_4b(spi), &addr_lanes, &data_lanes, &dummy);
+      }
+      return _spiflash_data_txrx(spi, data_lanes, 0, 0, spi->ctx->rd_buf, spi->ctx->rd_len);
+    }
+    // read: issue address and read
+    return _spiflash_read_txrx(spi, spi->op, spi->xip, spi->ctx->addr, spi->ctx->rd_buf, spi->ctx->rd_len);
+  }
+
+  case SPIFLASH_OP_READ_JEDEC: {
+    // read_jedec
+    SPIF_DBG("read_jedec...\n");
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    res = spi->hal->_spiflash_spi_txrx(spi, &_CMD(spi)->jedec_id, 1, (uint8_t *)spi->ctx->id_dst, 3);
+    return res;
+  }
+
+  case SPIFLASH_OP_READ_PRODUCT: {
+    // read_jedec
+    SPIF_DBG("read_prod...\n");
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    res = spi->hal->_spiflash_spi_txrx(spi, &_CMD(spi)->device_id, 1, (uint8_t *)spi->ctx->id_dst, 3);
+    return res;
+  }
+
+  case SPIFLASH_OP_READ_SFDP: {
+    // read_sfdp: 3 byte address and 8 dummy clocks
+    SPIF_DBG("read_sfdp...\n");
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    spi->ctx->tx_internal_buf[0] = _CMD(spi)->read_sfdp;
+    spi->ctx->tx_internal_buf[1] = (spi->ctx->addr >> 16) & 0xff;
+    spi->ctx->tx_internal_buf[2] = (spi->ctx->addr >> 8) & 0xff;
+    spi->ctx->tx_internal_buf[3] = spi->ctx->addr & 0xff;
+    spi->ctx->tx_internal_buf[4] = 0;
+    res = spi->hal->_spiflash_spi_txrx(spi, &spi->ctx->tx_internal_buf[0], 5, spi->ctx->rd_buf, spi->ctx->rd_len);
+    return res;
+  }
+
+  case SPIFLASH_OP_READ_SR:
+  case SPIFLASH_OP_READ_SR_BUSY: {
+    // read_sr
+    SPIF_DBG("read_sr...\n");
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    res = spi->hal->_spiflash_spi_txrx(spi, &_CMD(spi)->read_sr, 1, (uint8_t *)spi->ctx->sr_dst, 1);
+    return res;
+  }
+
+  case SPIFLASH_OP_READ_REG: {
+    // read_reg
+    SPIF_DBG("read_reg...\n");
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    res = spi->hal->_spiflash_spi_txrx(spi, &spi->ctx->reg_nbr, 1, (uint8_t *)spi->ctx->reg_dst, 1);
+    return res;
+  }
+
+  case SPIFLASH_OP_WRITE_REG_sWREN: {
+    // write_reg: issue write enable
+    SPIF_DBG("write_reg - enable...\n");
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    res = spi->hal->_spiflash_spi_txrx(spi, &_CMD(spi)->write_enable, 1, 0, 0);
+    return res;
+  }
+  case SPIFLASH_OP_WRITE_REG_DATA:
+  case SPIFLASH_OP_WRITE_REG_sDATAWAIT: {
+    // write_reg: data
+    SPIF_DBG("write_reg - data%s...\n", spi->op == SPIFLASH_OP_WRITE_REG_DATA ? "" : " wait");
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    spi->ctx->busy_check_wait = spi->op == SPIFLASH_OP_WRITE_REG_DATA ? BCW_IDLE : BCW_WAIT;
+    res = spi->hal->_spiflash_spi_txrx(spi, &spi->ctx->tx_internal_buf[0], 2, 0, 0);
+    return res;
+  }
+
+  case SPIFLASH_OP_QUAD_ENABLE_sREAD: {
+    // quad_enable: read register
+    SPIF_DBG("quad_enable - read...\n");
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    res = spi->hal->_spiflash_spi_txrx(spi,
+        _CMD(spi)->qe_read_reg ? &_CMD(spi)->qe_read_reg : &_CMD(spi)->read_sr, 1,
+        &spi->ctx->sr_data, 1);
+    return res;
+  }
+  case SPIFLASH_OP_QUAD_ENABLE_sWREN: {
+    // quad_enable: issue write enable
+    SPIF_DBG("quad_enable - enable...\n");
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    res = spi->hal->_spiflash_spi_txrx(spi, &_CMD(spi)->write_enable, 1, 0, 0);
+    return res;
+  }
+  case SPIFLASH_OP_QUAD_ENABLE_sDATA: {
+    // quad_enable: write register
+    SPIF_DBG("quad_enable - data wait...\n");
+    spi->ctx->tx_internal_buf[1] = spi->ctx->sr_data | _CMD(spi)->qe_bit;
+    spi->ctx->tx_internal_buf[0] = _CMD(spi)->qe_write_reg ?
+        _CMD(spi)->qe_write_reg : _CMD(spi)->write_sr;
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    _spiflash_set_wait(spi, TM_SR_WRITE, _CFG(spi)->sr_write_ms * 1000);
+    spi->ctx->busy_check_wait = BCW_WAIT;
+    res = spi->hal->_spiflash_spi_txrx(spi, &spi->ctx->tx_internal_buf[0], 2, 0, 0);
+    return res;
+  }
+
+  case SPIFLASH_OP_XIP_EXIT: {
+    // xip_exit: mode bit reset
+    SPIF_DBG("xip exit...\n");
+    return _spiflash_xip_exit_txrx(spi);
+  }
+
+  case SPIFLASH_OP_CRC32: {
+    // crc32: read into hal crc
+    return _spiflash_crc_txrx(spi, spi->ctx->addr, spi->ctx->rd_len);
+  }
+
+  case SPIFLASH_OP_SET_BURST_WRAP: {
+    // set_burst_wrap: command, dummy bytes and wrap bits on four lanes
+    spiflash_xfer_t xfer;
+    SPIF_DBG("set burst wrap...\n");
+    memset(&xfer, 0, sizeof(spiflash_xfer_t));
+    xfer.hdr = &spi->ctx->tx_internal_buf[0];
+    xfer.cmd_len = 1;
+    xfer.cmd_lanes = 1;
+    xfer.addr_len = 4;
+    xfer.addr_lanes = 4;
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    return spi->hal->_spiflash_spi_txrx_lanes(spi, &xfer);
+  }
+
+  case SPIFLASH_OP_IDLE:
+  default:
+    res = SPIFLASH_ERR_INTERNAL;
+    break;
+  } // switch (spi->op)
+
+  return res;
+}
+
+
+
+static int _spiflash_end_async(spiflash_t *spi, int res) {
+  _spiflash_trace(spi, SPIFLASH_TRACE_END, res);
+
+  // handle early termination
+  if (res != SPIFLASH_OK) {
+    _spiflash_finalize(spi);
+    return res;
+  }
+  
+  // handle suspended erase/program
+  if (spi->ctx->sus != SUS_IDLE) {
+    return _spiflash_end_suspend(spi);
+  }
+
+  // handle continuous read mode exit
+  if (spi->ctx->xip_pre_exit) {
+    SPIF_DBG("xip exit ok\n");
+    spi->hal->_spiflash_spi_cs(spi, 0);
+    spi->ctx->xip_pre_exit = 0;
+    if (spi->xip == XIP_ACTIVE) spi->xip = XIP_ARMED;
+    return _spiflash_begin_async(spi);
+  }
+
+  // handle busy pre check
+  if (spi->ctx->busy_pre_check) {
+    if (_spiflash_is_hwbusy(spi, spi->ctx->sr_data)) {
+      spi->hal->_spiflash_spi_cs(spi, 0);
+      SPIF_DBG("precheck busy\n");
+#if SPIFLASH_STATS
+      if (spi->stats) spi->stats->hw_busy++;
+#endif
+      return SPIFLASH_ERR_HW_BUSY;
+    } else {
+      spi->hal->_spiflash_spi_cs(spi, 0);
+      SPIF_DBG("precheck ok\n");
+      spi->ctx->busy_pre_check = 0;
+      spi->could_be_busy = 0;
+      return _spiflash_begin_async(spi);
+    }
+  }
+  
   // handle busy-check-wait states
-  switch (spi->busy_check_wait) {
+  switch (spi->ctx->busy_check_wait) {
   case BCW_WAIT:
-    SPIF_DBG("busy check WAIT %i...\n", spi->wait_period_ms);
+    SPIF_DBG("busy check WAIT %i us...\n", spi->ctx->wait_period_us);
+    spi->hal->_spiflash_spi_cs(spi, 0);
+    if (spi->ctx->pr) {
+      // flash is programming, meanwhile produce next page
+      res = _spiflash_produce(spi);
+      if (res != SPIFLASH_OK) return res;
+    }
+    if (spi->hal->_spiflash_wait_ready && !_spiflash_split_wait(spi)) {
+      // let hardware poll for ready
+      SPIF_DBG("busy check READY...\n");
+      spi->ctx->busy_check_wait = BCW_READY;
+      return _spiflash_wait_ready(spi);
+    }
+    // if wait period is 0, call wait and then break free of the bsw loop
+    spi->ctx->busy_check_wait = spi->ctx->wait_period_us == 0 ? BCW_IDLE : BCW_READ_SR;
+    _spiflash_busy_wait(spi);
+    return SPIFLASH_OK;
+  case BCW_READ_SR:
+    if (_spiflash_can_suspend(spi) && _spiflash_get_pending_read(spi)) {
+      // serve pending read
+      SPIF_DBG("busy check SUSPEND...\n");
+      spi->ctx->sus = SUS_CMD;
+      return _spiflash_begin_suspend(spi);
+    }
+    SPIF_DBG("busy CHECK wait...\n");
+    spi->ctx->busy_check_wait = BCW_CHECK;
+    spi->hal->_spiflash_spi_cs(spi, 1);
+    res = spi->hal->_spiflash_spi_txrx(spi, &_CMD(spi)->read_sr, 1, &spi->ctx->sr_data, 1);
+    return res;
+  case BCW_CHECK:
+    spi->hal->_spiflash_spi_cs(spi, 0);
+#if SPIFLASH_STATS
+    if (spi->stats) spi->stats->op[spi->ctx->stats_op].polls++;
+#endif
+    if (_spiflash_is_hwbusy(spi, spi->ctx->sr_data)) {
+      _spiflash_set_poll_wait(spi);
+      SPIF_DBG("BUSY check WAIT %i us...\n", spi->ctx->wait_period_us);
+      spi->ctx->busy_check_wait = BCW_READ_SR;
+      _spiflash_busy_wait(spi);
+      return SPIFLASH_OK;
+    } else {
+      SPIF_DBG("busy check wait ok\n");
+      _spiflash_update_timing(spi);
+      spi->ctx->busy_check_wait = BCW_IDLE;
+      break;
+    }
+  case BCW_READY:
+    SPIF_DBG("busy check ready ok\n");
+    spi->ctx->busy_check_wait = BCW_IDLE;
+    break;
+  case BCW_IDLE:
+    SPIF_DBG("no BCW\n");
+    break;
+  } // switch (spi->ctx->busy_check_wait)
+  
+  // handle results
+  switch (spi->op) {
+  case SPIFLASH_OP_WRITE_sWREN:
+    spi->hal->_spiflash_spi_cs(spi, 0);
+    if (_CFG(spi)->write_skip && spi->ctx->wr_len == 0) {
+      SPIF_DBG("write - skipped, finish\n");
+      spi->op = SPIFLASH_OP_IDLE;
+      break;
+    }
+    SPIF_DBG("write - enable ok\n");
+    spi->op = SPIFLASH_OP_WRITE_sADDR;
+    break;
+  case SPIFLASH_OP_WRITE_sADDR:
+    SPIF_DBG("write - address ok\n");
+    spi->op = SPIFLASH_OP_WRITE_sDATA;
+    break;
+  case SPIFLASH_OP_WRITE_sDATA:
+    if (spi->ctx->wr_len == 0 && _spiflash_next_seg(spi, spi->ctx->addr) &&
+        spi->ctx->seg_cont && (spi->ctx->addr & (_CFG(spi)->page_sz - 1)) != 0 &&
+        !_CFG(spi)->write_verify) {
+      // program not ended, feed next segment
+      SPIF_DBG("write - data ok, continue\n");
+      break;
+    }
+    if (spi->ctx->sq && spi->ctx->sq->vf_len) {
+      SPIF_DBG("write - data ok, verify\n");
+      spi->op = SPIFLASH_OP_WRITE_sVERIFY;
+      break;
+    }
+    spi->op = _spiflash_write_next(spi);
+    break;
+  case SPIFLASH_OP_WRITE_sVERIFY: {
+    uint32_t n = _spiflash_vf_chunk(spi);
     spi->hal->_spiflash_spi_cs(spi, 0);
-    // if wait period is 0, call wait and then break free of the bsw loop
-    spi->busy_check_wait = spi->wait_period_ms == 0 ? BCW_IDLE : BCW_READ_SR;
-    spi->hal->_spiflash_wait(spi, spi->wait_period_ms);
+    if (spi->hal->_spiflash_spi_rx_crc32 ?
+        spi->ctx->sq->crc != SPIFLASH_crc32_calc(0, spi->ctx->sq->vf_src, n) :
+        memcmp(spi->ctx->sq->chunk, spi->ctx->sq->vf_src, n) != 0) {
+      SPIF_DBG("write - verify failed at %08x\n", spi->ctx->sq->vf_addr);
+      res = SPIFLASH_ERR_VERIFY;
+      break;
+    }
+    spi->ctx->sq->vf_addr += n;
+    spi->ctx->sq->vf_src += n;
+    spi->ctx->sq->vf_len -= n;
+    if (spi->ctx->sq->vf_len == 0) {
+      SPIF_DBG("write - verify ok\n");
+      spi->op = _spiflash_write_next(spi);
+    }
+    break;
+  }
+
+  case SPIFLASH_OP_ERASE_BLOCK_sWREN:
+    SPIF_DBG("erase - enable ok\n");
+    spi->hal->_spiflash_spi_cs(spi, 0);
+    spi->op = SPIFLASH_OP_ERASE_BLOCK_sERAS;
+    break;
+  case SPIFLASH_OP_ERASE_BLOCK_sERAS:
+    SPIF_DBG("erase - ok\n");
+    if (spi->ctx->erase_len == 0) {
+      SPIF_DBG("erase - ok, finish\n");
+      spi->op = SPIFLASH_OP_IDLE;
+    } else if (_spiflash_queue_preempt(spi)) {
+      SPIF_DBG("erase - ok, preempted\n");
+      spiflash_req_t *req = _spiflash_q_at(spi, 0);
+      req->addr = spi->ctx->addr;
+      req->len = spi->ctx->erase_len;
+      spi->q->preempt = 1;
+      spi->op = SPIFLASH_OP_IDLE;
+    } else {
+      SPIF_DBG("erase - ok, new chunk\n");
+      spi->op = SPIFLASH_OP_ERASE_BLOCK_sWREN;
+    }
+    break;
+
+  case SPIFLASH_OP_WRITE_SR_sWREN:
+    SPIF_DBG("write_sr - enable ok\n");
+    spi->hal->_spiflash_spi_cs(spi, 0);
+    spi->op = SPIFLASH_OP_WRITE_SR_sDATA;
+    break;
+  case SPIFLASH_OP_WRITE_SR_sDATA:
+    SPIF_DBG("write_sr - ok\n");
+    spi->op = SPIFLASH_OP_IDLE;
+    break;
+
+  case SPIFLASH_OP_ERASE_CHIP_sWREN:
+    SPIF_DBG("erase chip - enable ok\n");
+    spi->hal->_spiflash_spi_cs(spi, 0);
+    spi->op = SPIFLASH_OP_ERASE_CHIP_sERAS;
+    break;
+  case SPIFLASH_OP_ERASE_CHIP_sERAS:
+    SPIF_DBG("erase chip - ok\n");
+    spi->op = SPIFLASH_OP_IDLE;
+    break;
+
+  case SPIFLASH_OP_READ:
+    SPIF_DBG("read - ok\n");
+    if (_spiflash_next_seg(spi, spi->ctx->addr + spi->ctx->rd_len)) {
+      if (!spi->ctx->seg_cont) spi->hal->_spiflash_spi_cs(spi, 0);
+    } else {
+      spi->op = SPIFLASH_OP_IDLE;
+    }
+    break;
+
+  case SPIFLASH_OP_FAST_READ:
+    SPIF_DBG("fast read - ok\n");
+    if (_spiflash_next_seg(spi, spi->ctx->addr + spi->ctx->rd_len)) {
+      if (!spi->ctx->seg_cont) spi->hal->_spiflash_spi_cs(spi, 0);
+    } else {
+      spi->op = SPIFLASH_OP_IDLE;
+    }
+    break;
+
+  case SPIFLASH_OP_QUAD_READ:
+    SPIF_DBG("quad read - ok\n");
+    if (spi->xip == XIP_ARMED) spi->xip = XIP_ACTIVE;
+    if (_spiflash_next_seg(spi, spi->ctx->addr + spi->ctx->rd_len)) {
+      if (!spi->ctx->seg_cont) spi->hal->_spiflash_spi_cs(spi, 0);
+    } else {
+      spi->op = SPIFLASH_OP_IDLE;
+    }
+    break;
+
+  case SPIFLASH_OP_XIP_EXIT:
+    SPIF_DBG("xip exit - ok\n");
+    spi->op = SPIFLASH_OP_IDLE;
+    break;
+
+  case SPIFLASH_OP_CRC32:
+    SPIF_DBG("crc ok\n");
+    if (spi->ctx->sq->crc_dst) {
+      *spi->ctx->sq->crc_dst = spi->ctx->sq->crc;
+    } else if (spi->ctx->sq->crc != spi->ctx->sq->crc_ref) {
+      res = SPIFLASH_ERR_VERIFY;
+    }
+    spi->op = SPIFLASH_OP_IDLE;
+    break;
+
+  case SPIFLASH_OP_SET_BURST_WRAP:
+    SPIF_DBG("set burst wrap - ok\n");
+    spi->wrap = (spi->ctx->tx_internal_buf[4] & 0x10) ? 0 : 8 << (spi->ctx->tx_internal_buf[4] >> 5);
+    spi->op = SPIFLASH_OP_IDLE;
+    break;
+
+  case SPIFLASH_OP_READ_JEDEC:
+    SPIF_DBG("read jedec ok\n");
+    spi->op = SPIFLASH_OP_IDLE;
+    break;
+
+  case SPIFLASH_OP_READ_PRODUCT:
+    SPIF_DBG("read prod ok\n");
+    spi->op = SPIFLASH_OP_IDLE;
+    break;
+
+  case SPIFLASH_OP_READ_SFDP:
+    SPIF_DBG("read sfdp ok\n");
+    spi->op = SPIFLASH_OP_IDLE;
+    break;
+
+  case SPIFLASH_OP_READ_SR_BUSY:
+  case SPIFLASH_OP_READ_SR:
+    SPIF_DBG("read sr ok\n");
+    if (spi->op == SPIFLASH_OP_READ_SR_BUSY) {
+      *spi->ctx->sr_dst = ((*spi->ctx->sr_dst & _CMD(spi)->sr_busy_bit)) != 0;
+    }
+    spi->op = SPIFLASH_OP_IDLE;
+    break;
+
+  case SPIFLASH_OP_WRITE_REG_sWREN:
+    SPIF_DBG("write_reg - enable ok\n");
+    spi->hal->_spiflash_spi_cs(spi, 0);
+    spi->op = SPIFLASH_OP_WRITE_REG_sDATAWAIT;
+    break;
+  case SPIFLASH_OP_WRITE_REG_sDATAWAIT:
+  case SPIFLASH_OP_WRITE_REG_DATA:
+    SPIF_DBG("write_reg - ok\n");
+    spi->op = SPIFLASH_OP_IDLE;
+    break;
+
+  case SPIFLASH_OP_READ_REG:
+    SPIF_DBG("read reg ok\n");
+    spi->op = SPIFLASH_OP_IDLE;
+    break;
+
+  case SPIFLASH_OP_QUAD_ENABLE_sREAD:
+    spi->hal->_spiflash_spi_cs(spi, 0);
+    if (spi->ctx->sr_data & _CMD(spi)->qe_bit) {
+      SPIF_DBG("quad_enable - ok\n");
+      spi->quad_en = QE_ON;
+      spi->op = SPIFLASH_OP_IDLE;
+    } else if (spi->quad_en == QE_VERIFY) {
+      // written, but did not stick
+      SPIF_DBG("quad_enable - failed\n");
+      spi->quad_en = QE_OFF;
+      res = SPIFLASH_ERR_BAD_CONFIG;
+    } else {
+      SPIF_DBG("quad_enable - read ok, write\n");
+      spi->op = SPIFLASH_OP_QUAD_ENABLE_sWREN;
+    }
+    break;
+  case SPIFLASH_OP_QUAD_ENABLE_sWREN:
+    SPIF_DBG("quad_enable - enable ok\n");
+    spi->hal->_spiflash_spi_cs(spi, 0);
+    spi->op = SPIFLASH_OP_QUAD_ENABLE_sDATA;
+    break;
+  case SPIFLASH_OP_QUAD_ENABLE_sDATA:
+    SPIF_DBG("quad_enable - write ok, verify\n");
+    spi->quad_en = QE_VERIFY;
+    spi->op = SPIFLASH_OP_QUAD_ENABLE_sREAD;
+    break;
+
+  case SPIFLASH_OP_IDLE:
+  default:
+    res = SPIFLASH_ERR_INTERNAL;
+    break;
+
+  } // switch (spi->op)
+
+  if (res == SPIFLASH_OK && spi->op == SPIFLASH_OP_IDLE && spi->ctx->pr) {
+    // producer may have failed when no page program was waited for
+    res = spi->ctx->pr->res;
+  }
+
+  if (res == SPIFLASH_OK && spi->op != SPIFLASH_OP_IDLE) {
+    // moar to do
+    res = _spiflash_begin_async(spi);
+  } else {
+    // finished or error
+    spi->hal->_spiflash_spi_cs(spi, 0);
+    _spiflash_finalize(spi);
+  }
+  
+
+  return res;
+}
+
+
+static int _spiflash_exe_granted(spiflash_t *spi) {
+  int res = SPIFLASH_OK;
+
+  if (spi->could_be_busy) {
+    // an operation failed on its way, the flash may still be busy with it
+    spi->ctx->busy_pre_check = 1;
+  }
+
+  if (spi->xip == XIP_MAPPED) {
+    // take the bus back from the memory mapping controller
+    res = spi->hal->_spiflash_xip_map(spi, 0);
+    if (res != SPIFLASH_OK) {
+      _spiflash_stats_end(spi);
+      spi->op = SPIFLASH_OP_IDLE;
+      return res;
+    }
+    spi->xip = XIP_UNMAPPED;
+    spi->ctx->xip_pre_exit = 1;
+  } else if (spi->xip == XIP_ACTIVE && spi->op != SPIFLASH_OP_QUAD_READ) {
+    spi->ctx->xip_pre_exit = 1;
+  }
+
+  if (spi->async) {
+    // asynchronous
+    res = _spiflash_begin_async(spi);
+  } else {
+    // blocking
+    res = _spiflash_begin_async(spi);
+    while (res == SPIFLASH_OK && spi->op != SPIFLASH_OP_IDLE) {
+      res = SPIFLASH_async_trigger(spi, res);
+    }
+    _spiflash_finalize(spi);
+  }
+
+  return res;
+}
+
+static int _spiflash_exe(spiflash_t *spi) {
+  int res;
+  if (spi->op == SPIFLASH_OP_WRITE_sWREN && _CFG(spi)->write_verify && spi->ctx->sq == 0) {
+    // nowhere to read back to
+    spi->op = SPIFLASH_OP_IDLE;
+    return SPIFLASH_ERR_BAD_CONFIG;
+  }
+  _spiflash_stats_start(spi);
+  res = _spiflash_bus_request(spi);
+  if (res == SPIFLASH_BUS_QUEUED) {
+    // started by SPIFLASH_async_trigger once granted
+    SPIF_DBG("bus queued\n");
+    spi->ctx->bus_wait = BUS_WAIT_OP;
+    return SPIFLASH_OK;
+  } else if (res != SPIFLASH_OK) {
+    _spiflash_stats_end(spi);
+    spi->op = SPIFLASH_OP_IDLE;
+    return res;
+  }
+  return _spiflash_exe_granted(spi);
+}
+
+
+void SPIFLASH_init(spiflash_t *spi, 
+                   const spiflash_config_t *cfg,
+                   const spiflash_cmd_tbl_t *cmd,
+                   const spiflash_hal_t *hal,
+                   spiflash_cb_async_t async_cb,
+                   uint8_t async,
+                   void *user_data) {
+  memset(spi, 0, sizeof(spiflash_t));
+  spi->cfg = cfg;
+  spi->cmd_tbl = cmd;
+  spi->hal = hal;
+  spi->async_cb = async_cb;
+  
+  spi->async = async;
+  spi->user_data = user_data;
+  spi->op = SPIFLASH_OP_IDLE;
+}
+
+
+static void _spiflash_abort(spiflash_t *spi) {
+  // clean up after an operation failing to start
+  spi->hal->_spiflash_spi_cs(spi, 0);
+  _spiflash_finalize(spi);
+  spi->op = SPIFLASH_OP_IDLE;
+}
+
+static void _spiflash_start_pending_read(spiflash_t *spi) {
+  int res;
+  spiflash_op_t op = spi->ctx->susp->op;
+  spi->ctx->addr = spi->ctx->susp->addr;
+  spi->ctx->rd_buf = spi->ctx->susp->buf;
+  spi->ctx->rd_len = spi->ctx->susp->len;
+  spi->op = op;
+  spi->ctx->susp->op = SPIFLASH_OP_IDLE;
+  res = _spiflash_exe(spi);
+  if (res != SPIFLASH_OK) {
+    _spiflash_abort(spi);
+    if (spi->async_cb) {
+      spi->async_cb(spi, op, res);
+    }
+  }
+}
+
+static int _spiflash_queue_start(spiflash_t *spi, const spiflash_req_t *req) {
+  switch (req->type) {
+  case SPIFLASH_REQ_READ:
+    return SPIFLASH_read(spi, req->addr, req->len, req->rd_buf);
+  case SPIFLASH_REQ_FAST_READ:
+    return SPIFLASH_fast_read(spi, req->addr, req->len, req->rd_buf);
+  case SPIFLASH_REQ_WRITE:
+    return SPIFLASH_write(spi, req->addr, req->len, req->wr_buf);
+  case SPIFLASH_REQ_ERASE:
+    return SPIFLASH_erase(spi, req->addr, req->len);
+  case SPIFLASH_REQ_CHIP_ERASE:
+    return SPIFLASH_chip_erase(spi);
+  default:
+    return SPIFLASH_ERR_INTERNAL;
+  }
+}
+
+
+static void _spiflash_queue_next(spiflash_t *spi) {
+  while (spi->q && spi->q->len > 0 && !spi->q_run && spi->op == SPIFLASH_OP_IDLE) {
+    int res;
+    SPIF_DBG("queue - start %i of %i\n", spi->q->head, spi->q->len);
+    spi->q_run = 1;
+    res = _spiflash_queue_start(spi, &spi->q->reqs[spi->q->head]);
+    if (res != SPIFLASH_OK) {
+      _spiflash_abort(spi);
+      _spiflash_queue_finish(spi, 0, res);
+    }
+  }
+}
+
+static int _spiflash_hold_read(spiflash_t *spi, spiflash_op_t op, uint32_t addr,
+    uint32_t len, uint8_t *buf) {
+  int res = SPIFLASH_ERR_BUSY;
+  if (!spi->async || _CMD(spi)->suspend == 0x00 || _CMD(spi)->resume == 0x00) {
+    return res;
+  }
+  _spiflash_critical(spi, 1);
+  // the operation may have finished meanwhile, giving the context back
+  switch (spi->ctx && spi->ctx->susp ? spi->op : SPIFLASH_OP_IDLE) {
+  case SPIFLASH_OP_ERASE_BLOCK_sWREN:
+  case SPIFLASH_OP_ERASE_BLOCK_sERAS:
+  case SPIFLASH_OP_WRITE_sWREN:
+  case SPIFLASH_OP_WRITE_sADDR:
+  case SPIFLASH_OP_WRITE_sDATA:
+  case SPIFLASH_OP_WRITE_sVERIFY:
+    if (spi->ctx->susp->op != SPIFLASH_OP_IDLE) break;
+    SPIF_DBG("read pending\n");
+    spi->ctx->susp->addr = addr;
+    spi->ctx->susp->len = len;
+    spi->ctx->susp->buf = buf;
+    spi->ctx->susp->op = op;
+    res = SPIFLASH_OK;
+    break;
+  default:
+    break;
+  }
+  _spiflash_critical(spi, 0);
+  return res;
+}
+
+static int _spiflash_read(spiflash_t *spi, spiflash_op_t op, uint32_t addr,
+    uint32_t len, uint8_t *buf) {
+  spi->ctx->addr = addr;
+  spi->ctx->rd_buf = buf;
+  spi->ctx->rd_len = len;
+
+  spi->op = op;
+
+  return _spiflash_exe(spi);
+}
+
+static int _spiflash_read_user(spiflash_t *spi, spiflash_op_t op, uint32_t addr,
+    uint32_t len, uint8_t *buf) {
+  // read through cache and write buffer
+  int res;
+  uint16_t ix;
+  uint16_t cnt = spi->cache ? spi->cache->cnt : 0;
+  uint32_t mask = cnt ? spi->cache->line_sz - 1 : 0;
+  if (spi->ctx->seq != SEQ_NONE || len == 0) {
+    return _spiflash_read(spi, op, addr, len, buf);
+  }
+  spi->ctx->rd_dst = buf;
+  spi->ctx->rd_dst_addr = addr;
+  spi->ctx->rd_dst_len = len;
+  if (cnt && _spiflash_cache_lookup(spi, addr, len, buf)) {
+    SPIF_DBG("cache hit %08x\n", addr);
+    spi->cache->hits++;
+    _spiflash_wbuf_end(spi, SPIFLASH_OK);
+    _spiflash_finish_now(spi);
+    return SPIFLASH_OK;
+  }
+  if (cnt == 0 ||
+      (addr & ~mask) != ((addr + len - 1) & ~mask)) {
+    if (cnt) spi->cache->misses++;
+    res = _spiflash_read(spi, op, addr, len, buf);
+  } else {
+    // read entire line, copy to buf when done
+    SPIF_DBG("cache fill %08x\n", addr & ~mask);
+    spi->cache->misses++;
+    ix = _spiflash_cache_victim(spi);
+    spi->cache->lines[ix].addr = SPIFLASH_CACHE_NO_LINE;
+    spi->cache->fill = ix + 1;
+    spi->cache->fill_addr = addr & ~mask;
+    res = _spiflash_read(spi, op, addr & ~mask, spi->cache->line_sz,
+        _spiflash_cache_mem(spi, ix));
+  }
+  if (res != SPIFLASH_OK) {
+    if (cnt) spi->cache->fill = 0;
+    spi->ctx->rd_dst = 0;
+  }
+  return res;
+}
+
+static int _spiflash_stream_read(spiflash_t *spi) {
+  // read into the next free buffer, with command and address
+  int res;
+  uint32_t n = spi->ctx->st->left < spi->ctx->st->sz ? spi->ctx->st->left : spi->ctx->st->sz;
+  spi->ctx->st->run = 1;
+  spi->ctx->st->paused = 0;
+  spi->ctx->st->addr += n;
+  spi->ctx->st->left -= n;
+  res = _spiflash_read(spi, spi->ctx->st->op, spi->ctx->st->addr - n, n,
+      _spiflash_stream_buf(spi, spi->ctx->st->filled));
+  if (res != SPIFLASH_OK) {
+    spi->ctx->st->run = 0;
+  }
+  return res;
+}
+
+static void _spiflash_stream_resume(spiflash_t *spi) {
+  int res;
+  if (spi->ctx->st == 0 || !spi->ctx->st->paused || spi->ctx->st->filled >= spi->ctx->st->cnt ||
+      spi->op != SPIFLASH_OP_IDLE) {
+    return;
+  }
+  SPIF_DBG("stream - resume at %08x\n", spi->ctx->st->addr);
+  res = _spiflash_stream_read(spi);
+  if (res != SPIFLASH_OK) {
+    _spiflash_abort(spi);
+    if (spi->async_cb) {
+      spi->async_cb(spi, spi->ctx->st->op, res);
+    }
+  }
+}
+
+static int _spiflash_seq_erase_preserve(spiflash_t *spi) {
+  // read head and tail, erase, write back head and tail
+  uint32_t end = spi->ctx->sq->addr + spi->ctx->sq->len;
+  switch (spi->ctx->seq_step) {
+  case 0:
+    spi->ctx->seq_step = 1;
+    if (spi->ctx->sq->head) {
+      SPIF_DBG("erase preserve - read head\n");
+      return SPIFLASH_read(spi, spi->ctx->sq->addr, spi->ctx->sq->head, spi->ctx->sq->buf);
+    }
+    // fall through
+  case 1:
+    spi->ctx->seq_step = 2;
+    if (spi->ctx->sq->tail) {
+      SPIF_DBG("erase preserve - read tail\n");
+      return SPIFLASH_read(spi, end - spi->ctx->sq->tail, spi->ctx->sq->tail,
+          spi->ctx->sq->buf + spi->ctx->sq->head);
+    }
+    // fall through
+  case 2:
+    SPIF_DBG("erase preserve - erase\n");
+    spi->ctx->seq_step = 3;
+    return SPIFLASH_erase(spi, spi->ctx->sq->addr, spi->ctx->sq->len);
+  case 3:
+    spi->ctx->seq_step = 4;
+    if (spi->ctx->sq->head) {
+      SPIF_DBG("erase preserve - write head\n");
+      return SPIFLASH_write(spi, spi->ctx->sq->addr, spi->ctx->sq->head, spi->ctx->sq->buf);
+    }
+    // fall through
+  case 4:
+    spi->ctx->seq_step = 5;
+    if (spi->ctx->sq->tail) {
+      SPIF_DBG("erase preserve - write tail\n");
+      return SPIFLASH_write(spi, end - spi->ctx->sq->tail, spi->ctx->sq->tail,
+          spi->ctx->sq->buf + spi->ctx->sq->head);
+    }
+    // fall through
+  default:
+    SPIF_DBG("erase preserve - ok\n");
+    spi->ctx->seq = SEQ_NONE;
     return SPIFLASH_OK;
-  case BCW_READ_SR:
-    SPIF_DBG("busy CHECK wait...\n");
-    spi->busy_check_wait = BCW_CHECK;
-    spi->hal->_spiflash_spi_cs(spi, 1);
-    res = spi->hal->_spiflash_spi_txrx(spi, &spi->cmd_tbl->read_sr, 1, &spi->sr_data, 1);
-    return res;
-  case BCW_CHECK:
-    spi->hal->_spiflash_spi_cs(spi, 0);
-    if (_spiflash_is_hwbusy(spi, spi->sr_data)) {
-      spi->wait_period_ms = DECR_WAIT(spi->wait_period_ms);
-      SPIF_DBG("BUSY check WAIT %i...\n", spi->wait_period_ms);
-      spi->busy_check_wait = BCW_READ_SR;
-      spi->hal->_spiflash_wait(spi, spi->wait_period_ms);
+  }
+}
+
+static int _spiflash_seq_update(spiflash_t *spi) {
+  // per sector: read, then program changed pages in place or erase and write
+  uint32_t sec_sz = _spiflash_get_min_erase_sz(spi);
+  uint32_t end = spi->ctx->sq->addr + spi->ctx->sq->len;
+  uint32_t o0 = spi->ctx->sq->sec > spi->ctx->sq->addr ? spi->ctx->sq->sec : spi->ctx->sq->addr;
+  uint32_t o1 = spi->ctx->sq->sec + sec_sz < end ? spi->ctx->sq->sec + sec_sz : end;
+  // sector contents and new data, only valid for the current sector
+  uint8_t *old = spi->ctx->sq->buf;
+  const uint8_t *upd = spi->ctx->sq->src;
+  uint32_t sec = spi->ctx->sq->sec;
+  uint32_t a;
+  while (1) {
+    switch (spi->ctx->seq_step) {
+    case UPD_READ:
+      SPIF_DBG("update - read sector %08x\n", spi->ctx->sq->sec);
+      spi->ctx->seq_step = UPD_CHECK;
+      return SPIFLASH_read(spi, spi->ctx->sq->sec, sec_sz, spi->ctx->sq->buf);
+    case UPD_CHECK:
+      spi->ctx->seq_step = UPD_PROGRAM;
+      spi->ctx->sq->cur = o0;
+      for (a = o0; a < o1; a++) {
+        if ((old[a - sec] & upd[a - spi->ctx->sq->addr]) != upd[a - spi->ctx->sq->addr]) {
+          SPIF_DBG("update - erase sector %08x\n", spi->ctx->sq->sec);
+          memcpy(&old[o0 - sec], &upd[o0 - spi->ctx->sq->addr], o1 - o0);
+          spi->ctx->seq_step = UPD_ERASED;
+          return SPIFLASH_erase(spi, spi->ctx->sq->sec, sec_sz);
+        }
+      }
+      break;
+    case UPD_PROGRAM:
+      while (spi->ctx->sq->cur < o1) {
+        // program differing part of next page
+        uint32_t pg_end = (spi->ctx->sq->cur | (_CFG(spi)->page_sz - 1)) + 1;
+        uint32_t p0 = spi->ctx->sq->cur;
+        uint32_t p1 = pg_end < o1 ? pg_end : o1;
+        spi->ctx->sq->cur = p1;
+        while (p0 < p1 && old[p0 - sec] == upd[p0 - spi->ctx->sq->addr]) p0++;
+        while (p1 > p0 && old[p1 - 1 - sec] == upd[p1 - 1 - spi->ctx->sq->addr]) p1--;
+        if (p0 < p1) {
+          SPIF_DBG("update - program %08x %i\n", p0, p1 - p0);
+          return SPIFLASH_write(spi, p0, p1 - p0, &upd[p0 - spi->ctx->sq->addr]);
+        }
+      }
+      spi->ctx->seq_step = UPD_NEXT;
+      break;
+    case UPD_ERASED: {
+      // write back all but the erased state
+      uint32_t skip = _spiflash_count_ff(spi->ctx->sq->buf, sec_sz);
+      spi->ctx->seq_step = UPD_NEXT;
+      if (skip < sec_sz) {
+        uint32_t n = sec_sz - skip - _spiflash_count_ff_rev(spi->ctx->sq->buf, sec_sz);
+        SPIF_DBG("update - write sector %08x\n", spi->ctx->sq->sec);
+        return SPIFLASH_write(spi, spi->ctx->sq->sec + skip, n, &spi->ctx->sq->buf[skip]);
+      }
+      break;
+    }
+    case UPD_NEXT:
+    default:
+      spi->ctx->sq->sec += sec_sz;
+      if (spi->ctx->sq->sec >= end) {
+        SPIF_DBG("update - ok\n");
+        spi->ctx->seq = SEQ_NONE;
+        return SPIFLASH_OK;
+      }
+      spi->ctx->seq_step = UPD_READ;
+      break;
+    }
+  }
+}
+
+static uint32_t _spiflash_wbuf_room(spiflash_t *spi, uint32_t addr) {
+  // bytes left in the open page, or in the page of addr if none is open
+  uint32_t end = spi->wb->len ? spi->wb->addr + spi->wb->len : addr;
+  return _CFG(spi)->page_sz - (end % _CFG(spi)->page_sz);
+}
+
+static uint32_t _spiflash_wbuf_absorb(spiflash_t *spi, uint32_t addr, uint32_t len,
+    const uint8_t *data) {
+  uint32_t room = _spiflash_wbuf_room(spi, addr);
+  uint32_t n = len < room ? len : room;
+  if (spi->wb->len == 0) {
+    spi->wb->addr = addr;
+    spi->wb->age_ms = 0;
+  }
+  memcpy(&spi->wb->buf[spi->wb->len], data, n);
+  spi->wb->len += n;
+  return n;
+}
+
+static int _spiflash_wbuf_flush(spiflash_t *spi) {
+  int res;
+  SPIF_DBG("wbuf - flush %08x %i\n", spi->wb->addr, spi->wb->len);
+  spi->wb->flushing = 1;
+  res = SPIFLASH_write(spi, spi->wb->addr, spi->wb->len, spi->wb->buf);
+  if (res != SPIFLASH_OK) {
+    spi->wb->flushing = 0;
+  }
+  return res;
+}
+
+static int _spiflash_seq_append(spiflash_t *spi) {
+  // buffer data, flush when not consecutive or page is full
+  uint32_t page_sz = _CFG(spi)->page_sz;
+  uint32_t n;
+  while (1) {
+    if (spi->wb->len && (spi->wb->in_addr != spi->wb->addr + spi->wb->len ||
+        _spiflash_wbuf_room(spi, spi->wb->in_addr) == page_sz)) {
+      return _spiflash_wbuf_flush(spi);
+    }
+    if (spi->wb->in_len == 0) {
+      spi->ctx->seq = SEQ_NONE;
       return SPIFLASH_OK;
+    }
+    if (spi->wb->len == 0 && spi->wb->in_addr % page_sz == 0 && spi->wb->in_len >= page_sz) {
+      // whole pages need no buffering
+      n = spi->wb->in_len - spi->wb->in_len % page_sz;
+      spi->wb->in_addr += n;
+      spi->wb->in_len -= n;
+      spi->wb->in_src += n;
+      return SPIFLASH_write(spi, spi->wb->in_addr - n, n, spi->wb->in_src - n);
+    }
+    n = _spiflash_wbuf_absorb(spi, spi->wb->in_addr, spi->wb->in_len, spi->wb->in_src);
+    spi->wb->in_addr += n;
+    spi->wb->in_len -= n;
+    spi->wb->in_src += n;
+  }
+}
+
+static int _spiflash_seq_check(spiflash_t *spi) {
+  // read chunk by chunk, comparing to seq_src or adding to the crc
+  uint32_t n = spi->ctx->sq->len < SPIFLASH_CHUNK_SZ ? spi->ctx->sq->len : SPIFLASH_CHUNK_SZ;
+  if (spi->ctx->seq_step) {
+    if (spi->ctx->seq == SEQ_VERIFY) {
+      if (memcmp(spi->ctx->sq->chunk, spi->ctx->sq->src, n) != 0) {
+        SPIF_DBG("verify - differs at %08x\n", spi->ctx->sq->addr);
+        spi->ctx->seq = SEQ_NONE;
+        return SPIFLASH_ERR_VERIFY;
+      }
+      spi->ctx->sq->src += n;
     } else {
-      SPIF_DBG("busy check wait ok\n");
-      spi->busy_check_wait = BCW_IDLE;
-      break;
+      spi->ctx->sq->crc = SPIFLASH_crc32_calc(spi->ctx->sq->crc, spi->ctx->sq->chunk, n);
     }
-  case BCW_IDLE:
-    SPIF_DBG("no BCW\n");
+    spi->ctx->sq->addr += n;
+    spi->ctx->sq->len -= n;
+    n = spi->ctx->sq->len < SPIFLASH_CHUNK_SZ ? spi->ctx->sq->len : SPIFLASH_CHUNK_SZ;
+  }
+  if (n == 0) {
+    SPIF_DBG("check - ok\n");
+    if (spi->ctx->seq == SEQ_CRC32) *spi->ctx->sq->crc_dst = spi->ctx->sq->crc;
+    spi->ctx->seq = SEQ_NONE;
+    return SPIFLASH_OK;
+  }
+  spi->ctx->seq_step = 1;
+  return _spiflash_read(spi, _spiflash_get_fast_read_op(spi), spi->ctx->sq->addr, n,
+      spi->ctx->sq->chunk);
+}
+
+static int _spiflash_seq_step(spiflash_t *spi) {
+  // start next operation in sequence, or finish the sequence
+  int res;
+  switch (spi->ctx->seq) {
+  case SEQ_ERASE_PRESERVE:
+    res = _spiflash_seq_erase_preserve(spi);
     break;
-  } // switch (spi->busy_check_wait)
-  
-  // handle results
-  switch (spi->op) {
-  case SPIFLASH_OP_WRITE_sWREN:
-    SPIF_DBG("write - enable ok\n");
-    spi->hal->_spiflash_spi_cs(spi, 0);
-    spi->op = SPIFLASH_OP_WRITE_sADDR;
+  case SEQ_UPDATE:
+    res = _spiflash_seq_update(spi);
     break;
-  case SPIFLASH_OP_WRITE_sADDR:
-    SPIF_DBG("write - address ok\n");
-    spi->op = SPIFLASH_OP_WRITE_sDATA;
+  case SEQ_APPEND:
+    res = _spiflash_seq_append(spi);
     break;
-  case SPIFLASH_OP_WRITE_sDATA:
-    if (spi->wr_len == 0) {
-      SPIF_DBG("write - data ok, finish\n");
-      spi->op = SPIFLASH_OP_IDLE;
-    } else {
-      SPIF_DBG("write - data ok, new chunk\n");
-      spi->op = SPIFLASH_OP_WRITE_sWREN;
-    }
+  case SEQ_VERIFY:
+  case SEQ_CRC32:
+    res = _spiflash_seq_check(spi);
     break;
-
-  case SPIFLASH_OP_ERASE_BLOCK_sWREN:
-    SPIF_DBG("erase - enable ok\n");
-    spi->hal->_spiflash_spi_cs(spi, 0);
-    spi->op = SPIFLASH_OP_ERASE_BLOCK_sERAS;
+  default:
+    res = SPIFLASH_ERR_INTERNAL;
     break;
-  case SPIFLASH_OP_ERASE_BLOCK_sERAS:
-    SPIF_DBG("erase - ok\n");
-    if (spi->erase_len == 0) {
-      SPIF_DBG("erase - ok, finish\n");
+  }
+  if (res != SPIFLASH_OK) {
+    _spiflash_abort(spi);
+    spi->ctx->seq = SEQ_NONE;
+  }
+  return res;
+}
+
+static int _spiflash_seq_start(spiflash_t *spi, uint8_t seq) {
+  int res;
+  spi->ctx->seq = seq;
+  spi->ctx->seq_step = 0;
+  res = _spiflash_seq_step(spi);
+  if (!spi->async) {
+    while (res == SPIFLASH_OK && spi->ctx->seq != SEQ_NONE) {
+      res = _spiflash_seq_step(spi);
+    }
+  }
+  return res;
+}
+
+static int _spiflash_async_trigger(spiflash_t *spi, int err_code) {
+  uint8_t st_run = spi->ctx->st && spi->ctx->st->run;
+  int res;
+  spiflash_op_t op;
+  if (err_code == SPIFLASH_OK && spi->ctx->bus_wait == BUS_NO_WAIT &&
+      !spi->ctx->bus_held && spi->hal->_spiflash_bus && spi->op != SPIFLASH_OP_IDLE) {
+    // busy wait is over, get the bus back before going on
+    err_code = _spiflash_bus_request(spi);
+    if (err_code == SPIFLASH_BUS_QUEUED) {
+      SPIF_DBG("bus queued\n");
+      spi->ctx->bus_wait = BUS_WAIT_BCW;
+      return SPIFLASH_OK;
+    }
+  } else if (spi->ctx->bus_wait != BUS_NO_WAIT) {
+    // bus granted
+    uint8_t bus_wait = spi->ctx->bus_wait;
+    spi->ctx->bus_wait = BUS_NO_WAIT;
+    if (err_code == SPIFLASH_OK) {
+      spi->ctx->bus_held = 1;
+      if (bus_wait == BUS_WAIT_OP) {
+        op = spi->op;
+        res = _spiflash_exe_granted(spi);
+        if (res == SPIFLASH_OK) return res;
+        _spiflash_abort(spi);
+        spi->op = op;
+        err_code = res;
+      }
+    }
+  }
+  res = _spiflash_end_async(spi, err_code);
+  if (res != SPIFLASH_OK) {
+    // stopped midway, the flash might still be programming or erasing
+    spi->could_be_busy = 1;
+  }
+  op = spi->op;
+  if (res != SPIFLASH_OK || op == SPIFLASH_OP_IDLE) {
+    _spiflash_cache_end(spi, res);
+    _spiflash_wbuf_end(spi, res);
+    if (res != SPIFLASH_OK) {
       spi->op = SPIFLASH_OP_IDLE;
-    } else {
-      SPIF_DBG("erase - ok, new chunk\n");
-      spi->op = SPIFLASH_OP_ERASE_BLOCK_sWREN;
+      spi->ctx->seq = SEQ_NONE;
+      if (spi->ctx->st) spi->ctx->st->run = 0;
+    } else if (spi->ctx->seq != SEQ_NONE && spi->async) {
+      // operation done, go on with sequence
+      res = _spiflash_seq_step(spi);
+      if (res == SPIFLASH_OK && spi->ctx->seq != SEQ_NONE) {
+        return res;
+      }
     }
-    break;
+    if (spi->q_run && spi->q->preempt && res == SPIFLASH_OK) {
+      _spiflash_queue_requeue(spi);
+    } else if (spi->q_run) {
+      spi->q->preempt = 0;
+      _spiflash_queue_finish(spi, 0, res);
+    } else if (spi->async && spi->async_cb && !(st_run && spi->ctx->st->paused)) {
+      // a pausing stream is not finished
+      spi->async_cb(spi, op, res);
+    }
+    if (spi->ctx->susp && spi->ctx->susp->op != SPIFLASH_OP_IDLE && spi->op == SPIFLASH_OP_IDLE) {
+      // operation finished before the pending read was served
+      _spiflash_start_pending_read(spi);
+    }
+    if (spi->async) {
+      _spiflash_stream_resume(spi);
+      _spiflash_queue_next(spi);
+    }
+  }
+  return res;
+}
 
-  case SPIFLASH_OP_WRITE_SR_sWREN:
-    SPIF_DBG("write_sr - enable ok\n");
-    spi->hal->_spiflash_spi_cs(spi, 0);
-    spi->op = SPIFLASH_OP_WRITE_SR_sDATA;
-    break;
-  case SPIFLASH_OP_WRITE_SR_sDATA:
-    SPIF_DBG("write_sr - ok\n");
-    spi->op = SPIFLASH_OP_IDLE;
-    break;
+int SPIFLASH_async_trigger(spiflash_t *spi, int err_code) {
+  int res;
+  _spiflash_critical(spi, 1);
+  if (spi->ctx == 0) {
+    // nothing runs
+    res = SPIFLASH_ERR_BAD_STATE;
+  } else {
+    _spiflash_enter(spi);
+    res = _spiflash_leave(spi, _spiflash_async_trigger(spi, err_code));
+  }
+  _spiflash_critical(spi, 0);
+  return res;
+}
 
-  case SPIFLASH_OP_ERASE_CHIP_sWREN:
-    SPIF_DBG("erase chip - enable ok\n");
-    spi->hal->_spiflash_spi_cs(spi, 0);
-    spi->op = SPIFLASH_OP_ERASE_CHIP_sERAS;
-    break;
-  case SPIFLASH_OP_ERASE_CHIP_sERAS:
-    SPIF_DBG("erase chip - ok\n");
-    spi->op = SPIFLASH_OP_IDLE;
-    break;
+int SPIFLASH_write(spiflash_t *spi, uint32_t addr, uint32_t len, const uint8_t *buf) {
+  int res;
+  if (spi->op != SPIFLASH_OP_IDLE) {
+    return SPIFLASH_ERR_BUSY;
+  }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
+  
+  spi->ctx->addr = addr;
+  spi->ctx->wr_buf = buf;
+  spi->ctx->wr_len = len;
+  
+  spi->op = SPIFLASH_OP_WRITE_sWREN;
+  
+  _spiflash_cache_apply(spi, addr, len, buf);
 
-  case SPIFLASH_OP_READ:
-    SPIF_DBG("read - ok\n");
-    spi->op = SPIFLASH_OP_IDLE;
-    break;
+  res = _spiflash_exe(spi);
+  if (res != SPIFLASH_OK) {
+    _spiflash_cache_end(spi, res);
+  }
+  
+  return _spiflash_leave(spi, res);
+}
 
-  case SPIFLASH_OP_FAST_READ:
-    SPIF_DBG("fast read - ok\n");
-    spi->op = SPIFLASH_OP_IDLE;
-    break;
+int SPIFLASH_write_produce(spiflash_t *spi, spiflash_produce_t *pr,
+    uint32_t addr, uint32_t len, uint8_t *bufs, spiflash_produce_cb_t cb) {
+  int res;
+  if (spi->op != SPIFLASH_OP_IDLE) {
+    return SPIFLASH_ERR_BUSY;
+  }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
+
+  spi->ctx->pr = pr;
+  spi->ctx->pr->cb = cb;
+  spi->ctx->pr->bufs = bufs;
+  spi->ctx->pr->ix = 0;
+  spi->ctx->pr->ready = 0;
+  spi->ctx->pr->addr = addr;
+  spi->ctx->pr->left = len;
+  spi->ctx->pr->res = SPIFLASH_OK;
+  res = _spiflash_produce(spi);
+  if (res != SPIFLASH_OK) {
+    spi->ctx->pr = 0;
+    return _spiflash_leave(spi, res);
+  }
+  _spiflash_produce_next(spi);
 
-  case SPIFLASH_OP_READ_JEDEC:
-    SPIF_DBG("read jedec ok\n");
-    spi->op = SPIFLASH_OP_IDLE;
-    break;
+  spi->op = SPIFLASH_OP_WRITE_sWREN;
 
-  case SPIFLASH_OP_READ_PRODUCT:
-    SPIF_DBG("read prod ok\n");
-    spi->op = SPIFLASH_OP_IDLE;
-    break;
+  res = _spiflash_exe(spi);
+  if (res != SPIFLASH_OK) {
+    _spiflash_cache_end(spi, res);
+  }
 
-  case SPIFLASH_OP_READ_SR_BUSY:
-  case SPIFLASH_OP_READ_SR:
-    SPIF_DBG("read sr ok\n");
-    if (spi->op == SPIFLASH_OP_READ_SR_BUSY) {
-      *spi->sr_dst = ((*spi->sr_dst & spi->cmd_tbl->sr_busy_bit)) != 0;
-    }
-    spi->op = SPIFLASH_OP_IDLE;
-    break;
+  return _spiflash_leave(spi, res);
+}
 
-  case SPIFLASH_OP_WRITE_REG_sWREN:
-    SPIF_DBG("write_reg - enable ok\n");
-    spi->hal->_spiflash_spi_cs(spi, 0);
-    spi->op = SPIFLASH_OP_WRITE_REG_sDATAWAIT;
-    break;
-  case SPIFLASH_OP_WRITE_REG_sDATAWAIT:
-  case SPIFLASH_OP_WRITE_REG_DATA:
-    SPIF_DBG("write_reg - ok\n");
-    spi->op = SPIFLASH_OP_IDLE;
-    break;
+int SPIFLASH_writev(spiflash_t *spi, const spiflash_iov_t *iov, uint32_t iovcnt) {
+  int res;
+  uint32_t i;
+  if (spi->op != SPIFLASH_OP_IDLE) {
+    return SPIFLASH_ERR_BUSY;
+  }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
+  res = _spiflash_first_seg(spi, &iov, &iovcnt);
+  if (res != SPIFLASH_OK || iovcnt == 0) {
+    return _spiflash_leave(spi, res);
+  }
 
-  case SPIFLASH_OP_READ_REG:
-    SPIF_DBG("read reg ok\n");
-    spi->op = SPIFLASH_OP_IDLE;
-    break;
+  spi->ctx->addr = iov[0].addr;
+  spi->ctx->wr_buf = iov[0].buf;
+  spi->ctx->wr_len = iov[0].len;
+  spi->ctx->iov = &iov[1];
+  spi->ctx->iov_cnt = iovcnt - 1;
 
-  case SPIFLASH_OP_IDLE:
-  default:
-    res = SPIFLASH_ERR_INTERNAL;
-    break;
+  spi->op = SPIFLASH_OP_WRITE_sWREN;
 
-  } // switch (spi->op)
+  for (i = 0; i < iovcnt; i++) {
+    _spiflash_cache_apply(spi, iov[i].addr, iov[i].len, iov[i].buf);
+  }
 
-  if (res == SPIFLASH_OK && spi->op != SPIFLASH_OP_IDLE) {
-    // moar to do
-    res = _spiflash_begin_async(spi);
-  } else {
-    // finished or error
-    spi->hal->_spiflash_spi_cs(spi, 0);
-    _spiflash_finalize(spi);
+  res = _spiflash_exe(spi);
+  if (res != SPIFLASH_OK) {
+    _spiflash_cache_end(spi, res);
+  }
+
+  return _spiflash_leave(spi, res);
+}
+
+int SPIFLASH_read(spiflash_t *spi, uint32_t addr, uint32_t len, uint8_t *buf) {
+  int res;
+  if (spi->op != SPIFLASH_OP_IDLE) {
+    return _spiflash_hold_read(spi, SPIFLASH_OP_READ, addr, len, buf);
+  }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
+
+  res = _spiflash_read_user(spi,
+      (spi->xip == XIP_ARMED || spi->xip == XIP_ACTIVE) ?
+          SPIFLASH_OP_QUAD_READ : SPIFLASH_OP_READ,
+      addr, len, buf);
+
+  return _spiflash_leave(spi, res);
+}
+
+int SPIFLASH_fast_read(spiflash_t *spi, uint32_t addr, uint32_t len,
+                       uint8_t *buf) {
+  int res;
+  spiflash_op_t op = _spiflash_get_fast_read_op(spi);
+
+  if (spi->op != SPIFLASH_OP_IDLE) {
+    return _spiflash_hold_read(spi, op, addr, len, buf);
+  }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
+
+  res = _spiflash_read_user(spi, op, addr, len, buf);
+
+  return _spiflash_leave(spi, res);
+}
+
+int SPIFLASH_readv(spiflash_t *spi, const spiflash_iov_t *iov, uint32_t iovcnt) {
+  int res;
+  if (spi->op != SPIFLASH_OP_IDLE) {
+    return SPIFLASH_ERR_BUSY;
+  }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
+  res = _spiflash_first_seg(spi, &iov, &iovcnt);
+  if (res != SPIFLASH_OK || iovcnt == 0) {
+    return _spiflash_leave(spi, res);
+  }
+
+  spi->ctx->addr = iov[0].addr;
+  spi->ctx->rd_buf = iov[0].buf;
+  spi->ctx->rd_len = iov[0].len;
+  spi->ctx->iov = &iov[1];
+  spi->ctx->iov_cnt = iovcnt - 1;
+  if (spi->wb && spi->wb->len) {
+    // see the pending data once read
+    spi->ctx->rd_dst_iov = iov;
+    spi->ctx->rd_dst_len = iovcnt;
+    spi->ctx->rd_dst_v = 1;
+  }
+
+  spi->op = _spiflash_get_fast_read_op(spi);
+
+  res = _spiflash_exe(spi);
+  if (res != SPIFLASH_OK) {
+    spi->ctx->rd_dst = 0;
+    spi->ctx->rd_dst_v = 0;
+  }
+
+  return _spiflash_leave(spi, res);
+}
+
+static uint8_t _spiflash_wrap_ok(spiflash_t *spi, uint32_t addr, uint32_t len) {
+  // the quad i/o read for given range is there to wrap
+  const spiflash_cmd_tbl_t *cmd = _CMD(spi);
+  if (_spiflash_get_lanes(spi) < 4) return 0;
+  return _spiflash_addr_4b(spi, addr, len) ? cmd->read_data_quad_io_4b : cmd->read_data_quad_io;
+}
+
+int SPIFLASH_read_line(spiflash_t *spi, uint32_t addr, uint32_t line_sz,
+    uint32_t lines, uint8_t *buf) {
+  int res;
+  uint32_t line = addr & ~(line_sz - 1);
+  uint32_t off = addr - line;
+  if (spi->op != SPIFLASH_OP_IDLE) {
+    return SPIFLASH_ERR_BUSY;
+  }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
+  if (spi->ctx->sq == 0 || line_sz == 0 || (line_sz & (line_sz - 1)) || lines == 0) {
+    return _spiflash_leave(spi, SPIFLASH_ERR_BAD_CONFIG);
   }
-  
 
-  return res;
-}
+  // critical word first, the start of the first line wrapped to or read last
+  spi->ctx->addr = addr;
+  spi->ctx->rd_buf = buf + off;
+  spi->ctx->rd_len = lines * line_sz - off;
+  spi->ctx->sq->line_iov.addr = line;
+  spi->ctx->sq->line_iov.len = off;
+  spi->ctx->sq->line_iov.buf = buf;
+  spi->ctx->iov = &spi->ctx->sq->line_iov;
+  spi->ctx->iov_cnt = off ? 1 : 0;
+  spi->ctx->rd_wrap = lines == 1 && off && spi->wrap == line_sz &&
+      _spiflash_wrap_ok(spi, line, line_sz);
+  if (spi->wb && spi->wb->len) {
+    // see the pending data once read
+    spi->ctx->rd_dst = buf;
+    spi->ctx->rd_dst_addr = line;
+    spi->ctx->rd_dst_len = lines * line_sz;
+  }
 
+  spi->op = _spiflash_get_fast_read_op(spi);
 
-static int _spiflash_exe(spiflash_t *spi) {
-  int res = SPIFLASH_OK;
+  res = _spiflash_exe(spi);
+  if (res != SPIFLASH_OK) {
+    spi->ctx->rd_dst = 0;
+  }
 
-  if (spi->could_be_busy) {
-    spi->busy_pre_check = 1;
+  return _spiflash_leave(spi, res);
+}
+
+static int _spiflash_check(spiflash_t *spi, uint8_t seq, uint32_t addr,
+    uint32_t len) {
+  if (len == 0) {
+    if (spi->ctx->sq->crc_dst) *spi->ctx->sq->crc_dst = 0;
+    _spiflash_finish_now(spi);
+    return SPIFLASH_OK;
+  }
+  if (spi->hal->_spiflash_spi_rx_crc32) {
+    // one transaction, checksummed by the hal
+    spi->ctx->addr = addr;
+    spi->ctx->rd_len = len;
+    spi->op = SPIFLASH_OP_CRC32;
+    return _spiflash_exe(spi);
   }
+  spi->ctx->sq->addr = addr;
+  spi->ctx->sq->len = len;
+  spi->ctx->sq->crc = 0;
+  return _spiflash_seq_start(spi, seq);
+}
 
-  if (spi->async) {
-    // asynchronous
-    res = _spiflash_begin_async(spi);
-  } else {
-    // blocking
-    res = _spiflash_begin_async(spi);
-    while (res == SPIFLASH_OK && spi->op != SPIFLASH_OP_IDLE) {
-      res = SPIFLASH_async_trigger(spi, res);
-    }
-    _spiflash_finalize(spi);
+int SPIFLASH_verify(spiflash_t *spi, uint32_t addr, uint32_t len,
+    const uint8_t *buf) {
+  int res;
+  if (spi->op != SPIFLASH_OP_IDLE) {
+    return SPIFLASH_ERR_BUSY;
   }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
+  if (spi->ctx->sq == 0) {
+    return _spiflash_leave(spi, SPIFLASH_ERR_BAD_CONFIG);
+  }
+  spi->ctx->sq->crc_dst = 0;
+  if (spi->hal->_spiflash_spi_rx_crc32) {
+    spi->ctx->sq->crc_ref = SPIFLASH_crc32_calc(0, buf, len);
+  }
+  spi->ctx->sq->src = buf;
+  res = _spiflash_check(spi, SEQ_VERIFY, addr, len);
+  return _spiflash_leave(spi, res);
+}
 
-  return res;
+int SPIFLASH_crc32(spiflash_t *spi, uint32_t addr, uint32_t len, uint32_t *crc) {
+  int res;
+  if (spi->op != SPIFLASH_OP_IDLE) {
+    return SPIFLASH_ERR_BUSY;
+  }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
+  if (spi->ctx->sq == 0) {
+    return _spiflash_leave(spi, SPIFLASH_ERR_BAD_CONFIG);
+  }
+  spi->ctx->sq->crc_dst = crc;
+  res = _spiflash_check(spi, SEQ_CRC32, addr, len);
+  return _spiflash_leave(spi, res);
 }
 
+uint32_t SPIFLASH_crc32_calc(uint32_t crc, const uint8_t *buf, uint32_t len) {
+  // a nibble at a time, to keep the table small
+  static const uint32_t tbl[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+    0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+  };
+  crc = ~crc;
+  while (len--) {
+    crc ^= *buf++;
+    crc = (crc >> 4) ^ tbl[crc & 0x0f];
+    crc = (crc >> 4) ^ tbl[crc & 0x0f];
+  }
+  return ~crc;
+}
 
-void SPIFLASH_init(spiflash_t *spi, 
-                   const spiflash_config_t *cfg,
-                   const spiflash_cmd_tbl_t *cmd,
-                   const spiflash_hal_t *hal,
-                   spiflash_cb_async_t async_cb,
-                   uint8_t async,
-                   void *user_data) {
-  memset(spi, 0, sizeof(spiflash_t));
-  spi->cfg = cfg;
-  spi->cmd_tbl = cmd;
-  spi->hal = hal;
-  spi->async_cb = async_cb;
-  
-  spi->async = async;
-  spi->user_data = user_data;
-  spi->op = SPIFLASH_OP_IDLE;
+int SPIFLASH_stream_start(spiflash_t *spi, spiflash_stream_t *st,
+    uint32_t addr, uint32_t len, uint8_t *bufs, uint8_t buf_cnt,
+    uint32_t buf_sz, spiflash_stream_cb_t cb) {
+  int res;
+  if (spi->op != SPIFLASH_OP_IDLE ||
+      (spi->ctx && spi->ctx->st && spi->ctx->st->paused)) {
+    return SPIFLASH_ERR_BUSY;
+  }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
+
+  spi->ctx->st = st;
+  spi->ctx->st->run = 0;
+  spi->ctx->st->paused = 0;
+  spi->ctx->st->cb = cb;
+  spi->ctx->st->bufs = bufs;
+  spi->ctx->st->cnt = buf_cnt;
+  spi->ctx->st->sz = buf_sz;
+  spi->ctx->st->head = 0;
+  spi->ctx->st->filled = 0;
+  spi->ctx->st->addr = addr;
+  spi->ctx->st->left = len;
+  spi->ctx->st->op = _spiflash_get_fast_read_op(spi);
+
+  res = _spiflash_stream_read(spi);
+  return _spiflash_leave(spi, res);
 }
 
+int SPIFLASH_stream_release(spiflash_t *spi) {
+  int res = SPIFLASH_OK;
+  if (spi->ctx == 0 || spi->ctx->st == 0 || spi->ctx->st->filled == 0) {
+    return SPIFLASH_ERR_BAD_STATE;
+  }
+  _spiflash_enter(spi);
+  spi->ctx->st->head = (spi->ctx->st->head + 1) % spi->ctx->st->cnt;
+  spi->ctx->st->filled--;
+  if (spi->ctx->st->paused && spi->op == SPIFLASH_OP_IDLE) {
+    SPIF_DBG("stream - resume at %08x\n", spi->ctx->st->addr);
+    res = _spiflash_stream_read(spi);
+  }
+  return _spiflash_leave(spi, res);
+}
 
-int SPIFLASH_async_trigger(spiflash_t *spi, int err_code) {
-  int res = _spiflash_end_async(spi, err_code);
-  spiflash_op_t op = spi->op;
-  if (res != SPIFLASH_OK || op == SPIFLASH_OP_IDLE) {
-    if (res != SPIFLASH_OK) {
-      spi->op = SPIFLASH_OP_IDLE;
-    }
-    if (spi->async && spi->async_cb) {
-      spi->async_cb(spi, op, res);
-    }
+int SPIFLASH_stream_stop(spiflash_t *spi) {
+  if (spi->ctx == 0 || spi->ctx->st == 0) {
+    return SPIFLASH_OK;
   }
-  return res;
+  _spiflash_enter(spi);
+  spi->ctx->st->left = 0;
+  if (spi->ctx->st->paused) {
+    spi->ctx->st->paused = 0;
+    _spiflash_finish_now(spi);
+  }
+  return _spiflash_leave(spi, SPIFLASH_OK);
 }
 
-int SPIFLASH_write(spiflash_t *spi, uint32_t addr, uint32_t len, const uint8_t *buf) {
+int SPIFLASH_read_jedec_id(spiflash_t *spi, uint32_t *jedec_id) {
   int res;
   if (spi->op != SPIFLASH_OP_IDLE) {
     return SPIFLASH_ERR_BUSY;
   }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
   
-  spi->addr = addr;
-  spi->wr_buf = buf;
-  spi->wr_len = len;
+  spi->ctx->id_dst = jedec_id;
   
-  spi->op = SPIFLASH_OP_WRITE_sWREN;
+  spi->op = SPIFLASH_OP_READ_JEDEC;
   
   res = _spiflash_exe(spi);
   
-  return res;
+  return _spiflash_leave(spi, res);
 }
 
-int SPIFLASH_read(spiflash_t *spi, uint32_t addr, uint32_t len, uint8_t *buf) {
+int SPIFLASH_read_sfdp(spiflash_t *spi, uint32_t addr, uint32_t len,
+    uint8_t *buf) {
   int res;
   if (spi->op != SPIFLASH_OP_IDLE) {
     return SPIFLASH_ERR_BUSY;
   }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
+  if (_CMD(spi)->read_sfdp == 0x00) {
+    return _spiflash_leave(spi, SPIFLASH_ERR_BAD_CONFIG);
+  }
 
-  spi->addr = addr;
-  spi->rd_buf = buf;
-  spi->rd_len = len;
+  spi->ctx->addr = addr;
+  spi->ctx->rd_len = len;
+  spi->ctx->rd_buf = buf;
 
-  spi->op = SPIFLASH_OP_READ;
+  spi->op = SPIFLASH_OP_READ_SFDP;
 
   res = _spiflash_exe(spi);
 
-  return res;
+  return _spiflash_leave(spi, res);
 }
 
-int SPIFLASH_fast_read(spiflash_t *spi, uint32_t addr, uint32_t len,
-                       uint8_t *buf) {
+int SPIFLASH_read_product_id(spiflash_t *spi, uint32_t *prod_id) {
   int res;
   if (spi->op != SPIFLASH_OP_IDLE) {
     return SPIFLASH_ERR_BUSY;
   }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
 
-  spi->addr = addr;
-  spi->rd_buf = buf;
-  spi->rd_len = len;
+  spi->ctx->id_dst = prod_id;
 
-  spi->op = spi->cmd_tbl->read_data_fast ? SPIFLASH_OP_FAST_READ : SPIFLASH_OP_READ;
+  spi->op = SPIFLASH_OP_READ_PRODUCT;
 
   res = _spiflash_exe(spi);
 
-  return res;
+  return _spiflash_leave(spi, res);
 }
 
-
-int SPIFLASH_read_jedec_id(spiflash_t *spi, uint32_t *jedec_id) {
+int SPIFLASH_read_sr(spiflash_t *spi, uint8_t *sr) {
   int res;
   if (spi->op != SPIFLASH_OP_IDLE) {
     return SPIFLASH_ERR_BUSY;
   }
-  
-  spi->id_dst = jedec_id;
-  
-  spi->op = SPIFLASH_OP_READ_JEDEC;
-  
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
+
+  spi->ctx->sr_dst = sr;
+
+  spi->op = SPIFLASH_OP_READ_SR;
+
   res = _spiflash_exe(spi);
-  
-  return res;
+
+  return _spiflash_leave(spi, res);
 }
 
-int SPIFLASH_read_product_id(spiflash_t *spi, uint32_t *prod_id) {
+int SPIFLASH_read_sr_busy(spiflash_t *spi, uint8_t *busy) {
   int res;
   if (spi->op != SPIFLASH_OP_IDLE) {
     return SPIFLASH_ERR_BUSY;
   }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
 
-  spi->id_dst = prod_id;
+  spi->ctx->sr_dst = busy;
 
-  spi->op = SPIFLASH_OP_READ_PRODUCT;
+  spi->op = SPIFLASH_OP_READ_SR_BUSY;
 
   res = _spiflash_exe(spi);
 
-  return res;
+  return _spiflash_leave(spi, res);
 }
 
-int SPIFLASH_read_sr(spiflash_t *spi, uint8_t *sr) {
+
+int SPIFLASH_write_sr(spiflash_t *spi, uint8_t sr) {
   int res;
   if (spi->op != SPIFLASH_OP_IDLE) {
     return SPIFLASH_ERR_BUSY;
   }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
 
-  spi->sr_dst = sr;
+  spi->ctx->sr_data = sr;
 
-  spi->op = SPIFLASH_OP_READ_SR;
+  spi->op = SPIFLASH_OP_WRITE_SR_sWREN;
 
   res = _spiflash_exe(spi);
 
-  return res;
+  return _spiflash_leave(spi, res);
 }
 
-int SPIFLASH_read_sr_busy(spiflash_t *spi, uint8_t *busy) {
+
+int SPIFLASH_quad_enable(spiflash_t *spi) {
   int res;
   if (spi->op != SPIFLASH_OP_IDLE) {
     return SPIFLASH_ERR_BUSY;
   }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
+
+  if (_CMD(spi)->qe_bit == 0) {
+    // nothing to enable
+    return _spiflash_leave(spi, SPIFLASH_OK);
+  }
 
-  spi->sr_dst = busy;
+  spi->quad_en = QE_OFF;
 
-  spi->op = SPIFLASH_OP_READ_SR_BUSY;
+  spi->op = SPIFLASH_OP_QUAD_ENABLE_sREAD;
 
   res = _spiflash_exe(spi);
 
-  return res;
+  return _spiflash_leave(spi, res);
+}
+
+int SPIFLASH_set_burst_wrap(spiflash_t *spi, uint8_t wrap_sz) {
+  int res;
+  uint8_t w;
+  if (spi->op != SPIFLASH_OP_IDLE) {
+    return SPIFLASH_ERR_BUSY;
+  }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
+  if (spi->xip != XIP_OFF) {
+    return _spiflash_leave(spi, SPIFLASH_ERR_BAD_STATE);
+  }
+  if (_CMD(spi)->set_burst_wrap == 0x00 || _CMD(spi)->read_data_quad_io == 0x00 ||
+      _spiflash_get_lanes(spi) < 4) {
+    return _spiflash_leave(spi, SPIFLASH_ERR_BAD_CONFIG);
+  }
+  // W6-W5 select 8, 16, 32 or 64 bytes, W4 disables wrapping
+  switch (wrap_sz) {
+  case 0:  w = 0x10; break;
+  case 8:  w = 0x00; break;
+  case 16: w = 0x20; break;
+  case 32: w = 0x40; break;
+  case 64: w = 0x60; break;
+  default: return _spiflash_leave(spi, SPIFLASH_ERR_BAD_CONFIG);
+  }
+
+  spi->ctx->tx_internal_buf[0] = _CMD(spi)->set_burst_wrap;
+  spi->ctx->tx_internal_buf[1] = 0;
+  spi->ctx->tx_internal_buf[2] = 0;
+  spi->ctx->tx_internal_buf[3] = 0;
+  spi->ctx->tx_internal_buf[4] = w;
+
+  spi->op = SPIFLASH_OP_SET_BURST_WRAP;
+
+  res = _spiflash_exe(spi);
+  return _spiflash_leave(spi, res);
 }
 
+int SPIFLASH_xip_enter(spiflash_t *spi) {
+  int res;
+  spiflash_xfer_t xfer;
+  if (spi->op != SPIFLASH_OP_IDLE) {
+    return SPIFLASH_ERR_BUSY;
+  }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
+  if (spi->xip != XIP_OFF) {
+    return _spiflash_leave(spi, SPIFLASH_OK);
+  }
+  if (spi->wrap) {
+    // continuous reads would wrap
+    return _spiflash_leave(spi, SPIFLASH_ERR_BAD_STATE);
+  }
+  if (_CMD(spi)->xip_mode_bits == 0x00) {
+    return _spiflash_leave(spi, SPIFLASH_ERR_BAD_CONFIG);
+  }
 
-int SPIFLASH_write_sr(spiflash_t *spi, uint8_t sr) {
+  spi->xip = XIP_ARMED;
+  if (_spiflash_compose_multi_read(spi, spi->xip, 0, 0, &xfer) != SPIFLASH_OK) {
+    spi->xip = XIP_OFF;
+    return _spiflash_leave(spi, SPIFLASH_ERR_BAD_CONFIG);
+  }
+  if (spi->hal->_spiflash_xip_map) {
+    spi->xip = XIP_UNMAPPED;
+    _spiflash_xip_remap(spi);
+  }
+
+  return _spiflash_leave(spi, SPIFLASH_OK);
+}
+
+int SPIFLASH_xip_exit(spiflash_t *spi) {
   int res;
   if (spi->op != SPIFLASH_OP_IDLE) {
     return SPIFLASH_ERR_BUSY;
   }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
 
-  spi->sr_data = sr;
+  if (spi->xip == XIP_MAPPED) {
+    res = spi->hal->_spiflash_xip_map(spi, 0);
+    if (res != SPIFLASH_OK) {
+      return _spiflash_leave(spi, res);
+    }
+  }
+  spi->xip = XIP_OFF;
 
-  spi->op = SPIFLASH_OP_WRITE_SR_sWREN;
+  spi->op = SPIFLASH_OP_XIP_EXIT;
 
   res = _spiflash_exe(spi);
 
-  return res;
+  return _spiflash_leave(spi, res);
 }
 
 
@@ -706,15 +3087,17 @@ int SPIFLASH_read_reg(spiflash_t *spi, uint8_t reg, uint8_t *data) {
   if (spi->op != SPIFLASH_OP_IDLE) {
     return SPIFLASH_ERR_BUSY;
   }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
 
-  spi->reg_nbr = reg;
-  spi->reg_dst = data;
+  spi->ctx->reg_nbr = reg;
+  spi->ctx->reg_dst = data;
 
   spi->op = SPIFLASH_OP_READ_REG;
 
   res = _spiflash_exe(spi);
 
-  return res;
+  return _spiflash_leave(spi, res);
 }
 
 
@@ -724,18 +3107,20 @@ int SPIFLASH_write_reg(spiflash_t *spi, uint8_t reg, uint8_t data,
   if (spi->op != SPIFLASH_OP_IDLE) {
     return SPIFLASH_ERR_BUSY;
   }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
 
-  spi->tx_internal_buf[0] = reg;
-  spi->tx_internal_buf[1] = data;
+  spi->ctx->tx_internal_buf[0] = reg;
+  spi->ctx->tx_internal_buf[1] = data;
 
   spi->op = write_en ? SPIFLASH_OP_WRITE_REG_sWREN : SPIFLASH_OP_WRITE_REG_DATA;
   if (write_en) {
-    spi->wait_period_ms = wait_ms;
+    _spiflash_set_wait(spi, TM_NONE, wait_ms * 1000);
   }
 
   res = _spiflash_exe(spi);
 
-  return res;
+  return _spiflash_leave(spi, res);
 }
 
 
@@ -744,21 +3129,134 @@ int SPIFLASH_erase(spiflash_t *spi, uint32_t addr, uint32_t len) {
   if (spi->op != SPIFLASH_OP_IDLE) {
     return SPIFLASH_ERR_BUSY;
   }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
 
-  uint32_t era_sz = _spiflash_get_largest_erase_area(spi, addr, len);
+  uint32_t era_sz = _spiflash_get_erase_area(spi, addr, len);
 
   if (era_sz == 0) {
-    return SPIFLASH_ERR_ERASE_UNALIGNED;
+    return _spiflash_leave(spi, SPIFLASH_ERR_ERASE_UNALIGNED);
   }
 
-  spi->addr = addr;
-  spi->erase_len = len;
+  if (_spiflash_is_chip_erase_cheaper(spi, addr, len)) {
+    spi->op = SPIFLASH_OP_ERASE_CHIP_sWREN;
+  } else {
+    spi->ctx->addr = addr;
+    spi->ctx->erase_len = len;
+    spi->op = SPIFLASH_OP_ERASE_BLOCK_sWREN;
+  }
 
-  spi->op = SPIFLASH_OP_ERASE_BLOCK_sWREN;
+  _spiflash_cache_apply(spi, addr, len, NULL);
 
   res = _spiflash_exe(spi);
+  if (res != SPIFLASH_OK) {
+    _spiflash_cache_end(spi, res);
+  }
 
-  return res;
+  return _spiflash_leave(spi, res);
+}
+
+int SPIFLASH_erase_preserve(spiflash_t *spi, uint32_t addr, uint32_t len,
+    uint8_t *buf, uint32_t buf_len) {
+  int res;
+  uint32_t min_sz = _spiflash_get_min_erase_sz(spi);
+  uint32_t start, end;
+  if (spi->op != SPIFLASH_OP_IDLE) {
+    return SPIFLASH_ERR_BUSY;
+  }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
+  if (spi->ctx->sq == 0 || min_sz == 0) {
+    return _spiflash_leave(spi, SPIFLASH_ERR_BAD_CONFIG);
+  }
+
+  start = addr & ~(min_sz - 1);
+  end = (addr + len + min_sz - 1) & ~(min_sz - 1);
+  if (start == addr && end == addr + len) {
+    res = SPIFLASH_erase(spi, addr, len);
+    return _spiflash_leave(spi, res);
+  }
+  if ((addr - start) + (end - addr - len) > buf_len) {
+    return _spiflash_leave(spi, SPIFLASH_ERR_ERASE_UNALIGNED);
+  }
+
+  spi->ctx->sq->addr = start;
+  spi->ctx->sq->len = end - start;
+  spi->ctx->sq->buf = buf;
+  spi->ctx->sq->head = addr - start;
+  spi->ctx->sq->tail = end - addr - len;
+
+  res = _spiflash_seq_start(spi, SEQ_ERASE_PRESERVE);
+  return _spiflash_leave(spi, res);
+}
+
+int SPIFLASH_update(spiflash_t *spi, uint32_t addr, uint32_t len,
+    const uint8_t *data, uint8_t *buf, uint32_t buf_len) {
+  int res;
+  uint32_t sec_sz = _spiflash_get_min_erase_sz(spi);
+  if (spi->op != SPIFLASH_OP_IDLE) {
+    return SPIFLASH_ERR_BUSY;
+  }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
+  if (spi->ctx->sq == 0 || sec_sz == 0) {
+    return _spiflash_leave(spi, SPIFLASH_ERR_BAD_CONFIG);
+  }
+  if (buf_len < sec_sz) {
+    return _spiflash_leave(spi, SPIFLASH_ERR_ERASE_UNALIGNED);
+  }
+
+  spi->ctx->sq->addr = addr;
+  spi->ctx->sq->len = len;
+  spi->ctx->sq->src = data;
+  spi->ctx->sq->buf = buf;
+  spi->ctx->sq->sec = addr & ~(sec_sz - 1);
+
+  res = _spiflash_seq_start(spi, SEQ_UPDATE);
+  return _spiflash_leave(spi, res);
+}
+
+int SPIFLASH_append(spiflash_t *spi, uint32_t addr, uint32_t len,
+    const uint8_t *data) {
+  int res;
+  uint32_t room;
+  if (spi->op != SPIFLASH_OP_IDLE) {
+    return SPIFLASH_ERR_BUSY;
+  }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
+  if (spi->wb == 0 || _CFG(spi)->page_sz == 0) {
+    return _spiflash_leave(spi, SPIFLASH_ERR_BAD_CONFIG);
+  }
+
+  room = _spiflash_wbuf_room(spi, addr);
+  if ((spi->wb->len == 0 || addr == spi->wb->addr + spi->wb->len) && len < room) {
+    // fits in open page
+    if (len) _spiflash_wbuf_absorb(spi, addr, len, data);
+    _spiflash_finish_now(spi);
+    return _spiflash_leave(spi, SPIFLASH_OK);
+  }
+
+  spi->wb->in_addr = addr;
+  spi->wb->in_len = len;
+  spi->wb->in_src = data;
+  res = _spiflash_seq_start(spi, SEQ_APPEND);
+  return _spiflash_leave(spi, res);
+}
+
+int SPIFLASH_flush(spiflash_t *spi) {
+  int res;
+  if (spi->op != SPIFLASH_OP_IDLE) {
+    return SPIFLASH_ERR_BUSY;
+  }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
+  if (spi->wb == 0 || spi->wb->len == 0) {
+    _spiflash_finish_now(spi);
+    return _spiflash_leave(spi, SPIFLASH_OK);
+  }
+  res = _spiflash_wbuf_flush(spi);
+  return _spiflash_leave(spi, res);
 }
 
 int SPIFLASH_chip_erase(spiflash_t *spi) {
@@ -766,15 +3264,202 @@ int SPIFLASH_chip_erase(spiflash_t *spi) {
   if (spi->op != SPIFLASH_OP_IDLE) {
     return SPIFLASH_ERR_BUSY;
   }
+  res = _spiflash_enter(spi);
+  if (res != SPIFLASH_OK) return res;
 
   spi->op = SPIFLASH_OP_ERASE_CHIP_sWREN;
 
+  _spiflash_cache_apply(spi, 0, _CFG(spi)->sz, NULL);
+
   res = _spiflash_exe(spi);
+  if (res != SPIFLASH_OK) {
+    _spiflash_cache_end(spi, res);
+  }
 
-  return res;
+  return _spiflash_leave(spi, res);
+}
+
+int SPIFLASH_stats_init(spiflash_t *spi, spiflash_stats_t *stats) {
+#if SPIFLASH_STATS
+  spi->stats = stats;
+  SPIFLASH_stats_reset(spi);
+  return SPIFLASH_OK;
+#else
+  (void)spi; (void)stats;
+  return SPIFLASH_ERR_UNSUPPORTED;
+#endif
+}
+
+int SPIFLASH_stats_get(spiflash_t *spi, spiflash_stats_t *stats) {
+#if SPIFLASH_STATS
+  if (spi->stats == 0) {
+    memset(stats, 0, sizeof(spiflash_stats_t));
+    return SPIFLASH_ERR_BAD_CONFIG;
+  }
+  memcpy(stats, spi->stats, sizeof(spiflash_stats_t));
+  return SPIFLASH_OK;
+#else
+  (void)spi;
+  memset(stats, 0, sizeof(spiflash_stats_t));
+  return SPIFLASH_ERR_UNSUPPORTED;
+#endif
+}
+
+void SPIFLASH_stats_reset(spiflash_t *spi) {
+#if SPIFLASH_STATS
+  if (spi->stats) memset(spi->stats, 0, sizeof(spiflash_stats_t));
+#else
+  (void)spi;
+#endif
+}
+
+int SPIFLASH_trace_init(spiflash_t *spi, spiflash_trace_t *recs, uint16_t cnt) {
+#if SPIFLASH_TRACE
+  if (recs == 0 || cnt == 0) {
+    spi->tr = 0;
+    return SPIFLASH_OK;
+  }
+  memset(recs, 0, cnt * sizeof(spiflash_trace_t));
+  spi->tr = recs;
+  spi->tr_cnt = cnt;
+  spi->tr_head = 0;
+  return SPIFLASH_OK;
+#else
+  (void)spi; (void)recs; (void)cnt;
+  return SPIFLASH_ERR_UNSUPPORTED;
+#endif
 }
 
 int SPIFLASH_is_busy(spiflash_t *spi) {
   return spi->op == SPIFLASH_OP_IDLE ? SPIFLASH_OK : SPIFLASH_ERR_BUSY;
 }
 
+int SPIFLASH_cache_init(spiflash_t *spi, spiflash_cache_t *cache,
+    spiflash_cache_line_t *lines, uint8_t *mem, uint16_t line_cnt,
+    uint32_t line_sz) {
+  if (line_cnt && (line_sz == 0 || (line_sz & (line_sz - 1)))) {
+    return SPIFLASH_ERR_BAD_CONFIG;
+  }
+  if (cache == 0 || line_cnt == 0) {
+    spi->cache = 0;
+    return SPIFLASH_OK;
+  }
+  spi->cache = cache;
+  spi->cache->lines = lines;
+  spi->cache->mem = mem;
+  spi->cache->cnt = line_cnt;
+  spi->cache->line_sz = line_sz;
+  spi->cache->used = 0;
+  spi->cache->hits = 0;
+  spi->cache->misses = 0;
+  spi->cache->fill = 0;
+  SPIFLASH_cache_invalidate(spi);
+  return SPIFLASH_OK;
+}
+
+void SPIFLASH_cache_invalidate(spiflash_t *spi) {
+  uint16_t ix;
+  if (spi->cache == 0) return;
+  for (ix = 0; ix < spi->cache->cnt; ix++) {
+    spi->cache->lines[ix].addr = SPIFLASH_CACHE_NO_LINE;
+    spi->cache->lines[ix].used = 0;
+  }
+}
+
+void SPIFLASH_cache_stats(spiflash_t *spi, uint32_t *hits, uint32_t *misses) {
+  if (hits) *hits = spi->cache ? spi->cache->hits : 0;
+  if (misses) *misses = spi->cache ? spi->cache->misses : 0;
+}
+
+void SPIFLASH_wbuf_init(spiflash_t *spi, spiflash_wbuf_t *wb, uint8_t *buf,
+    uint32_t timeout_ms) {
+  if (wb == 0 || buf == 0) {
+    spi->wb = 0;
+    return;
+  }
+  spi->wb = wb;
+  spi->wb->buf = buf;
+  spi->wb->len = 0;
+  spi->wb->timeout_ms = timeout_ms;
+  spi->wb->age_ms = 0;
+  spi->wb->flushing = 0;
+}
+
+int SPIFLASH_wbuf_tick(spiflash_t *spi, uint32_t elapsed_ms) {
+  if (spi->wb == 0 || spi->wb->len == 0 || spi->wb->timeout_ms == 0 ||
+      spi->wb->flushing) {
+    return SPIFLASH_OK;
+  }
+  spi->wb->age_ms += elapsed_ms;
+  if (spi->wb->age_ms < spi->wb->timeout_ms || spi->op != SPIFLASH_OP_IDLE) {
+    return SPIFLASH_OK;
+  }
+  return SPIFLASH_flush(spi);
+}
+
+void SPIFLASH_queue_init(spiflash_t *spi, spiflash_queue_t *q,
+    spiflash_req_t *reqs, uint8_t capacity) {
+  spi->q_run = 0;
+  if (q == 0 || reqs == 0 || capacity == 0) {
+    spi->q = 0;
+    return;
+  }
+  spi->q = q;
+  spi->q->reqs = reqs;
+  spi->q->cap = capacity;
+  spi->q->head = 0;
+  spi->q->len = 0;
+  spi->q->preempt = 0;
+}
+
+void SPIFLASH_suspend_init(spiflash_op_ctx_t *ctx, spiflash_suspend_t *sus) {
+  if (sus) memset(sus, 0, sizeof(spiflash_suspend_t));
+  ctx->susp = sus;
+}
+
+void SPIFLASH_timing_init(spiflash_t *spi, spiflash_timing_t *tm) {
+  if (tm) memset(tm, 0, sizeof(spiflash_timing_t));
+  spi->timing = tm;
+}
+
+void SPIFLASH_seq_init(spiflash_op_ctx_t *ctx, spiflash_seq_t *sq) {
+  if (sq) memset(sq, 0, sizeof(spiflash_seq_t));
+  ctx->sq = sq;
+}
+
+void SPIFLASH_ctx_pool_init(spiflash_ctx_pool_t *pool, spiflash_op_ctx_t *ctxs,
+    uint8_t cnt) {
+  memset(ctxs, 0, cnt * sizeof(spiflash_op_ctx_t));
+  pool->ctxs = ctxs;
+  pool->cnt = cnt;
+}
+
+void SPIFLASH_ctx_init(spiflash_t *spi, spiflash_ctx_pool_t *pool) {
+  spi->pool = pool;
+}
+
+int SPIFLASH_submit(spiflash_t *spi, const spiflash_req_t *req) {
+  int res;
+  if (!spi->async) {
+    res = _spiflash_queue_start(spi, req);
+    if (req->cb) {
+      req->cb(spi, req, res);
+    }
+    return res;
+  }
+
+  _spiflash_critical(spi, 1);
+  if (spi->q == 0 || spi->q->len >= spi->q->cap) {
+    res = SPIFLASH_ERR_QUEUE_FULL;
+  } else {
+    res = _spiflash_enter(spi);
+  }
+  if (res == SPIFLASH_OK) {
+    _spiflash_queue_insert(spi, req, 0);
+    _spiflash_queue_next(spi);
+    _spiflash_leave(spi, res);
+  }
+  _spiflash_critical(spi, 0);
+
+  return res;
+}
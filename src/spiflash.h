@@ -48,16 +48,108 @@ extern "C" {
 #define SPIFLASH_ERR_BUSY             (_SPIFLASH_ERR_BASE - 4)
 #define SPIFLASH_ERR_ERASE_UNALIGNED  (_SPIFLASH_ERR_BASE - 5)
 #define SPIFLASH_ERR_BAD_CONFIG       (_SPIFLASH_ERR_BASE - 6)
+#define SPIFLASH_ERR_QUEUE_FULL       (_SPIFLASH_ERR_BASE - 7)
+#define SPIFLASH_ERR_OUT_OF_RANGE     (_SPIFLASH_ERR_BASE - 8)
+#define SPIFLASH_ERR_UNSUPPORTED      (_SPIFLASH_ERR_BASE - 9)
+#define SPIFLASH_ERR_VERIFY           (_SPIFLASH_ERR_BASE - 10)
 
 #ifndef SPIF_DBG
 #define SPIF_DBG(...) //printf("SPIFL:" __VA_ARGS__)
 #endif
 
+/**
+ * Number of operation classes tracked by the adaptive timing model, see
+ * SPIFLASH_timing_init: sr write, page program, all block erase sizes and chip
+ * erase.
+ */
+#define SPIFLASH_TIMING_CLASSES       (8)
+
+/**
+ * Max number of transactions in a list passed to _spiflash_spi_txrx_chain.
+ * Lists are built on stack.
+ */
+#ifndef SPIFLASH_CHAIN_MAX
+#define SPIFLASH_CHAIN_MAX            (4)
+#endif
+
+/**
+ * Size of the buffer for command, address and dummy bytes of a transaction,
+ * room for cfg.addr_dummy_sz up to 2.
+ */
+#ifndef SPIFLASH_HDR_MAX
+#define SPIFLASH_HDR_MAX              (8)
+#endif
+
+/**
+ * Size of the buffer in the sequence context, see SPIFLASH_seq_init, that
+ * SPIFLASH_verify, SPIFLASH_crc32 and cfg.write_verify read the flash through,
+ * one chunk per transaction.
+ */
+#ifndef SPIFLASH_CHUNK_SZ
+#define SPIFLASH_CHUNK_SZ             (32)
+#endif
+
+/**
+ * Set to 1 to be able to collect statistics per operation, see
+ * SPIFLASH_stats_init.
+ */
+#ifndef SPIFLASH_STATS
+#define SPIFLASH_STATS                (0)
+#endif
+
+/**
+ * Set to 1 to be able to trace the state machine into a ring of records, see
+ * SPIFLASH_trace_init.
+ */
+#ifndef SPIFLASH_TRACE
+#define SPIFLASH_TRACE                (0)
+#endif
+
+/**
+ * For a build fixed to one spi flash, define SPIFLASH_CFG_CONST and
+ * SPIFLASH_CMD_CONST to the names of a static const spiflash_config_t and
+ * spiflash_cmd_tbl_t, found in the file named by SPIFLASH_CONST_HEADER, e.g.
+ *   -DSPIFLASH_CONST_HEADER='"my_flash.h"' -DSPIFLASH_CFG_CONST=my_cfg
+ *   -DSPIFLASH_CMD_CONST=my_cmds
+ * The driver then reads config and commands as compile time constants,
+ * letting the compiler drop unsupported commands and erase sizes. Pass the
+ * same structs to SPIFLASH_init, as other modules still use spi->cfg and
+ * spi->cmd_tbl.
+ */
+
 /**
  * Set if standard spi flash commands.
  */
 #define SPIFLASH_CMD_TBL_STANDARD \
   (spiflash_cmd_tbl_t) { \
+    _SPIFLASH_CMD_TBL_STANDARD_ENTRIES \
+  }
+
+/**
+ * Set if standard spi flash commands, including the dual and quad lane read
+ * commands found in most quad capable spi flashes.
+ */
+#define SPIFLASH_CMD_TBL_STANDARD_QUAD \
+  (spiflash_cmd_tbl_t) { \
+    _SPIFLASH_CMD_TBL_STANDARD_ENTRIES \
+    _SPIFLASH_CMD_TBL_QUAD_ENTRIES \
+  }
+
+#define _SPIFLASH_CMD_TBL_QUAD_ENTRIES \
+    .read_data_dual_out = 0x3b, \
+    .read_data_dual_io = 0xbb, \
+    .read_data_quad_out = 0x6b, \
+    .read_data_quad_io = 0xeb, \
+    .read_data_dual_out_dummy = 8, \
+    .read_data_dual_io_dummy = 4, \
+    .read_data_quad_out_dummy = 8, \
+    .read_data_quad_io_dummy = 6, \
+    .read_data_dual_out_4b = 0x3c, \
+    .read_data_dual_io_4b = 0xbc, \
+    .read_data_quad_out_4b = 0x6c, \
+    .read_data_quad_io_4b = 0xec,
+
+#define _SPIFLASH_CMD_TBL_STANDARD_ENTRIES \
     .write_disable = 0x04, \
     .write_enable = 0x06, \
     .page_program = 0x02, \
@@ -71,15 +163,25 @@ extern "C" {
     .block_erase_32 = 0x52, \
     .block_erase_64 = 0xd8, \
     .chip_erase = 0xc7, \
+    .read_data_4b = 0x13, \
+    .read_data_fast_4b = 0x0c, \
+    .page_program_4b = 0x12, \
+    .block_erase_4_4b = 0x21, \
+    .block_erase_64_4b = 0xdc, \
     .device_id = 0x90, \
     .jedec_id = 0x9f, \
-    .sr_busy_bit = 0x01, \
-  }
+    .read_sfdp = 0x5a, \
+    .sr_busy_bit = 0x01,
 
 #define SPIFLASH_SYNCHRONOUS          (0)
 #define SPIFLASH_ASYNCHRONOUS         (1)
 #define SPIFLASH_ENDIANNESS_LITTLE    (0)
 #define SPIFLASH_ENDIANNESS_BIG       (1)
+#define SPIFLASH_WRITE_SKIP_NONE      (0)
+#define SPIFLASH_WRITE_SKIP_PAGES     (1)
+#define SPIFLASH_WRITE_SKIP_BYTES     (2)
+#define SPIFLASH_CACHE_NO_LINE        (0xffffffff)
+#define SPIFLASH_BUS_QUEUED           (1)
 
 /**
  * Defines the hardware commands for given spi flash. These numbers are found
@@ -91,8 +193,28 @@ typedef struct spiflash_cmd_tbl_s {
   uint8_t write_enable;
 
   uint8_t page_program;
+  // quad page program commands: quad input (1-1-4) and quad i/o (1-4-4)
+  uint8_t page_program_quad_in;
+  uint8_t page_program_quad_io;
   uint8_t read_data;
   uint8_t read_data_fast;
+
+  // multi lane read commands: dual output (1-1-2), dual i/o (1-2-2),
+  // quad output (1-1-4) and quad i/o (1-4-4)
+  uint8_t read_data_dual_out;
+  uint8_t read_data_dual_io;
+  uint8_t read_data_quad_out;
+  uint8_t read_data_quad_io;
+  // dummy clock cycles between address and data of the multi lane read
+  // commands, including any mode bit cycles
+  uint8_t read_data_dual_out_dummy;
+  uint8_t read_data_dual_io_dummy;
+  uint8_t read_data_quad_out_dummy;
+  uint8_t read_data_quad_io_dummy;
+  // mode bits sent after the address of the dual/quad i/o reads to enter
+  // continuous read mode, where following reads need no command. E.g. 0xa0.
+  // 0x00 if not supported.
+  uint8_t xip_mode_bits;
   
   uint8_t write_sr;
   uint8_t read_sr;
@@ -104,15 +226,97 @@ typedef struct spiflash_cmd_tbl_s {
   uint8_t block_erase_64;
   uint8_t chip_erase;
 
+  // native 4 byte address commands of spi flashes larger than 16 MB. With
+  // addr_sz 3, these are used for accesses reaching beyond 16 MB, instead of
+  // switching the address mode of the flash. Dummy cycles are as for the 3
+  // byte commands. 0x00 if not supported.
+  uint8_t read_data_4b;
+  uint8_t read_data_fast_4b;
+  uint8_t read_data_dual_out_4b;
+  uint8_t read_data_dual_io_4b;
+  uint8_t read_data_quad_out_4b;
+  uint8_t read_data_quad_io_4b;
+  uint8_t page_program_4b;
+  uint8_t page_program_quad_in_4b;
+  uint8_t block_erase_4_4b;
+  uint8_t block_erase_32_4b;
+  uint8_t block_erase_64_4b;
+
+  // erase/program suspend and resume, e.g. 0x75/0x7a or 0xb0/0x30
+  uint8_t suspend;
+  uint8_t resume;
+
   uint8_t device_id;
   uint8_t jedec_id;
+  // read serial flash discoverable parameters, normally 0x5a
+  uint8_t read_sfdp;
   
   // indicate which bit in the SR which is the busy flag bit
   uint8_t sr_busy_bit;
+
+  // quad enable bit which must be set before quad commands can be used, 0x00
+  // if the flash needs no quad enable
+  uint8_t qe_bit;
+  // commands for reading and writing the register holding the quad enable
+  // bit, 0x00 if the bit is in the SR and read_sr/write_sr are to be used
+  uint8_t qe_read_reg;
+  uint8_t qe_write_reg;
+
+  // set burst with wrap, 0x77 on e.g. Winbond flashes, followed by three
+  // dummy bytes and the wrap bits on four lanes. Makes read_data_quad_io wrap
+  // within aligned lines, see SPIFLASH_set_burst_wrap. 0x00 if not supported.
+  uint8_t set_burst_wrap;
 } spiflash_cmd_tbl_t;
 
 struct spiflash_s;
 
+/**
+ * Describes how to poll the flash for ready, see _spiflash_wait_ready.
+ */
+typedef struct {
+  // command reading the status register
+  uint8_t cmd;
+  // status register bits to check
+  uint8_t mask;
+  // the flash is ready when (status & mask) == match
+  uint8_t match;
+  // suggested interval between polls in us
+  uint32_t interval_us;
+  // typical time in us until ready, zero if unknown
+  uint32_t typ_us;
+} spiflash_poll_t;
+
+/**
+ * Describes a spi transaction where the phases may be clocked over more than
+ * one data lane. The phases are, in order:
+ *   command  hdr[0 .. cmd_len-1] on cmd_lanes
+ *   address  hdr[cmd_len .. cmd_len+addr_len-1] on addr_lanes
+ *   mode     the following mode_len bytes of hdr on addr_lanes
+ *   dummy    dummy_cycles clock cycles
+ *   data     tx_len bytes from tx_data or rx_len bytes into rx_data on
+ *            data_lanes
+ * A phase of zero length is skipped. During dummy cycles, the data lines
+ * should be kept high.
+ * When passed to _spiflash_spi_txrx_chain, next points to the transaction to
+ * carry out directly after this one, or is zero.
+ */
+typedef struct spiflash_xfer_s {
+  const uint8_t *hdr;
+  uint8_t cmd_len;
+  uint8_t addr_len;
+  uint8_t mode_len;
+  uint8_t dummy_cycles;
+  // lane widths, 1, 2 or 4
+  uint8_t cmd_lanes;
+  uint8_t addr_lanes;
+  uint8_t data_lanes;
+  const uint8_t *tx_data;
+  uint32_t tx_len;
+  uint8_t *rx_data;
+  uint32_t rx_len;
+  const struct spiflash_xfer_s *next;
+} spiflash_xfer_t;
+
 /**
  * Defines the hardware abstraction layer for the spi flash driver.
  */
@@ -156,13 +360,161 @@ typedef struct spiflash_hal_s {
    * @param spi  pointer to the spi flash driver struct.
    */
   void (*_spiflash_wait)(struct spiflash_s *spi, uint32_t ms);
+
+  /**
+   * Carry out a multi lane spi transaction as described by xfer. Optional,
+   * set to zero if the spi bus only supports single lane transfers.
+   * The xfer struct itself is only valid during the call, while the buffers
+   * it points to are valid until the transaction is finished. Otherwise, this
+   * behaves as _spiflash_spi_txrx.
+   *
+   * @param spi   pointer to the spi flash driver struct.
+   * @param xfer  the transaction.
+   * @return 0 if ok, anything else is considered an error.
+   */
+  int (*_spiflash_spi_txrx_lanes)(struct spiflash_s *spi,
+      const spiflash_xfer_t *xfer);
+
+  /**
+   * Hand over reads to a memory mapping spi controller. Optional, set to zero
+   * if not supported.
+   * Called from SPIFLASH_xip_enter with a template of the continuous read
+   * transaction: the command, address length, mode bits, dummy cycles and
+   * lane widths. The address bytes and data phase of the template are to be
+   * ignored. The xfer struct and its hdr are only valid during the call.
+   * Called with xfer set to zero when the driver needs the spi bus back, after
+   * which the controller must not access the flash until mapped again.
+   * This call must always block, also in asynchronous mode.
+   *
+   * @param spi   pointer to the spi flash driver struct.
+   * @param xfer  the read transaction template, or zero to unmap.
+   * @return 0 if ok, anything else is considered an error.
+   */
+  int (*_spiflash_xip_map)(struct spiflash_s *spi, const spiflash_xfer_t *xfer);
+
+  /**
+   * Carry out a list of spi transactions back to back, as one transfer, e.g.
+   * by a chained dma. Optional, set to zero if not supported.
+   * If supported, a page program is issued as command, address and data in
+   * one call, and reads of continuous segments (see SPIFLASH_readv) as command,
+   * address and one data phase per segment. Lane widths are as for
+   * _spiflash_spi_txrx_lanes, and are all 1 if that is not supported. When
+   * all transactions are finished, spiflash_async_cb is to be called once in
+   * asynchronous mode. In synchronous mode, this must block.
+   * The xfer structs are only valid during the call, the hdr and data buffers
+   * are valid until the transfer is finished.
+   *
+   * @param spi   pointer to the spi flash driver struct.
+   * @param xfer  the first transaction, linked by xfer->next.
+   * @return 0 if ok, anything else is considered an error.
+   */
+  int (*_spiflash_spi_txrx_chain)(struct spiflash_s *spi,
+      const spiflash_xfer_t *xfer);
+
+  /**
+   * Wait given number of microseconds. Optional, set to zero if not
+   * supported, and waits are rounded up to whole milliseconds and passed to
+   * _spiflash_wait instead.
+   * Never called with zero, waits for the busy pin always go to
+   * _spiflash_wait. Otherwise as _spiflash_wait.
+   *
+   * @param spi  pointer to the spi flash driver struct.
+   * @param us   microseconds to wait.
+   */
+  void (*_spiflash_wait_us)(struct spiflash_s *spi, uint32_t us);
+
+  /**
+   * Wait until the flash is ready, by hardware. Optional, set to zero if not
+   * supported, and the driver polls the status register itself.
+   * Use e.g. the auto polling of a qspi controller, or a busy/ready pin, to
+   * find out when the flash is no longer busy. When ready,
+   * spiflash_async_trigger is to be called in asynchronous mode. In
+   * synchronous mode, this must block until ready.
+   * Called with CS deasserted, a polling controller handles CS itself. The
+   * poll struct is only valid during the call.
+   * Not used while a read may be pending for suspend, see SPIFLASH_read.
+   *
+   * @param spi   pointer to the spi flash driver struct.
+   * @param poll  how to poll for ready.
+   * @return 0 if ok, anything else is considered an error.
+   */
+  int (*_spiflash_wait_ready)(struct spiflash_s *spi, const spiflash_poll_t *poll);
+
+  /**
+   * Request or release a shared spi bus. Optional, set to zero if the driver
+   * owns the bus.
+   * Requested before an operation starts, and after each busy wait before
+   * talking to the flash again. Released before each busy wait, and when the
+   * operation is finished, so other devices may use the bus meanwhile. Waits
+   * by _spiflash_wait_ready keep the bus, as the controller polls the flash.
+   * In asynchronous mode, return SPIFLASH_BUS_QUEUED if the bus cannot be
+   * granted at once, and call spiflash_async_trigger when granted. In
+   * synchronous mode, this must block until granted.
+   * See spiflash_bus.h for an arbiter.
+   *
+   * @param spi      pointer to the spi flash driver struct.
+   * @param request  !0 to request the bus, 0 to release it.
+   * @return 0 if granted or released, SPIFLASH_BUS_QUEUED if granted later,
+   *         anything else is considered an error.
+   */
+  int (*_spiflash_bus)(struct spiflash_s *spi, uint8_t request);
+
+  /**
+   * Return a free running timestamp in microseconds, wrapping at 2^32.
+   * Optional, set to zero if not supported, and no latencies are recorded in
+   * the statistics and trace, see SPIFLASH_STATS and SPIFLASH_TRACE. Called
+   * from the same contexts as spiflash_async_trigger.
+   *
+   * @param spi  pointer to the spi flash driver struct.
+   * @return the timestamp.
+   */
+  uint32_t (*_spiflash_time_us)(struct spiflash_s *spi);
+
+  /**
+   * Read and checksum without storing the data. Optional, set to zero if not
+   * supported, and SPIFLASH_crc32, SPIFLASH_verify and cfg.write_verify read
+   * the data chunk by chunk into the driver struct instead.
+   * Carries out the transaction as _spiflash_spi_txrx_lanes, with lanes all 1
+   * if that is not supported, but the xfer->rx_len received bytes are only
+   * run through a crc, e.g. by the checksum unit of a dma or qspi controller.
+   * *crc is to be updated as by SPIFLASH_crc32_calc(*crc, data, rx_len).
+   * When finished, spiflash_async_trigger is to be called in asynchronous
+   * mode. In synchronous mode, this must block.
+   * The xfer struct is only valid during the call, the hdr buffer and crc
+   * are valid until the transfer is finished.
+   *
+   * @param spi   pointer to the spi flash driver struct.
+   * @param xfer  the transaction, rx_data is zero.
+   * @param crc   the crc to update.
+   * @return 0 if ok, anything else is considered an error.
+   */
+  int (*_spiflash_spi_rx_crc32)(struct spiflash_s *spi,
+      const spiflash_xfer_t *xfer, uint32_t *crc);
+
+  /**
+   * Enter or leave a critical section. Optional, set to zero if
+   * SPIFLASH_submit is never called while spiflash_async_trigger may run,
+   * e.g. if both are called from the same task or interrupt.
+   * In asynchronous mode, SPIFLASH_submit and spiflash_async_trigger change
+   * the request queue and the ongoing operation, and each runs entirely
+   * within a critical section, as does holding a read pending, see
+   * SPIFLASH_read. Other calls are only to be made while the driver is idle,
+   * or from its callbacks. Sections nest, as request callbacks may
+   * submit and a hal may trigger before returning, so use a counting
+   * interrupt disable or a recursive mutex.
+   *
+   * @param spi    pointer to the spi flash driver struct.
+   * @param enter  !0 to enter, 0 to leave.
+   */
+  void (*_spiflash_critical)(struct spiflash_s *spi, uint8_t enter);
 } spiflash_hal_t;
 
 /**
  * Spi flash configuration. These values are found in the data sheet.
  * If busy pin is wired to your processor somehow, set the *_ms values to zero.
  * Prior to waiting for busy pin, _spiflash_wait_async will be called with 0
- * ms. When busy pin releases, call spiflash_async_trigger.
+ * ms. When busy pin releases, call spiflash_async_trigger. Preferably, use
+ * _spiflash_wait_ready in the hal instead.
  */
 typedef struct spiflash_config_s {
   // size of flash in bytes
@@ -178,11 +530,17 @@ typedef struct spiflash_config_s {
   //                    little endian [0x01234567 = 0x67 0x45 0x23 0x01])
   // normally big endian
   uint8_t addr_endian;
+  // number of data lanes wired between the spi bus and the flash, 1, 2 or 4.
+  // Zero is treated as 1. Multi lane reads are only used if the hal
+  // supports _spiflash_spi_txrx_lanes.
+  uint8_t lanes;
   
   // typical write sr time in ms
   uint32_t sr_write_ms;
   // typical page program time in ms
   uint32_t page_program_ms;
+  // typical page program time in us, overrides page_program_ms if nonzero
+  uint32_t page_program_us;
   // typical 4k block erase time in ms
   uint32_t block_erase_4_ms;
   // typical 8k block erase time in ms
@@ -195,6 +553,21 @@ typedef struct spiflash_config_s {
   uint32_t block_erase_64_ms;
   // typical chip erase time in ms
   uint32_t chip_erase_ms;
+  // if suspend is supported, longest time in ms between checks for pending
+  // reads while waiting for an erase or a page program, see SPIFLASH_read.
+  // Zero if waits should not be split.
+  uint32_t suspend_poll_ms;
+  // as programming can only clear bits, written 0xff bytes need no
+  // programming. SPIFLASH_WRITE_SKIP_PAGES skips page programs of all 0xff
+  // data, SPIFLASH_WRITE_SKIP_BYTES also leaves out leading and trailing 0xff
+  // bytes of each page program. SPIFLASH_WRITE_SKIP_NONE (zero) programs all.
+  uint8_t write_skip;
+  // if nonzero, each page program is read back and compared to the written
+  // data before the next one, and SPIFLASH_write fails with
+  // SPIFLASH_ERR_VERIFY on a difference. Segments of SPIFLASH_writev that
+  // continue a page are then programmed separately. Needs a sequence context,
+  // see SPIFLASH_seq_init, or writes fail with SPIFLASH_ERR_BAD_CONFIG.
+  uint8_t write_verify;
 } spiflash_config_t;
 
 /**
@@ -209,20 +582,34 @@ typedef enum {
   SPIFLASH_OP_WRITE_sWREN,
   SPIFLASH_OP_WRITE_sADDR,
   SPIFLASH_OP_WRITE_sDATA,
+  SPIFLASH_OP_WRITE_sVERIFY,
   SPIFLASH_OP_WRITE_SR_sWREN,
   SPIFLASH_OP_WRITE_SR_sDATA,
   SPIFLASH_OP_WRITE_REG_sWREN,
   SPIFLASH_OP_WRITE_REG_sDATAWAIT,
   SPIFLASH_OP_WRITE_REG_DATA,
+  SPIFLASH_OP_QUAD_ENABLE_sREAD,
+  SPIFLASH_OP_QUAD_ENABLE_sWREN,
+  SPIFLASH_OP_QUAD_ENABLE_sDATA,
+  SPIFLASH_OP_XIP_EXIT,
   SPIFLASH_OP_READ,
   SPIFLASH_OP_FAST_READ,
+  SPIFLASH_OP_QUAD_READ,
   SPIFLASH_OP_READ_SR,
   SPIFLASH_OP_READ_SR_BUSY,
   SPIFLASH_OP_READ_JEDEC,
   SPIFLASH_OP_READ_PRODUCT,
   SPIFLASH_OP_READ_REG,
+  SPIFLASH_OP_READ_SFDP,
+  SPIFLASH_OP_CRC32,
+  SPIFLASH_OP_SET_BURST_WRAP,
 } spiflash_op_t;
 
+/**
+ * Number of spi flash device operations.
+ */
+#define SPIFLASH_OPS                  (SPIFLASH_OP_SET_BURST_WRAP + 1)
+
 /**
  * In asynchronous mode, this is called when an operation have finished.
  *
@@ -234,25 +621,296 @@ typedef void (*spiflash_cb_async_t)(struct spiflash_s *spi,
     spiflash_op_t operation, int err_code);
 
 /**
- * The spi flash driver struct.
+ * Streaming read callback, see SPIFLASH_stream_start. Called when a buffer
+ * has been filled. Hand it back by SPIFLASH_stream_release when consumed.
+ *
+ * @param spi  the spi flash struct.
+ * @param buf  the filled buffer.
+ * @param len  number of bytes in buffer.
  */
-typedef struct spiflash_s {
-  // physical spi flash config
-  const spiflash_config_t *cfg;
-  // command table
-  const spiflash_cmd_tbl_t *cmd_tbl;
-  // HAL config
-  const spiflash_hal_t *hal;
-  // Asynchronous callback
-  spiflash_cb_async_t async_cb;
+typedef void (*spiflash_stream_cb_t)(struct spiflash_s *spi,
+    uint8_t *buf, uint32_t len);
 
-  // user data for identification
+/**
+ * Producer callback for SPIFLASH_write_produce. Fill buf with the len bytes
+ * of data to be written at addr, never more than a page.
+ *
+ * @param spi   the spi flash struct.
+ * @param addr  flash address of the data.
+ * @param buf   where to put the data.
+ * @param len   number of bytes to produce.
+ * @return SPIFLASH_OK, anything else aborts the write with this error code.
+ */
+typedef int (*spiflash_produce_cb_t)(struct spiflash_s *spi,
+    uint32_t addr, uint8_t *buf, uint32_t len);
+
+/**
+ * Request types for the request queue, see SPIFLASH_submit.
+ */
+typedef enum {
+  SPIFLASH_REQ_READ = 0,
+  SPIFLASH_REQ_FAST_READ,
+  SPIFLASH_REQ_WRITE,
+  SPIFLASH_REQ_ERASE,
+  SPIFLASH_REQ_CHIP_ERASE,
+} spiflash_req_type_t;
+
+/**
+ * Request priorities for the request queue. Requests of higher priority are
+ * started before those of lower, and preempt those of lower between each
+ * block erase and page program. Requests of equal priority are started in
+ * order.
+ */
+typedef enum {
+  // long running background work, e.g. erases
+  SPIFLASH_PRIO_BACKGROUND = -1,
+  SPIFLASH_PRIO_NORMAL = 0,
+  // latency critical, e.g. reads
+  SPIFLASH_PRIO_CRITICAL = 1,
+} spiflash_prio_t;
+
+struct spiflash_req_s;
+
+/**
+ * Called when a queued request have finished.
+ *
+ * @param spi       the spiflash struct.
+ * @param req       the finished request, only valid during the call.
+ * @param err_code  the error code on error or SPIFLASH_OK.
+ */
+typedef void (*spiflash_req_cb_t)(struct spiflash_s *spi,
+    const struct spiflash_req_s *req, int err_code);
+
+/**
+ * A request in the request queue, see SPIFLASH_submit.
+ */
+typedef struct spiflash_req_s {
+  spiflash_req_type_t type;
+  // a spiflash_prio_t
+  int8_t prio;
+  // address and length of the read, write or erase, ignored for chip erase
+  uint32_t addr;
+  uint32_t len;
+  union {
+    const uint8_t *wr_buf;
+    uint8_t *rd_buf;
+  };
+  // completion callback, may be zero
+  spiflash_req_cb_t cb;
+  // user data for the completion callback
   void *user_data;
-  
+} spiflash_req_t;
+
+/**
+ * A segment in a scatter-gather read or write, see SPIFLASH_readv and
+ * SPIFLASH_writev.
+ */
+typedef struct {
+  // flash address of segment
+  uint32_t addr;
+  // number of bytes in segment
+  uint32_t len;
+  // data of segment, only read from in SPIFLASH_writev
+  uint8_t *buf;
+} spiflash_iov_t;
+
+/**
+ * A line in the read cache, see SPIFLASH_cache_init.
+ */
+typedef struct {
+  // flash address of line, or SPIFLASH_CACHE_NO_LINE if not in use
+  uint32_t addr;
+  // when the line was last used
+  uint32_t used;
+} spiflash_cache_line_t;
+
+/**
+ * Read cache state, see SPIFLASH_cache_init. 32 bytes on 32 bit targets.
+ */
+typedef struct {
+  spiflash_cache_line_t *lines;
+  uint8_t *mem;
+  uint32_t line_sz;
+  uint32_t used;
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t fill_addr;
+  uint16_t cnt;
+  uint16_t fill;
+} spiflash_cache_t;
+
+/**
+ * Write buffer state, see SPIFLASH_wbuf_init. 36 bytes on 32 bit targets.
+ */
+typedef struct {
+  uint8_t *buf;
+  uint32_t addr;
+  uint32_t len;
+  uint32_t timeout_ms;
+  uint32_t age_ms;
+  const uint8_t *in_src;
+  uint32_t in_addr;
+  uint32_t in_len;
+  uint8_t flushing;
+} spiflash_wbuf_t;
+
+/**
+ * Streaming read context, see SPIFLASH_stream_start. 32 bytes on 32 bit
+ * targets.
+ */
+typedef struct {
+  spiflash_stream_cb_t cb;
+  uint8_t *bufs;
+  uint32_t sz;
+  uint32_t addr;
+  uint32_t left;
+  spiflash_op_t op;
+  uint8_t cnt;
+  uint8_t head;
+  uint8_t filled;
+  uint8_t run;
+  uint8_t paused;
+} spiflash_stream_t;
+
+/**
+ * Producer write context, see SPIFLASH_write_produce. 24 bytes on 32 bit
+ * targets.
+ */
+typedef struct {
+  spiflash_produce_cb_t cb;
+  uint8_t *bufs;
+  uint32_t addr;
+  uint32_t left;
+  int res;
+  uint8_t ix;
+  uint8_t ready;
+} spiflash_produce_t;
+
+/**
+ * Request queue state, see SPIFLASH_queue_init. 8 bytes on 32 bit targets.
+ */
+typedef struct {
+  spiflash_req_t *reqs;
+  uint8_t cap;
+  uint8_t head;
+  uint8_t len;
+  uint8_t preempt;
+} spiflash_queue_t;
+
+/**
+ * State of the read served while an erase or program is suspended, see
+ * SPIFLASH_suspend_init. 20 bytes on 32 bit targets.
+ */
+typedef struct {
+  uint8_t *buf;
+  uint32_t addr;
+  uint32_t len;
+  spiflash_op_t op;
+  uint8_t q;
+} spiflash_suspend_t;
+
+/**
+ * Running estimates of the adaptive timing model, see SPIFLASH_timing_init.
+ * 36 bytes.
+ */
+typedef struct {
+  uint32_t est_us[SPIFLASH_TIMING_CLASSES];
+  uint32_t waited_us;
+} spiflash_timing_t;
+
+/**
+ * Context of multi step operations, see SPIFLASH_seq_init. 100 bytes on 32
+ * bit targets with the default SPIFLASH_CHUNK_SZ.
+ */
+typedef struct {
+  const uint8_t *src;
+  uint8_t *buf;
+  uint32_t addr;
+  uint32_t len;
+  uint32_t head;
+  uint32_t tail;
+  uint32_t sec;
+  uint32_t cur;
+  const uint8_t *vf_src;
+  uint32_t vf_addr;
+  uint32_t vf_len;
+  uint32_t crc;
+  uint32_t crc_ref;
+  uint32_t *crc_dst;
+  spiflash_iov_t line_iov;
+  uint8_t chunk[SPIFLASH_CHUNK_SZ];
+} spiflash_seq_t;
+
+/**
+ * Statistics of one kind of operation, see SPIFLASH_stats_get.
+ */
+typedef struct {
+  // number of operations finished, successfully or not
+  uint32_t count;
+  // bytes requested to be read, written or erased
+  uint32_t bytes;
+  // latency from start to finish in us, zero if there is no
+  // hal._spiflash_time_us
+  uint32_t total_us;
+  uint32_t min_us;
+  uint32_t max_us;
+  // number of times the status register was polled while busy waiting
+  uint32_t polls;
+  // time asked of hal._spiflash_wait and hal._spiflash_wait_us in us, busy pin
+  // waits not included
+  uint32_t wait_us;
+} spiflash_op_stats_t;
+
+/**
+ * Statistics of a spi flash, see SPIFLASH_stats_init. 816 bytes.
+ */
+typedef struct {
+  // indexed by the operation as started, e.g. SPIFLASH_OP_WRITE_sWREN for
+  // writes and SPIFLASH_OP_ERASE_BLOCK_sWREN for erases
+  spiflash_op_stats_t op[SPIFLASH_OPS];
+  // operations refused with SPIFLASH_ERR_HW_BUSY by the busy pre check
+  uint32_t hw_busy;
+} spiflash_stats_t;
+
+#define SPIFLASH_TRACE_NONE           (0)
+#define SPIFLASH_TRACE_BEGIN          (1)
+#define SPIFLASH_TRACE_END            (2)
+
+/**
+ * A trace record, see SPIFLASH_trace_init. 16 bytes.
+ */
+typedef struct {
+  // hal._spiflash_time_us when recorded, zero if there is none
+  uint32_t ts;
+  uint32_t addr;
+  uint32_t len;
+  // SPIFLASH_TRACE_BEGIN when a step is started, SPIFLASH_TRACE_END when a
+  // step has finished, SPIFLASH_TRACE_NONE for an unused record
+  uint8_t ev;
+  // the spiflash_op_t
+  uint8_t op;
+  // internal busy check wait state
+  uint8_t bcw;
+  // for SPIFLASH_TRACE_END, zero if the step went fine, n for driver error
+  // code _SPIFLASH_ERR_BASE - n, or 0xff for other errors
+  uint8_t err;
+} spiflash_trace_t;
+
+/**
+ * State of the operation running on a spi flash, see SPIFLASH_ctx_pool_init.
+ * Attached to a spi flash from a pool while anything runs on it, and free for
+ * any spi flash of the pool otherwise. 80 bytes on 32 bit targets, 8 more
+ * with SPIFLASH_STATS.
+ */
+typedef struct {
+  // spi flash the context is attached to, NULL if free
+  struct spiflash_s *spi;
+  // optional, see SPIFLASH_seq_init and SPIFLASH_suspend_init
+  spiflash_seq_t *sq;
+  spiflash_suspend_t *susp;
+
   // internals
-  uint8_t async;
-  volatile spiflash_op_t op;
-  uint32_t wait_period_ms;
+  uint32_t wait_period_us;
   uint32_t addr;
   union {
     uint32_t wr_len;
@@ -266,18 +924,109 @@ typedef struct spiflash_s {
     uint8_t *reg_dst;
     uint32_t *id_dst;
   };
-  uint8_t could_be_busy;
+  const spiflash_iov_t *iov;
+  uint32_t iov_cnt;
+  // where the read lands when done, for the read cache and write buffer:
+  // rd_dst_len bytes from rd_dst_addr, or rd_dst_len segments if rd_dst_v
+  union {
+    uint8_t *rd_dst;
+    const spiflash_iov_t *rd_dst_iov;
+  };
+  uint32_t rd_dst_addr;
+  uint32_t rd_dst_len;
+  spiflash_stream_t *st;
+  spiflash_produce_t *pr;
   uint8_t busy_pre_check;
   uint8_t busy_check_wait;
+  uint8_t xip_pre_exit;
+  uint8_t sus;
+  uint8_t seg_cont;
+  uint8_t seq;
+  uint8_t seq_step;
+  uint8_t tm;
+  uint8_t bus_held;
+  uint8_t bus_wait;
+  uint8_t addr_4b;
+  uint8_t rd_wrap;
+  uint8_t rd_dst_v;
   union {
     uint8_t reg_nbr;
     uint8_t sr_data;
-    uint8_t tx_internal_buf[16];
+    uint8_t tx_internal_buf[SPIFLASH_HDR_MAX];
   };
+#if SPIFLASH_STATS
+  spiflash_op_t stats_op;
+  uint32_t stats_t0;
+#endif
+} spiflash_op_ctx_t;
+
+/**
+ * A pool of operation contexts shared by one or more spi flashes, see
+ * SPIFLASH_ctx_pool_init.
+ */
+typedef struct {
+  spiflash_op_ctx_t *ctxs;
+  uint8_t cnt;
+} spiflash_ctx_pool_t;
+
+/**
+ * The spi flash driver struct, one per spi flash, 60 bytes on 32 bit targets,
+ * 4 more with SPIFLASH_STATS and 8 more with SPIFLASH_TRACE. It only holds
+ * what describes the spi flash and lasts between operations. The state of a
+ * running operation is kept in an operation context taken from a pool, see
+ * SPIFLASH_ctx_init, and the state of the optional request queue, timing
+ * model, read cache, write buffer and statistics in separate structs, only
+ * allocated by those using them.
+ */
+typedef struct spiflash_s {
+  // physical spi flash config
+  const spiflash_config_t *cfg;
+  // command table
+  const spiflash_cmd_tbl_t *cmd_tbl;
+  // HAL config
+  const spiflash_hal_t *hal;
+  // Asynchronous callback
+  spiflash_cb_async_t async_cb;
+
+  // user data for identification
+  void *user_data;
+  // owner of this driver struct, for layers built on top of the driver,
+  // leaving user_data to the hal. One layer at a time, as the layer also owns
+  // async_cb: the layers of spiflash_os.h and spiflash_stripe.h do not stack
+  void *layer;
+  // shared bus this driver is attached to, for the hal
+  void *bus;
+  
+  // internals
+  spiflash_ctx_pool_t *pool;
+  spiflash_op_ctx_t *ctx;
+  spiflash_queue_t *q;
+  spiflash_timing_t *timing;
+  spiflash_cache_t *cache;
+  spiflash_wbuf_t *wb;
+  // a spiflash_op_t
+  volatile uint8_t op;
+  uint8_t async;
+  uint8_t quad_en;
+  uint8_t xip;
+  uint8_t wrap;
+  uint8_t q_run;
+  uint8_t nest;
+  // an operation stopped midway, the next one checks the busy bit first
+  uint8_t could_be_busy;
+#if SPIFLASH_STATS
+  spiflash_stats_t *stats;
+#endif
+#if SPIFLASH_TRACE
+  spiflash_trace_t *tr;
+  uint16_t tr_cnt;
+  uint16_t tr_head;
+#endif
 } spiflash_t;
 
 /**
- * Initiates the spi flash device struct.
+ * Initiates the spi flash device struct. The struct is cleared, so the pool of
+ * operation contexts is given afterwards, see SPIFLASH_ctx_init.
  *
  * @param spi        pointer to the spi flash driver struct.
  * @param cfg        pointer to the spi flash driver configuration struct.
@@ -297,7 +1046,40 @@ void SPIFLASH_init(spiflash_t *spi,
                    void *user_data);
 
 /**
- * Writes data to the spi flash.
+ * Sets up a pool of cnt caller allocated operation contexts, all free and
+ * without sequence context or suspend state. A spi flash takes a context from
+ * its pool when an operation is started while nothing runs on it, and gives
+ * it back when the operation and anything following it has finished: queued
+ * requests, a held read, a sequence, and a streaming read until all of its
+ * buffers are released. Spi flashes rarely running at the same time may share
+ * a pool of fewer contexts than spi flashes.
+ * In asynchronous mode, contexts are taken and given back within
+ * hal._spiflash_critical of the spi flash, so spi flashes sharing a pool from
+ * different interrupts or tasks need a critical section covering them all.
+ *
+ * @param pool  the pool.
+ * @param ctxs  array of cnt operation contexts.
+ * @param cnt   number of contexts.
+ */
+void SPIFLASH_ctx_pool_init(spiflash_ctx_pool_t *pool, spiflash_op_ctx_t *ctxs,
+    uint8_t cnt);
+
+/**
+ * Sets the pool the spi flash takes its operation contexts from, see
+ * SPIFLASH_ctx_pool_init. Without a pool, all calls talking to the spi flash
+ * return SPIFLASH_ERR_BAD_CONFIG, and when all contexts of the pool are in use
+ * by other spi flashes, SPIFLASH_ERR_BUSY. Call when the driver is idle.
+ *
+ * @param spi   pointer to the spi flash driver struct.
+ * @param pool  the pool, kept as long as the spi flash is used, or NULL.
+ */
+void SPIFLASH_ctx_init(spiflash_t *spi, spiflash_ctx_pool_t *pool);
+
+/**
+ * Writes data to the spi flash. If the command table holds a quad page
+ * program command, the hal supports multi lane transactions and cfg.lanes is
+ * 4, data is written over four lanes once quad mode is enabled, see
+ * SPIFLASH_quad_enable.
  *
  * @param spi   the spi flash struct.
  * @param addr  the address of the spi flash to write to.
@@ -307,9 +1089,50 @@ void SPIFLASH_init(spiflash_t *spi,
  */
 int SPIFLASH_write(spiflash_t *spi, uint32_t addr, uint32_t len, const uint8_t *buf);
 
+/**
+ * Writes a number of segments to the spi flash, as if calling SPIFLASH_write
+ * for each segment. The data is fed directly from the segment buffers. A
+ * segment starting where the previous one ended continues the same page
+ * program.
+ * The segment array must be kept until the write is finished.
+ *
+ * @param spi     the spi flash struct.
+ * @param iov     the segments to write.
+ * @param iovcnt  number of segments. Empty segments are skipped, and with no
+ *                data at all the write is finished at once.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_BAD_CONFIG if iov is NULL
+ *         with segments to write.
+ */
+int SPIFLASH_writev(spiflash_t *spi, const spiflash_iov_t *iov, uint32_t iovcnt);
+
+/**
+ * Writes data to the spi flash, produced page by page by cb. The data for the
+ * first page is produced before any spi communication. While a page is
+ * being programmed, cb is asked for the data of the next page, taking turns
+ * between two cfg.page_sz buffers laid out after each other in bufs. In
+ * asynchronous mode, this lets the caller prepare data, e.g. decrypt it,
+ * while the flash is busy programming.
+ * In asynchronous mode, the asynchronous callback is called once, when all
+ * is done, and pr and bufs must be kept until then.
+ *
+ * @param spi   pointer to the spi flash driver struct.
+ * @param pr    context of the write.
+ * @param addr  the address of the spi flash to write to.
+ * @param len   number of bytes to write.
+ * @param bufs  2 * cfg.page_sz bytes of buffers.
+ * @param cb    the producer callback.
+ * @return error code or SPIFLASH_OK, or the error code from cb.
+ */
+int SPIFLASH_write_produce(spiflash_t *spi, spiflash_produce_t *pr,
+    uint32_t addr, uint32_t len, uint8_t *bufs, spiflash_produce_cb_t cb);
+
 /**
  * Erases data in the spi flash. The erase range must be aligned to the
  * smallest erase size a SPIFLASH_ERR_ERASE_UNALIGNED will be returned.
+ * The range is erased in the way with the lowest total erase time, given the
+ * configured block erase times (or their running estimates, see
+ * SPIFLASH_timing_init). If the range is the entire flash and a chip erase is
+ * faster, the chip is erased instead.
  *
  * @param spi   pointer to the spi flash driver struct.
  * @param addr  the address of the spi flash to write to.
@@ -319,6 +1142,85 @@ int SPIFLASH_write(spiflash_t *spi, uint32_t addr, uint32_t len, const uint8_t *
  */
 int SPIFLASH_erase(spiflash_t *spi, uint32_t addr, uint32_t len);
 
+/**
+ * Erases data in the spi flash, without alignment requirements. The range is
+ * widened to the smallest erase size. The bytes in the widened part are
+ * read into buf before the erase and written back after it, so that only the
+ * given range is erased.
+ * In asynchronous mode, the asynchronous callback is called once, when all
+ * is done, and buf must be kept until then.
+ *
+ * @param spi      pointer to the spi flash driver struct.
+ * @param addr     the address of the spi flash to erase from.
+ * @param len      number of bytes to erase.
+ * @param buf      scratch buffer for the preserved bytes, at most twice the
+ *                 smallest erase size is needed.
+ * @param buf_len  size of buf.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_ERASE_UNALIGNED if buf is
+ *         too small. SPIFLASH_ERR_BAD_CONFIG if there is no sequence context,
+ *         see SPIFLASH_seq_init.
+ */
+int SPIFLASH_erase_preserve(spiflash_t *spi, uint32_t addr, uint32_t len,
+    uint8_t *buf, uint32_t buf_len);
+
+/**
+ * Updates data in the spi flash, erasing only where needed. Sector by sector,
+ * where a sector is the smallest erase size, the current contents are read
+ * into buf. If the new data only clears bits, the pages that differ are
+ * programmed without erase. Otherwise, the new data is merged into buf, the
+ * sector is erased and buf written back.
+ * In asynchronous mode, the asynchronous callback is called once, when all
+ * is done, and data and buf must be kept until then.
+ *
+ * @param spi      pointer to the spi flash driver struct.
+ * @param addr     the address of the spi flash to update.
+ * @param len      number of bytes to update.
+ * @param data     the new data.
+ * @param buf      scratch buffer, must hold one sector.
+ * @param buf_len  size of buf.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_ERASE_UNALIGNED if buf
+ *         cannot hold a sector. SPIFLASH_ERR_BAD_CONFIG if there is no
+ *         sequence context, see SPIFLASH_seq_init.
+ */
+int SPIFLASH_update(spiflash_t *spi, uint32_t addr, uint32_t len,
+    const uint8_t *data, uint8_t *buf, uint32_t buf_len);
+
+/**
+ * Writes data to the spi flash through the write buffer, see
+ * SPIFLASH_wbuf_init. Data that is consecutive to the pending data, or any
+ * data if nothing is pending, is collected in the buffer until it holds the
+ * rest of a page. The page is then programmed in one go. Data that is not
+ * consecutive first flushes the pending data. Whole pages are written
+ * directly from data.
+ * If no programming is needed, this returns at once, and in asynchronous
+ * mode the asynchronous callback is called before returning. Otherwise, in
+ * asynchronous mode, the asynchronous callback is called once, when all is
+ * done, and data must be kept until then.
+ * Until flushed, pending data is seen by SPIFLASH_read, SPIFLASH_fast_read,
+ * SPIFLASH_readv, SPIFLASH_read_line and streamed reads, but not by verifies,
+ * crcs or other operations. Flush before erasing or writing the same page in
+ * other ways.
+ *
+ * @param spi   pointer to the spi flash driver struct.
+ * @param addr  the address of the spi flash to write to.
+ * @param len   number of bytes to write.
+ * @param data  the data to write.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_BAD_CONFIG if there is no
+ *         write buffer.
+ */
+int SPIFLASH_append(spiflash_t *spi, uint32_t addr, uint32_t len,
+    const uint8_t *data);
+
+/**
+ * Programs the data pending in the write buffer, see SPIFLASH_append. If
+ * nothing is pending, this returns at once, and in asynchronous mode the
+ * asynchronous callback is called before returning.
+ *
+ * @param spi  pointer to the spi flash driver struct.
+ * @return error code or SPIFLASH_OK
+ */
+int SPIFLASH_flush(spiflash_t *spi);
+
 /**
  * Erases the entire spi flash chip.
  *
@@ -338,6 +1240,19 @@ int SPIFLASH_write_sr(spiflash_t *spi, uint8_t sr);
 
 /**
  * Reads from the spi flash.
+ * In asynchronous mode, if an erase or a write is ongoing, cmd_tbl has
+ * suspend and resume commands and there is a suspend state, see
+ * SPIFLASH_suspend_init, the read is held pending instead of returning
+ * SPIFLASH_ERR_BUSY. When the busy wait of the current block erase or page
+ * program ends, or after at most cfg.suspend_poll_ms, the erase or program is
+ * suspended, the read is carried out, and the erase or program is resumed. The
+ * asynchronous callback is called with operation SPIFLASH_OP_READ when the
+ * read is finished, while the erase or write goes on. One read can be pending
+ * at a time.
+ * A read overlapping the block being erased or the page being programmed,
+ * which the flash cannot return valid data for, is kept pending until that
+ * block erase or page program has finished. Parts of an erase or write not yet
+ * reached are read as they were before.
  *
  * @param spi   pointer to the spi flash driver struct.
  * @param addr  the address to read from.
@@ -351,6 +1266,12 @@ int SPIFLASH_read(spiflash_t *spi, uint32_t addr, uint32_t len, uint8_t *buf);
  * Reads from the spi flash, fast mode. Will automatically add one extra
  * dummy byte to address (apart from cfg.addr_dummy_sz). If not supported
  * (0 in cmd_tbl), a normal read will take place.
+ * If the hal supports multi lane transactions and cfg.lanes is more than one,
+ * the widest multi lane read in cmd_tbl is used instead, preferring quad i/o
+ * over quad output over dual i/o over dual output. Quad reads are only used
+ * once quad mode is enabled, see SPIFLASH_quad_enable.
+ * During an erase or a write, the read may be held pending as described for
+ * SPIFLASH_read.
  *
  * @param spi   pointer to the spi flash driver struct.
  * @param addr  the address to read from.
@@ -361,6 +1282,159 @@ int SPIFLASH_read(spiflash_t *spi, uint32_t addr, uint32_t len, uint8_t *buf);
 int SPIFLASH_fast_read(spiflash_t *spi, uint32_t addr, uint32_t len, 
                        uint8_t *buf);
 
+/**
+ * Reads a number of segments from the spi flash, as if calling
+ * SPIFLASH_fast_read for each segment. A segment starting where the previous
+ * one ended is read within the same read transaction, without issuing the
+ * command and address again.
+ * The segment array must be kept until the read is finished.
+ *
+ * @param spi     pointer to the spi flash driver struct.
+ * @param iov     the segments to read.
+ * @param iovcnt  number of segments. Empty segments are skipped, and with no
+ *                data at all the read is finished at once.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_BAD_CONFIG if iov is NULL
+ *         with segments to read.
+ */
+int SPIFLASH_readv(spiflash_t *spi, const spiflash_iov_t *iov, uint32_t iovcnt);
+
+/**
+ * Sets the length of the lines that quad i/o reads wrap within, by
+ * cmd_tbl.set_burst_wrap. A read from inside a line continues at the line
+ * start after the line end. Quad mode must be enabled, see
+ * SPIFLASH_quad_enable. While set, the driver uses quad i/o reads only where
+ * the wrap is wanted, see SPIFLASH_read_line, and other reads by quad or dual
+ * output or fast read instead.
+ * The driver starts out without wrap after SPIFLASH_init, while the flash
+ * keeps its setting until power off. If the mcu may reset without the flash,
+ * set the wrap, or 0, after SPIFLASH_init.
+ *
+ * @param spi      pointer to the spi flash driver struct.
+ * @param wrap_sz  line length, 8, 16, 32 or 64, or 0 to stop wrapping.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_BAD_CONFIG if the wrap
+ *         length or quad i/o reads are not supported.
+ *         SPIFLASH_ERR_BAD_STATE in continuous read mode.
+ */
+int SPIFLASH_set_burst_wrap(spiflash_t *spi, uint8_t wrap_sz);
+
+/**
+ * Reads whole lines for a cache fill, starting with the byte at addr. The
+ * lines are the aligned lines of line_sz bytes from the one holding addr,
+ * and are stored in buf in address order, buf[0] being the first byte of
+ * the first line.
+ * If lines is 1 and a burst wrap of line_sz is set, see
+ * SPIFLASH_set_burst_wrap, the line is read in one wrapping transaction from
+ * addr. Otherwise one transaction reads from addr to the end of the last
+ * line, prefetching the lines after the first, and a second one reads the
+ * start of the first line up to addr. As for SPIFLASH_readv, the flash is
+ * read directly and not through the read cache.
+ *
+ * @param spi      pointer to the spi flash driver struct.
+ * @param addr     the missed address.
+ * @param line_sz  line size, a power of two.
+ * @param lines    number of lines, including the one holding addr.
+ * @param buf      lines * line_sz bytes.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_BAD_CONFIG if line_sz is
+ *         not a power of two, lines is zero or there is no sequence context,
+ *         see SPIFLASH_seq_init.
+ */
+int SPIFLASH_read_line(spiflash_t *spi, uint32_t addr, uint32_t line_sz,
+    uint32_t lines, uint8_t *buf);
+
+/**
+ * Compares the spi flash to buf, without a buffer of the same size. If the
+ * hal supports _spiflash_spi_rx_crc32, the crc of the flash is compared to
+ * the crc of buf in one transaction. Otherwise the flash is read
+ * SPIFLASH_CHUNK_SZ bytes at a time and compared as it goes. The flash itself
+ * is read, not the read cache or pending data of the write buffer.
+ * In asynchronous mode, the asynchronous callback is called once, when all
+ * is done, and buf must be kept until then.
+ *
+ * @param spi   pointer to the spi flash driver struct.
+ * @param addr  the address of the spi flash to compare.
+ * @param len   number of bytes to compare.
+ * @param buf   the expected data.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_VERIFY if the flash
+ *         differs. SPIFLASH_ERR_BAD_CONFIG if there is no sequence context,
+ *         see SPIFLASH_seq_init.
+ */
+int SPIFLASH_verify(spiflash_t *spi, uint32_t addr, uint32_t len,
+    const uint8_t *buf);
+
+/**
+ * Calculates the crc32 of a region of the spi flash, as SPIFLASH_crc32_calc
+ * from zero. The region is read as for SPIFLASH_verify.
+ * In asynchronous mode, *crc is set when the asynchronous callback is called.
+ *
+ * @param spi   pointer to the spi flash driver struct.
+ * @param addr  the address of the spi flash region.
+ * @param len   number of bytes in the region.
+ * @param crc   populated with the crc.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_BAD_CONFIG if there is no
+ *         sequence context, see SPIFLASH_seq_init.
+ */
+int SPIFLASH_crc32(spiflash_t *spi, uint32_t addr, uint32_t len, uint32_t *crc);
+
+/**
+ * Continues a crc32 with more data, the ethernet/zlib crc32 (reflected
+ * polynomial 0xedb88320). Start with crc zero.
+ *
+ * @param crc  the crc so far.
+ * @param buf  the data.
+ * @param len  number of bytes.
+ * @return the new crc.
+ */
+uint32_t SPIFLASH_crc32_calc(uint32_t crc, const uint8_t *buf, uint32_t len);
+
+/**
+ * Starts a streaming read of len bytes from addr, through buf_cnt caller
+ * allocated buffers of buf_sz bytes each, laid out after each other in bufs.
+ * The buffers are filled in turn and handed to cb. As long as there is a
+ * free buffer when one is filled, the read carries on within the same read
+ * transaction, without issuing the command and address again. Otherwise the
+ * stream is paused until a buffer is released by SPIFLASH_stream_release,
+ * and the driver may be used for other operations meanwhile.
+ * Buffers must be released in the order they were handed to cb, and can be
+ * released from within cb.
+ * In asynchronous mode, the asynchronous callback is called when the stream
+ * is finished. In synchronous mode, this returns when the stream is finished
+ * or paused. st and bufs must be kept until the stream is finished.
+ *
+ * @param spi      pointer to the spi flash driver struct.
+ * @param st       context of the stream.
+ * @param addr     the address to read from.
+ * @param len      number of bytes to read.
+ * @param bufs     buf_cnt * buf_sz bytes of buffers.
+ * @param buf_cnt  number of buffers, at least one.
+ * @param buf_sz   size of each buffer.
+ * @param cb       called for each filled buffer.
+ * @return error code or SPIFLASH_OK
+ */
+int SPIFLASH_stream_start(spiflash_t *spi, spiflash_stream_t *st,
+    uint32_t addr, uint32_t len, uint8_t *bufs, uint8_t buf_cnt,
+    uint32_t buf_sz, spiflash_stream_cb_t cb);
+
+/**
+ * Releases the oldest buffer handed to the streaming read callback, see
+ * SPIFLASH_stream_start. A paused stream is resumed as soon as the driver
+ * is idle.
+ *
+ * @param spi  pointer to the spi flash driver struct.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_BAD_STATE if no buffer is
+ *         held.
+ */
+int SPIFLASH_stream_release(spiflash_t *spi);
+
+/**
+ * Stops a streaming read once the buffer being filled is done, see
+ * SPIFLASH_stream_start. A paused stream is stopped at once, calling the
+ * asynchronous callback in asynchronous mode.
+ *
+ * @param spi  pointer to the spi flash driver struct.
+ * @return error code or SPIFLASH_OK
+ */
+int SPIFLASH_stream_stop(spiflash_t *spi);
+
 /**
  * Reads the status register.
  *
@@ -389,6 +1463,21 @@ int SPIFLASH_read_sr_busy(spiflash_t *spi, uint8_t *busy);
  */
 int SPIFLASH_read_jedec_id(spiflash_t *spi, uint32_t *jedec_id);
 
+/**
+ * Reads from the serial flash discoverable parameters (SFDP, JESD216) of the
+ * device. The SFDP address is always 3 bytes, followed by 8 dummy clocks.
+ * See spiflash_sfdp.h for filling in the config and command table from these.
+ *
+ * @param spi      pointer to the spi flash driver struct.
+ * @param addr     the SFDP address to read from.
+ * @param len      number of bytes to read.
+ * @param buf      where to store the data.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_BAD_CONFIG if there is no
+ *         read_sfdp command.
+ */
+int SPIFLASH_read_sfdp(spiflash_t *spi, uint32_t addr, uint32_t len,
+    uint8_t *buf);
+
 /**
  * Reads some hardware specific register.
  *
@@ -413,6 +1502,54 @@ int SPIFLASH_read_reg(spiflash_t *spi, uint8_t reg, uint8_t *data);
 int SPIFLASH_write_reg(spiflash_t *spi, uint8_t reg, uint8_t data,
     uint8_t write_en, uint32_t wait_ms);
 
+/**
+ * Sets the quad enable bit cmd_tbl.qe_bit, unless already set. This must be
+ * called once before any quad lane commands are used, if the flash has a
+ * quad enable bit. The register holding the bit is first read by
+ * cmd_tbl.qe_read_reg or read_sr. The bit is then written, exactly as by
+ * SPIFLASH_write_reg with cmd_tbl.qe_write_reg or SPIFLASH_write_sr, waiting
+ * cfg.sr_write_ms, and finally read back.
+ * Once set, reads and writes are automatically done over four lanes if
+ * supported by the hal, the config and the command table.
+ * If cmd_tbl.qe_bit is zero, this returns SPIFLASH_OK at once without any spi
+ * communication.
+ *
+ * @param spi  pointer to the spi flash driver struct.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_BAD_CONFIG if the bit
+ *         could not be set.
+ */
+int SPIFLASH_quad_enable(spiflash_t *spi);
+
+/**
+ * Enters continuous read mode (XIP). Following reads through SPIFLASH_read
+ * and SPIFLASH_fast_read will be done by the widest dual or quad i/o read,
+ * with cmd_tbl.xip_mode_bits after the address. Having sent these once, the
+ * flash expects no command on following reads, only address.
+ * If the hal supports _spiflash_xip_map, the reads are instead handed over to
+ * the memory mapping controller.
+ * Any other operation first takes the flash out of continuous read mode and
+ * unmaps the controller. When the operation is finished, the driver returns to
+ * continuous read mode by next read, or by mapping the controller again.
+ * This does not communicate with the flash, apart from through
+ * _spiflash_xip_map, and there will be no asynchronous callback.
+ *
+ * @param spi  pointer to the spi flash driver struct.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_BAD_CONFIG if no dual or
+ *         quad i/o read or no xip mode bits are available.
+ *         SPIFLASH_ERR_BAD_STATE if a burst wrap is set.
+ */
+int SPIFLASH_xip_enter(spiflash_t *spi);
+
+/**
+ * Leaves continuous read mode (XIP), see SPIFLASH_xip_enter. All ones are
+ * clocked over the address and mode bits, which takes the flash out of
+ * continuous read mode and is ignored otherwise.
+ *
+ * @param spi  pointer to the spi flash driver struct.
+ * @return error code or SPIFLASH_OK
+ */
+int SPIFLASH_xip_exit(spiflash_t *spi);
+
 /**
  * Reads the product id of the device, 3 bytes.
  *
@@ -423,6 +1560,209 @@ int SPIFLASH_write_reg(spiflash_t *spi, uint8_t reg, uint8_t data,
 int SPIFLASH_read_product_id(spiflash_t *spi, uint32_t *prod_id);
 
 
+/**
+ * Sets up the request queue, a ring buffer of caller allocated request
+ * descriptors used by SPIFLASH_submit. Call when the driver is idle.
+ *
+ * @param spi       pointer to the spi flash driver struct.
+ * @param q         queue state, kept as long as the queue is used, or NULL
+ *                  to remove the queue.
+ * @param reqs      array of capacity request descriptors.
+ * @param capacity  max number of requests in the queue.
+ */
+void SPIFLASH_queue_init(spiflash_t *spi, spiflash_queue_t *q,
+    spiflash_req_t *reqs, uint8_t capacity);
+
+/**
+ * Submits a request to the request queue, see SPIFLASH_queue_init. The
+ * request is copied, so it need not be kept by the caller. Any buffers it
+ * points to must be kept until the request is finished.
+ * In asynchronous mode, the request is started at once if the driver is
+ * idle. Otherwise it is queued after all requests of same or higher
+ * priority, and started from SPIFLASH_async_trigger as soon as the operations
+ * before it have finished. When finished, req.cb is called instead of the
+ * asynchronous callback.
+ * An ongoing erase or write request is preempted by a queued request of
+ * higher priority when the current block erase or page program is
+ * finished, and continued afterwards. If suspend is set up (see
+ * SPIFLASH_read), a queued read of higher priority is served by suspending
+ * the current block erase or page program, unless the read overlaps it.
+ * In synchronous mode, the request is carried out at once and req.cb is
+ * called before returning.
+ * May be called from another context than spiflash_async_trigger, e.g. a
+ * task while the hal triggers from interrupts, only if the hal has
+ * _spiflash_critical.
+ *
+ * @param spi  pointer to the spi flash driver struct.
+ * @param req  the request.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_QUEUE_FULL if the queue
+ *         is full, or in asynchronous mode if there is no queue.
+ *         SPIFLASH_ERR_BUSY if no operation context is free to run the
+ *         queue.
+ */
+int SPIFLASH_submit(spiflash_t *spi, const spiflash_req_t *req);
+
+/**
+ * Sets up the suspend state of an operation context, letting reads be served
+ * while an erase or a write is suspended, see SPIFLASH_read and
+ * SPIFLASH_submit. Without it, reads during an erase or a write return
+ * SPIFLASH_ERR_BUSY, and queued reads wait for the current block erase or page
+ * program. Call after SPIFLASH_ctx_pool_init, while the context is free.
+ *
+ * @param ctx  the operation context.
+ * @param sus  suspend state, kept as long as suspend is used, or NULL to stop
+ *             suspending.
+ */
+void SPIFLASH_suspend_init(spiflash_op_ctx_t *ctx, spiflash_suspend_t *sus);
+
+/**
+ * Sets up the adaptive timing model. The typical times of the config then only
+ * seed a running estimate per operation class, updated from how long each
+ * operation actually took. The first wait is 7/8 of the estimate, followed by
+ * polls every 1/16 of it. Without it, the typical time is waited, followed by
+ * polls at halving intervals down to 1 ms. Call when the driver is idle.
+ *
+ * @param spi  pointer to the spi flash driver struct.
+ * @param tm   the estimates, kept as long as they are used, or NULL to go
+ *             back to the typical times.
+ */
+void SPIFLASH_timing_init(spiflash_t *spi, spiflash_timing_t *tm);
+
+/**
+ * Sets up the sequence context of an operation context, for operations
+ * carried out in several steps or read through a chunk buffer:
+ * SPIFLASH_erase_preserve, SPIFLASH_update, SPIFLASH_verify, SPIFLASH_crc32,
+ * SPIFLASH_read_line and cfg.write_verify. Without it, these return
+ * SPIFLASH_ERR_BAD_CONFIG. One sequence context is enough for all of them.
+ * Call after SPIFLASH_ctx_pool_init, while the context is free.
+ *
+ * @param ctx  the operation context.
+ * @param sq   the sequence context, kept as long as it is used, or NULL.
+ */
+void SPIFLASH_seq_init(spiflash_op_ctx_t *ctx, spiflash_seq_t *sq);
+
+/**
+ * Sets up the read cache, caller allocated lines of line_sz bytes each,
+ * typically the page size or the smallest erase size. Reads by SPIFLASH_read
+ * and SPIFLASH_fast_read, also when queued, are served from the cache if all
+ * lines covering the read are cached. A missing read within one line reads
+ * the entire line into the least recently used line, other reads pass
+ * through. SPIFLASH_write, SPIFLASH_writev, SPIFLASH_erase and
+ * SPIFLASH_chip_erase update the cached lines they touch, and a failing
+ * operation invalidates the cache.
+ * In asynchronous mode, a read served from the cache calls the asynchronous
+ * callback, or req.cb if queued, before returning.
+ * Reads are only served from the cache when the driver is idle, and not
+ * within SPIFLASH_erase_preserve or SPIFLASH_update.
+ *
+ * @param spi      pointer to the spi flash driver struct.
+ * @param cache    cache state, kept as long as the cache is used.
+ * @param lines    array of line_cnt cache lines.
+ * @param mem      line_cnt * line_sz bytes of line data.
+ * @param line_cnt number of lines, 0 disables the cache.
+ * @param line_sz  size of a line, a power of two.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_BAD_CONFIG if line_sz is
+ *         not a power of two.
+ */
+int SPIFLASH_cache_init(spiflash_t *spi, spiflash_cache_t *cache,
+    spiflash_cache_line_t *lines, uint8_t *mem, uint16_t line_cnt,
+    uint32_t line_sz);
+
+/**
+ * Invalidates all lines of the read cache. Call this if the flash is
+ * altered by other means than through the driver.
+ *
+ * @param spi  pointer to the spi flash driver struct.
+ */
+void SPIFLASH_cache_invalidate(spiflash_t *spi);
+
+/**
+ * Returns the read cache counters, see SPIFLASH_cache_init. Reads passing
+ * through the cache count as misses.
+ *
+ * @param spi     pointer to the spi flash driver struct.
+ * @param hits    where to store number of reads served from the cache, or
+ *                NULL.
+ * @param misses  where to store number of reads from the flash, or NULL.
+ */
+void SPIFLASH_cache_stats(spiflash_t *spi, uint32_t *hits, uint32_t *misses);
+
+/**
+ * Sets up the write buffer used by SPIFLASH_append, caller allocated and
+ * cfg.page_sz bytes long. Any data pending in a previous buffer is dropped.
+ *
+ * @param spi         pointer to the spi flash driver struct.
+ * @param wb          write buffer state, kept as long as the buffer is used.
+ * @param buf         the buffer, or NULL to disable.
+ * @param timeout_ms  time in milliseconds after which pending data is flushed
+ *                    by SPIFLASH_wbuf_tick, 0 for never.
+ */
+void SPIFLASH_wbuf_init(spiflash_t *spi, spiflash_wbuf_t *wb, uint8_t *buf,
+    uint32_t timeout_ms);
+
+/**
+ * Ages the data pending in the write buffer, call this periodically. Once
+ * the data has been pending for the timeout given to SPIFLASH_wbuf_init, it
+ * is flushed as by SPIFLASH_flush, as soon as the driver is idle. In
+ * asynchronous mode, the asynchronous callback is called when flushed.
+ *
+ * @param spi         pointer to the spi flash driver struct.
+ * @param elapsed_ms  milliseconds since last call.
+ * @return error code or SPIFLASH_OK
+ */
+int SPIFLASH_wbuf_tick(spiflash_t *spi, uint32_t elapsed_ms);
+
+/**
+ * Starts collecting statistics per operation into caller allocated stats,
+ * clearing them. Only available if the driver is built with SPIFLASH_STATS set
+ * to 1. Call when the driver is idle.
+ *
+ * @param spi    pointer to the spi flash driver struct.
+ * @param stats  the statistics, kept as long as they are collected, or NULL
+ *               to stop.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_UNSUPPORTED if the driver
+ *         is built without statistics.
+ */
+int SPIFLASH_stats_init(spiflash_t *spi, spiflash_stats_t *stats);
+
+/**
+ * Copies the statistics collected since SPIFLASH_stats_init or the last
+ * reset. In asynchronous mode, an operation finishing during the copy may be
+ * partly included.
+ * Bus utilization is total_us - wait_us of each operation, the time the flash
+ * was not waited for.
+ *
+ * @param spi    pointer to the spi flash driver struct.
+ * @param stats  receives the statistics.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_UNSUPPORTED if the driver
+ *         is built without statistics, SPIFLASH_ERR_BAD_CONFIG if none are
+ *         collected.
+ */
+int SPIFLASH_stats_get(spiflash_t *spi, spiflash_stats_t *stats);
+
+/**
+ * Clears all statistics.
+ *
+ * @param spi  pointer to the spi flash driver struct.
+ */
+void SPIFLASH_stats_reset(spiflash_t *spi);
+
+/**
+ * Starts tracing into a ring of records that you allocate. Each step of the
+ * state machine is recorded when started and when finished, with operation,
+ * address, length and timestamp, overwriting the oldest records. Recording
+ * is a few stores per step, so the trace may be left on in release builds.
+ * Only available if the driver is built with SPIFLASH_TRACE set to 1. Decode
+ * the records with SPIFLASH_trace_dump in spiflash_trace.h.
+ *
+ * @param spi   pointer to the spi flash driver struct.
+ * @param recs  array of cnt records, or NULL to stop tracing.
+ * @param cnt   number of records.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_UNSUPPORTED if the driver
+ *         is built without trace.
+ */
+int SPIFLASH_trace_init(spiflash_t *spi, spiflash_trace_t *recs, uint16_t cnt);
+
 /**
  * Returns if the driver is busy or not. Will not do any spi communication.
  *
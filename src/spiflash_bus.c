@@ -0,0 +1,99 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Peter Andersson (pelleplutt1976<at>gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * spiflash_bus.c
+ *
+ * @author: petera
+ */
+
+#include "spiflash_bus.h"
+
+static void _spiflash_bus_flash_grant(spiflash_bus_client_t *client) {
+  SPIFLASH_async_trigger(client->spi, SPIFLASH_OK);
+}
+
+void SPIFLASH_bus_init(spiflash_bus_t *bus) {
+  memset(bus, 0, sizeof(spiflash_bus_t));
+}
+
+void SPIFLASH_bus_attach(spiflash_bus_t *bus, spiflash_bus_client_t *client,
+    int8_t prio, spiflash_bus_grant_cb_t grant_cb, void *user_data) {
+  memset(client, 0, sizeof(spiflash_bus_client_t));
+  client->bus = bus;
+  client->prio = prio;
+  client->grant_cb = grant_cb;
+  client->user_data = user_data;
+  client->next = bus->clients;
+  bus->clients = client;
+}
+
+void SPIFLASH_bus_attach_flash(spiflash_bus_t *bus, spiflash_bus_client_t *client,
+    spiflash_t *spi, int8_t prio) {
+  SPIFLASH_bus_attach(bus, client, prio, _spiflash_bus_flash_grant, 0);
+  client->spi = spi;
+  spi->bus = client;
+}
+
+int SPIFLASH_bus_request(spiflash_bus_client_t *client) {
+  spiflash_bus_t *bus = client->bus;
+  if (bus->owner == 0 || bus->owner == client) {
+    bus->owner = client;
+    return SPIFLASH_OK;
+  }
+  if (!client->waiting) {
+    client->waiting = 1;
+    client->since = bus->seq++;
+  }
+  return SPIFLASH_BUS_QUEUED;
+}
+
+void SPIFLASH_bus_release(spiflash_bus_client_t *client) {
+  spiflash_bus_t *bus = client->bus;
+  spiflash_bus_client_t *c, *next = 0;
+  if (bus->owner != client) {
+    client->waiting = 0;
+    return;
+  }
+  // highest priority, then longest waiting
+  for (c = bus->clients; c; c = c->next) {
+    if (c->waiting && (next == 0 || c->prio > next->prio ||
+        (c->prio == next->prio && c->since - next->since >= 0x80000000u))) {
+      next = c;
+    }
+  }
+  bus->owner = next;
+  if (next) {
+    next->waiting = 0;
+    next->grant_cb(next);
+  }
+}
+
+int SPIFLASH_bus_hal(spiflash_t *spi, uint8_t request) {
+  spiflash_bus_client_t *client = (spiflash_bus_client_t *)spi->bus;
+  if (request) {
+    return SPIFLASH_bus_request(client);
+  }
+  SPIFLASH_bus_release(client);
+  return SPIFLASH_OK;
+}
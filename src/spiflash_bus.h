@@ -0,0 +1,144 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Peter Andersson (pelleplutt1976<at>gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+/**
+ * spiflash_bus.h
+ *
+ * Arbiter for a spi bus shared by several spi flashes and other devices.
+ *
+ * @author: petera
+ */
+
+#ifndef SPIFLASH_BUS_H_
+#define SPIFLASH_BUS_H_
+
+#include "spiflash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct spiflash_bus_s;
+struct spiflash_bus_client_s;
+
+/**
+ * Bus grant callback, see SPIFLASH_bus_request.
+ *
+ * @param client  the client now owning the bus.
+ */
+typedef void (*spiflash_bus_grant_cb_t)(struct spiflash_bus_client_s *client);
+
+/**
+ * A device on the shared bus.
+ */
+typedef struct spiflash_bus_client_s {
+  struct spiflash_bus_s *bus;
+  // higher priority clients are granted the bus first
+  int8_t prio;
+  // called when granted, if not granted at once
+  spiflash_bus_grant_cb_t grant_cb;
+  // the spi flash driver struct, for spi flash clients
+  spiflash_t *spi;
+  // user data for the grant callback
+  void *user_data;
+
+  // internals
+  struct spiflash_bus_client_s *next;
+  uint8_t waiting;
+  uint32_t since;
+} spiflash_bus_client_t;
+
+/**
+ * The bus arbiter struct.
+ */
+typedef struct spiflash_bus_s {
+  spiflash_bus_client_t *clients;
+  spiflash_bus_client_t *owner;
+  uint32_t seq;
+} spiflash_bus_t;
+
+/**
+ * Sets up a bus arbiter, without any clients.
+ *
+ * @param bus  pointer to the bus arbiter struct.
+ */
+void SPIFLASH_bus_init(spiflash_bus_t *bus);
+
+/**
+ * Attaches a device other than a spi flash, e.g. a display, to the bus. Before
+ * using the bus, it must be requested by SPIFLASH_bus_request, and when done
+ * released by SPIFLASH_bus_release.
+ *
+ * @param bus        pointer to the bus arbiter struct.
+ * @param client     the client struct, kept by the bus.
+ * @param prio       priority of the client.
+ * @param grant_cb   called when the bus is granted, if not at once.
+ * @param user_data  user data for the grant callback.
+ */
+void SPIFLASH_bus_attach(spiflash_bus_t *bus, spiflash_bus_client_t *client,
+    int8_t prio, spiflash_bus_grant_cb_t grant_cb, void *user_data);
+
+/**
+ * Attaches a spi flash to the bus. The spi flash must be initiated by
+ * SPIFLASH_init in asynchronous mode, and its hal must have
+ * SPIFLASH_bus_hal as _spiflash_bus. The driver then requests the bus for
+ * each operation, and releases it during busy waits of erases and writes.
+ *
+ * @param bus     pointer to the bus arbiter struct.
+ * @param client  the client struct, kept by the bus.
+ * @param spi     the spi flash driver struct.
+ * @param prio    priority of the spi flash.
+ */
+void SPIFLASH_bus_attach_flash(spiflash_bus_t *bus, spiflash_bus_client_t *client,
+    spiflash_t *spi, int8_t prio);
+
+/**
+ * Requests the bus. If the bus is free, it is granted at once. Otherwise the
+ * client waits until the bus is released, and then the waiting client of
+ * highest priority, first come first served, is granted the bus and its
+ * grant callback is called.
+ * Not interrupt safe, call from one context only or protect.
+ *
+ * @param client  the client.
+ * @return SPIFLASH_OK if granted, SPIFLASH_BUS_QUEUED if granted later.
+ */
+int SPIFLASH_bus_request(spiflash_bus_client_t *client);
+
+/**
+ * Releases the bus, see SPIFLASH_bus_request. If the client is waiting and
+ * not yet granted, it stops waiting.
+ *
+ * @param client  the client.
+ */
+void SPIFLASH_bus_release(spiflash_bus_client_t *client);
+
+/**
+ * An implementation of spiflash_hal_t._spiflash_bus for spi flashes attached
+ * by SPIFLASH_bus_attach_flash.
+ */
+int SPIFLASH_bus_hal(spiflash_t *spi, uint8_t request);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*SPIFLASH_BUS_H_*/
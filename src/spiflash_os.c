@@ -0,0 +1,254 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Peter Andersson (pelleplutt1976<at>gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * spiflash_os.c
+ *
+ * @author: petera
+ */
+
+#include "spiflash_os.h"
+
+static void _spiflash_os_async_cb(spiflash_t *spi, spiflash_op_t op, int err_code) {
+  spiflash_os_front_t *front = (spiflash_os_front_t *)spi->layer;
+  (void)op;
+  front->res = err_code;
+  front->done = 1;
+}
+
+static void _spiflash_os_begin(spiflash_os_front_t *front) {
+  front->os->mutex_lock(front->mutex);
+  front->done = 0;
+  front->sleeping = 0;
+  front->res = SPIFLASH_OK;
+}
+
+static int _spiflash_os_end(spiflash_os_front_t *front, int res) {
+  // drive the operation started with result res until finished, some finish
+  // at once without asynchronous callback
+  while (res == SPIFLASH_OK && !front->done &&
+      front->spi->op != SPIFLASH_OP_IDLE) {
+    if (front->sleeping) {
+      front->sleeping = 0;
+      front->os->sleep_ms(front->sleep_ms);
+      res = SPIFLASH_async_trigger(front->spi, SPIFLASH_OK);
+    } else {
+      front->os->sem_take(front->sem);
+      res = SPIFLASH_async_trigger(front->spi, front->hw_res);
+    }
+  }
+  if (front->done) {
+    res = front->res;
+  }
+  front->os->mutex_unlock(front->mutex);
+  return res;
+}
+
+int SPIFLASH_os_init(spiflash_os_front_t *front, spiflash_t *spi,
+    const spiflash_os_t *os, void *mutex, void *sem) {
+  if (!spi->async || (spi->layer && spi->async_cb != _spiflash_os_async_cb)) {
+    return SPIFLASH_ERR_BAD_CONFIG;
+  }
+  memset(front, 0, sizeof(spiflash_os_front_t));
+  front->spi = spi;
+  front->os = os;
+  front->mutex = mutex;
+  front->sem = sem;
+  spi->layer = front;
+  spi->async_cb = _spiflash_os_async_cb;
+  return SPIFLASH_OK;
+}
+
+void SPIFLASH_os_complete(spiflash_t *spi, int err_code) {
+  spiflash_os_front_t *front = (spiflash_os_front_t *)spi->layer;
+  front->hw_res = err_code;
+  front->os->sem_give(front->sem);
+}
+
+void SPIFLASH_os_hal_wait(spiflash_t *spi, uint32_t ms) {
+  spiflash_os_front_t *front = (spiflash_os_front_t *)spi->layer;
+  if (ms == 0) return;
+  front->sleep_ms = ms;
+  front->sleeping = 1;
+}
+
+int SPIFLASH_os_read(spiflash_os_front_t *front, uint32_t addr, uint32_t len,
+    uint8_t *buf) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_read(front->spi, addr, len, buf));
+}
+
+int SPIFLASH_os_fast_read(spiflash_os_front_t *front, uint32_t addr,
+    uint32_t len, uint8_t *buf) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_fast_read(front->spi, addr, len, buf));
+}
+
+int SPIFLASH_os_write(spiflash_os_front_t *front, uint32_t addr, uint32_t len,
+    const uint8_t *buf) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_write(front->spi, addr, len, buf));
+}
+
+int SPIFLASH_os_erase(spiflash_os_front_t *front, uint32_t addr, uint32_t len) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_erase(front->spi, addr, len));
+}
+
+int SPIFLASH_os_chip_erase(spiflash_os_front_t *front) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_chip_erase(front->spi));
+}
+
+int SPIFLASH_os_read_sr(spiflash_os_front_t *front, uint8_t *sr) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_read_sr(front->spi, sr));
+}
+
+int SPIFLASH_os_read_jedec_id(spiflash_os_front_t *front, uint32_t *jedec_id) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_read_jedec_id(front->spi, jedec_id));
+}
+
+int SPIFLASH_os_writev(spiflash_os_front_t *front, const spiflash_iov_t *iov,
+    uint32_t iovcnt) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_writev(front->spi, iov, iovcnt));
+}
+
+int SPIFLASH_os_write_produce(spiflash_os_front_t *front,
+    spiflash_produce_t *pr, uint32_t addr, uint32_t len, uint8_t *bufs,
+    spiflash_produce_cb_t cb) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front,
+      SPIFLASH_write_produce(front->spi, pr, addr, len, bufs, cb));
+}
+
+int SPIFLASH_os_readv(spiflash_os_front_t *front, const spiflash_iov_t *iov,
+    uint32_t iovcnt) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_readv(front->spi, iov, iovcnt));
+}
+
+int SPIFLASH_os_read_line(spiflash_os_front_t *front, uint32_t addr,
+    uint32_t line_sz, uint32_t lines, uint8_t *buf) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front,
+      SPIFLASH_read_line(front->spi, addr, line_sz, lines, buf));
+}
+
+int SPIFLASH_os_erase_preserve(spiflash_os_front_t *front, uint32_t addr,
+    uint32_t len, uint8_t *buf, uint32_t buf_len) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front,
+      SPIFLASH_erase_preserve(front->spi, addr, len, buf, buf_len));
+}
+
+int SPIFLASH_os_update(spiflash_os_front_t *front, uint32_t addr, uint32_t len,
+    const uint8_t *data, uint8_t *buf, uint32_t buf_len) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front,
+      SPIFLASH_update(front->spi, addr, len, data, buf, buf_len));
+}
+
+int SPIFLASH_os_append(spiflash_os_front_t *front, uint32_t addr, uint32_t len,
+    const uint8_t *data) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_append(front->spi, addr, len, data));
+}
+
+int SPIFLASH_os_flush(spiflash_os_front_t *front) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_flush(front->spi));
+}
+
+int SPIFLASH_os_wbuf_tick(spiflash_os_front_t *front, uint32_t elapsed_ms) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_wbuf_tick(front->spi, elapsed_ms));
+}
+
+int SPIFLASH_os_verify(spiflash_os_front_t *front, uint32_t addr, uint32_t len,
+    const uint8_t *buf) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_verify(front->spi, addr, len, buf));
+}
+
+int SPIFLASH_os_crc32(spiflash_os_front_t *front, uint32_t addr, uint32_t len,
+    uint32_t *crc) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_crc32(front->spi, addr, len, crc));
+}
+
+int SPIFLASH_os_write_sr(spiflash_os_front_t *front, uint8_t sr) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_write_sr(front->spi, sr));
+}
+
+int SPIFLASH_os_read_sr_busy(spiflash_os_front_t *front, uint8_t *busy) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_read_sr_busy(front->spi, busy));
+}
+
+int SPIFLASH_os_read_product_id(spiflash_os_front_t *front, uint32_t *prod_id) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_read_product_id(front->spi, prod_id));
+}
+
+int SPIFLASH_os_read_sfdp(spiflash_os_front_t *front, uint32_t addr,
+    uint32_t len, uint8_t *buf) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_read_sfdp(front->spi, addr, len, buf));
+}
+
+int SPIFLASH_os_read_reg(spiflash_os_front_t *front, uint8_t reg,
+    uint8_t *data) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_read_reg(front->spi, reg, data));
+}
+
+int SPIFLASH_os_write_reg(spiflash_os_front_t *front, uint8_t reg,
+    uint8_t data, uint8_t write_en, uint32_t wait_ms) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front,
+      SPIFLASH_write_reg(front->spi, reg, data, write_en, wait_ms));
+}
+
+int SPIFLASH_os_quad_enable(spiflash_os_front_t *front) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_quad_enable(front->spi));
+}
+
+int SPIFLASH_os_set_burst_wrap(spiflash_os_front_t *front, uint8_t wrap_sz) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_set_burst_wrap(front->spi, wrap_sz));
+}
+
+int SPIFLASH_os_xip_enter(spiflash_os_front_t *front) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_xip_enter(front->spi));
+}
+
+int SPIFLASH_os_xip_exit(spiflash_os_front_t *front) {
+  _spiflash_os_begin(front);
+  return _spiflash_os_end(front, SPIFLASH_xip_exit(front->spi));
+}
@@ -0,0 +1,179 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Peter Andersson (pelleplutt1976<at>gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+/**
+ * spiflash_os.h
+ *
+ * Blocking front end for multitasking systems. The driver runs in
+ * asynchronous mode underneath, while the calling task sleeps.
+ *
+ * @author: petera
+ */
+
+#ifndef SPIFLASH_OS_H_
+#define SPIFLASH_OS_H_
+
+#include "spiflash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Os primitives used by the front end. Mutex and semaphore are created by
+ * the caller and passed as handles to SPIFLASH_os_init.
+ */
+typedef struct {
+  // lock and unlock a mutex
+  void (*mutex_lock)(void *mutex);
+  void (*mutex_unlock)(void *mutex);
+  // take a binary semaphore, sleeping until given
+  void (*sem_take)(void *sem);
+  // give a binary semaphore, also from interrupt context
+  void (*sem_give)(void *sem);
+  // sleep given number of milliseconds, rounded up to whole ticks
+  void (*sleep_ms)(uint32_t ms);
+} spiflash_os_t;
+
+/**
+ * The front end struct.
+ */
+typedef struct {
+  spiflash_t *spi;
+  const spiflash_os_t *os;
+  void *mutex;
+  void *sem;
+
+  // internals
+  volatile int hw_res;
+  uint32_t sleep_ms;
+  uint8_t sleeping;
+  uint8_t done;
+  int res;
+} spiflash_os_front_t;
+
+/**
+ * Sets up a front end for a spi flash, initiated by SPIFLASH_init in
+ * asynchronous mode. The front end takes over the asynchronous callback and
+ * spi.layer, and the spi flash must only be used through the front end from
+ * now on. Layers taking these over are exclusive: a spi flash under a front
+ * end cannot be part of a volume of spiflash_stripe.h, nor hold a pool of
+ * spiflash_pool.h, and the other way around.
+ * The hal of the spi flash must call SPIFLASH_os_complete instead of
+ * SPIFLASH_async_trigger, and should have SPIFLASH_os_hal_wait as
+ * _spiflash_wait.
+ * Each blocking call locks the mutex, starts the operation and sleeps on
+ * the semaphore, or by os.sleep_ms, until the next step. All steps, including
+ * SPIFLASH_async_trigger, run in the calling task, so several tasks may call
+ * the front end at the same time.
+ *
+ * @param front  pointer to the front end struct.
+ * @param spi    the spi flash driver struct.
+ * @param os     the os primitives.
+ * @param mutex  mutex handle for os.mutex_lock and os.mutex_unlock.
+ * @param sem    binary semaphore handle for os.sem_take and os.sem_give,
+ *               initially taken.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_BAD_CONFIG if the spi
+ *         flash is synchronous, or taken over by another layer.
+ */
+int SPIFLASH_os_init(spiflash_os_front_t *front, spiflash_t *spi,
+    const spiflash_os_t *os, void *mutex, void *sem);
+
+/**
+ * Call from the hal when a spi transaction is finished, or when the busy pin
+ * signals not busy, instead of SPIFLASH_async_trigger. May be called from
+ * interrupt context, also before the hal call starting the transaction has
+ * returned.
+ *
+ * @param spi       pointer to the spi flash driver struct.
+ * @param err_code  as for SPIFLASH_async_trigger.
+ */
+void SPIFLASH_os_complete(spiflash_t *spi, int err_code);
+
+/**
+ * An implementation of spiflash_hal_t._spiflash_wait, making the calling task
+ * sleep by os.sleep_ms. Not for the busy pin, which is waited for with zero
+ * milliseconds and must be signalled by SPIFLASH_os_complete.
+ */
+void SPIFLASH_os_hal_wait(spiflash_t *spi, uint32_t ms);
+
+/**
+ * Blocking versions of the corresponding SPIFLASH functions. They return
+ * once the operation has finished, with its result. Callbacks given to them,
+ * like the producer of SPIFLASH_os_write_produce, are called from the calling
+ * task.
+ * There are no blocking versions of SPIFLASH_submit, nor of the streaming
+ * reads of SPIFLASH_stream_start. Both finish by callbacks of their own after
+ * returning, while the front end only drives the driver within its calls. The
+ * functions not talking to the spi flash, like SPIFLASH_cache_init or
+ * SPIFLASH_stats_get, are called on the spi flash directly.
+ */
+int SPIFLASH_os_read(spiflash_os_front_t *front, uint32_t addr, uint32_t len,
+    uint8_t *buf);
+int SPIFLASH_os_fast_read(spiflash_os_front_t *front, uint32_t addr,
+    uint32_t len, uint8_t *buf);
+int SPIFLASH_os_write(spiflash_os_front_t *front, uint32_t addr, uint32_t len,
+    const uint8_t *buf);
+int SPIFLASH_os_erase(spiflash_os_front_t *front, uint32_t addr, uint32_t len);
+int SPIFLASH_os_chip_erase(spiflash_os_front_t *front);
+int SPIFLASH_os_read_sr(spiflash_os_front_t *front, uint8_t *sr);
+int SPIFLASH_os_read_jedec_id(spiflash_os_front_t *front, uint32_t *jedec_id);
+int SPIFLASH_os_writev(spiflash_os_front_t *front, const spiflash_iov_t *iov,
+    uint32_t iovcnt);
+int SPIFLASH_os_write_produce(spiflash_os_front_t *front,
+    spiflash_produce_t *pr, uint32_t addr, uint32_t len, uint8_t *bufs,
+    spiflash_produce_cb_t cb);
+int SPIFLASH_os_readv(spiflash_os_front_t *front, const spiflash_iov_t *iov,
+    uint32_t iovcnt);
+int SPIFLASH_os_read_line(spiflash_os_front_t *front, uint32_t addr,
+    uint32_t line_sz, uint32_t lines, uint8_t *buf);
+int SPIFLASH_os_erase_preserve(spiflash_os_front_t *front, uint32_t addr,
+    uint32_t len, uint8_t *buf, uint32_t buf_len);
+int SPIFLASH_os_update(spiflash_os_front_t *front, uint32_t addr, uint32_t len,
+    const uint8_t *data, uint8_t *buf, uint32_t buf_len);
+int SPIFLASH_os_append(spiflash_os_front_t *front, uint32_t addr, uint32_t len,
+    const uint8_t *data);
+int SPIFLASH_os_flush(spiflash_os_front_t *front);
+int SPIFLASH_os_wbuf_tick(spiflash_os_front_t *front, uint32_t elapsed_ms);
+int SPIFLASH_os_verify(spiflash_os_front_t *front, uint32_t addr, uint32_t len,
+    const uint8_t *buf);
+int SPIFLASH_os_crc32(spiflash_os_front_t *front, uint32_t addr, uint32_t len,
+    uint32_t *crc);
+int SPIFLASH_os_write_sr(spiflash_os_front_t *front, uint8_t sr);
+int SPIFLASH_os_read_sr_busy(spiflash_os_front_t *front, uint8_t *busy);
+int SPIFLASH_os_read_product_id(spiflash_os_front_t *front, uint32_t *prod_id);
+int SPIFLASH_os_read_sfdp(spiflash_os_front_t *front, uint32_t addr,
+    uint32_t len, uint8_t *buf);
+int SPIFLASH_os_read_reg(spiflash_os_front_t *front, uint8_t reg,
+    uint8_t *data);
+int SPIFLASH_os_write_reg(spiflash_os_front_t *front, uint8_t reg,
+    uint8_t data, uint8_t write_en, uint32_t wait_ms);
+int SPIFLASH_os_quad_enable(spiflash_os_front_t *front);
+int SPIFLASH_os_set_burst_wrap(spiflash_os_front_t *front, uint8_t wrap_sz);
+int SPIFLASH_os_xip_enter(spiflash_os_front_t *front);
+int SPIFLASH_os_xip_exit(spiflash_os_front_t *front);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*SPIFLASH_OS_H_*/
@@ -0,0 +1,162 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Peter Andersson (pelleplutt1976<at>gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * spiflash_pool.c
+ *
+ * @author: petera
+ */
+
+#include "spiflash_pool.h"
+
+#define POOL_NONE     (0xffff)
+
+static uint16_t _spiflash_pool_least_worn(spiflash_pool_t *pool, uint8_t state) {
+  // sector in given state with fewest erases
+  uint16_t i;
+  uint16_t ix = POOL_NONE;
+  for (i = 0; i < pool->sec_cnt; i++) {
+    if (pool->secs[i].state == state &&
+        (ix == POOL_NONE || pool->secs[i].erases < pool->secs[ix].erases)) {
+      ix = i;
+    }
+  }
+  return ix;
+}
+
+static void _spiflash_pool_erased(spiflash_t *spi, const spiflash_req_t *req,
+    int err_code) {
+  spiflash_pool_t *pool = (spiflash_pool_t *)req->user_data;
+  spiflash_pool_sec_t *sec = &pool->secs[(req->addr - pool->addr) / pool->sec_sz];
+  pool->erasing = 0;
+  pool->res = err_code;
+  if (err_code == SPIFLASH_OK) {
+    sec->erases++;
+    sec->state = SPIFLASH_POOL_READY;
+    pool->dirty--;
+    pool->ready++;
+    if (spi->async) {
+      SPIFLASH_pool_refill(pool);
+    }
+  } else {
+    // retried by next SPIFLASH_pool_refill
+    sec->state = SPIFLASH_POOL_DIRTY;
+  }
+}
+
+static int _spiflash_pool_erase_next(spiflash_pool_t *pool) {
+  spiflash_req_t req;
+  uint16_t ix;
+  int res;
+  if (pool->erasing || pool->ready >= pool->target) {
+    return SPIFLASH_OK;
+  }
+  ix = _spiflash_pool_least_worn(pool, SPIFLASH_POOL_DIRTY);
+  if (ix == POOL_NONE) {
+    return SPIFLASH_OK;
+  }
+  memset(&req, 0, sizeof(req));
+  req.type = SPIFLASH_REQ_ERASE;
+  req.prio = SPIFLASH_PRIO_BACKGROUND;
+  req.addr = pool->addr + ix * pool->sec_sz;
+  req.len = pool->sec_sz;
+  req.cb = _spiflash_pool_erased;
+  req.user_data = pool;
+  pool->secs[ix].state = SPIFLASH_POOL_ERASING;
+  pool->erasing = 1;
+  res = SPIFLASH_submit(pool->spi, &req);
+  if (res != SPIFLASH_OK && pool->erasing) {
+    // not queued, callback not called
+    pool->erasing = 0;
+    pool->secs[ix].state = SPIFLASH_POOL_DIRTY;
+  }
+  return res;
+}
+
+int SPIFLASH_pool_init(spiflash_pool_t *pool, spiflash_t *spi,
+    spiflash_pool_sec_t *secs, uint32_t addr, uint16_t sec_cnt,
+    uint32_t sec_sz, uint16_t target) {
+  uint16_t i;
+  if (sec_sz == 0 || addr % sec_sz || (spi->async && spi->layer)) {
+    return SPIFLASH_ERR_BAD_CONFIG;
+  }
+  if (addr > spi->cfg->sz || sec_cnt > (spi->cfg->sz - addr) / sec_sz) {
+    return SPIFLASH_ERR_OUT_OF_RANGE;
+  }
+  memset(pool, 0, sizeof(spiflash_pool_t));
+  pool->spi = spi;
+  pool->secs = secs;
+  pool->addr = addr;
+  pool->sec_cnt = sec_cnt;
+  pool->sec_sz = sec_sz;
+  pool->target = target;
+  for (i = 0; i < sec_cnt; i++) {
+    secs[i].state = SPIFLASH_POOL_USED;
+  }
+  return SPIFLASH_OK;
+}
+
+int SPIFLASH_pool_get(spiflash_pool_t *pool, uint32_t *addr) {
+  uint16_t ix = _spiflash_pool_least_worn(pool, SPIFLASH_POOL_READY);
+  if (ix == POOL_NONE) {
+    return SPIFLASH_ERR_BUSY;
+  }
+  pool->secs[ix].state = SPIFLASH_POOL_USED;
+  pool->ready--;
+  *addr = pool->addr + ix * pool->sec_sz;
+  if (pool->spi->async) {
+    _spiflash_pool_erase_next(pool);
+  }
+  return SPIFLASH_OK;
+}
+
+int SPIFLASH_pool_release(spiflash_pool_t *pool, uint32_t addr) {
+  spiflash_pool_sec_t *sec;
+  if (addr < pool->addr || (addr - pool->addr) / pool->sec_sz >= pool->sec_cnt) {
+    return SPIFLASH_ERR_OUT_OF_RANGE;
+  }
+  sec = &pool->secs[(addr - pool->addr) / pool->sec_sz];
+  if (sec->state != SPIFLASH_POOL_USED) {
+    return SPIFLASH_OK;
+  }
+  sec->state = SPIFLASH_POOL_DIRTY;
+  pool->dirty++;
+  if (pool->spi->async) {
+    _spiflash_pool_erase_next(pool);
+  }
+  return SPIFLASH_OK;
+}
+
+int SPIFLASH_pool_refill(spiflash_pool_t *pool) {
+  int res;
+  pool->res = SPIFLASH_OK;
+  res = _spiflash_pool_erase_next(pool);
+  if (!pool->spi->async) {
+    while (res == SPIFLASH_OK && pool->res == SPIFLASH_OK &&
+        pool->ready < pool->target && pool->dirty) {
+      res = _spiflash_pool_erase_next(pool);
+    }
+    if (res == SPIFLASH_OK) res = pool->res;
+  }
+  return res;
+}
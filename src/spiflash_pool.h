@@ -0,0 +1,159 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Peter Andersson (pelleplutt1976<at>gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * spiflash_pool.h
+ *
+ * Pool of pre-erased sectors with erase counters. Free sectors are erased in
+ * the background through the request queue, so that writers get an erased
+ * sector at once.
+ *
+ * @author: petera
+ */
+
+#ifndef SPIFLASH_POOL_H_
+#define SPIFLASH_POOL_H_
+
+#include "spiflash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Sector states.
+ */
+// holds data of the user, never erased by the pool
+#define SPIFLASH_POOL_USED            (0)
+// free, to be erased
+#define SPIFLASH_POOL_DIRTY           (1)
+// free, being erased
+#define SPIFLASH_POOL_ERASING         (2)
+// free and erased, ready to be handed out
+#define SPIFLASH_POOL_READY           (3)
+
+/**
+ * State of a sector in the pool.
+ */
+typedef struct {
+  // number of erases of the sector, counted up by the pool. Load saved
+  // counters before SPIFLASH_pool_init to keep them over restarts
+  uint32_t erases;
+  // a SPIFLASH_POOL_* state
+  uint8_t state;
+} spiflash_pool_sec_t;
+
+/**
+ * The pool struct.
+ */
+typedef struct spiflash_pool_s {
+  spiflash_t *spi;
+  spiflash_pool_sec_t *secs;
+  // address of the first sector
+  uint32_t addr;
+  uint32_t sec_sz;
+  uint16_t sec_cnt;
+  // number of erased sectors to keep ready
+  uint16_t target;
+  // number of sectors ready, and free sectors not yet erased, including one
+  // being erased
+  uint16_t ready;
+  uint16_t dirty;
+  // result of the last background erase
+  int res;
+
+  // internals
+  uint8_t erasing;
+} spiflash_pool_t;
+
+/**
+ * Sets up a pool of sec_cnt sectors of sec_sz bytes from addr, on a spi
+ * flash initiated by SPIFLASH_init. In asynchronous mode, the spi flash must
+ * have a request queue, see SPIFLASH_queue_init, and the pool submits
+ * background erases to it, finished from SPIFLASH_async_trigger. Such a spi
+ * flash cannot be under a front end of spiflash_os.h nor in a volume of
+ * spiflash_stripe.h, as their calls to the driver would race the pool's
+ * requests. All sectors start out as used, release the free
+ * ones by SPIFLASH_pool_release.
+ * The erase counters in secs are kept as they are, zero them or load saved
+ * counters first.
+ *
+ * @param pool     pointer to the pool struct.
+ * @param spi      the spi flash driver struct.
+ * @param secs     array of sec_cnt sector states.
+ * @param addr     address of the first sector, aligned to sec_sz.
+ * @param sec_cnt  number of sectors.
+ * @param sec_sz   size of a sector, a size SPIFLASH_erase can erase.
+ * @param target   number of erased sectors to keep ready.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_BAD_CONFIG if addr is not
+ *         aligned, sec_sz is zero, or an asynchronous spi flash is taken
+ *         over by another layer, SPIFLASH_ERR_OUT_OF_RANGE if the
+ *         sectors do not fit in the spi flash.
+ */
+int SPIFLASH_pool_init(spiflash_pool_t *pool, spiflash_t *spi,
+    spiflash_pool_sec_t *secs, uint32_t addr, uint16_t sec_cnt,
+    uint32_t sec_sz, uint16_t target);
+
+/**
+ * Hands out the erased sector with the fewest erases, at once and without
+ * spi communication. The sector is used until released. In asynchronous
+ * mode, an erase of the next free sector is submitted if fewer than target
+ * sectors are ready.
+ *
+ * @param pool  pointer to the pool struct.
+ * @param addr  populated with the address of the sector.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_BUSY if no sector is
+ *         ready, check pool.dirty to see if any is on its way.
+ */
+int SPIFLASH_pool_get(spiflash_pool_t *pool, uint32_t *addr);
+
+/**
+ * Gives back the sector holding addr to the pool, to be erased. In
+ * asynchronous mode, an erase is submitted if fewer than target sectors are
+ * ready.
+ *
+ * @param pool  pointer to the pool struct.
+ * @param addr  an address within the sector.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_OUT_OF_RANGE if addr is
+ *         not in the pool.
+ */
+int SPIFLASH_pool_release(spiflash_pool_t *pool, uint32_t addr);
+
+/**
+ * Erases free sectors, fewest erases first, until target sectors are ready.
+ * In asynchronous mode, this submits a background erase, and the next one
+ * is submitted when it finishes. Call to go on after pool.res reported a
+ * failed erase, or after SPIFLASH_ERR_QUEUE_FULL. In synchronous mode, this
+ * is the only way sectors are erased, and it blocks until done, so call it
+ * in idle time.
+ *
+ * @param pool  pointer to the pool struct.
+ * @return error code or SPIFLASH_OK.
+ */
+int SPIFLASH_pool_refill(spiflash_pool_t *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*SPIFLASH_POOL_H_*/
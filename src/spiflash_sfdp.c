@@ -0,0 +1,265 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Peter Andersson (pelleplutt1976<at>gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * spiflash_sfdp.c
+ *
+ * @author: petera
+ */
+
+#include "spiflash_sfdp.h"
+
+#define SFDP_HDR_SZ           (16)
+#define SFDP_SIGNATURE        (0x50444653)
+#define SFDP_16MB             (16*1024*1024)
+
+// erase time units in ms, BFPT dword 10
+static const uint32_t _sfdp_erase_unit_ms[4] = { 1, 16, 128, 1000 };
+// chip erase time units in ms, BFPT dword 11
+static const uint32_t _sfdp_chip_unit_ms[4] = { 16, 256, 4000, 64000 };
+
+static uint32_t _sfdp_dw(const uint8_t *tbl, uint32_t n) {
+  // dwords are numbered from 1 as in JESD216
+  const uint8_t *p = &tbl[(n - 1) * 4];
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint8_t _sfdp_dummy(uint32_t v) {
+  // dummy clocks and mode clocks, as both are dummy cycles to the driver
+  return (v & 0x1f) + ((v >> 5) & 0x07);
+}
+
+static void _sfdp_erase_type(spiflash_config_t *cfg, spiflash_cmd_tbl_t *cmd,
+    uint8_t size_n, uint8_t opcode, uint32_t ms) {
+  uint8_t *op;
+  uint32_t *tm;
+  switch (size_n) {
+  case 12: op = &cmd->block_erase_4;  tm = &cfg->block_erase_4_ms;  break;
+  case 13: op = &cmd->block_erase_8;  tm = &cfg->block_erase_8_ms;  break;
+  case 14: op = &cmd->block_erase_16; tm = &cfg->block_erase_16_ms; break;
+  case 15: op = &cmd->block_erase_32; tm = &cfg->block_erase_32_ms; break;
+  case 16: op = &cmd->block_erase_64; tm = &cfg->block_erase_64_ms; break;
+  default: return;
+  }
+  *op = opcode;
+  if (ms) *tm = ms;
+}
+
+int SPIFLASH_sfdp_parse(const uint8_t *bfpt, uint32_t dwords,
+    spiflash_config_t *cfg, spiflash_cmd_tbl_t *cmd) {
+  uint32_t dw1, dw2, dw3, dw4, dw10 = 0;
+  uint32_t i;
+  uint8_t erase_types = 0;
+  if (dwords < 9) {
+    return SPIFLASH_ERR_UNSUPPORTED;
+  }
+  dw1 = _sfdp_dw(bfpt, 1);
+  dw2 = _sfdp_dw(bfpt, 2);
+  dw3 = _sfdp_dw(bfpt, 3);
+  dw4 = _sfdp_dw(bfpt, 4);
+
+  // density in bits
+  if (dw2 & 0x80000000) {
+    uint32_t n = dw2 & 0x7fffffff;
+    if (n < 3 || n > 34) {
+      return SPIFLASH_ERR_UNSUPPORTED;
+    }
+    cfg->sz = (uint32_t)1 << (n - 3);
+  } else {
+    cfg->sz = (dw2 >> 3) + 1;
+  }
+
+  // address bytes
+  switch ((dw1 >> 17) & 0x03) {
+  case 2:
+    cfg->addr_sz = 4;
+    break;
+  case 1:
+    // beyond 16 MB by the 4 byte commands, if there are any
+    cfg->addr_sz = 3;
+    if (cfg->sz > SFDP_16MB && cmd->read_data_4b == 0x00) cfg->sz = SFDP_16MB;
+    break;
+  default:
+    cfg->addr_sz = 3;
+    break;
+  }
+
+  // dual and quad reads
+  cmd->read_data_dual_out = (dw1 & (1<<16)) ? (dw4 >> 8) & 0xff : 0x00;
+  cmd->read_data_dual_out_dummy = (dw1 & (1<<16)) ? _sfdp_dummy(dw4) : 0;
+  cmd->read_data_dual_io = (dw1 & (1<<20)) ? (dw4 >> 24) & 0xff : 0x00;
+  cmd->read_data_dual_io_dummy = (dw1 & (1<<20)) ? _sfdp_dummy(dw4 >> 16) : 0;
+  cmd->read_data_quad_out = (dw1 & (1<<22)) ? (dw3 >> 24) & 0xff : 0x00;
+  cmd->read_data_quad_out_dummy = (dw1 & (1<<22)) ? _sfdp_dummy(dw3 >> 16) : 0;
+  cmd->read_data_quad_io = (dw1 & (1<<21)) ? (dw3 >> 8) & 0xff : 0x00;
+  cmd->read_data_quad_io_dummy = (dw1 & (1<<21)) ? _sfdp_dummy(dw3) : 0;
+
+  // erase types, with typical times from dword 10 if present
+  if (dwords >= 10) {
+    dw10 = _sfdp_dw(bfpt, 10);
+  }
+  for (i = 0; i < 4; i++) {
+    uint32_t dw = _sfdp_dw(bfpt, 8 + i / 2) >> ((i & 1) * 16);
+    uint32_t ms = 0;
+    if ((dw & 0xff) == 0) continue;
+    if (erase_types == 0) {
+      cmd->block_erase_4 = 0x00;
+      cmd->block_erase_8 = 0x00;
+      cmd->block_erase_16 = 0x00;
+      cmd->block_erase_32 = 0x00;
+      cmd->block_erase_64 = 0x00;
+    }
+    erase_types++;
+    if (dw10) {
+      uint32_t t = dw10 >> (4 + i * 7);
+      ms = ((t & 0x1f) + 1) * _sfdp_erase_unit_ms[(t >> 5) & 0x03];
+    }
+    _sfdp_erase_type(cfg, cmd, dw & 0xff, (dw >> 8) & 0xff, ms);
+  }
+  if (erase_types == 0 && (dw1 & 0x03) == 0x01) {
+    _sfdp_erase_type(cfg, cmd, 12, (dw1 >> 8) & 0xff, 0);
+  }
+
+  // page size, page program and chip erase times
+  if (dwords >= 11) {
+    uint32_t dw11 = _sfdp_dw(bfpt, 11);
+    uint32_t us = (((dw11 >> 8) & 0x1f) + 1) * ((dw11 & (1<<13)) ? 64 : 8);
+    cfg->page_sz = 1 << ((dw11 >> 4) & 0x0f);
+    cfg->page_program_us = us;
+    cfg->page_program_ms = (us + 999) / 1000;
+    cfg->chip_erase_ms = (((dw11 >> 24) & 0x1f) + 1) *
+        _sfdp_chip_unit_ms[(dw11 >> 29) & 0x03];
+  }
+
+  // quad enable requirements, only the variants writing a single register
+  if (dwords >= 15) {
+    switch ((_sfdp_dw(bfpt, 15) >> 20) & 0x07) {
+    case 0:
+      cmd->qe_bit = 0x00;
+      break;
+    case 2:
+      // bit 6 of sr1
+      cmd->qe_bit = 0x40;
+      cmd->qe_read_reg = 0x00;
+      cmd->qe_write_reg = 0x00;
+      break;
+    case 3:
+      // bit 7 of sr2, read by 0x3f and written by 0x3e
+      cmd->qe_bit = 0x80;
+      cmd->qe_read_reg = 0x3f;
+      cmd->qe_write_reg = 0x3e;
+      break;
+    case 6:
+      // bit 1 of sr2, read by 0x35 and written by 0x31
+      cmd->qe_bit = 0x02;
+      cmd->qe_read_reg = 0x35;
+      cmd->qe_write_reg = 0x31;
+      break;
+    default:
+      // sr2 written together with sr1 by write_sr, left as configured
+      break;
+    }
+  }
+
+  return SPIFLASH_OK;
+}
+
+static void _sfdp_4bait(const uint8_t *tbl, const uint8_t *bfpt,
+    spiflash_cmd_tbl_t *cmd) {
+  // 4 byte address instruction table: supported commands and erase opcodes
+  uint32_t dw1 = _sfdp_dw(tbl, 1);
+  uint32_t dw2 = _sfdp_dw(tbl, 2);
+  uint32_t i;
+  cmd->read_data_4b = (dw1 & (1<<0)) ? 0x13 : 0x00;
+  cmd->read_data_fast_4b = (dw1 & (1<<1)) ? 0x0c : 0x00;
+  cmd->read_data_dual_out_4b = (dw1 & (1<<2)) ? 0x3c : 0x00;
+  cmd->read_data_dual_io_4b = (dw1 & (1<<3)) ? 0xbc : 0x00;
+  cmd->read_data_quad_out_4b = (dw1 & (1<<4)) ? 0x6c : 0x00;
+  cmd->read_data_quad_io_4b = (dw1 & (1<<5)) ? 0xec : 0x00;
+  cmd->page_program_4b = (dw1 & (1<<6)) ? 0x12 : 0x00;
+  cmd->page_program_quad_in_4b = (dw1 & (1<<7)) ? 0x34 : 0x00;
+  cmd->block_erase_4_4b = 0x00;
+  cmd->block_erase_32_4b = 0x00;
+  cmd->block_erase_64_4b = 0x00;
+  for (i = 0; i < 4; i++) {
+    uint8_t size_n = (_sfdp_dw(bfpt, 8 + i / 2) >> ((i & 1) * 16)) & 0xff;
+    uint8_t opcode = (dw2 >> (i * 8)) & 0xff;
+    if ((dw1 & (1 << (9 + i))) == 0) continue;
+    if (size_n == 12) cmd->block_erase_4_4b = opcode;
+    else if (size_n == 15) cmd->block_erase_32_4b = opcode;
+    else if (size_n == 16) cmd->block_erase_64_4b = opcode;
+  }
+}
+
+int SPIFLASH_sfdp_discover(spiflash_t *spi, spiflash_config_t *cfg,
+    spiflash_cmd_tbl_t *cmd) {
+  uint8_t hdr[SFDP_HDR_SZ];
+  uint8_t bfpt[SPIFLASH_SFDP_BFPT_DWORDS * 4];
+  uint8_t tbl[8];
+  uint32_t dwords, ptr, i;
+  int res;
+  if (spi->async) {
+    return SPIFLASH_ERR_BAD_CONFIG;
+  }
+  // sfdp header and first parameter header, which is the basic table
+  res = SPIFLASH_read_sfdp(spi, 0, SFDP_HDR_SZ, hdr);
+  if (res != SPIFLASH_OK) {
+    return res;
+  }
+  if (_sfdp_dw(hdr, 1) != SFDP_SIGNATURE || hdr[8] != 0x00 || hdr[15] != 0xff) {
+    return SPIFLASH_ERR_UNSUPPORTED;
+  }
+  dwords = hdr[11];
+  if (dwords < 9) {
+    return SPIFLASH_ERR_UNSUPPORTED;
+  }
+  if (dwords > SPIFLASH_SFDP_BFPT_DWORDS) dwords = SPIFLASH_SFDP_BFPT_DWORDS;
+  ptr = hdr[12] | (hdr[13] << 8) | (hdr[14] << 16);
+  res = SPIFLASH_read_sfdp(spi, ptr, dwords * 4, bfpt);
+  if (res != SPIFLASH_OK) {
+    return res;
+  }
+  // look for the 4 byte address instruction table among the other headers
+  for (i = 1; i <= hdr[6]; i++) {
+    res = SPIFLASH_read_sfdp(spi, 8 + i * 8, 8, tbl);
+    if (res != SPIFLASH_OK) {
+      return res;
+    }
+    if (tbl[0] == 0x84 && tbl[7] == 0xff && tbl[3] >= 2) {
+      ptr = tbl[4] | (tbl[5] << 8) | (tbl[6] << 16);
+      res = SPIFLASH_read_sfdp(spi, ptr, 8, tbl);
+      if (res != SPIFLASH_OK) {
+        return res;
+      }
+      _sfdp_4bait(tbl, bfpt, cmd);
+      break;
+    }
+  }
+  res = SPIFLASH_sfdp_parse(bfpt, dwords, cfg, cmd);
+  if (res != SPIFLASH_OK) {
+    return res;
+  }
+  spi->cfg = cfg;
+  spi->cmd_tbl = cmd;
+  return SPIFLASH_OK;
+}
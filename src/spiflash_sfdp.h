@@ -0,0 +1,94 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Peter Andersson (pelleplutt1976<at>gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+/**
+ * spiflash_sfdp.h
+ *
+ * Fills in the spi flash config and command table from the serial flash
+ * discoverable parameters (SFDP, JESD216) of the device.
+ *
+ * @author: petera
+ */
+
+#ifndef SPIFLASH_SFDP_H_
+#define SPIFLASH_SFDP_H_
+
+#include "spiflash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Number of dwords of the basic flash parameter table used, see
+ * SPIFLASH_sfdp_parse.
+ */
+#define SPIFLASH_SFDP_BFPT_DWORDS     (16)
+
+/**
+ * Reads the SFDP header and basic flash parameter table of the device, and
+ * updates cfg and cmd with SPIFLASH_sfdp_parse. If the device has a 4 byte
+ * address instruction table, the 4 byte commands of cmd are taken from it.
+ * The spi flash is then set to use cfg and cmd. Only in synchronous mode, and
+ * with no operation ongoing, typically at startup after
+ * SPIFLASH_read_jedec_id. For a spi flash used asynchronously later on, call
+ * SPIFLASH_init with SPIFLASH_SYNCHRONOUS first and again with
+ * SPIFLASH_ASYNCHRONOUS after discovery.
+ *
+ * @param spi      pointer to the spi flash driver struct, initiated with a
+ *                 config and command table good enough for reading SFDP,
+ *                 e.g. SPIFLASH_CMD_TBL_STANDARD.
+ * @param cfg      config to update, prefilled with values not found in SFDP
+ *                 such as sr_write_ms, lanes and addr_endian.
+ * @param cmd      command table to update, prefilled with commands not found
+ *                 in SFDP, e.g. from SPIFLASH_CMD_TBL_STANDARD.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_UNSUPPORTED if the device
+ *         has no valid SFDP. SPIFLASH_ERR_BAD_CONFIG if asynchronous.
+ */
+int SPIFLASH_sfdp_discover(spiflash_t *spi, spiflash_config_t *cfg,
+    spiflash_cmd_tbl_t *cmd);
+
+/**
+ * Updates cfg and cmd from a basic flash parameter table (BFPT) read from
+ * SFDP. Size, page size, erase commands and typical times, page program and
+ * chip erase typical times, dual and quad read commands with dummy cycles,
+ * quad enable bit and address size are taken from the table, as far as the
+ * table revision has them. Erase commands of sizes not listed are cleared.
+ * Devices with both 3 and 4 byte addressing are used with 3 byte addresses,
+ * and beyond 16 MB by the 4 byte commands of cmd. If cmd has no read_data_4b,
+ * the size is capped at 16 MB.
+ *
+ * @param bfpt     the table, as read from the device.
+ * @param dwords   number of dwords in the table, at least 9.
+ * @param cfg      config to update.
+ * @param cmd      command table to update.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_UNSUPPORTED if the table
+ *         is too short or describes a device larger than 4 GB.
+ */
+int SPIFLASH_sfdp_parse(const uint8_t *bfpt, uint32_t dwords,
+    spiflash_config_t *cfg, spiflash_cmd_tbl_t *cmd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*SPIFLASH_SFDP_H_*/
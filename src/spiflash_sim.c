@@ -0,0 +1,832 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Peter Andersson (pelleplutt1976<at>gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * spiflash_sim.c
+ *
+ * @author: petera
+ */
+
+#include "spiflash_sim.h"
+#include <stddef.h>
+
+#define SIM_WEL         (0x02)
+#define SIM_SUSPEND_NS  (20000)
+
+#define SIM_PH_CMD      0
+#define SIM_PH_ADDR     1
+#define SIM_PH_DUMMY    2
+#define SIM_PH_DATA     3
+
+#define SIM_NONE        0
+#define SIM_WREN        1
+#define SIM_WRDI        2
+#define SIM_RDSR        3
+#define SIM_RDSR2       4
+#define SIM_WRSR        5
+#define SIM_WRSR2       6
+#define SIM_JEDEC       7
+#define SIM_READ        8
+#define SIM_SFDP        9
+#define SIM_PROG        10
+#define SIM_ERASE       11
+#define SIM_CHIP        12
+#define SIM_SUSPEND     13
+#define SIM_RESUME      14
+#define SIM_WRAP        15
+#define SIM_BAD         16
+
+// address bytes, cfg.addr_sz if SIM_ADDR_CFG
+#define SIM_ADDR_CFG    0xff
+// dummy cycles, taken from the command table if SIM_DUMMY_TBL
+#define SIM_DUMMY_TBL   0xff
+
+typedef struct {
+  uint8_t cmd_ofs;
+  uint8_t op;
+  uint8_t addr;
+  uint8_t addr_lanes;
+  uint8_t data_lanes;
+  uint8_t dummy;
+  uint8_t dummy_ofs;
+  uint32_t erase_sz;
+} _sim_cmd_t;
+
+#define _C(_f)  offsetof(spiflash_cmd_tbl_t, _f)
+
+static const _sim_cmd_t _sim_cmds[] = {
+  { _C(write_enable),            SIM_WREN,    0, 1, 1, 0, 0, 0 },
+  { _C(write_disable),           SIM_WRDI,    0, 1, 1, 0, 0, 0 },
+  { _C(read_sr),                 SIM_RDSR,    0, 1, 1, 0, 0, 0 },
+  { _C(qe_read_reg),             SIM_RDSR2,   0, 1, 1, 0, 0, 0 },
+  { _C(write_sr),                SIM_WRSR,    0, 1, 1, 0, 0, 0 },
+  { _C(qe_write_reg),            SIM_WRSR2,   0, 1, 1, 0, 0, 0 },
+  { _C(jedec_id),                SIM_JEDEC,   0, 1, 1, 0, 0, 0 },
+  { _C(read_sfdp),               SIM_SFDP,    3, 1, 1, 8, 0, 0 },
+  { _C(read_data),               SIM_READ,    SIM_ADDR_CFG, 1, 1, 0, 0, 0 },
+  { _C(read_data_fast),          SIM_READ,    SIM_ADDR_CFG, 1, 1, 8, 0, 0 },
+  { _C(read_data_dual_out),      SIM_READ,    SIM_ADDR_CFG, 1, 2, SIM_DUMMY_TBL, _C(read_data_dual_out_dummy), 0 },
+  { _C(read_data_dual_io),       SIM_READ,    SIM_ADDR_CFG, 2, 2, SIM_DUMMY_TBL, _C(read_data_dual_io_dummy), 0 },
+  { _C(read_data_quad_out),      SIM_READ,    SIM_ADDR_CFG, 1, 4, SIM_DUMMY_TBL, _C(read_data_quad_out_dummy), 0 },
+  { _C(read_data_quad_io),       SIM_READ,    SIM_ADDR_CFG, 4, 4, SIM_DUMMY_TBL, _C(read_data_quad_io_dummy), 0 },
+  { _C(read_data_4b),            SIM_READ,    4, 1, 1, 0, 0, 0 },
+  { _C(read_data_fast_4b),       SIM_READ,    4, 1, 1, 8, 0, 0 },
+  { _C(read_data_dual_out_4b),   SIM_READ,    4, 1, 2, SIM_DUMMY_TBL, _C(read_data_dual_out_dummy), 0 },
+  { _C(read_data_dual_io_4b),    SIM_READ,    4, 2, 2, SIM_DUMMY_TBL, _C(read_data_dual_io_dummy), 0 },
+  { _C(read_data_quad_out_4b),   SIM_READ,    4, 1, 4, SIM_DUMMY_TBL, _C(read_data_quad_out_dummy), 0 },
+  { _C(read_data_quad_io_4b),    SIM_READ,    4, 4, 4, SIM_DUMMY_TBL, _C(read_data_quad_io_dummy), 0 },
+  { _C(page_program),            SIM_PROG,    SIM_ADDR_CFG, 1, 1, 0, 0, 0 },
+  { _C(page_program_quad_in),    SIM_PROG,    SIM_ADDR_CFG, 1, 4, 0, 0, 0 },
+  { _C(page_program_quad_io),    SIM_PROG,    SIM_ADDR_CFG, 4, 4, 0, 0, 0 },
+  { _C(page_program_4b),         SIM_PROG,    4, 1, 1, 0, 0, 0 },
+  { _C(page_program_quad_in_4b), SIM_PROG,    4, 1, 4, 0, 0, 0 },
+  { _C(block_erase_4),           SIM_ERASE,   SIM_ADDR_CFG, 1, 1, 0, 0, 4*1024 },
+  { _C(block_erase_8),           SIM_ERASE,   SIM_ADDR_CFG, 1, 1, 0, 0, 8*1024 },
+  { _C(block_erase_16),          SIM_ERASE,   SIM_ADDR_CFG, 1, 1, 0, 0, 16*1024 },
+  { _C(block_erase_32),          SIM_ERASE,   SIM_ADDR_CFG, 1, 1, 0, 0, 32*1024 },
+  { _C(block_erase_64),          SIM_ERASE,   SIM_ADDR_CFG, 1, 1, 0, 0, 64*1024 },
+  { _C(block_erase_4_4b),        SIM_ERASE,   4, 1, 1, 0, 0, 4*1024 },
+  { _C(block_erase_32_4b),       SIM_ERASE,   4, 1, 1, 0, 0, 32*1024 },
+  { _C(block_erase_64_4b),       SIM_ERASE,   4, 1, 1, 0, 0, 64*1024 },
+  { _C(chip_erase),              SIM_CHIP,    0, 1, 1, 0, 0, 0 },
+  { _C(suspend),                 SIM_SUSPEND, 0, 1, 1, 0, 0, 0 },
+  { _C(resume),                  SIM_RESUME,  0, 1, 1, 0, 0, 0 },
+  { _C(set_burst_wrap),          SIM_WRAP,    0, 1, 4, 0, 0, 0 },
+};
+
+static void _sim_error(spiflash_sim_t *sim, const char *what) {
+  SPIF_DBG("sim - error: %s, cmd %02x\n", what, sim->code);
+  sim->errors++;
+  sim->error = what;
+}
+
+static int _sim_busy(spiflash_sim_t *sim) {
+  return sim->now_ns < sim->busy_until_ns;
+}
+
+static void _sim_set_busy(spiflash_sim_t *sim, uint32_t typ_us) {
+  sim->busy_until_ns = sim->now_ns +
+      (uint64_t)typ_us * sim->busy_pct * 1000 / 100;
+}
+
+static void _sim_clock(spiflash_sim_t *sim, uint32_t cycles) {
+  uint64_t ns = (uint64_t)cycles * 1000000 / sim->clk_khz;
+  sim->now_ns += ns;
+  sim->bus_ns += ns;
+}
+
+static int _sim_qe(spiflash_sim_t *sim) {
+  uint8_t reg = sim->cmd->qe_read_reg ? sim->sr2 : sim->sr;
+  return !sim->qe_required || (reg & sim->cmd->qe_bit);
+}
+
+static uint32_t _sim_erase_us(spiflash_sim_t *sim, uint32_t sz) {
+  switch (sz) {
+  case 4*1024: return sim->cfg->block_erase_4_ms * 1000;
+  case 8*1024: return sim->cfg->block_erase_8_ms * 1000;
+  case 16*1024: return sim->cfg->block_erase_16_ms * 1000;
+  case 32*1024: return sim->cfg->block_erase_32_ms * 1000;
+  default: return sim->cfg->block_erase_64_ms * 1000;
+  }
+}
+
+static void _sim_decode(spiflash_sim_t *sim, uint8_t code) {
+  const uint8_t *tbl = (const uint8_t *)sim->cmd;
+  uint32_t i;
+  sim->code = code;
+  sim->op = SIM_BAD;
+  for (i = 0; i < sizeof(_sim_cmds) / sizeof(_sim_cmds[0]); i++) {
+    const _sim_cmd_t *c = &_sim_cmds[i];
+    if (code == 0x00 || tbl[c->cmd_ofs] != code) continue;
+    sim->op = c->op;
+    sim->addr_len = c->addr == SIM_ADDR_CFG ? sim->cfg->addr_sz : c->addr;
+    // address dummy bytes follow the address of all addressed commands
+    // but read_sfdp
+    sim->addr_dummy = c->addr == 0 || c->op == SIM_SFDP ?
+        0 : sim->cfg->addr_dummy_sz;
+    sim->addr_lanes = c->addr_lanes;
+    sim->data_lanes = c->data_lanes;
+    sim->dummy_exp = c->dummy == SIM_DUMMY_TBL ? tbl[c->dummy_ofs] : c->dummy;
+    sim->erase_sz = c->erase_sz;
+    break;
+  }
+  if (sim->op == SIM_BAD) {
+    _sim_error(sim, "unknown command");
+  } else if (_sim_busy(sim) && sim->op != SIM_RDSR && sim->op != SIM_RDSR2 &&
+      sim->op != SIM_SUSPEND && sim->op != SIM_RESUME) {
+    _sim_error(sim, "command while busy");
+  } else if (sim->data_lanes == 4 && !_sim_qe(sim)) {
+    _sim_error(sim, "quad command without quad enable");
+  }
+  sim->phase = sim->addr_len ? SIM_PH_ADDR : SIM_PH_DATA;
+}
+
+static void _sim_addr_done(spiflash_sim_t *sim) {
+  sim->pos = sim->addr % sim->cfg->sz;
+  sim->phase = sim->op == SIM_READ || sim->op == SIM_SFDP ?
+      SIM_PH_DUMMY : SIM_PH_DATA;
+  if (sim->op == SIM_PROG) {
+    if (!sim->wel) {
+      _sim_error(sim, "program without write enable");
+    } else if (sim->suspended) {
+      _sim_error(sim, "program while suspended");
+    }
+  }
+}
+
+static void _sim_tx_byte(spiflash_sim_t *sim, uint8_t b, uint8_t lanes) {
+  switch (sim->phase) {
+  case SIM_PH_CMD:
+    if (lanes != 1) _sim_error(sim, "command lanes");
+    _sim_decode(sim, b);
+    break;
+  case SIM_PH_ADDR:
+    if (lanes != sim->addr_lanes) _sim_error(sim, "address lanes");
+    if (sim->addr_got < sim->addr_len) {
+      if (sim->cfg->addr_endian == SPIFLASH_ENDIANNESS_LITTLE) {
+        sim->addr |= (uint32_t)b << (8 * sim->addr_got);
+      } else {
+        sim->addr = (sim->addr << 8) | b;
+      }
+    }
+    if (++sim->addr_got == sim->addr_len + sim->addr_dummy) {
+      _sim_addr_done(sim);
+    }
+    break;
+  case SIM_PH_DUMMY:
+    // mode bits or dummy bytes, on the address lanes
+    if (lanes != sim->addr_lanes) _sim_error(sim, "dummy lanes");
+    if (sim->dummy == 0) {
+      sim->mode = b;
+      sim->mode_got = 1;
+    }
+    sim->dummy += 8 / lanes;
+    break;
+  case SIM_PH_DATA:
+    if (lanes != sim->data_lanes) _sim_error(sim, "data lanes");
+    if (sim->op == SIM_PROG) {
+      uint32_t page_sz = sim->cfg->page_sz;
+      uint32_t a = (sim->pos & ~(page_sz - 1)) + ((sim->pos + sim->cnt) & (page_sz - 1));
+      if (sim->cnt == page_sz) _sim_error(sim, "page overflow");
+      if (sim->wel && !sim->suspended) sim->mem[a] &= b;
+    } else if (sim->op == SIM_WRSR || sim->op == SIM_WRSR2) {
+      if (sim->cnt < sizeof(sim->sr_new)) sim->sr_new[sim->cnt] = b;
+    } else if (sim->op == SIM_WRAP) {
+      // three dummy bytes and the wrap bits
+      if (sim->cnt == 3) sim->wrap_bits = b;
+    } else {
+      _sim_error(sim, "unexpected data");
+    }
+    sim->cnt++;
+    break;
+  }
+}
+
+static uint8_t _sim_rx_byte(spiflash_sim_t *sim, uint8_t lanes) {
+  uint8_t b = 0xff;
+  if (sim->phase == SIM_PH_DUMMY) {
+    if (sim->dummy != sim->dummy_exp) _sim_error(sim, "dummy cycles");
+    sim->phase = SIM_PH_DATA;
+  } else if (sim->phase != SIM_PH_DATA) {
+    _sim_error(sim, "read before address");
+    return b;
+  }
+  if (lanes != sim->data_lanes) _sim_error(sim, "data lanes");
+  switch (sim->op) {
+  case SIM_RDSR:
+    b = sim->sr | (sim->wel ? SIM_WEL : 0) | (_sim_busy(sim) ? sim->cmd->sr_busy_bit : 0);
+    break;
+  case SIM_RDSR2:
+    b = sim->sr2;
+    break;
+  case SIM_JEDEC:
+    b = (sim->jedec_id >> (8 * (2 - sim->cnt % 3))) & 0xff;
+    break;
+  case SIM_SFDP:
+    if (sim->sfdp && sim->addr + sim->cnt < sim->sfdp_len) {
+      b = sim->sfdp[sim->addr + sim->cnt];
+    }
+    break;
+  case SIM_READ:
+    if (sim->suspended && sim->pos - sim->busy_addr < sim->busy_sz) {
+      _sim_error(sim, "read of suspended block");
+    }
+    b = sim->mem[sim->pos];
+    if (sim->wrap && sim->addr_lanes == 4) {
+      // quad i/o reads wrap within the line
+      sim->pos = (sim->pos & ~(sim->wrap - 1)) | ((sim->pos + 1) & (sim->wrap - 1));
+    } else {
+      sim->pos = (sim->pos + 1) % sim->cfg->sz;
+    }
+    break;
+  default:
+    _sim_error(sim, "unexpected read");
+    break;
+  }
+  sim->cnt++;
+  return b;
+}
+
+static void _sim_tx(spiflash_sim_t *sim, const uint8_t *buf, uint32_t len,
+    uint8_t lanes) {
+  uint32_t i;
+  for (i = 0; i < len; i++) {
+    _sim_tx_byte(sim, buf[i], lanes);
+  }
+  _sim_clock(sim, len * 8 / lanes);
+}
+
+static void _sim_rx(spiflash_sim_t *sim, uint8_t *buf, uint32_t len,
+    uint8_t lanes) {
+  uint32_t i;
+  for (i = 0; i < len; i++) {
+    buf[i] = _sim_rx_byte(sim, lanes);
+  }
+  _sim_clock(sim, len * 8 / lanes);
+}
+
+static void _sim_cs_begin(spiflash_sim_t *sim) {
+  sim->addr = 0;
+  sim->addr_got = 0;
+  sim->dummy = 0;
+  sim->mode_got = 0;
+  sim->cnt = 0;
+  if (sim->cont) {
+    // continuous read mode, the command is left out
+    if (_sim_busy(sim)) _sim_error(sim, "command while busy");
+    sim->phase = SIM_PH_ADDR;
+  } else {
+    sim->op = SIM_NONE;
+    sim->phase = SIM_PH_CMD;
+  }
+}
+
+static void _sim_cs_end(spiflash_sim_t *sim) {
+  const spiflash_config_t *cfg = sim->cfg;
+  if (sim->op == SIM_READ) {
+    // the mode bits decide whether the next read leaves out the command
+    sim->cont = sim->addr_lanes > 1 && sim->mode_got &&
+        sim->cmd->xip_mode_bits && sim->mode == sim->cmd->xip_mode_bits;
+    return;
+  }
+  if (sim->phase == SIM_PH_ADDR) {
+    if (sim->op != SIM_NONE && sim->op != SIM_BAD) {
+      _sim_error(sim, "address cut short");
+    }
+    return;
+  }
+  switch (sim->op) {
+  case SIM_WREN:
+    if (!_sim_busy(sim)) sim->wel = 1;
+    break;
+  case SIM_WRDI:
+    sim->wel = 0;
+    break;
+  case SIM_WRSR:
+  case SIM_WRSR2:
+    if (!sim->wel) {
+      _sim_error(sim, "status write without write enable");
+      break;
+    }
+    if (sim->cnt == 0) break;
+    if (sim->op == SIM_WRSR) {
+      sim->sr = sim->sr_new[0] & ~(SIM_WEL | sim->cmd->sr_busy_bit);
+      if (sim->cnt > 1) sim->sr2 = sim->sr_new[1];
+    } else {
+      sim->sr2 = sim->sr_new[0];
+    }
+    sim->wel = 0;
+    _sim_set_busy(sim, cfg->sr_write_ms * 1000);
+    break;
+  case SIM_PROG:
+    if (!sim->wel || sim->suspended) break;
+    if (sim->cnt == 0) _sim_error(sim, "program without data");
+    sim->wel = 0;
+    sim->programs++;
+    sim->busy_addr = sim->pos & ~(cfg->page_sz - 1);
+    sim->busy_sz = cfg->page_sz;
+    _sim_set_busy(sim, cfg->page_program_us ?
+        cfg->page_program_us : cfg->page_program_ms * 1000);
+    break;
+  case SIM_ERASE:
+  case SIM_CHIP: {
+    uint32_t a = 0, sz = cfg->sz;
+    if (!sim->wel) {
+      _sim_error(sim, "erase without write enable");
+      break;
+    }
+    if (sim->suspended) {
+      _sim_error(sim, "erase while suspended");
+      break;
+    }
+    if (sim->op == SIM_ERASE) {
+      // the block holding the address is erased
+      sz = sim->erase_sz;
+      if (sim->pos & (sz - 1)) _sim_error(sim, "erase unaligned");
+      a = sim->pos & ~(sz - 1);
+    }
+    memset(&sim->mem[a], 0xff, sz);
+    sim->wel = 0;
+    sim->erases++;
+    sim->busy_addr = a;
+    sim->busy_sz = sz;
+    _sim_set_busy(sim, sim->op == SIM_ERASE ?
+        _sim_erase_us(sim, sz) : cfg->chip_erase_ms * 1000);
+    break;
+  }
+  case SIM_SUSPEND:
+    if (_sim_busy(sim) && !sim->suspended) {
+      sim->suspended = 1;
+      sim->sus_left_ns = sim->busy_until_ns - sim->now_ns;
+      sim->busy_until_ns = sim->now_ns + SIM_SUSPEND_NS;
+    }
+    break;
+  case SIM_RESUME:
+    if (sim->suspended) {
+      sim->suspended = 0;
+      sim->busy_until_ns = sim->now_ns + sim->sus_left_ns;
+    }
+    break;
+  case SIM_WRAP:
+    if (sim->cnt != 4) {
+      _sim_error(sim, "burst wrap length");
+      break;
+    }
+    sim->wrap = (sim->wrap_bits & 0x10) ? 0 : 8 << ((sim->wrap_bits >> 5) & 3);
+    break;
+  default:
+    break;
+  }
+}
+
+static void _sim_done(spiflash_t *spi) {
+  if (spi->async) ((spiflash_sim_t *)spi->user_data)->pending = 1;
+}
+
+static void _sim_xfer(spiflash_sim_t *sim, const spiflash_xfer_t *xfer) {
+  uint8_t cmd_lanes = xfer->cmd_lanes ? xfer->cmd_lanes : 1;
+  uint8_t addr_lanes = xfer->addr_lanes ? xfer->addr_lanes : 1;
+  uint8_t data_lanes = xfer->data_lanes ? xfer->data_lanes : 1;
+  sim->xfers++;
+  if (!sim->cs) _sim_error(sim, "transfer without cs");
+  if (xfer->cmd_len + xfer->addr_len + xfer->mode_len) {
+    _sim_tx(sim, xfer->hdr, xfer->cmd_len, cmd_lanes);
+    _sim_tx(sim, xfer->hdr + xfer->cmd_len, xfer->addr_len + xfer->mode_len,
+        addr_lanes);
+  }
+  if (xfer->dummy_cycles) {
+    if (sim->phase != SIM_PH_DUMMY) {
+      _sim_error(sim, "unexpected dummy cycles");
+    } else {
+      // data lines are kept high, as if mode bits 0xff
+      if (sim->dummy == 0) {
+        sim->mode = 0xff;
+        sim->mode_got = 1;
+      }
+      sim->dummy += xfer->dummy_cycles;
+    }
+    _sim_clock(sim, xfer->dummy_cycles);
+  }
+  _sim_tx(sim, xfer->tx_data, xfer->tx_len, data_lanes);
+  _sim_rx(sim, xfer->rx_data, xfer->rx_len, data_lanes);
+}
+
+static int _sim_hal_txrx(spiflash_t *spi, const uint8_t *tx_data,
+    uint32_t tx_len, uint8_t *rx_data, uint32_t rx_len) {
+  spiflash_sim_t *sim = (spiflash_sim_t *)spi->user_data;
+  sim->xfers++;
+  if (!sim->cs) _sim_error(sim, "transfer without cs");
+  _sim_tx(sim, tx_data, tx_len, 1);
+  _sim_rx(sim, rx_data, rx_len, 1);
+  _sim_done(spi);
+  return SPIFLASH_OK;
+}
+
+static void _sim_hal_cs(spiflash_t *spi, uint8_t cs) {
+  spiflash_sim_t *sim = (spiflash_sim_t *)spi->user_data;
+  if (cs && !sim->cs) {
+    _sim_cs_begin(sim);
+  } else if (!cs && sim->cs) {
+    _sim_cs_end(sim);
+  }
+  sim->cs = cs;
+}
+
+static void _sim_hal_wait(spiflash_t *spi, uint32_t ms) {
+  spiflash_sim_t *sim = (spiflash_sim_t *)spi->user_data;
+  if (ms == 0) {
+    // busy pin
+    if (sim->busy_until_ns > sim->now_ns) sim->now_ns = sim->busy_until_ns;
+  } else {
+    sim->now_ns += (uint64_t)ms * 1000000;
+  }
+  _sim_done(spi);
+}
+
+static int _sim_hal_txrx_lanes(spiflash_t *spi, const spiflash_xfer_t *xfer) {
+  _sim_xfer((spiflash_sim_t *)spi->user_data, xfer);
+  _sim_done(spi);
+  return SPIFLASH_OK;
+}
+
+static int _sim_hal_txrx_chain(spiflash_t *spi, const spiflash_xfer_t *xfer) {
+  for (; xfer; xfer = xfer->next) {
+    _sim_xfer((spiflash_sim_t *)spi->user_data, xfer);
+  }
+  _sim_done(spi);
+  return SPIFLASH_OK;
+}
+
+static void _sim_hal_wait_us(spiflash_t *spi, uint32_t us) {
+  spiflash_sim_t *sim = (spiflash_sim_t *)spi->user_data;
+  sim->now_ns += (uint64_t)us * 1000;
+  _sim_done(spi);
+}
+
+static int _sim_hal_wait_ready(spiflash_t *spi, const spiflash_poll_t *poll) {
+  spiflash_sim_t *sim = (spiflash_sim_t *)spi->user_data;
+  if (poll->cmd != sim->cmd->read_sr || poll->mask != sim->cmd->sr_busy_bit) {
+    _sim_error(sim, "poll description");
+  }
+  if (sim->busy_until_ns > sim->now_ns) sim->now_ns = sim->busy_until_ns;
+  _sim_done(spi);
+  return SPIFLASH_OK;
+}
+
+static int _sim_hal_rx_crc32(spiflash_t *spi, const spiflash_xfer_t *xfer,
+    uint32_t *crc) {
+  spiflash_sim_t *sim = (spiflash_sim_t *)spi->user_data;
+  spiflash_xfer_t hdr = *xfer;
+  uint8_t data_lanes = xfer->data_lanes ? xfer->data_lanes : 1;
+  uint8_t buf[64];
+  uint32_t left = xfer->rx_len;
+  hdr.rx_len = 0;
+  _sim_xfer(sim, &hdr);
+  while (left) {
+    uint32_t n = left < sizeof(buf) ? left : sizeof(buf);
+    _sim_rx(sim, buf, n, data_lanes);
+    *crc = SPIFLASH_crc32_calc(*crc, buf, n);
+    left -= n;
+  }
+  _sim_done(spi);
+  return SPIFLASH_OK;
+}
+
+static uint32_t _sim_hal_time_us(spiflash_t *spi) {
+  return (uint32_t)(((spiflash_sim_t *)spi->user_data)->now_ns / 1000);
+}
+
+const spiflash_hal_t SPIFLASH_sim_hal = {
+  ._spiflash_spi_txrx = _sim_hal_txrx,
+  ._spiflash_spi_cs = _sim_hal_cs,
+  ._spiflash_wait = _sim_hal_wait,
+  ._spiflash_spi_txrx_lanes = _sim_hal_txrx_lanes,
+  ._spiflash_spi_txrx_chain = _sim_hal_txrx_chain,
+  ._spiflash_wait_us = _sim_hal_wait_us,
+  ._spiflash_wait_ready = _sim_hal_wait_ready,
+  ._spiflash_time_us = _sim_hal_time_us,
+  ._spiflash_spi_rx_crc32 = _sim_hal_rx_crc32,
+};
+
+void SPIFLASH_sim_init(spiflash_sim_t *sim, const spiflash_config_t *cfg,
+    const spiflash_cmd_tbl_t *cmd, uint8_t *mem) {
+  memset(sim, 0, sizeof(spiflash_sim_t));
+  sim->cfg = cfg;
+  sim->cmd = cmd;
+  sim->mem = mem;
+  sim->clk_khz = 50000;
+  sim->busy_pct = 100;
+  sim->jedec_id = 0xef4018;
+  memset(mem, 0xff, cfg->sz);
+}
+
+void SPIFLASH_sim_run(spiflash_t *spi) {
+  spiflash_sim_t *sim = (spiflash_sim_t *)spi->user_data;
+  while (sim->pending) {
+    sim->pending = 0;
+    SPIFLASH_async_trigger(spi, SPIFLASH_OK);
+  }
+}
+
+#define BENCH_SZ        (256*1024)
+#define BENCH_REQS      (40)
+
+typedef struct {
+  const char *name;
+  uint64_t t0_ns;
+  uint64_t lat_ns;
+  uint64_t lat_max_ns;
+  uint32_t ops;
+  uint32_t bytes;
+} _bench_t;
+
+static uint8_t _bench_buf[4096];
+static uint8_t _bench_ref[4096];
+static uint32_t _bench_seed;
+static int _bench_res;
+static spiflash_req_t _bench_reqs[BENCH_REQS];
+// submit time of each queued request, found by its user_data
+static uint64_t _bench_submit_ns[BENCH_REQS];
+static spiflash_queue_t _bench_q;
+static spiflash_seq_t _bench_sq;
+static spiflash_suspend_t _bench_sus;
+static spiflash_op_ctx_t _bench_ctx;
+static spiflash_ctx_pool_t _bench_pool;
+static _bench_t *_bench_q_stats[3];
+
+static uint32_t _bench_rand(void) {
+  _bench_seed = _bench_seed * 1103515245 + 12345;
+  return _bench_seed >> 8;
+}
+
+static void _bench_cb(spiflash_t *spi, spiflash_op_t op, int err_code) {
+  (void)spi; (void)op;
+  if (err_code != SPIFLASH_OK) _bench_res = err_code;
+}
+
+static void _bench_start(spiflash_sim_t *sim, _bench_t *b, const char *name) {
+  memset(b, 0, sizeof(_bench_t));
+  b->name = name;
+  b->t0_ns = sim->now_ns;
+}
+
+static void _bench_add(_bench_t *b, uint64_t lat_ns, uint32_t bytes) {
+  b->ops++;
+  b->bytes += bytes;
+  b->lat_ns += lat_ns;
+  if (lat_ns > b->lat_max_ns) b->lat_max_ns = lat_ns;
+}
+
+static int _bench_end(spiflash_t *spi, _bench_t *b, int res, uint64_t t0_ns,
+    uint32_t bytes) {
+  // finish an operation and account for it
+  spiflash_sim_t *sim = (spiflash_sim_t *)spi->user_data;
+  SPIFLASH_sim_run(spi);
+  if (res == SPIFLASH_OK) res = _bench_res;
+  if (res == SPIFLASH_OK && SPIFLASH_is_busy(spi) != SPIFLASH_OK) {
+    res = SPIFLASH_ERR_INTERNAL;
+  }
+  _bench_add(b, sim->now_ns - t0_ns, bytes);
+  return res;
+}
+
+static void _bench_report(spiflash_sim_t *sim, _bench_t *b,
+    spiflash_sim_out_t out, void *user) {
+  char line[128];
+  uint64_t us = (sim->now_ns - b->t0_ns) / 1000;
+  snprintf(line, sizeof(line),
+      "%-12s %4u ops %7u bytes %9u us %7u kB/s  lat avg %8u max %8u us",
+      b->name, (unsigned)b->ops, (unsigned)b->bytes, (unsigned)us,
+      (unsigned)(us ? (uint64_t)b->bytes * 1000000 / 1024 / us : 0),
+      (unsigned)(b->ops ? b->lat_ns / b->ops / 1000 : 0),
+      (unsigned)(b->lat_max_ns / 1000));
+  out(user, line);
+}
+
+static void _bench_req_cb(spiflash_t *spi, const spiflash_req_t *req,
+    int err_code) {
+  spiflash_sim_t *sim = (spiflash_sim_t *)spi->user_data;
+  _bench_t *b = _bench_q_stats[req->type == SPIFLASH_REQ_ERASE ? 2 :
+      (req->type == SPIFLASH_REQ_WRITE ? 1 : 0)];
+  if (err_code != SPIFLASH_OK) _bench_res = err_code;
+  _bench_add(b, sim->now_ns - *(const uint64_t *)req->user_data, req->len);
+}
+
+static int _bench_submit(spiflash_t *spi, spiflash_req_t *req, uint32_t n) {
+  // submit as the n:th request, noting when
+  spiflash_sim_t *sim = (spiflash_sim_t *)spi->user_data;
+  _bench_submit_ns[n] = sim->now_ns;
+  req->user_data = &_bench_submit_ns[n];
+  return SPIFLASH_submit(spi, req);
+}
+
+static int _bench_queue(spiflash_t *spi, spiflash_sim_out_t out, void *user) {
+  // a background erase, and writes mixed with latency critical reads
+  spiflash_sim_t *sim = (spiflash_sim_t *)spi->user_data;
+  spiflash_queue_t *saved_q = spi->q;
+  _bench_t rd, wr, er;
+  spiflash_req_t req;
+  int res = SPIFLASH_OK;
+  uint32_t n = 0;
+  int i;
+  _bench_start(sim, &rd, "queue read");
+  _bench_start(sim, &wr, "queue write");
+  _bench_start(sim, &er, "queue erase");
+  _bench_q_stats[0] = &rd;
+  _bench_q_stats[1] = &wr;
+  _bench_q_stats[2] = &er;
+  SPIFLASH_queue_init(spi, &_bench_q, _bench_reqs, BENCH_REQS);
+  memset(&req, 0, sizeof(req));
+  req.cb = _bench_req_cb;
+  req.type = SPIFLASH_REQ_ERASE;
+  req.prio = SPIFLASH_PRIO_BACKGROUND;
+  req.addr = 0x30000;
+  req.len = 0x10000;
+  res = _bench_submit(spi, &req, n++);
+  for (i = 0; res == SPIFLASH_OK && i < 16; i++) {
+    req.type = SPIFLASH_REQ_WRITE;
+    req.prio = SPIFLASH_PRIO_NORMAL;
+    req.addr = 0x11000 + i * 256;
+    req.len = 256;
+    req.wr_buf = _bench_buf;
+    res = _bench_submit(spi, &req, n++);
+    if (res != SPIFLASH_OK) break;
+    req.type = SPIFLASH_REQ_READ;
+    req.prio = SPIFLASH_PRIO_CRITICAL;
+    req.addr = _bench_rand() % BENCH_SZ;
+    req.len = 64;
+    req.rd_buf = _bench_ref;
+    res = _bench_submit(spi, &req, n++);
+  }
+  SPIFLASH_sim_run(spi);
+  if (res == SPIFLASH_OK) res = _bench_res;
+  // put back as they were, the driver being idle
+  spi->q = saved_q;
+  _bench_report(sim, &rd, out, user);
+  _bench_report(sim, &wr, out, user);
+  _bench_report(sim, &er, out, user);
+  return res;
+}
+
+int SPIFLASH_sim_bench(spiflash_t *spi, spiflash_sim_out_t out, void *user) {
+  spiflash_sim_t *sim = (spiflash_sim_t *)spi->user_data;
+  spiflash_cb_async_t saved_cb = spi->async_cb;
+  spiflash_ctx_pool_t *saved_pool = spi->pool;
+  uint32_t errors = sim->errors;
+  _bench_t b;
+  uint64_t t0;
+  uint32_t i, a;
+  int res = SPIFLASH_OK;
+  int wrapped;
+  char line[128];
+
+  if (sim->cfg->sz < BENCH_SZ) {
+    return SPIFLASH_ERR_BAD_CONFIG;
+  }
+  spi->async_cb = _bench_cb;
+  if (saved_pool == 0) {
+    SPIFLASH_ctx_pool_init(&_bench_pool, &_bench_ctx, 1);
+    SPIFLASH_seq_init(&_bench_ctx, &_bench_sq);
+    SPIFLASH_suspend_init(&_bench_ctx, &_bench_sus);
+    SPIFLASH_ctx_init(spi, &_bench_pool);
+  }
+  _bench_res = SPIFLASH_OK;
+  _bench_seed = 1;
+  for (i = 0; i < sizeof(_bench_buf); i++) {
+    _bench_buf[i] = _bench_rand();
+  }
+
+  _bench_start(sim, &b, "erase 4k");
+  for (i = 0; res == SPIFLASH_OK && i < 16; i++) {
+    t0 = sim->now_ns;
+    res = SPIFLASH_erase(spi, i * 4096, 4096);
+    res = _bench_end(spi, &b, res, t0, 4096);
+  }
+  _bench_report(sim, &b, out, user);
+
+  _bench_start(sim, &b, "erase 64k");
+  for (i = 1; res == SPIFLASH_OK && i < BENCH_SZ / 0x10000; i++) {
+    t0 = sim->now_ns;
+    res = SPIFLASH_erase(spi, i * 0x10000, 0x10000);
+    res = _bench_end(spi, &b, res, t0, 0x10000);
+  }
+  _bench_report(sim, &b, out, user);
+
+  _bench_start(sim, &b, "write 16");
+  for (i = 0; res == SPIFLASH_OK && i < 256; i++) {
+    t0 = sim->now_ns;
+    res = SPIFLASH_write(spi, 0x10000 + i * 16, 16, &_bench_buf[i * 16]);
+    res = _bench_end(spi, &b, res, t0, 16);
+  }
+  _bench_report(sim, &b, out, user);
+
+  _bench_start(sim, &b, "write 4k");
+  for (i = 0; res == SPIFLASH_OK && i < 16; i++) {
+    t0 = sim->now_ns;
+    res = SPIFLASH_write(spi, 0x20000 + i * 4096, 4096, _bench_buf);
+    res = _bench_end(spi, &b, res, t0, 4096);
+  }
+  _bench_report(sim, &b, out, user);
+
+  _bench_start(sim, &b, "read seq 4k");
+  for (i = 0; res == SPIFLASH_OK && i < 16; i++) {
+    t0 = sim->now_ns;
+    res = SPIFLASH_fast_read(spi, 0x20000 + i * 4096, 4096, _bench_ref);
+    res = _bench_end(spi, &b, res, t0, 4096);
+    if (res == SPIFLASH_OK && memcmp(_bench_ref, _bench_buf, 4096)) {
+      out(user, "read back differs from written data");
+      res = SPIFLASH_ERR_INTERNAL;
+    }
+  }
+  _bench_report(sim, &b, out, user);
+
+  _bench_start(sim, &b, "verify 64k");
+  for (i = 0; res == SPIFLASH_OK && i < 16; i++) {
+    t0 = sim->now_ns;
+    res = SPIFLASH_verify(spi, 0x20000 + i * 4096, 4096, _bench_buf);
+    res = _bench_end(spi, &b, res, t0, 4096);
+  }
+  _bench_report(sim, &b, out, user);
+
+  _bench_start(sim, &b, "read rnd 16");
+  for (i = 0; res == SPIFLASH_OK && i < 256; i++) {
+    a = _bench_rand() % (BENCH_SZ - 16);
+    t0 = sim->now_ns;
+    res = SPIFLASH_read(spi, a, 16, _bench_ref);
+    res = _bench_end(spi, &b, res, t0, 16);
+  }
+  _bench_report(sim, &b, out, user);
+
+  // wrapping if the flash can
+  wrapped = res == SPIFLASH_OK && SPIFLASH_set_burst_wrap(spi, 32) == SPIFLASH_OK;
+  SPIFLASH_sim_run(spi);
+  _bench_start(sim, &b, "read line 32");
+  for (i = 0; res == SPIFLASH_OK && i < 256; i++) {
+    a = 0x20000 + _bench_rand() % 0x10000;
+    t0 = sim->now_ns;
+    res = SPIFLASH_read_line(spi, a, 32, 1, _bench_ref);
+    res = _bench_end(spi, &b, res, t0, 32);
+    if (res == SPIFLASH_OK && memcmp(_bench_ref, &_bench_buf[a & 4095 & ~31], 32)) {
+      out(user, "line read differs from written data");
+      res = SPIFLASH_ERR_INTERNAL;
+    }
+  }
+  _bench_report(sim, &b, out, user);
+  if (wrapped) {
+    if (SPIFLASH_set_burst_wrap(spi, 0) == SPIFLASH_OK) SPIFLASH_sim_run(spi);
+  }
+
+  if (res == SPIFLASH_OK) {
+    res = _bench_queue(spi, out, user);
+  }
+
+  spi->async_cb = saved_cb;
+  spi->pool = saved_pool;
+  if (res == SPIFLASH_OK && sim->errors != errors) {
+    snprintf(line, sizeof(line), "simulated flash errors: %u, last: %s",
+        (unsigned)(sim->errors - errors), sim->error);
+    out(user, line);
+    res = SPIFLASH_ERR_INTERNAL;
+  }
+  return res;
+}
@@ -0,0 +1,183 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Peter Andersson (pelleplutt1976<at>gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+/**
+ * spiflash_sim.h
+ *
+ * Simulated spi flash over a RAM array, for running and benchmarking the
+ * driver on a host without hardware.
+ *
+ * @author: petera
+ */
+
+#ifndef SPIFLASH_SIM_H_
+#define SPIFLASH_SIM_H_
+
+#include "spiflash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A simulated spi flash. Set up by SPIFLASH_sim_init, and given as user_data
+ * to SPIFLASH_init together with SPIFLASH_sim_hal.
+ *
+ * The flash is described by the same config and command table as given to
+ * the driver. It decodes the commands of the table with their address sizes,
+ * dummy cycles and lane widths. Programming only clears bits and wraps within
+ * the page, erases set whole blocks of the erase size, and the flash stays
+ * busy for the typical times of the config. Time is simulated, and moves by
+ * the spi clock for each transfer and by each wait.
+ *
+ * Anything a real spi flash would ignore or misbehave on, e.g. programming
+ * without write enable, a command while busy, wrong dummy cycles or lanes, an
+ * unaligned erase, or reading the block of a suspended erase or program, is
+ * counted in errors.
+ */
+typedef struct {
+  // the spi flash simulated, as given to the driver
+  const spiflash_config_t *cfg;
+  const spiflash_cmd_tbl_t *cmd;
+  // cfg.sz bytes of flash memory
+  uint8_t *mem;
+  // spi clock in kHz, default 50000
+  uint32_t clk_khz;
+  // busy times in percent of the typical times of cfg, default 100
+  uint32_t busy_pct;
+  // returned by jedec_id, default 0xef4018
+  uint32_t jedec_id;
+  // returned by read_sfdp, may be zero
+  const uint8_t *sfdp;
+  uint32_t sfdp_len;
+  // if set, quad lane commands need cmd.qe_bit set in the status register
+  uint8_t qe_required;
+
+  // simulated time in ns
+  uint64_t now_ns;
+  // time in ns spent on the spi bus
+  uint64_t bus_ns;
+  // number of errors, and the last one
+  uint32_t errors;
+  const char *error;
+  // number of transfers, page programs and erases
+  uint32_t xfers;
+  uint32_t programs;
+  uint32_t erases;
+  // length of the lines quad i/o reads wrap within, 0 if not wrapping
+  uint8_t wrap;
+
+  // internals
+  uint64_t busy_until_ns;
+  uint64_t sus_left_ns;
+  uint32_t busy_addr;
+  uint32_t busy_sz;
+  uint32_t addr;
+  uint32_t pos;
+  uint32_t dummy;
+  uint32_t cnt;
+  uint32_t erase_sz;
+  uint8_t sr;
+  uint8_t sr2;
+  uint8_t cs;
+  uint8_t pending;
+  uint8_t suspended;
+  uint8_t op;
+  uint8_t code;
+  uint8_t cont;
+  uint8_t phase;
+  uint8_t addr_len;
+  uint8_t addr_dummy;
+  uint8_t addr_got;
+  uint8_t addr_lanes;
+  uint8_t data_lanes;
+  uint8_t dummy_exp;
+  uint8_t mode;
+  uint8_t mode_got;
+  uint8_t wel;
+  uint8_t wrap_bits;
+  uint8_t sr_new[2];
+} spiflash_sim_t;
+
+/**
+ * Called with each line of benchmark results, see SPIFLASH_sim_bench.
+ *
+ * @param user  the user pointer given to SPIFLASH_sim_bench.
+ * @param line  zero terminated line, without newline.
+ */
+typedef void (*spiflash_sim_out_t)(void *user, const char *line);
+
+/**
+ * A hal for the simulated spi flash, with all optional functions but
+ * _spiflash_xip_map, _spiflash_bus and _spiflash_critical. Copy it and clear
+ * functions to simulate a simpler spi controller.
+ */
+extern const spiflash_hal_t SPIFLASH_sim_hal;
+
+/**
+ * Sets up a simulated spi flash, erased and idle, with default clock, busy
+ * times and jedec id.
+ *
+ * @param sim  the simulated spi flash.
+ * @param cfg  the spi flash config, kept as long as the simulation runs.
+ * @param cmd  the command table, kept as long as the simulation runs.
+ * @param mem  cfg.sz bytes of flash memory.
+ */
+void SPIFLASH_sim_init(spiflash_sim_t *sim, const spiflash_config_t *cfg,
+    const spiflash_cmd_tbl_t *cmd, uint8_t *mem);
+
+/**
+ * In asynchronous mode, calls SPIFLASH_async_trigger for each transfer or
+ * wait finished by the simulated spi flash, until the driver is idle. As time
+ * is simulated, everything finishes at once. Call after each asynchronous
+ * call to the driver. Does nothing in synchronous mode.
+ *
+ * @param spi  pointer to the spi flash driver struct.
+ */
+void SPIFLASH_sim_run(spiflash_t *spi);
+
+/**
+ * Runs a benchmark on the simulated spi flash in simulated time, and reports
+ * throughput and latency for sequential, random and line reads, verifies, small
+ * and large writes, erases and a mix of queued requests, the queued ones
+ * from submit to completion. The first 256 KB of the flash are overwritten.
+ * The driver must be idle, set up with SPIFLASH_sim_hal and sim as
+ * user_data. A read cache, write buffer, timing
+ * model or operation context pool of the driver is used as is, the contexts
+ * of the pool with sequence contexts. The request queue is replaced during
+ * the benchmark, and a pool of one context with sequence context and suspend
+ * state is lent if the driver has none.
+ *
+ * @param spi   pointer to the spi flash driver struct.
+ * @param out   called for each line of results.
+ * @param user  passed to out.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_BAD_CONFIG if the flash is
+ *         smaller than 256 KB. SPIFLASH_ERR_INTERNAL if data read back
+ *         differs, or the simulated flash counted errors.
+ */
+int SPIFLASH_sim_bench(spiflash_t *spi, spiflash_sim_out_t out, void *user);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*SPIFLASH_SIM_H_*/
@@ -0,0 +1,218 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Peter Andersson (pelleplutt1976<at>gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * spiflash_stripe.c
+ *
+ * @author: petera
+ */
+
+#include "spiflash_stripe.h"
+
+static int _spiflash_stripe_next(spiflash_stripe_t *st, uint8_t d, uint32_t pos,
+    uint32_t end, uint32_t *vaddr, uint32_t *daddr, uint32_t *len) {
+  // find next piece of the volume range [pos, end) on spi flash d
+  uint32_t a, e;
+  if (st->stripe_sz) {
+    uint32_t ss = st->stripe_sz;
+    uint32_t k = pos / ss;
+    k += (d + st->dev_cnt - k % st->dev_cnt) % st->dev_cnt;
+    a = k * ss > pos ? k * ss : pos;
+    e = (k + 1) * ss < end ? (k + 1) * ss : end;
+    *daddr = (k / st->dev_cnt) * ss + (a - k * ss);
+  } else {
+    uint32_t base = d * st->dev_sz;
+    a = base > pos ? base : pos;
+    e = base + st->dev_sz < end ? base + st->dev_sz : end;
+    *daddr = a - base;
+  }
+  if (a >= e) return 0;
+  *vaddr = a;
+  *len = e - a;
+  return 1;
+}
+
+static int _spiflash_stripe_issue(spiflash_stripe_t *st, uint8_t d, uint8_t *issued) {
+  // start next operation of the part on spi flash d
+  spiflash_stripe_leg_t *leg = &st->leg[d];
+  spiflash_stripe_req_t *req = leg->req;
+  spiflash_t *spi = st->devs[d];
+  uint32_t end = req->addr + req->len;
+  uint32_t va, da, len;
+  uint8_t n = 0;
+  *issued = 0;
+  switch (req->type) {
+  case SPIFLASH_REQ_READ:
+  case SPIFLASH_REQ_FAST_READ:
+  case SPIFLASH_REQ_WRITE:
+    while (n < SPIFLASH_STRIPE_IOV &&
+        _spiflash_stripe_next(st, d, leg->pos, end, &va, &da, &len)) {
+      leg->iov[n].addr = da;
+      leg->iov[n].len = len;
+      leg->iov[n].buf = req->type == SPIFLASH_REQ_WRITE ?
+          (uint8_t *)&req->wr_buf[va - req->addr] : &req->rd_buf[va - req->addr];
+      leg->pos = va + len;
+      n++;
+    }
+    if (n == 0) return SPIFLASH_OK;
+    *issued = 1;
+    return req->type == SPIFLASH_REQ_WRITE ?
+        SPIFLASH_writev(spi, leg->iov, n) : SPIFLASH_readv(spi, leg->iov, n);
+  case SPIFLASH_REQ_ERASE: {
+    // stripes of one spi flash lie after each other, erase them in one go
+    uint32_t da0, da1;
+    if (!_spiflash_stripe_next(st, d, leg->pos, end, &va, &da0, &len)) {
+      return SPIFLASH_OK;
+    }
+    da1 = da0 + len;
+    leg->pos = va + len;
+    while (_spiflash_stripe_next(st, d, leg->pos, end, &va, &da, &len)) {
+      da1 = da + len;
+      leg->pos = va + len;
+    }
+    *issued = 1;
+    return SPIFLASH_erase(spi, da0, da1 - da0);
+  }
+  case SPIFLASH_REQ_CHIP_ERASE:
+    if (leg->pos == end) return SPIFLASH_OK;
+    leg->pos = end;
+    *issued = 1;
+    return SPIFLASH_chip_erase(spi);
+  default:
+    return SPIFLASH_ERR_INTERNAL;
+  }
+}
+
+static void _spiflash_stripe_leg_done(spiflash_stripe_t *st, uint8_t d, int res) {
+  spiflash_stripe_req_t *req = st->leg[d].req;
+  st->leg[d].req = 0;
+  if (res != SPIFLASH_OK && req->res == SPIFLASH_OK) {
+    req->res = res;
+  }
+  if (--req->legs == 0 && req->cb) {
+    req->cb(st, req, req->res);
+  }
+}
+
+static void _spiflash_stripe_run(spiflash_stripe_t *st, uint8_t d) {
+  // carry on with the part on spi flash d, until waiting or done
+  while (1) {
+    uint8_t issued;
+    int res = _spiflash_stripe_issue(st, d, &issued);
+    if (res != SPIFLASH_OK || !issued) {
+      _spiflash_stripe_leg_done(st, d, res);
+      return;
+    }
+    if (st->devs[d]->async) return;
+  }
+}
+
+static void _spiflash_stripe_async_cb(spiflash_t *spi, spiflash_op_t op, int err_code) {
+  spiflash_stripe_t *st = (spiflash_stripe_t *)spi->layer;
+  uint8_t d;
+  (void)op;
+  for (d = 0; d < st->dev_cnt; d++) {
+    if (st->devs[d] == spi) break;
+  }
+  if (d == st->dev_cnt || st->leg[d].req == 0) return;
+  if (err_code != SPIFLASH_OK) {
+    _spiflash_stripe_leg_done(st, d, err_code);
+  } else {
+    _spiflash_stripe_run(st, d);
+  }
+}
+
+int SPIFLASH_stripe_init(spiflash_stripe_t *st, spiflash_t **devs,
+    uint8_t dev_cnt, uint32_t stripe_sz) {
+  uint8_t d;
+  if (dev_cnt == 0 || dev_cnt > SPIFLASH_STRIPE_MAX_DEVS) {
+    return SPIFLASH_ERR_BAD_CONFIG;
+  }
+  for (d = 0; d < dev_cnt; d++) {
+    if (devs[d]->cfg->sz != devs[0]->cfg->sz || devs[d]->async != devs[0]->async) {
+      return SPIFLASH_ERR_BAD_CONFIG;
+    }
+    // owned by another layer
+    if (devs[d]->layer && devs[d]->async_cb != _spiflash_stripe_async_cb) {
+      return SPIFLASH_ERR_BAD_CONFIG;
+    }
+  }
+  memset(st, 0, sizeof(spiflash_stripe_t));
+  st->devs = devs;
+  st->dev_cnt = dev_cnt;
+  st->stripe_sz = stripe_sz;
+  st->dev_sz = devs[0]->cfg->sz;
+  for (d = 0; d < dev_cnt; d++) {
+    devs[d]->layer = st;
+    devs[d]->async_cb = _spiflash_stripe_async_cb;
+  }
+  return SPIFLASH_OK;
+}
+
+uint32_t SPIFLASH_stripe_size(spiflash_stripe_t *st) {
+  return st->dev_sz * st->dev_cnt;
+}
+
+int SPIFLASH_stripe_submit(spiflash_stripe_t *st, spiflash_stripe_req_t *req) {
+  uint8_t d;
+  uint32_t va, da, len;
+  uint8_t touched[SPIFLASH_STRIPE_MAX_DEVS];
+  if (req->type == SPIFLASH_REQ_CHIP_ERASE) {
+    req->addr = 0;
+    req->len = SPIFLASH_stripe_size(st);
+  }
+  if (req->addr > SPIFLASH_stripe_size(st) ||
+      req->len > SPIFLASH_stripe_size(st) - req->addr) {
+    return SPIFLASH_ERR_OUT_OF_RANGE;
+  }
+
+  req->legs = 0;
+  req->res = SPIFLASH_OK;
+  for (d = 0; d < st->dev_cnt; d++) {
+    touched[d] = _spiflash_stripe_next(st, d, req->addr, req->addr + req->len,
+        &va, &da, &len);
+    if (touched[d] && (st->leg[d].req || SPIFLASH_is_busy(st->devs[d]))) {
+      return SPIFLASH_ERR_BUSY;
+    }
+    req->legs += touched[d];
+  }
+  if (req->legs == 0) {
+    if (req->cb) req->cb(st, req, SPIFLASH_OK);
+    return SPIFLASH_OK;
+  }
+
+  // count all parts before starting any, as they may finish at once
+  for (d = 0; d < st->dev_cnt; d++) {
+    if (touched[d]) {
+      st->leg[d].req = req;
+      st->leg[d].pos = req->addr;
+    }
+  }
+  for (d = 0; d < st->dev_cnt; d++) {
+    if (touched[d]) {
+      _spiflash_stripe_run(st, d);
+    }
+  }
+
+  return st->devs[0]->async ? SPIFLASH_OK : req->res;
+}
@@ -0,0 +1,173 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Peter Andersson (pelleplutt1976<at>gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+/**
+ * spiflash_stripe.h
+ *
+ * Striping or concatenation of several identical spi flashes into one
+ * volume.
+ *
+ * @author: petera
+ */
+
+#ifndef SPIFLASH_STRIPE_H_
+#define SPIFLASH_STRIPE_H_
+
+#include "spiflash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Max number of spi flashes in a volume.
+ */
+#ifndef SPIFLASH_STRIPE_MAX_DEVS
+#define SPIFLASH_STRIPE_MAX_DEVS      (4)
+#endif
+
+/**
+ * Max number of stripes read or written on one spi flash by one
+ * SPIFLASH_readv or SPIFLASH_writev.
+ */
+#ifndef SPIFLASH_STRIPE_IOV
+#define SPIFLASH_STRIPE_IOV           (4)
+#endif
+
+struct spiflash_stripe_s;
+struct spiflash_stripe_req_s;
+
+/**
+ * Volume request completion callback, see SPIFLASH_stripe_submit.
+ *
+ * @param st        the volume.
+ * @param req       the finished request.
+ * @param err_code  SPIFLASH_OK, or the first error of any spi flash.
+ */
+typedef void (*spiflash_stripe_cb_t)(struct spiflash_stripe_s *st,
+    struct spiflash_stripe_req_s *req, int err_code);
+
+/**
+ * A volume request, see SPIFLASH_stripe_submit.
+ */
+typedef struct spiflash_stripe_req_s {
+  spiflash_req_type_t type;
+  // volume address and length of the read, write or erase, ignored for
+  // chip erase
+  uint32_t addr;
+  uint32_t len;
+  union {
+    const uint8_t *wr_buf;
+    uint8_t *rd_buf;
+  };
+  // completion callback, may be zero
+  spiflash_stripe_cb_t cb;
+  // user data for the completion callback
+  void *user_data;
+
+  // internals
+  uint8_t legs;
+  int res;
+} spiflash_stripe_req_t;
+
+/**
+ * The part of a volume request carried out by one spi flash.
+ */
+typedef struct {
+  spiflash_stripe_req_t *req;
+  // volume address from where the rest of this part is found
+  uint32_t pos;
+  spiflash_iov_t iov[SPIFLASH_STRIPE_IOV];
+} spiflash_stripe_leg_t;
+
+/**
+ * The volume struct.
+ */
+typedef struct spiflash_stripe_s {
+  spiflash_t **devs;
+  uint8_t dev_cnt;
+  // stripe size, or 0 for concatenation
+  uint32_t stripe_sz;
+  uint32_t dev_sz;
+  spiflash_stripe_leg_t leg[SPIFLASH_STRIPE_MAX_DEVS];
+} spiflash_stripe_t;
+
+/**
+ * Sets up a volume of dev_cnt identical spi flashes, all initiated by
+ * SPIFLASH_init, either all synchronous or all asynchronous. The volume takes
+ * over the asynchronous callback and spi.layer of each spi flash, so they must
+ * only be used through the volume from now on. A spi flash under a front end
+ * of spiflash_os.h cannot be part of a volume, nor can a volume member be
+ * given a front end.
+ * With a stripe size, the volume is split in stripes handed to the spi
+ * flashes in turn: stripe 0 to the first, stripe 1 to the second and so on.
+ * The stripe size should be a multiple of cfg.page_sz, and a multiple of the
+ * smallest erase size if erasing. Without a stripe size, the spi flashes are
+ * concatenated after each other.
+ *
+ * @param st         pointer to the volume struct.
+ * @param devs       array of dev_cnt spi flash driver structs.
+ * @param dev_cnt    number of spi flashes.
+ * @param stripe_sz  stripe size, or 0 for concatenation.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_BAD_CONFIG if the spi
+ *         flashes differ in size or mode, if too many, or if any is taken
+ *         over by another layer.
+ */
+int SPIFLASH_stripe_init(spiflash_stripe_t *st, spiflash_t **devs,
+    uint8_t dev_cnt, uint32_t stripe_sz);
+
+/**
+ * Returns the size of the volume.
+ *
+ * @param st  pointer to the volume struct.
+ * @return size in bytes.
+ */
+uint32_t SPIFLASH_stripe_size(spiflash_stripe_t *st);
+
+/**
+ * Submits a read, fast read, write, erase or chip erase to the volume. The
+ * request is split on the spi flashes it touches, and the parts are carried
+ * out in parallel in asynchronous mode, each spi flash reading or writing
+ * its stripes in chunks of up to SPIFLASH_STRIPE_IOV stripes. Reads are
+ * always done as by SPIFLASH_fast_read. An erase must cover whole stripes,
+ * so that each part is aligned on its spi flash.
+ * Requests touching different spi flashes may run at the same time, e.g. an
+ * erase on one spi flash while writing to another.
+ * The request is not copied and must be kept until finished, as well as the
+ * buffer it points to. req.cb is called when all parts are finished, also in
+ * synchronous mode.
+ *
+ * @param st   pointer to the volume struct.
+ * @param req  the request.
+ * @return error code or SPIFLASH_OK. SPIFLASH_ERR_BUSY if any of the spi
+ *         flashes touched is busy with another request,
+ *         SPIFLASH_ERR_OUT_OF_RANGE if the request does not fit in the volume.
+ *         In asynchronous mode, errors of the spi flashes are only reported
+ *         through req.cb.
+ */
+int SPIFLASH_stripe_submit(spiflash_stripe_t *st, spiflash_stripe_req_t *req);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*SPIFLASH_STRIPE_H_*/
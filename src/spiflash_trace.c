@@ -0,0 +1,120 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Peter Andersson (pelleplutt1976<at>gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * spiflash_trace.c
+ *
+ * @author: petera
+ */
+
+#include "spiflash_trace.h"
+
+#define _OP(_op)  [SPIFLASH_OP_##_op] = #_op
+
+static const char *const _trace_op_names[SPIFLASH_OPS] = {
+  _OP(IDLE),
+  _OP(ERASE_BLOCK_sWREN),
+  _OP(ERASE_BLOCK_sERAS),
+  _OP(ERASE_CHIP_sWREN),
+  _OP(ERASE_CHIP_sERAS),
+  _OP(WRITE_sWREN),
+  _OP(WRITE_sADDR),
+  _OP(WRITE_sDATA),
+  _OP(WRITE_sVERIFY),
+  _OP(WRITE_SR_sWREN),
+  _OP(WRITE_SR_sDATA),
+  _OP(WRITE_REG_sWREN),
+  _OP(WRITE_REG_sDATAWAIT),
+  _OP(WRITE_REG_DATA),
+  _OP(QUAD_ENABLE_sREAD),
+  _OP(QUAD_ENABLE_sWREN),
+  _OP(QUAD_ENABLE_sDATA),
+  _OP(XIP_EXIT),
+  _OP(READ),
+  _OP(FAST_READ),
+  _OP(QUAD_READ),
+  _OP(READ_SR),
+  _OP(READ_SR_BUSY),
+  _OP(READ_JEDEC),
+  _OP(READ_PRODUCT),
+  _OP(READ_REG),
+  _OP(READ_SFDP),
+  _OP(CRC32),
+  _OP(SET_BURST_WRAP),
+};
+
+// busy check wait states, as BCW_* in spiflash.c
+static const char *const _trace_bcw_names[] = {
+  "IDLE", "WAIT", "READ_SR", "CHECK", "READY"
+};
+
+const char *SPIFLASH_trace_op_name(uint8_t op) {
+  if (op >= SPIFLASH_OPS || _trace_op_names[op] == 0) return "?";
+  return _trace_op_names[op];
+}
+
+int SPIFLASH_trace_decode(const spiflash_trace_t *rec, char *line, uint32_t sz) {
+  const char *ev = rec->ev == SPIFLASH_TRACE_BEGIN ? "BEGIN" :
+      (rec->ev == SPIFLASH_TRACE_END ? "END" : "?");
+  const char *bcw =
+      rec->bcw < sizeof(_trace_bcw_names) / sizeof(_trace_bcw_names[0]) ?
+      _trace_bcw_names[rec->bcw] : "?";
+  int n = snprintf(line, sz, "%10u %-5s %-19s bcw:%-7s addr:%08x len:%u",
+      (unsigned)rec->ts, ev, SPIFLASH_trace_op_name(rec->op), bcw,
+      (unsigned)rec->addr, (unsigned)rec->len);
+  if (rec->err && n >= 0 && (uint32_t)n < sz) {
+    if (rec->err == 0xff) {
+      n += snprintf(&line[n], sz - n, " err:hal");
+    } else {
+      n += snprintf(&line[n], sz - n, " err:%i", _SPIFLASH_ERR_BASE - rec->err);
+    }
+  }
+  return n;
+}
+
+int SPIFLASH_trace_dump(spiflash_t *spi, spiflash_trace_out_t out, void *user) {
+#if SPIFLASH_TRACE
+  char line[112];
+  uint32_t prev_ts = 0;
+  uint16_t i, ix = spi->tr_head;
+  int cnt = 0;
+  if (spi->tr == 0) return 0;
+  // from the oldest, unused records are only found before the first used one
+  for (i = 0; i < spi->tr_cnt; i++) {
+    const spiflash_trace_t *rec = &spi->tr[ix];
+    int n;
+    if (++ix == spi->tr_cnt) ix = 0;
+    if (rec->ev == SPIFLASH_TRACE_NONE) continue;
+    n = snprintf(line, sizeof(line), "+%-8u ",
+        cnt ? (unsigned)(rec->ts - prev_ts) : 0u);
+    SPIFLASH_trace_decode(rec, &line[n], sizeof(line) - n);
+    prev_ts = rec->ts;
+    out(user, line);
+    cnt++;
+  }
+  return cnt;
+#else
+  (void)spi; (void)out; (void)user;
+  return 0;
+#endif
+}
@@ -0,0 +1,87 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Peter Andersson (pelleplutt1976<at>gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+/**
+ * spiflash_trace.h
+ *
+ * Decodes the state machine trace recorded by the spi flash driver, see
+ * SPIFLASH_trace_init.
+ *
+ * @author: petera
+ */
+
+#ifndef SPIFLASH_TRACE_H_
+#define SPIFLASH_TRACE_H_
+
+#include "spiflash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Receives one decoded trace record as a zero terminated line, without
+ * newline.
+ *
+ * @param user  the user pointer given to SPIFLASH_trace_dump.
+ * @param line  the decoded record.
+ */
+typedef void (*spiflash_trace_out_t)(void *user, const char *line);
+
+/**
+ * Returns the name of an operation, e.g. "WRITE_sADDR" for
+ * SPIFLASH_OP_WRITE_sADDR, or "?" if unknown.
+ *
+ * @param op  the spiflash_op_t.
+ * @return the name.
+ */
+const char *SPIFLASH_trace_op_name(uint8_t op);
+
+/**
+ * Decodes a trace record into text, e.g.
+ *     12345678 END   WRITE_sADDR         bcw:WAIT    addr:00001000 len:256
+ * Also for records copied from a target, e.g. post-mortem.
+ *
+ * @param rec   the record.
+ * @param line  receives the text.
+ * @param sz    size of line, 96 bytes are always enough.
+ * @return number of characters as by snprintf.
+ */
+int SPIFLASH_trace_decode(const spiflash_trace_t *rec, char *line, uint32_t sz);
+
+/**
+ * Decodes the trace of a spi flash, oldest record first. Each line is
+ * prefixed by the time since the previous record in us. Only available if the
+ * driver is built with SPIFLASH_TRACE set to 1.
+ *
+ * @param spi   pointer to the spi flash driver struct.
+ * @param out   called for each record.
+ * @param user  passed to out.
+ * @return number of records decoded.
+ */
+int SPIFLASH_trace_dump(spiflash_t *spi, spiflash_trace_out_t out, void *user);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*SPIFLASH_TRACE_H_*/
@@ -0,0 +1,57 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Peter Andersson (pelleplutt1976<at>gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * bench.c
+ *
+ * Runs SPIFLASH_sim_bench on a simulated quad spi flash, synchronous and
+ * asynchronous.
+ *
+ * @author: petera
+ */
+
+#include "test.h"
+
+static test_dev_t _d;
+
+static void _bench_out(void *user, const char *line) {
+  (void)user;
+  printf("  %s\n", line);
+}
+
+int main(void) {
+  uint8_t async;
+  int res, fails = 0;
+  for (async = 0; async < 2; async++) {
+    test_dev_init(&_d, async);
+    printf("%s\n", async ? "asynchronous" : "synchronous");
+    res = SPIFLASH_sim_bench(&_d.spi, _bench_out, 0);
+    if (res != SPIFLASH_OK) {
+      printf("  failed %i, %u simulation errors %s\n", res,
+          (unsigned)_d.sim.errors, _d.sim.error ? _d.sim.error : "");
+      fails++;
+    }
+    test_dev_free(&_d);
+  }
+  return fails ? 1 : 0;
+}
@@ -0,0 +1,137 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Peter Andersson (pelleplutt1976<at>gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * test.h
+ *
+ * Host tests of the driver and its layers, run against the simulated spi
+ * flash of spiflash_sim.h.
+ *
+ * @author: petera
+ */
+
+#ifndef TEST_H_
+#define TEST_H_
+
+#include "spiflash.h"
+#include "spiflash_sim.h"
+#include "test_const.h"
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * Checks an expression, and on failure reports it and fails the test.
+ */
+#define TEST_CHECK(_x) do { \
+    if (!(_x)) { test_fail(__FILE__, __LINE__, #_x, 0, 0); return; } \
+  } while (0)
+
+/**
+ * Checks a result code, and on mismatch reports both and fails the test.
+ */
+#define TEST_RES(_x, _res) do { \
+    int _r = (_x); \
+    if (_r != (_res)) { test_fail(__FILE__, __LINE__, #_x, _r, (_res)); return; } \
+  } while (0)
+
+/**
+ * A simulated spi flash with its driver. sim is first, as the hal of the
+ * simulated spi flash has it as user_data.
+ */
+typedef struct {
+  spiflash_sim_t sim;
+  spiflash_config_t cfg;
+  spiflash_cmd_tbl_t cmd;
+  spiflash_hal_t hal;
+  spiflash_t spi;
+  // a pool of one operation context with suspend state and sequence
+  // context, set up by test_dev_start, and the queue attached by the tests
+  // using it
+  spiflash_op_ctx_t ctx;
+  spiflash_ctx_pool_t pool;
+  spiflash_queue_t q;
+  spiflash_suspend_t sus;
+  spiflash_seq_t sq;
+  uint8_t *mem;
+  // asynchronous callbacks since last test_done, and the last result
+  uint32_t cb_cnt;
+  int cb_res;
+} test_dev_t;
+
+/**
+ * A test, run once synchronous and once asynchronous.
+ */
+typedef struct {
+  const char *name;
+  void (*fn)(uint8_t async);
+} test_t;
+
+/**
+ * Sets up a 1 MB quad spi flash with suspend and resume, and its driver with
+ * all of the simulated hal. Change cfg, cmd or hal and call test_dev_start
+ * again to try other setups, after TEST_FIXED_CFG for cfg and cmd.
+ */
+void test_dev_init(test_dev_t *d, uint8_t async);
+
+/**
+ * Initiates the driver again with cfg, cmd and hal of the device, with its
+ * pool of one operation context with suspend state and sequence context.
+ */
+void test_dev_start(test_dev_t *d);
+
+void test_dev_free(test_dev_t *d);
+
+/**
+ * Finishes a call to the driver: runs the simulation, and in asynchronous
+ * mode returns the result given to the asynchronous callback, which must
+ * have been called exactly once. Returns res if the call failed at once.
+ */
+int test_done(test_dev_t *d, int res);
+
+/**
+ * Fills buf with bytes from a seed.
+ */
+void test_fill(uint8_t *buf, uint32_t len, uint32_t seed);
+
+void test_fail(const char *file, int line, const char *what, int res,
+    int expected);
+
+/**
+ * Reports the rest of a test as skipped.
+ */
+void test_skip(void);
+
+/**
+ * Ends a test about to change the config or command table of its device when
+ * the driver is built fixed to TEST_CFG and TEST_CMD, see test_const.h.
+ */
+#if defined(SPIFLASH_CFG_CONST) || defined(SPIFLASH_CMD_CONST)
+#define TEST_FIXED_CFG(_d) do { test_dev_free(_d); test_skip(); return; } while (0)
+#else
+#define TEST_FIXED_CFG(_d) do { (void)(_d); } while (0)
+#endif
+
+extern const test_t test_core[];
+extern const test_t test_layers[];
+
+#endif /*TEST_H_*/
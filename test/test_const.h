@@ -0,0 +1,73 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Peter Andersson (pelleplutt1976<at>gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * test_const.h
+ *
+ * Config and command table of the simulated spi flash of the tests. Also
+ * given as SPIFLASH_CONST_HEADER when the tests are built with the driver
+ * fixed to them, see make test_const.
+ *
+ * @author: petera
+ */
+
+#ifndef TEST_CONST_H_
+#define TEST_CONST_H_
+
+#include "spiflash.h"
+
+#define TEST_FLASH_SZ   (1024*1024)
+
+/**
+ * A 1 MB quad spi flash with suspend and resume.
+ */
+#define TEST_CFG \
+  (spiflash_config_t) { \
+    .sz = TEST_FLASH_SZ, \
+    .page_sz = 256, \
+    .addr_sz = 3, \
+    .addr_endian = SPIFLASH_ENDIANNESS_BIG, \
+    .lanes = 4, \
+    .sr_write_ms = 10, \
+    .page_program_ms = 1, \
+    .block_erase_4_ms = 50, \
+    .block_erase_32_ms = 150, \
+    .block_erase_64_ms = 200, \
+    .chip_erase_ms = 2000, \
+    .suspend_poll_ms = 1, \
+  }
+
+#define TEST_CMD \
+  (spiflash_cmd_tbl_t) { \
+    _SPIFLASH_CMD_TBL_STANDARD_ENTRIES \
+    _SPIFLASH_CMD_TBL_QUAD_ENTRIES \
+    .suspend = 0x75, \
+    .resume = 0x7a, \
+  }
+
+#if defined(SPIFLASH_CFG_CONST) || defined(SPIFLASH_CMD_CONST)
+static const spiflash_config_t test_const_cfg = TEST_CFG;
+static const spiflash_cmd_tbl_t test_const_cmd = TEST_CMD;
+#endif
+
+#endif /*TEST_CONST_H_*/
@@ -0,0 +1,974 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Peter Andersson (pelleplutt1976<at>gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * test_core.c
+ *
+ * Tests of the driver operations and sequences.
+ *
+ * @author: petera
+ */
+
+#include "test.h"
+#include <stdlib.h>
+
+static test_dev_t _d;
+static test_dev_t _d2;
+static uint8_t _wr[0x4000];
+static uint8_t _rd[0x4000];
+static uint8_t _scratch[0x4000];
+
+static void _test_settle(test_dev_t *d) {
+  // finish a call that may or may not need the bus
+  SPIFLASH_sim_run(&d->spi);
+  d->cb_cnt = 0;
+}
+
+static void test_read_write_erase(uint8_t async) {
+  test_dev_t *d = &_d;
+  test_dev_init(d, async);
+  test_fill(_wr, 1000, 1);
+
+  TEST_RES(test_done(d, SPIFLASH_erase(&d->spi, 0x10000, 0x10000)), SPIFLASH_OK);
+  TEST_CHECK(d->mem[0x10000] == 0xff && d->mem[0x1ffff] == 0xff);
+  TEST_RES(test_done(d, SPIFLASH_write(&d->spi, 0x10003, 1000, _wr)), SPIFLASH_OK);
+  TEST_CHECK(memcmp(&d->mem[0x10003], _wr, 1000) == 0);
+  TEST_CHECK(d->mem[0x10002] == 0xff && d->mem[0x10003 + 1000] == 0xff);
+
+  memset(_rd, 0, sizeof(_rd));
+  TEST_RES(test_done(d, SPIFLASH_read(&d->spi, 0x10003, 1000, _rd)), SPIFLASH_OK);
+  TEST_CHECK(memcmp(_rd, _wr, 1000) == 0);
+  memset(_rd, 0, sizeof(_rd));
+  TEST_RES(test_done(d, SPIFLASH_fast_read(&d->spi, 0x10003, 1000, _rd)), SPIFLASH_OK);
+  TEST_CHECK(memcmp(_rd, _wr, 1000) == 0);
+
+  TEST_RES(SPIFLASH_erase(&d->spi, 0x10001, 0x1000), SPIFLASH_ERR_ERASE_UNALIGNED);
+  if (async) {
+    TEST_RES(SPIFLASH_erase(&d->spi, 0x20000, 0x1000), SPIFLASH_OK);
+    TEST_RES(SPIFLASH_write(&d->spi, 0x10003, 10, _wr), SPIFLASH_ERR_BUSY);
+    TEST_RES(test_done(d, SPIFLASH_OK), SPIFLASH_OK);
+  }
+  TEST_CHECK(d->sim.errors == 0);
+  test_dev_free(d);
+}
+
+static void test_readv_writev(uint8_t async) {
+  test_dev_t *d = &_d;
+  spiflash_iov_t wv[3], rv[3];
+  test_dev_init(d, async);
+  test_fill(_wr, 600, 2);
+  // two segments continuing each other across a page, and one elsewhere
+  wv[0] = (spiflash_iov_t){ .addr = 0xf0, .len = 100, .buf = &_wr[0] };
+  wv[1] = (spiflash_iov_t){ .addr = 0x154, .len = 300, .buf = &_wr[100] };
+  wv[2] = (spiflash_iov_t){ .addr = 0x3000, .len = 200, .buf = &_wr[400] };
+
+  TEST_RES(test_done(d, SPIFLASH_erase(&d->spi, 0, 0x4000)), SPIFLASH_OK);
+  TEST_RES(test_done(d, SPIFLASH_writev(&d->spi, wv, 3)), SPIFLASH_OK);
+  TEST_CHECK(memcmp(&d->mem[0xf0], _wr, 400) == 0);
+  TEST_CHECK(memcmp(&d->mem[0x3000], &_wr[400], 200) == 0);
+
+  memset(_rd, 0, sizeof(_rd));
+  rv[0] = (spiflash_iov_t){ .addr = 0x3000, .len = 200, .buf = &_rd[400] };
+  rv[1] = (spiflash_iov_t){ .addr = 0xf0, .len = 150, .buf = &_rd[0] };
+  rv[2] = (spiflash_iov_t){ .addr = 0x186, .len = 250, .buf = &_rd[150] };
+  TEST_RES(test_done(d, SPIFLASH_readv(&d->spi, rv, 3)), SPIFLASH_OK);
+  TEST_CHECK(memcmp(_rd, _wr, 600) == 0);
+
+  // leading empty segments are skipped, and nothing at all finishes at once
+  memset(_rd, 0, sizeof(_rd));
+  rv[0].len = 0;
+  rv[1].len = 0;
+  TEST_RES(test_done(d, SPIFLASH_readv(&d->spi, rv, 3)), SPIFLASH_OK);
+  TEST_CHECK(memcmp(&_rd[150], &_wr[150], 250) == 0 && _rd[0] == 0 && _rd[400] == 0);
+  wv[0].len = 0;
+  wv[1] = (spiflash_iov_t){ .addr = 0x3800, .len = 10, .buf = _wr };
+  TEST_RES(test_done(d, SPIFLASH_writev(&d->spi, wv, 2)), SPIFLASH_OK);
+  TEST_CHECK(memcmp(&d->mem[0x3800], _wr, 10) == 0 && d->mem[0x380a] == 0xff);
+  d->sim.xfers = 0;
+  TEST_RES(test_done(d, SPIFLASH_readv(&d->spi, rv, 2)), SPIFLASH_OK);
+  TEST_RES(test_done(d, SPIFLASH_writev(&d->spi, wv, 1)), SPIFLASH_OK);
+  TEST_RES(test_done(d, SPIFLASH_readv(&d->spi, 0, 0)), SPIFLASH_OK);
+  TEST_RES(test_done(d, SPIFLASH_writev(&d->spi, 0, 0)), SPIFLASH_OK);
+  TEST_CHECK(d->sim.xfers == 0);
+  TEST_RES(SPIFLASH_readv(&d->spi, 0, 1), SPIFLASH_ERR_BAD_CONFIG);
+  TEST_RES(SPIFLASH_writev(&d->spi, 0, 1), SPIFLASH_ERR_BAD_CONFIG);
+  TEST_CHECK(d->ctx.spi == 0);
+  TEST_CHECK(d->sim.errors == 0);
+  test_dev_free(d);
+}
+
+static void test_update(uint8_t async) {
+  test_dev_t *d = &_d;
+  uint32_t erases;
+  test_dev_init(d, async);
+  test_fill(_wr, 8192, 3);
+  TEST_RES(test_done(d, SPIFLASH_erase(&d->spi, 0x20000, 0x2000)), SPIFLASH_OK);
+  TEST_RES(test_done(d, SPIFLASH_write(&d->spi, 0x20000, 0x2000, _wr)), SPIFLASH_OK);
+
+  // setting bits needs an erase of both sectors, keeping the rest
+  memset(_rd, 0xa5, 200);
+  TEST_RES(test_done(d, SPIFLASH_update(&d->spi, 0x20f9c, 200, _rd,
+      _scratch, 4096)), SPIFLASH_OK);
+  TEST_CHECK(memcmp(&d->mem[0x20000], _wr, 0xf9c) == 0);
+  TEST_CHECK(memcmp(&d->mem[0x20f9c], _rd, 200) == 0);
+  TEST_CHECK(memcmp(&d->mem[0x20f9c + 200], &_wr[0xf9c + 200], 0x2000 - 0xf9c - 200) == 0);
+
+  // only clearing bits needs no erase
+  erases = d->sim.erases;
+  memset(_rd, 0x00, 16);
+  TEST_RES(test_done(d, SPIFLASH_update(&d->spi, 0x21800, 16, _rd,
+      _scratch, 4096)), SPIFLASH_OK);
+  TEST_CHECK(d->sim.erases == erases);
+  TEST_CHECK(memcmp(&d->mem[0x21800], _rd, 16) == 0);
+
+  TEST_RES(SPIFLASH_update(&d->spi, 0x20000, 16, _rd, _scratch, 1024),
+      SPIFLASH_ERR_ERASE_UNALIGNED);
+  TEST_CHECK(d->sim.errors == 0);
+  test_dev_free(d);
+}
+
+static void test_erase_preserve(uint8_t async) {
+  test_dev_t *d = &_d;
+  uint32_t i;
+  test_dev_init(d, async);
+  test_fill(_wr, 0x3000, 4);
+  TEST_RES(test_done(d, SPIFLASH_erase(&d->spi, 0x30000, 0x3000)), SPIFLASH_OK);
+  TEST_RES(test_done(d, SPIFLASH_write(&d->spi, 0x30000, 0x3000, _wr)), SPIFLASH_OK);
+
+  TEST_RES(test_done(d, SPIFLASH_erase_preserve(&d->spi, 0x30100, 0x1010,
+      _scratch, sizeof(_scratch))), SPIFLASH_OK);
+  TEST_CHECK(memcmp(&d->mem[0x30000], _wr, 0x100) == 0);
+  for (i = 0x30100; i < 0x31110; i++) {
+    TEST_CHECK(d->mem[i] == 0xff);
+  }
+  TEST_CHECK(memcmp(&d->mem[0x31110], &_wr[0x1110], 0x3000 - 0x1110) == 0);
+
+  TEST_RES(SPIFLASH_erase_preserve(&d->spi, 0x30100, 0x10, _scratch, 16),
+      SPIFLASH_ERR_ERASE_UNALIGNED);
+  TEST_CHECK(d->sim.errors == 0);
+  test_dev_free(d);
+}
+
+static uint32_t _produce_base;
+static uint32_t _produce_cnt;
+static uint32_t _produce_fail_at;
+static uint32_t _produce_addr[8];
+static uint32_t _produce_len[8];
+static uint8_t _produce_busy[8];
+static uint32_t _produce_programs[8];
+
+static int _test_produce_cb(spiflash_t *spi, uint32_t addr, uint8_t *buf,
+    uint32_t len) {
+  // produces _wr as written from _produce_base, noting when asked
+  spiflash_sim_t *sim = (spiflash_sim_t *)spi->user_data;
+  if (_produce_cnt < 8) {
+    _produce_addr[_produce_cnt] = addr;
+    _produce_len[_produce_cnt] = len;
+    _produce_busy[_produce_cnt] = sim->now_ns < sim->busy_until_ns;
+    _produce_programs[_produce_cnt] = sim->programs;
+  }
+  _produce_cnt++;
+  if (_produce_cnt == _produce_fail_at) return -5;
+  memcpy(buf, &_wr[addr - _produce_base], len);
+  return SPIFLASH_OK;
+}
+
+static uint32_t _stream_len;
+static uint32_t _stream_cnt;
+static uint8_t _stream_hold;
+static uint8_t *_stream_bufs[16];
+
+static void _test_stream_cb(spiflash_t *spi, uint8_t *buf, uint32_t len) {
+  // collects the stream into _scratch, releasing each buffer at once unless
+  // held
+  memcpy(&_scratch[_stream_len], buf, len);
+  _stream_len += len;
+  if (_stream_cnt < sizeof(_stream_bufs) / sizeof(_stream_bufs[0])) {
+    _stream_bufs[_stream_cnt] = buf;
+  }
+  _stream_cnt++;
+  if (!_stream_hold) SPIFLASH_stream_release(spi);
+}
+
+static void _test_stream_reset(uint8_t hold) {
+  _stream_len = 0;
+  _stream_cnt = 0;
+  _stream_hold = hold;
+}
+
+static void test_append(uint8_t async) {
+  test_dev_t *d = &_d;
+  spiflash_wbuf_t wb;
+  spiflash_stream_t st;
+  spiflash_iov_t rv[2];
+  uint8_t page[256];
+  uint8_t bufs[2 * 64];
+  uint32_t i, programs;
+  test_dev_init(d, async);
+  test_fill(_wr, 300, 5);
+  TEST_RES(SPIFLASH_append(&d->spi, 0x5000, 10, _wr), SPIFLASH_ERR_BAD_CONFIG);
+  TEST_RES(test_done(d, SPIFLASH_erase(&d->spi, 0x5000, 0x1000)), SPIFLASH_OK);
+  SPIFLASH_wbuf_init(&d->spi, &wb, page, 0);
+
+  programs = d->sim.programs;
+  for (i = 0; i < 10; i++) {
+    TEST_RES(test_done(d, SPIFLASH_append(&d->spi, 0x5000 + i * 30, 30,
+        &_wr[i * 30])), SPIFLASH_OK);
+  }
+  // one page programmed, the rest pending but seen by reads
+  TEST_CHECK(d->sim.programs == programs + 1);
+  TEST_CHECK(d->mem[0x5000 + 256] == 0xff);
+  memset(_rd, 0, sizeof(_rd));
+  TEST_RES(test_done(d, SPIFLASH_read(&d->spi, 0x5000, 300, _rd)), SPIFLASH_OK);
+  TEST_CHECK(memcmp(_rd, _wr, 300) == 0);
+
+  // as are scatter-gather, line and streamed reads
+  memset(_rd, 0, sizeof(_rd));
+  rv[0] = (spiflash_iov_t){ .addr = 0x50f0, .len = 0x20, .buf = &_rd[0] };
+  rv[1] = (spiflash_iov_t){ .addr = 0x5110, .len = 0x1c, .buf = &_rd[0x20] };
+  TEST_RES(test_done(d, SPIFLASH_readv(&d->spi, rv, 2)), SPIFLASH_OK);
+  TEST_CHECK(memcmp(&_rd[0], &_wr[0xf0], 0x20) == 0);
+  TEST_CHECK(memcmp(&_rd[0x20], &_wr[0x110], 0x1c) == 0);
+  memset(_rd, 0, sizeof(_rd));
+  TEST_RES(test_done(d, SPIFLASH_read_line(&d->spi, 0x5108, 32, 2, _rd)), SPIFLASH_OK);
+  TEST_CHECK(memcmp(_rd, &_wr[0x100], 300 - 0x100) == 0 && _rd[300 - 0x100] == 0xff);
+  _test_stream_reset(0);
+  TEST_RES(test_done(d, SPIFLASH_stream_start(&d->spi, &st, 0x5000, 300, bufs, 2,
+      64, _test_stream_cb)), SPIFLASH_OK);
+  TEST_CHECK(_stream_len == 300 && memcmp(_scratch, _wr, 300) == 0);
+  TEST_CHECK(d->sim.programs == programs + 1);
+
+  TEST_RES(test_done(d, SPIFLASH_flush(&d->spi)), SPIFLASH_OK);
+  TEST_CHECK(d->sim.programs == programs + 2);
+  TEST_CHECK(memcmp(&d->mem[0x5000], _wr, 300) == 0);
+  TEST_CHECK(d->sim.errors == 0);
+  test_dev_free(d);
+}
+
+static void test_write_skip(uint8_t async) {
+  test_dev_t *d = &_d;
+  uint8_t modes[] = { SPIFLASH_WRITE_SKIP_NONE, SPIFLASH_WRITE_SKIP_PAGES,
+      SPIFLASH_WRITE_SKIP_BYTES };
+  uint32_t m, programs[3];
+  uint64_t bus_ns[3];
+  test_dev_init(d, async);
+  TEST_FIXED_CFG(d);
+  // a page of data, one of 0xff, one with 0xff leading and one with 0xff
+  // trailing
+  test_fill(_wr, 0x400, 14);
+  memset(&_wr[0x100], 0xff, 0x100);
+  memset(&_wr[0x200], 0xff, 100);
+  memset(&_wr[0x400 - 50], 0xff, 50);
+
+  for (m = 0; m < sizeof(modes); m++) {
+    d->cfg.write_skip = modes[m];
+    test_dev_start(d);
+    TEST_RES(test_done(d, SPIFLASH_erase(&d->spi, 0xb000, 0x1000)), SPIFLASH_OK);
+    programs[m] = d->sim.programs;
+    bus_ns[m] = d->sim.bus_ns;
+    TEST_RES(test_done(d, SPIFLASH_write(&d->spi, 0xb000, 0x400, _wr)), SPIFLASH_OK);
+    programs[m] = d->sim.programs - programs[m];
+    bus_ns[m] = d->sim.bus_ns - bus_ns[m];
+    TEST_CHECK(memcmp(&d->mem[0xb000], _wr, 0x400) == 0);
+    TEST_CHECK(d->mem[0xb400] == 0xff);
+  }
+  TEST_CHECK(programs[0] == 4 && programs[1] == 3 && programs[2] == 3);
+  TEST_CHECK(bus_ns[1] < bus_ns[0] && bus_ns[2] < bus_ns[1]);
+
+  // nothing at all to program
+  m = d->sim.programs;
+  TEST_RES(test_done(d, SPIFLASH_write(&d->spi, 0xb800, 0x100, &_wr[0x100])), SPIFLASH_OK);
+  TEST_CHECK(d->sim.programs == m);
+  TEST_CHECK(d->sim.errors == 0);
+  test_dev_free(d);
+}
+
+static void test_write_produce(uint8_t async) {
+  test_dev_t *d = &_d;
+  spiflash_produce_t pr;
+  uint8_t bufs[2 * 256];
+  uint32_t i, programs, xfers;
+  test_dev_init(d, async);
+  test_fill(_wr, 0x1000, 13);
+  TEST_RES(test_done(d, SPIFLASH_erase(&d->spi, 0xa000, 0x1000)), SPIFLASH_OK);
+
+  // a partial first page, two whole ones and a short last one
+  _produce_base = 0xa010;
+  _produce_cnt = 0;
+  _produce_fail_at = 0;
+  programs = d->sim.programs;
+  xfers = d->sim.xfers;
+  TEST_RES(test_done(d, SPIFLASH_write_produce(&d->spi, &pr, 0xa010, 808, bufs,
+      _test_produce_cb)), SPIFLASH_OK);
+  TEST_CHECK(_produce_cnt == 4 && d->sim.programs == programs + 4);
+  TEST_CHECK(memcmp(&d->mem[0xa010], _wr, 808) == 0);
+  TEST_CHECK(d->mem[0xa00f] == 0xff && d->mem[0xa010 + 808] == 0xff);
+  TEST_CHECK(_produce_addr[0] == 0xa010 && _produce_len[0] == 240);
+  TEST_CHECK(_produce_addr[1] == 0xa100 && _produce_len[1] == 256);
+  TEST_CHECK(_produce_addr[2] == 0xa200 && _produce_len[2] == 256);
+  TEST_CHECK(_produce_addr[3] == 0xa300 && _produce_len[3] == 56);
+  // the first page before talking to the flash, the others while the page
+  // before is programmed
+  TEST_CHECK(!_produce_busy[0] && _produce_programs[0] == programs);
+  TEST_CHECK(d->sim.xfers != xfers);
+  for (i = 1; i < 4; i++) {
+    TEST_CHECK(_produce_busy[i] && _produce_programs[i] == programs + i);
+  }
+
+  // a failing producer aborts the write
+  TEST_RES(test_done(d, SPIFLASH_erase(&d->spi, 0xa000, 0x1000)), SPIFLASH_OK);
+  _produce_cnt = 0;
+  _produce_fail_at = 3;
+  programs = d->sim.programs;
+  TEST_RES(test_done(d, SPIFLASH_write_produce(&d->spi, &pr, 0xa010, 808, bufs,
+      _test_produce_cb)), -5);
+  TEST_CHECK(_produce_cnt == 3 && d->sim.programs == programs + 2);
+  TEST_CHECK(memcmp(&d->mem[0xa010], _wr, 496) == 0 && d->mem[0xa200] == 0xff);
+  _produce_cnt = 0;
+  _produce_fail_at = 1;
+  TEST_RES(SPIFLASH_write_produce(&d->spi, &pr, 0xa010, 808, bufs,
+      _test_produce_cb), -5);
+  TEST_CHECK(d->ctx.spi == 0);
+  TEST_CHECK(d->sim.errors == 0);
+  test_dev_free(d);
+}
+
+static void test_stream(uint8_t async) {
+  test_dev_t *d = &_d;
+  spiflash_stream_t st;
+  uint8_t bufs[3 * 100];
+  uint32_t i;
+  test_dev_init(d, async);
+  test_fill(d->mem, 0x10000, 12);
+
+  // buffers filled in turn, released at once
+  _test_stream_reset(0);
+  TEST_RES(test_done(d, SPIFLASH_stream_start(&d->spi, &st, 0x9010, 1050, bufs, 3,
+      100, _test_stream_cb)), SPIFLASH_OK);
+  TEST_CHECK(_stream_len == 1050 && _stream_cnt == 11);
+  TEST_CHECK(memcmp(_scratch, &d->mem[0x9010], 1050) == 0);
+  for (i = 0; i < _stream_cnt; i++) {
+    TEST_CHECK(_stream_bufs[i] == &bufs[(i % 3) * 100]);
+  }
+  TEST_CHECK(d->ctx.spi == 0);
+
+  // held buffers pause the stream, which lets other operations in
+  _test_stream_reset(1);
+  TEST_RES(SPIFLASH_stream_start(&d->spi, &st, 0x9123, 500, bufs, 2, 100,
+      _test_stream_cb), SPIFLASH_OK);
+  SPIFLASH_sim_run(&d->spi);
+  TEST_CHECK(_stream_cnt == 2 && d->cb_cnt == 0 && st.paused);
+  memset(_rd, 0, sizeof(_rd));
+  TEST_RES(test_done(d, SPIFLASH_read(&d->spi, 0x100, 16, _rd)), SPIFLASH_OK);
+  TEST_CHECK(memcmp(_rd, &d->mem[0x100], 16) == 0);
+  TEST_CHECK(_stream_cnt == 2 && st.paused);
+  while (_stream_cnt < 5) {
+    i = _stream_cnt;
+    TEST_RES(SPIFLASH_stream_release(&d->spi), SPIFLASH_OK);
+    SPIFLASH_sim_run(&d->spi);
+    TEST_CHECK(_stream_cnt == i + 1);
+  }
+  TEST_RES(SPIFLASH_stream_release(&d->spi), SPIFLASH_OK);
+  TEST_RES(SPIFLASH_stream_release(&d->spi), SPIFLASH_OK);
+  TEST_RES(SPIFLASH_stream_release(&d->spi), SPIFLASH_ERR_BAD_STATE);
+  TEST_CHECK(d->cb_cnt == (async ? 1 : 0) && d->cb_res == SPIFLASH_OK);
+  TEST_CHECK(_stream_len == 500 && memcmp(_scratch, &d->mem[0x9123], 500) == 0);
+  for (i = 0; i < _stream_cnt; i++) {
+    TEST_CHECK(_stream_bufs[i] == &bufs[(i % 2) * 100]);
+  }
+  TEST_CHECK(d->ctx.spi == 0);
+  TEST_CHECK(d->sim.errors == 0);
+  test_dev_free(d);
+}
+
+static void test_cache(uint8_t async) {
+  test_dev_t *d = &_d;
+  spiflash_cache_t cache;
+  spiflash_cache_line_t lines[2];
+  uint8_t mem[2 * 64];
+  uint32_t xfers, hits, misses, i;
+  test_dev_init(d, async);
+  test_fill(_wr, 0x100, 11);
+  TEST_RES(test_done(d, SPIFLASH_erase(&d->spi, 0x8000, 0x1000)), SPIFLASH_OK);
+  TEST_RES(test_done(d, SPIFLASH_write(&d->spi, 0x8000, 0x100, _wr)), SPIFLASH_OK);
+  TEST_RES(SPIFLASH_cache_init(&d->spi, &cache, lines, mem, 2, 48), SPIFLASH_ERR_BAD_CONFIG);
+  TEST_RES(SPIFLASH_cache_init(&d->spi, &cache, lines, mem, 2, 64), SPIFLASH_OK);
+
+  // a line filled by a miss serves the next read without the flash
+  TEST_RES(test_done(d, SPIFLASH_read(&d->spi, 0x8004, 16, _rd)), SPIFLASH_OK);
+  xfers = d->sim.xfers;
+  memset(_rd, 0, sizeof(_rd));
+  TEST_RES(test_done(d, SPIFLASH_read(&d->spi, 0x8020, 32, _rd)), SPIFLASH_OK);
+  TEST_CHECK(d->sim.xfers == xfers);
+  TEST_CHECK(memcmp(_rd, &_wr[0x20], 32) == 0);
+
+  // the least recently used line is evicted
+  TEST_RES(test_done(d, SPIFLASH_read(&d->spi, 0x8040, 16, _rd)), SPIFLASH_OK);
+  TEST_RES(test_done(d, SPIFLASH_read(&d->spi, 0x8000, 16, _rd)), SPIFLASH_OK);
+  TEST_RES(test_done(d, SPIFLASH_read(&d->spi, 0x8080, 16, _rd)), SPIFLASH_OK);
+  xfers = d->sim.xfers;
+  TEST_RES(test_done(d, SPIFLASH_read(&d->spi, 0x8000, 16, _rd)), SPIFLASH_OK);
+  TEST_RES(test_done(d, SPIFLASH_read(&d->spi, 0x8080, 16, _rd)), SPIFLASH_OK);
+  TEST_CHECK(d->sim.xfers == xfers);
+  TEST_RES(test_done(d, SPIFLASH_read(&d->spi, 0x8040, 16, _rd)), SPIFLASH_OK);
+  TEST_CHECK(d->sim.xfers != xfers);
+  TEST_CHECK(memcmp(_rd, &_wr[0x40], 16) == 0);
+
+  // writes go through, updating the cached line
+  memset(_scratch, 0, 4);
+  TEST_RES(test_done(d, SPIFLASH_write(&d->spi, 0x8048, 4, _scratch)), SPIFLASH_OK);
+  xfers = d->sim.xfers;
+  TEST_RES(test_done(d, SPIFLASH_read(&d->spi, 0x8040, 64, _rd)), SPIFLASH_OK);
+  TEST_CHECK(d->sim.xfers == xfers);
+  TEST_CHECK(memcmp(_rd, &d->mem[0x8040], 64) == 0 && _rd[8] == 0 && _rd[11] == 0);
+
+  // erases too
+  TEST_RES(test_done(d, SPIFLASH_erase(&d->spi, 0x8000, 0x1000)), SPIFLASH_OK);
+  xfers = d->sim.xfers;
+  TEST_RES(test_done(d, SPIFLASH_read(&d->spi, 0x8080, 64, _rd)), SPIFLASH_OK);
+  TEST_CHECK(d->sim.xfers == xfers);
+  for (i = 0; i < 64; i++) {
+    TEST_CHECK(_rd[i] == 0xff);
+  }
+
+  SPIFLASH_cache_invalidate(&d->spi);
+  TEST_RES(test_done(d, SPIFLASH_read(&d->spi, 0x8080, 64, _rd)), SPIFLASH_OK);
+  TEST_CHECK(d->sim.xfers != xfers);
+  SPIFLASH_cache_stats(&d->spi, &hits, &misses);
+  TEST_CHECK(hits == 6 && misses == 5);
+  TEST_CHECK(d->sim.errors == 0);
+  test_dev_free(d);
+}
+
+static void test_verify(uint8_t async) {
+  test_dev_t *d = &_d;
+  uint32_t crc = 0;
+  test_dev_init(d, async);
+  test_fill(_wr, 3000, 6);
+  TEST_RES(test_done(d, SPIFLASH_erase(&d->spi, 0x6000, 0x1000)), SPIFLASH_OK);
+  TEST_RES(test_done(d, SPIFLASH_write(&d->spi, 0x6010, 3000, _wr)), SPIFLASH_OK);
+
+  TEST_RES(test_done(d, SPIFLASH_verify(&d->spi, 0x6010, 3000, _wr)), SPIFLASH_OK);
+  TEST_RES(test_done(d, SPIFLASH_crc32(&d->spi, 0x6010, 3000, &crc)), SPIFLASH_OK);
+  TEST_CHECK(crc == SPIFLASH_crc32_calc(0, _wr, 3000));
+  _wr[2999] ^= 1;
+  TEST_RES(test_done(d, SPIFLASH_verify(&d->spi, 0x6010, 3000, _wr)), SPIFLASH_ERR_VERIFY);
+
+  // the same again checksummed by the hal
+  d->hal._spiflash_spi_rx_crc32 = 0;
+  test_dev_start(d);
+  TEST_RES(test_done(d, SPIFLASH_verify(&d->spi, 0x6010, 3000, _wr)), SPIFLASH_ERR_VERIFY);
+  _wr[2999] ^= 1;
+  TEST_RES(test_done(d, SPIFLASH_verify(&d->spi, 0x6010, 3000, _wr)), SPIFLASH_OK);
+
+  // programming over programmed data does not give the new data
+  TEST_FIXED_CFG(d);
+  d->cfg.write_verify = 1;
+  test_dev_start(d);
+  TEST_RES(test_done(d, SPIFLASH_write(&d->spi, 0x6010, 3000, _wr)), SPIFLASH_OK);
+  test_fill(_wr, 3000, 7);
+  TEST_RES(test_done(d, SPIFLASH_write(&d->spi, 0x6010, 3000, _wr)), SPIFLASH_ERR_VERIFY);
+
+  // nothing to read back through without a sequence context
+  SPIFLASH_seq_init(&d->ctx, 0);
+  TEST_RES(SPIFLASH_write(&d->spi, 0x6010, 3000, _wr), SPIFLASH_ERR_BAD_CONFIG);
+  TEST_RES(SPIFLASH_verify(&d->spi, 0x6010, 3000, _wr), SPIFLASH_ERR_BAD_CONFIG);
+  TEST_RES(SPIFLASH_crc32(&d->spi, 0x6010, 3000, &crc), SPIFLASH_ERR_BAD_CONFIG);
+  TEST_RES(SPIFLASH_is_busy(&d->spi), SPIFLASH_OK);
+  TEST_CHECK(d->sim.errors == 0);
+  test_dev_free(d);
+}
+
+static void test_xip(uint8_t async) {
+  test_dev_t *d = &_d;
+  uint32_t i;
+  test_dev_init(d, async);
+  TEST_RES(SPIFLASH_xip_enter(&d->spi), SPIFLASH_ERR_BAD_CONFIG);
+  TEST_FIXED_CFG(d);
+  d->cmd.xip_mode_bits = 0xa0;
+  test_dev_start(d);
+  test_fill(_wr, 512, 8);
+  TEST_RES(test_done(d, SPIFLASH_erase(&d->spi, 0x7000, 0x1000)), SPIFLASH_OK);
+  TEST_RES(test_done(d, SPIFLASH_write(&d->spi, 0x7000, 512, _wr)), SPIFLASH_OK);
+
+  TEST_RES(SPIFLASH_xip_enter(&d->spi), SPIFLASH_OK);
+  for (i = 0; i < 4; i++) {
+    memset(_rd, 0, sizeof(_rd));
+    TEST_RES(test_done(d, SPIFLASH_read(&d->spi, 0x7000 + i * 100, 100, _rd)), SPIFLASH_OK);
+    TEST_CHECK(memcmp(_rd, &_wr[i * 100], 100) == 0);
+    // the flash stays in continuous read mode between reads
+    TEST_CHECK(d->sim.cont);
+  }
+  // writes leave continuous read mode, and reads go back to it
+  TEST_RES(test_done(d, SPIFLASH_write(&d->spi, 0x7200, 16, _wr)), SPIFLASH_OK);
+  TEST_CHECK(memcmp(&d->mem[0x7200], _wr, 16) == 0);
+  TEST_RES(test_done(d, SPIFLASH_read(&d->spi, 0x7200, 16, _rd)), SPIFLASH_OK);
+  TEST_CHECK(memcmp(_rd, _wr, 16) == 0);
+  TEST_CHECK(d->sim.cont);
+
+  TEST_RES(SPIFLASH_xip_exit(&d->spi), SPIFLASH_OK);
+  _test_settle(d);
+  TEST_CHECK(!d->sim.cont);
+  TEST_RES(test_done(d, SPIFLASH_read(&d->spi, 0x7000, 100, _rd)), SPIFLASH_OK);
+  TEST_CHECK(memcmp(_rd, _wr, 100) == 0);
+  TEST_CHECK(d->sim.errors == 0);
+  test_dev_free(d);
+}
+
+static void test_read_line(uint8_t async) {
+  test_dev_t *d = &_d;
+  uint8_t wraps[] = { 0, 32 };
+  uint32_t w, a, lines, i;
+  test_dev_init(d, async);
+  TEST_FIXED_CFG(d);
+  d->cmd.set_burst_wrap = 0x77;
+  test_dev_start(d);
+  test_fill(d->mem, TEST_FLASH_SZ, 9);
+
+  for (w = 0; w < sizeof(wraps); w++) {
+    TEST_RES(test_done(d, SPIFLASH_set_burst_wrap(&d->spi, wraps[w])), SPIFLASH_OK);
+    TEST_CHECK(d->sim.wrap == wraps[w]);
+    for (lines = 1; lines <= 3; lines++) {
+      for (a = 0x8000; a < 0x8000 + 32; a += 7) {
+        memset(_rd, 0, sizeof(_rd));
+        TEST_RES(test_done(d, SPIFLASH_read_line(&d->spi, a, 32, lines, _rd)), SPIFLASH_OK);
+        TEST_CHECK(memcmp(_rd, &d->mem[0x8000], 32 * lines) == 0);
+      }
+    }
+    // other reads do not wrap
+    TEST_RES(test_done(d, SPIFLASH_fast_read(&d->spi, 0x9011, 100, _rd)), SPIFLASH_OK);
+    TEST_CHECK(memcmp(_rd, &d->mem[0x9011], 100) == 0);
+  }
+  TEST_RES(test_done(d, SPIFLASH_set_burst_wrap(&d->spi, 16)), SPIFLASH_OK);
+  TEST_RES(SPIFLASH_xip_enter(&d->spi), SPIFLASH_ERR_BAD_STATE);
+  TEST_RES(SPIFLASH_set_burst_wrap(&d->spi, 12), SPIFLASH_ERR_BAD_CONFIG);
+  TEST_RES(SPIFLASH_read_line(&d->spi, 0, 12, 1, _rd), SPIFLASH_ERR_BAD_CONFIG);
+  TEST_RES(SPIFLASH_read_line(&d->spi, 0, 16, 0, _rd), SPIFLASH_ERR_BAD_CONFIG);
+  for (i = 0; i < 16; i++) {
+    TEST_RES(test_done(d, SPIFLASH_read_line(&d->spi, 0xa000 + i, 16, 1, _rd)), SPIFLASH_OK);
+    TEST_CHECK(memcmp(_rd, &d->mem[0xa000], 16) == 0);
+  }
+  TEST_CHECK(d->sim.errors == 0);
+  test_dev_free(d);
+}
+
+static void test_suspend(uint8_t async) {
+  test_dev_t *d = &_d;
+  uint64_t t0_ns;
+  uint32_t i;
+  // suspends only happen asynchronously
+  if (!async) return;
+  test_dev_init(d, async);
+  test_fill(&d->mem[0x30000], 0x2000, 13);
+  memcpy(_wr, &d->mem[0x31000], 0x100);
+
+  // served while the erase is suspended
+  t0_ns = d->sim.now_ns;
+  TEST_RES(SPIFLASH_erase(&d->spi, 0x30000, 0x1000), SPIFLASH_OK);
+  TEST_RES(SPIFLASH_read(&d->spi, 0x31000, 0x100, _rd), SPIFLASH_OK);
+  TEST_RES(SPIFLASH_read(&d->spi, 0x31000, 0x100, _rd), SPIFLASH_ERR_BUSY);
+  SPIFLASH_sim_run(&d->spi);
+  TEST_CHECK(d->cb_cnt == 2 && d->cb_res == SPIFLASH_OK);
+  TEST_CHECK(memcmp(_rd, _wr, 0x100) == 0);
+  // the suspend is polled in microseconds, adding little to the erase
+  TEST_CHECK(d->sim.now_ns - t0_ns < d->cfg.block_erase_4_ms * 1000000ull + 500000);
+  d->cb_cnt = 0;
+
+  // the block being erased is read once erased, the simulated flash
+  // counts reads of a suspended block as errors
+  TEST_RES(SPIFLASH_erase(&d->spi, 0x31000, 0x1000), SPIFLASH_OK);
+  TEST_RES(SPIFLASH_read(&d->spi, 0x30ff0, 0x20, _rd), SPIFLASH_OK);
+  SPIFLASH_sim_run(&d->spi);
+  TEST_CHECK(d->cb_cnt == 2 && d->cb_res == SPIFLASH_OK);
+  for (i = 0; i < 0x20; i++) {
+    TEST_CHECK(_rd[i] == 0xff);
+  }
+  d->cb_cnt = 0;
+
+  // and the page being programmed once programmed
+  test_fill(_wr, 0x200, 14);
+  TEST_RES(SPIFLASH_write(&d->spi, 0x31000, 0x200, _wr), SPIFLASH_OK);
+  TEST_RES(SPIFLASH_read(&d->spi, 0x31000, 0x10, _rd), SPIFLASH_OK);
+  SPIFLASH_sim_run(&d->spi);
+  TEST_CHECK(d->cb_cnt == 2 && d->cb_res == SPIFLASH_OK);
+  TEST_CHECK(memcmp(_rd, _wr, 0x10) == 0);
+  TEST_CHECK(memcmp(&d->mem[0x31000], _wr, 0x200) == 0);
+  d->cb_cnt = 0;
+
+  // without suspend state, reads wait for the erase
+  SPIFLASH_suspend_init(&d->ctx, 0);
+  TEST_RES(SPIFLASH_erase(&d->spi, 0x30000, 0x1000), SPIFLASH_OK);
+  TEST_RES(SPIFLASH_read(&d->spi, 0x31000, 0x10, _rd), SPIFLASH_ERR_BUSY);
+  TEST_RES(test_done(d, SPIFLASH_OK), SPIFLASH_OK);
+  TEST_CHECK(d->sim.errors == 0);
+  test_dev_free(d);
+}
+
+static void test_timing(uint8_t async) {
+  test_dev_t *d = &_d;
+  spiflash_timing_t tm;
+  uint32_t i, xfers, fixed;
+  test_dev_init(d, async);
+  // polled by the driver in whole waits, the flash erasing in three times
+  // the typical time
+  TEST_FIXED_CFG(d);
+  d->cfg.suspend_poll_ms = 0;
+  d->hal._spiflash_wait_ready = 0;
+  test_dev_start(d);
+  d->sim.busy_pct = 300;
+  xfers = d->sim.xfers;
+  for (i = 0; i < 8; i++) {
+    TEST_RES(test_done(d, SPIFLASH_erase(&d->spi, i * 0x1000, 0x1000)), SPIFLASH_OK);
+  }
+  fixed = d->sim.xfers - xfers;
+
+  // the estimate follows, polling less than the halving intervals
+  SPIFLASH_timing_init(&d->spi, &tm);
+  for (i = 0; i < 8; i++) {
+    TEST_RES(test_done(d, SPIFLASH_erase(&d->spi, i * 0x1000, 0x1000)), SPIFLASH_OK);
+  }
+  xfers = d->sim.xfers;
+  for (i = 0; i < 8; i++) {
+    TEST_RES(test_done(d, SPIFLASH_erase(&d->spi, i * 0x1000, 0x1000)), SPIFLASH_OK);
+  }
+  TEST_CHECK(d->sim.xfers - xfers < fixed);
+  TEST_CHECK(tm.est_us[2] > d->cfg.block_erase_4_ms * 1000 * 2);
+  TEST_CHECK(d->sim.errors == 0);
+  test_dev_free(d);
+}
+
+static void test_stats(uint8_t async) {
+  test_dev_t *d = &_d;
+  spiflash_stats_t st, got;
+  test_dev_init(d, async);
+#if SPIFLASH_STATS
+  TEST_RES(SPIFLASH_stats_get(&d->spi, &got), SPIFLASH_ERR_BAD_CONFIG);
+  TEST_RES(SPIFLASH_stats_init(&d->spi, &st), SPIFLASH_OK);
+  TEST_RES(test_done(d, SPIFLASH_erase(&d->spi, 0x7000, 0x1000)), SPIFLASH_OK);
+  TEST_RES(test_done(d, SPIFLASH_write(&d->spi, 0x7000, 0x100, _wr)), SPIFLASH_OK);
+  TEST_RES(SPIFLASH_stats_get(&d->spi, &got), SPIFLASH_OK);
+  TEST_CHECK(got.op[SPIFLASH_OP_ERASE_BLOCK_sWREN].count == 1);
+  TEST_CHECK(got.op[SPIFLASH_OP_ERASE_BLOCK_sWREN].bytes == 0x1000);
+  TEST_CHECK(got.op[SPIFLASH_OP_WRITE_sWREN].count == 1);
+  TEST_CHECK(got.op[SPIFLASH_OP_WRITE_sWREN].bytes == 0x100);
+  SPIFLASH_stats_reset(&d->spi);
+  TEST_CHECK(st.op[SPIFLASH_OP_WRITE_sWREN].count == 0);
+  // detached, nothing is counted
+  TEST_RES(SPIFLASH_stats_init(&d->spi, 0), SPIFLASH_OK);
+  TEST_RES(test_done(d, SPIFLASH_erase(&d->spi, 0x7000, 0x1000)), SPIFLASH_OK);
+  TEST_CHECK(st.op[SPIFLASH_OP_ERASE_BLOCK_sWREN].count == 0);
+#else
+  (void)got;
+  TEST_RES(SPIFLASH_stats_init(&d->spi, &st), SPIFLASH_ERR_UNSUPPORTED);
+#endif
+  test_dev_free(d);
+}
+
+#define TEST_REQS   (8)
+
+static spiflash_req_t _reqs[TEST_REQS];
+static uint32_t _done_addr[TEST_REQS];
+static int _done_res[TEST_REQS];
+static uint32_t _done_cnt;
+
+static void _test_req_cb(spiflash_t *spi, const spiflash_req_t *req,
+    int err_code) {
+  (void)spi;
+  if (_done_cnt < TEST_REQS) {
+    _done_addr[_done_cnt] = req->addr;
+    _done_res[_done_cnt] = err_code;
+  }
+  _done_cnt++;
+}
+
+static void _test_submit(test_dev_t *d, spiflash_req_type_t type, int8_t prio,
+    uint32_t addr, uint32_t len, uint8_t *buf, int *res) {
+  spiflash_req_t req;
+  memset(&req, 0, sizeof(req));
+  req.type = type;
+  req.prio = prio;
+  req.addr = addr;
+  req.len = len;
+  req.rd_buf = buf;
+  req.cb = _test_req_cb;
+  *res = SPIFLASH_submit(&d->spi, &req);
+}
+
+static int _crit_depth;
+static uint32_t _crit_cnt;
+
+static void _test_critical(spiflash_t *spi, uint8_t enter) {
+  (void)spi;
+  _crit_depth += enter ? 1 : -1;
+  _crit_cnt++;
+}
+
+static void test_queue(uint8_t async) {
+  test_dev_t *d = &_d;
+  int res;
+  test_dev_init(d, async);
+  _done_cnt = 0;
+  // queued only if there is a queue
+  _test_submit(d, SPIFLASH_REQ_READ, SPIFLASH_PRIO_NORMAL, 0x50000, 0x100, _rd, &res);
+  TEST_RES(res, async ? SPIFLASH_ERR_QUEUE_FULL : SPIFLASH_OK);
+  d->hal._spiflash_critical = _test_critical;
+  test_dev_start(d);
+  _crit_depth = 0;
+  _crit_cnt = 0;
+  SPIFLASH_queue_init(&d->spi, &d->q, _reqs, TEST_REQS);
+  _done_cnt = 0;
+  test_fill(_wr, 256, 10);
+  test_fill(&d->mem[0x50000], 0x100, 11);
+
+  _test_submit(d, SPIFLASH_REQ_ERASE, SPIFLASH_PRIO_BACKGROUND, 0x40000, 0x10000, 0, &res);
+  TEST_RES(res, SPIFLASH_OK);
+  _test_submit(d, SPIFLASH_REQ_WRITE, SPIFLASH_PRIO_NORMAL, 0x60000, 256, _wr, &res);
+  TEST_RES(res, SPIFLASH_OK);
+  _test_submit(d, SPIFLASH_REQ_READ, SPIFLASH_PRIO_CRITICAL, 0x50000, 0x100, _rd, &res);
+  TEST_RES(res, SPIFLASH_OK);
+  SPIFLASH_sim_run(&d->spi);
+
+  TEST_CHECK(_done_cnt == 3);
+  TEST_CHECK(_done_res[0] == SPIFLASH_OK && _done_res[1] == SPIFLASH_OK &&
+      _done_res[2] == SPIFLASH_OK);
+  if (async) {
+    // the read is served while the erase is suspended, the write waits
+    TEST_CHECK(_done_addr[0] == 0x50000 && _done_addr[1] == 0x40000 &&
+        _done_addr[2] == 0x60000);
+  } else {
+    TEST_CHECK(_done_addr[0] == 0x40000 && _done_addr[1] == 0x60000 &&
+        _done_addr[2] == 0x50000);
+  }
+  TEST_CHECK(memcmp(_rd, &d->mem[0x50000], 0x100) == 0);
+  TEST_CHECK(memcmp(&d->mem[0x60000], _wr, 256) == 0);
+  TEST_CHECK(d->mem[0x40000] == 0xff && d->mem[0x4ffff] == 0xff);
+  // critical sections only in asynchronous mode, and left as entered
+  TEST_CHECK(_crit_depth == 0 && (_crit_cnt > 0) == async);
+  TEST_CHECK(d->sim.errors == 0);
+  test_dev_free(d);
+}
+
+static void test_queue_suspend(uint8_t async) {
+  test_dev_t *d = &_d;
+  static uint8_t rd_a[0x100], rd_b[0x100];
+  uint32_t i;
+  int res;
+  // suspends only happen asynchronously
+  if (!async) return;
+  test_dev_init(d, async);
+  SPIFLASH_queue_init(&d->spi, &d->q, _reqs, TEST_REQS);
+  _done_cnt = 0;
+  test_fill(&d->mem[0x50000], 0x2000, 12);
+  memset(rd_a, 0, sizeof(rd_a));
+  memset(rd_b, 0, sizeof(rd_b));
+
+  _test_submit(d, SPIFLASH_REQ_ERASE, SPIFLASH_PRIO_BACKGROUND, 0x40000, 0x10000, 0, &res);
+  TEST_RES(res, SPIFLASH_OK);
+  _test_submit(d, SPIFLASH_REQ_READ, SPIFLASH_PRIO_NORMAL, 0x50000, 0x100, rd_a, &res);
+  TEST_RES(res, SPIFLASH_OK);
+  // a more urgent read arrives while the first is served in a suspend
+  while (d->sim.pending && d->ctx.sus == 0) {
+    d->sim.pending = 0;
+    SPIFLASH_async_trigger(&d->spi, SPIFLASH_OK);
+  }
+  TEST_CHECK(d->ctx.sus != 0);
+  _test_submit(d, SPIFLASH_REQ_READ, SPIFLASH_PRIO_CRITICAL, 0x51000, 0x100, rd_b, &res);
+  TEST_RES(res, SPIFLASH_OK);
+  SPIFLASH_sim_run(&d->spi);
+
+  TEST_CHECK(_done_cnt == 3);
+  for (i = 0; i < 3; i++) {
+    TEST_RES(_done_res[i], SPIFLASH_OK);
+  }
+  TEST_CHECK(_done_addr[0] == 0x50000 && _done_addr[1] == 0x51000 &&
+      _done_addr[2] == 0x40000);
+  TEST_CHECK(memcmp(rd_a, &d->mem[0x50000], 0x100) == 0);
+  TEST_CHECK(memcmp(rd_b, &d->mem[0x51000], 0x100) == 0);
+  TEST_CHECK(d->mem[0x40000] == 0xff && d->mem[0x4ffff] == 0xff);
+
+  // a read of the erased block waits, without holding up other reads
+  _done_cnt = 0;
+  _test_submit(d, SPIFLASH_REQ_ERASE, SPIFLASH_PRIO_BACKGROUND, 0x50000, 0x1000, 0, &res);
+  TEST_RES(res, SPIFLASH_OK);
+  _test_submit(d, SPIFLASH_REQ_READ, SPIFLASH_PRIO_CRITICAL, 0x50f00, 0x100, rd_a, &res);
+  TEST_RES(res, SPIFLASH_OK);
+  _test_submit(d, SPIFLASH_REQ_READ, SPIFLASH_PRIO_CRITICAL, 0x51000, 0x100, rd_b, &res);
+  TEST_RES(res, SPIFLASH_OK);
+  SPIFLASH_sim_run(&d->spi);
+  TEST_CHECK(_done_cnt == 3);
+  TEST_CHECK(_done_addr[0] == 0x51000 && _done_addr[1] == 0x50000 &&
+      _done_addr[2] == 0x50f00);
+  for (i = 0; i < 0x100; i++) {
+    TEST_CHECK(rd_a[i] == 0xff);
+  }
+  TEST_CHECK(memcmp(rd_b, &d->mem[0x51000], 0x100) == 0);
+  TEST_CHECK(d->sim.errors == 0);
+  test_dev_free(d);
+}
+
+static uint32_t _txrx_fail_at;
+
+static int _test_txrx_fail(spiflash_t *spi, const uint8_t *tx_data,
+    uint32_t tx_len, uint8_t *rx_data, uint32_t rx_len) {
+  // fails the n:th transfer
+  if (_txrx_fail_at && --_txrx_fail_at == 0) return -1;
+  return SPIFLASH_sim_hal._spiflash_spi_txrx(spi, tx_data, tx_len, rx_data, rx_len);
+}
+
+static uint8_t _cmds_seen[256];
+
+static void _test_cs_seen(spiflash_t *spi, uint8_t cs) {
+  // notes the command of each transaction
+  spiflash_sim_t *sim = (spiflash_sim_t *)spi->user_data;
+  SPIFLASH_sim_hal._spiflash_spi_cs(spi, cs);
+  if (!cs) _cmds_seen[sim->code] = 1;
+}
+
+static void test_addr_4b(uint8_t async) {
+  // a 32 MB flash with 3 byte addresses, accessed across 16 MB
+  test_dev_t *d = &_d;
+  const uint32_t mb16 = 0x1000000;
+  uint32_t i;
+  test_dev_init(d, async);
+  TEST_FIXED_CFG(d);
+  free(d->mem);
+  d->cfg.sz = 2 * mb16;
+  d->mem = malloc(d->cfg.sz);
+  SPIFLASH_sim_init(&d->sim, &d->cfg, &d->cmd, d->mem);
+  d->hal._spiflash_spi_cs = _test_cs_seen;
+  test_dev_start(d);
+  test_fill(_wr, 0x3000, 15);
+
+  memset(_cmds_seen, 0, sizeof(_cmds_seen));
+  TEST_RES(test_done(d, SPIFLASH_erase(&d->spi, mb16 - 0x10000, 0x20000)), SPIFLASH_OK);
+  TEST_CHECK(_cmds_seen[d->cmd.block_erase_64] && _cmds_seen[d->cmd.block_erase_64_4b]);
+  memset(_cmds_seen, 0, sizeof(_cmds_seen));
+  TEST_RES(test_done(d, SPIFLASH_erase(&d->spi, mb16 + 0x20000, 0x1000)), SPIFLASH_OK);
+  TEST_CHECK(_cmds_seen[d->cmd.block_erase_4_4b] && !_cmds_seen[d->cmd.block_erase_4]);
+  for (i = 0; i < 0x1000; i++) {
+    TEST_CHECK(d->mem[mb16 - 0x800 + i] == 0xff);
+  }
+
+  memset(_cmds_seen, 0, sizeof(_cmds_seen));
+  TEST_RES(test_done(d, SPIFLASH_write(&d->spi, mb16 - 0x810, 0x1000, _wr)), SPIFLASH_OK);
+  TEST_CHECK(_cmds_seen[d->cmd.page_program] && _cmds_seen[d->cmd.page_program_4b]);
+  TEST_CHECK(memcmp(&d->mem[mb16 - 0x810], _wr, 0x1000) == 0);
+  TEST_CHECK(d->mem[mb16 - 0x811] == 0xff && d->mem[mb16 - 0x810 + 0x1000] == 0xff);
+  TEST_RES(test_done(d, SPIFLASH_write(&d->spi, mb16 + 0x20010, 0x100, _wr)), SPIFLASH_OK);
+  TEST_CHECK(memcmp(&d->mem[mb16 + 0x20010], _wr, 0x100) == 0);
+
+  // reads reaching beyond 16 MB are single 4 byte address transactions
+  memset(_cmds_seen, 0, sizeof(_cmds_seen));
+  memset(_rd, 0, sizeof(_rd));
+  TEST_RES(test_done(d, SPIFLASH_read(&d->spi, mb16 - 0x810, 0x1000, _rd)), SPIFLASH_OK);
+  TEST_CHECK(_cmds_seen[d->cmd.read_data_4b] && !_cmds_seen[d->cmd.read_data]);
+  TEST_CHECK(memcmp(_rd, _wr, 0x1000) == 0);
+  memset(_cmds_seen, 0, sizeof(_cmds_seen));
+  memset(_rd, 0, sizeof(_rd));
+  TEST_RES(test_done(d, SPIFLASH_fast_read(&d->spi, mb16 - 0x810, 0x1000, _rd)), SPIFLASH_OK);
+  TEST_CHECK(_cmds_seen[d->cmd.read_data_quad_io_4b] && !_cmds_seen[d->cmd.read_data_quad_io]);
+  TEST_CHECK(memcmp(_rd, _wr, 0x1000) == 0);
+  memset(_rd, 0, sizeof(_rd));
+  TEST_RES(test_done(d, SPIFLASH_fast_read(&d->spi, mb16 + 0x20010, 0x100, _rd)), SPIFLASH_OK);
+  TEST_CHECK(memcmp(_rd, _wr, 0x100) == 0);
+  // and below with 3 byte addresses
+  memset(_cmds_seen, 0, sizeof(_cmds_seen));
+  TEST_RES(test_done(d, SPIFLASH_fast_read(&d->spi, mb16 - 0x810, 0x800, _rd)), SPIFLASH_OK);
+  TEST_CHECK(_cmds_seen[d->cmd.read_data_quad_io] && !_cmds_seen[d->cmd.read_data_quad_io_4b]);
+  TEST_CHECK(d->sim.errors == 0);
+  test_dev_free(d);
+}
+
+static void test_ctx_pool(uint8_t async) {
+  // two spi flashes sharing one operation context
+  test_dev_t *a = &_d;
+  test_dev_t *b = &_d2;
+  uint32_t xfers;
+  test_dev_init(a, async);
+  test_dev_init(b, async);
+  SPIFLASH_ctx_init(&b->spi, &a->pool);
+  test_fill(_wr, 0x100, 2);
+
+  TEST_RES(test_done(a, SPIFLASH_erase(&a->spi, 0x10000, 0x1000)), SPIFLASH_OK);
+  TEST_CHECK(a->ctx.spi == 0 && a->spi.ctx == 0);
+  TEST_RES(test_done(b, SPIFLASH_write(&b->spi, 0x10000, 0x100, _wr)), SPIFLASH_OK);
+  TEST_CHECK(a->ctx.spi == 0 && b->spi.ctx == 0);
+  TEST_CHECK(memcmp(&b->mem[0x10000], _wr, 0x100) == 0);
+  if (async) {
+    TEST_RES(SPIFLASH_erase(&a->spi, 0x20000, 0x1000), SPIFLASH_OK);
+    TEST_CHECK(a->ctx.spi == &a->spi && a->spi.ctx == &a->ctx);
+    TEST_RES(SPIFLASH_read(&b->spi, 0x10000, 0x100, _rd), SPIFLASH_ERR_BUSY);
+    TEST_RES(test_done(a, SPIFLASH_OK), SPIFLASH_OK);
+    TEST_CHECK(a->ctx.spi == 0);
+  }
+  memset(_rd, 0, 0x100);
+  TEST_RES(test_done(b, SPIFLASH_read(&b->spi, 0x10000, 0x100, _rd)), SPIFLASH_OK);
+  TEST_CHECK(memcmp(_rd, _wr, 0x100) == 0);
+
+  // no pool
+  SPIFLASH_ctx_init(&b->spi, 0);
+  TEST_RES(SPIFLASH_read(&b->spi, 0x10000, 0x100, _rd), SPIFLASH_ERR_BAD_CONFIG);
+
+  // an operation failing midway has the next one check the busy bit first
+  xfers = a->sim.xfers;
+  TEST_RES(test_done(a, SPIFLASH_read(&a->spi, 0x10000, 0x100, _rd)), SPIFLASH_OK);
+  xfers = a->sim.xfers - xfers;
+  a->hal._spiflash_spi_txrx = _test_txrx_fail;
+  _txrx_fail_at = 2;
+  TEST_RES(test_done(a, SPIFLASH_erase(&a->spi, 0x30000, 0x1000)), -1);
+  TEST_CHECK(a->spi.could_be_busy && a->ctx.spi == 0);
+  a->hal._spiflash_spi_txrx = SPIFLASH_sim_hal._spiflash_spi_txrx;
+  a->sim.xfers = 0;
+  TEST_RES(test_done(a, SPIFLASH_read(&a->spi, 0x10000, 0x100, _rd)), SPIFLASH_OK);
+  TEST_CHECK(a->sim.xfers == xfers + 1 && !a->spi.could_be_busy);
+  a->sim.xfers = 0;
+  TEST_RES(test_done(a, SPIFLASH_read(&a->spi, 0x10000, 0x100, _rd)), SPIFLASH_OK);
+  TEST_CHECK(a->sim.xfers == xfers);
+
+  TEST_CHECK(a->sim.errors == 0 && b->sim.errors == 0);
+  test_dev_free(a);
+  test_dev_free(b);
+}
+
+const test_t test_core[] = {
+  { "read write erase", test_read_write_erase },
+  { "readv writev", test_readv_writev },
+  { "update", test_update },
+  { "erase preserve", test_erase_preserve },
+  { "append", test_append },
+  { "write skip", test_write_skip },
+  { "write produce", test_write_produce },
+  { "stream", test_stream },
+  { "cache", test_cache },
+  { "verify", test_verify },
+  { "xip", test_xip },
+  { "read line", test_read_line },
+  { "suspend", test_suspend },
+  { "timing", test_timing },
+  { "stats", test_stats },
+  { "queue", test_queue },
+  { "queue suspend", test_queue_suspend },
+  { "4 byte address", test_addr_4b },
+  { "ctx pool", test_ctx_pool },
+  { 0, 0 },
+};
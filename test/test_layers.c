@@ -0,0 +1,440 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Peter Andersson (pelleplutt1976<at>gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * test_layers.c
+ *
+ * Tests of the layers on top of the driver: volumes, sector pools, bus
+ * arbitration, os front end and SFDP discovery.
+ *
+ * @author: petera
+ */
+
+#include "test.h"
+#include "spiflash_stripe.h"
+#include "spiflash_pool.h"
+#include "spiflash_bus.h"
+#include "spiflash_os.h"
+#include "spiflash_sfdp.h"
+
+static test_dev_t _devs[2];
+static uint8_t _wr[0x6000];
+static uint8_t _rd[0x6000];
+
+static uint32_t _st_cnt;
+static int _st_res;
+
+static void _test_stripe_cb(spiflash_stripe_t *st, spiflash_stripe_req_t *req,
+    int err_code) {
+  (void)st;
+  (void)req;
+  _st_cnt++;
+  _st_res = err_code;
+}
+
+static int _test_stripe(spiflash_stripe_t *st, spiflash_stripe_req_t *req,
+    spiflash_req_type_t type, uint32_t addr, uint32_t len, uint8_t *buf) {
+  int res;
+  memset(req, 0, sizeof(spiflash_stripe_req_t));
+  req->type = type;
+  req->addr = addr;
+  req->len = len;
+  req->rd_buf = buf;
+  req->cb = _test_stripe_cb;
+  _st_cnt = 0;
+  res = SPIFLASH_stripe_submit(st, req);
+  if (res != SPIFLASH_OK) return res;
+  SPIFLASH_sim_run(&_devs[0].spi);
+  SPIFLASH_sim_run(&_devs[1].spi);
+  if (_st_cnt != 1) return SPIFLASH_ERR_INTERNAL;
+  return _st_res;
+}
+
+static void test_stripe(uint8_t async) {
+  spiflash_stripe_t st;
+  spiflash_stripe_req_t req;
+  spiflash_t *devs[2] = { &_devs[0].spi, &_devs[1].spi };
+  uint32_t i;
+  test_dev_init(&_devs[0], async);
+  test_dev_init(&_devs[1], async);
+  TEST_RES(SPIFLASH_stripe_init(&st, devs, 2, 0x1000), SPIFLASH_OK);
+  TEST_CHECK(SPIFLASH_stripe_size(&st) == 2 * TEST_FLASH_SZ);
+  test_fill(_wr, sizeof(_wr), 20);
+
+  TEST_RES(_test_stripe(&st, &req, SPIFLASH_REQ_ERASE, 0x10000, 0x8000, 0), SPIFLASH_OK);
+  TEST_RES(_test_stripe(&st, &req, SPIFLASH_REQ_WRITE, 0x10800, 0x6000, _wr), SPIFLASH_OK);
+  // stripes alternate between the spi flashes
+  for (i = 0; i < 0x6000; i += 0x100) {
+    uint32_t va = 0x10800 + i;
+    uint32_t stripe = va / 0x1000;
+    test_dev_t *d = &_devs[stripe & 1];
+    TEST_CHECK(d->mem[(stripe / 2) * 0x1000 + (va & 0xfff)] == _wr[i]);
+  }
+  memset(_rd, 0, sizeof(_rd));
+  TEST_RES(_test_stripe(&st, &req, SPIFLASH_REQ_READ, 0x10800, 0x6000, _rd), SPIFLASH_OK);
+  TEST_CHECK(memcmp(_rd, _wr, 0x6000) == 0);
+
+  TEST_RES(_test_stripe(&st, &req, SPIFLASH_REQ_ERASE, 0x10800, 0x1000, 0),
+      SPIFLASH_ERR_ERASE_UNALIGNED);
+  TEST_RES(_test_stripe(&st, &req, SPIFLASH_REQ_READ, 2 * TEST_FLASH_SZ - 16, 32, _rd),
+      SPIFLASH_ERR_OUT_OF_RANGE);
+  TEST_CHECK(_devs[0].sim.errors == 0 && _devs[1].sim.errors == 0);
+  test_dev_free(&_devs[0]);
+  test_dev_free(&_devs[1]);
+}
+
+#define TEST_POOL_SECS    (8)
+#define TEST_POOL_ADDR    (0x80000)
+
+static void test_pool(uint8_t async) {
+  test_dev_t *d = &_devs[0];
+  spiflash_pool_t pool;
+  spiflash_pool_sec_t secs[TEST_POOL_SECS];
+  spiflash_req_t reqs[4];
+  uint32_t addr, i;
+  test_dev_init(d, async);
+  SPIFLASH_queue_init(&d->spi, &d->q, reqs, 4);
+  memset(&d->mem[TEST_POOL_ADDR], 0, TEST_POOL_SECS * 4096);
+  memset(secs, 0, sizeof(secs));
+  // the first sector is the most worn
+  secs[0].erases = 10;
+
+  TEST_RES(SPIFLASH_pool_init(&pool, &d->spi, secs, TEST_POOL_ADDR + 1,
+      TEST_POOL_SECS, 4096, 2), SPIFLASH_ERR_BAD_CONFIG);
+  TEST_RES(SPIFLASH_pool_init(&pool, &d->spi, secs, TEST_FLASH_SZ - 4096,
+      TEST_POOL_SECS, 4096, 2), SPIFLASH_ERR_OUT_OF_RANGE);
+  TEST_RES(SPIFLASH_pool_init(&pool, &d->spi, secs, TEST_POOL_ADDR,
+      TEST_POOL_SECS, 4096, 2), SPIFLASH_OK);
+  TEST_RES(SPIFLASH_pool_get(&pool, &addr), SPIFLASH_ERR_BUSY);
+
+  for (i = 0; i < TEST_POOL_SECS; i++) {
+    TEST_RES(SPIFLASH_pool_release(&pool, TEST_POOL_ADDR + i * 4096 + 7), SPIFLASH_OK);
+  }
+  TEST_RES(SPIFLASH_pool_release(&pool, TEST_POOL_ADDR - 1), SPIFLASH_ERR_OUT_OF_RANGE);
+  if (async) {
+    SPIFLASH_sim_run(&d->spi);
+  } else {
+    TEST_RES(SPIFLASH_pool_refill(&pool), SPIFLASH_OK);
+  }
+  TEST_RES(pool.res, SPIFLASH_OK);
+  TEST_CHECK(pool.ready == 2 && pool.dirty == TEST_POOL_SECS - 2);
+
+  // sectors come out erased, never the worn one while others are free
+  for (i = 0; i < TEST_POOL_SECS - 1; i++) {
+    TEST_RES(SPIFLASH_pool_get(&pool, &addr), SPIFLASH_OK);
+    TEST_CHECK(addr != TEST_POOL_ADDR);
+    TEST_CHECK(d->mem[addr] == 0xff && d->mem[addr + 4095] == 0xff);
+    TEST_CHECK((addr - TEST_POOL_ADDR) % 4096 == 0);
+    if (async) {
+      SPIFLASH_sim_run(&d->spi);
+    } else {
+      TEST_RES(SPIFLASH_pool_refill(&pool), SPIFLASH_OK);
+    }
+  }
+  TEST_CHECK(pool.ready == 1 && pool.dirty == 0);
+  TEST_RES(SPIFLASH_pool_get(&pool, &addr), SPIFLASH_OK);
+  TEST_CHECK(addr == TEST_POOL_ADDR && secs[0].erases == 11);
+  TEST_RES(SPIFLASH_pool_get(&pool, &addr), SPIFLASH_ERR_BUSY);
+  for (i = 1; i < TEST_POOL_SECS; i++) {
+    TEST_CHECK(secs[i].erases == 1);
+  }
+  TEST_CHECK(d->sim.errors == 0);
+  test_dev_free(d);
+}
+
+static spiflash_bus_client_t *_granted[4];
+static uint32_t _granted_cnt;
+
+static void _test_grant(spiflash_bus_client_t *client) {
+  if (_granted_cnt < 4) {
+    _granted[_granted_cnt] = client;
+  }
+  _granted_cnt++;
+}
+
+static void test_bus(uint8_t async) {
+  test_dev_t *d = &_devs[0];
+  spiflash_bus_t bus;
+  spiflash_bus_client_t a, b, c, fc;
+  uint32_t xfers;
+  SPIFLASH_bus_init(&bus);
+  SPIFLASH_bus_attach(&bus, &a, 0, _test_grant, 0);
+  SPIFLASH_bus_attach(&bus, &b, 0, _test_grant, 0);
+  SPIFLASH_bus_attach(&bus, &c, 1, _test_grant, 0);
+  _granted_cnt = 0;
+
+  // highest priority first, then first come first served
+  TEST_RES(SPIFLASH_bus_request(&a), SPIFLASH_OK);
+  TEST_RES(SPIFLASH_bus_request(&b), SPIFLASH_BUS_QUEUED);
+  TEST_RES(SPIFLASH_bus_request(&c), SPIFLASH_BUS_QUEUED);
+  SPIFLASH_bus_release(&a);
+  TEST_CHECK(_granted_cnt == 1 && _granted[0] == &c);
+  TEST_RES(SPIFLASH_bus_request(&a), SPIFLASH_BUS_QUEUED);
+  SPIFLASH_bus_release(&c);
+  TEST_CHECK(_granted_cnt == 2 && _granted[1] == &b);
+  SPIFLASH_bus_release(&b);
+  TEST_CHECK(_granted_cnt == 3 && _granted[2] == &a);
+  SPIFLASH_bus_release(&a);
+  TEST_CHECK(bus.owner == 0);
+  if (!async) return;
+
+  test_dev_init(d, async);
+  d->hal._spiflash_bus = SPIFLASH_bus_hal;
+  test_dev_start(d);
+  SPIFLASH_bus_attach_flash(&bus, &fc, &d->spi, 0);
+  test_fill(&d->mem[0x1000], 256, 21);
+
+  // the read waits for the bus
+  TEST_RES(SPIFLASH_bus_request(&a), SPIFLASH_OK);
+  xfers = d->sim.xfers;
+  TEST_RES(SPIFLASH_read(&d->spi, 0x1000, 256, _rd), SPIFLASH_OK);
+  SPIFLASH_sim_run(&d->spi);
+  TEST_CHECK(d->sim.xfers == xfers && d->cb_cnt == 0);
+  SPIFLASH_bus_release(&a);
+  TEST_RES(test_done(d, SPIFLASH_OK), SPIFLASH_OK);
+  TEST_CHECK(memcmp(_rd, &d->mem[0x1000], 256) == 0);
+  TEST_CHECK(bus.owner == 0);
+
+  // the bus is free while the erase is busy
+  TEST_RES(SPIFLASH_erase(&d->spi, 0x1000, 0x1000), SPIFLASH_OK);
+  TEST_CHECK(bus.owner == &fc);
+  while (bus.owner == &fc && d->sim.pending) {
+    d->sim.pending = 0;
+    SPIFLASH_async_trigger(&d->spi, SPIFLASH_OK);
+  }
+  TEST_CHECK(bus.owner == 0 && d->cb_cnt == 0);
+  TEST_RES(SPIFLASH_bus_request(&a), SPIFLASH_OK);
+  SPIFLASH_bus_release(&a);
+  TEST_RES(test_done(d, SPIFLASH_OK), SPIFLASH_OK);
+  TEST_CHECK(d->mem[0x1000] == 0xff && d->mem[0x1fff] == 0xff);
+  TEST_CHECK(d->sim.errors == 0);
+  test_dev_free(d);
+}
+
+static spiflash_sim_t *_os_sim;
+static int _os_locked;
+static uint32_t _os_sleeps;
+
+static void _test_os_lock(void *mutex) {
+  (void)mutex;
+  _os_locked++;
+}
+
+static void _test_os_unlock(void *mutex) {
+  (void)mutex;
+  _os_locked--;
+}
+
+static void _test_os_take(void *sem) {
+  // the simulated transfer is already done
+  (void)sem;
+  _os_sim->pending = 0;
+}
+
+static void _test_os_give(void *sem) {
+  (void)sem;
+}
+
+static void _test_os_sleep(uint32_t ms) {
+  _os_sim->now_ns += (uint64_t)ms * 1000000;
+  _os_sleeps++;
+}
+
+static const spiflash_os_t _test_os = {
+  .mutex_lock = _test_os_lock,
+  .mutex_unlock = _test_os_unlock,
+  .sem_take = _test_os_take,
+  .sem_give = _test_os_give,
+  .sleep_ms = _test_os_sleep,
+};
+
+static void test_os(uint8_t async) {
+  test_dev_t *d = &_devs[0];
+  spiflash_os_front_t front;
+  spiflash_iov_t iov[2];
+  spiflash_wbuf_t wb;
+  uint8_t wb_buf[256];
+  spiflash_stripe_t st;
+  spiflash_t *devs[1];
+  spiflash_pool_t pool;
+  spiflash_pool_sec_t secs[4];
+  uint32_t id, crc;
+  uint8_t sr;
+  test_dev_init(d, async);
+  if (!async) {
+    TEST_RES(SPIFLASH_os_init(&front, &d->spi, &_test_os, 0, 0), SPIFLASH_ERR_BAD_CONFIG);
+    test_dev_free(d);
+    return;
+  }
+  // busy waits by sleeping the task
+  d->hal._spiflash_wait = SPIFLASH_os_hal_wait;
+  d->hal._spiflash_wait_us = 0;
+  d->hal._spiflash_wait_ready = 0;
+  test_dev_start(d);
+  _os_sim = &d->sim;
+  _os_locked = 0;
+  _os_sleeps = 0;
+  TEST_RES(SPIFLASH_os_init(&front, &d->spi, &_test_os, 0, 0), SPIFLASH_OK);
+  test_fill(_wr, 1000, 22);
+
+  TEST_RES(SPIFLASH_os_read_jedec_id(&front, &id), SPIFLASH_OK);
+  // the id bytes in the order received, manufacturer first
+  TEST_CHECK(((id & 0xff) << 16 | (id & 0xff00) | ((id >> 16) & 0xff)) ==
+      d->sim.jedec_id);
+  TEST_RES(SPIFLASH_os_erase(&front, 0x2000, 0x1000), SPIFLASH_OK);
+  TEST_CHECK(_os_sleeps > 0);
+  TEST_RES(SPIFLASH_os_write(&front, 0x2010, 1000, _wr), SPIFLASH_OK);
+  TEST_CHECK(memcmp(&d->mem[0x2010], _wr, 1000) == 0);
+  memset(_rd, 0, sizeof(_rd));
+  TEST_RES(SPIFLASH_os_read(&front, 0x2010, 1000, _rd), SPIFLASH_OK);
+  TEST_CHECK(memcmp(_rd, _wr, 1000) == 0);
+  memset(_rd, 0, sizeof(_rd));
+  TEST_RES(SPIFLASH_os_fast_read(&front, 0x2010, 1000, _rd), SPIFLASH_OK);
+  TEST_CHECK(memcmp(_rd, _wr, 1000) == 0);
+  TEST_RES(SPIFLASH_os_read_sr(&front, &sr), SPIFLASH_OK);
+  TEST_CHECK((sr & 1) == 0);
+  TEST_RES(SPIFLASH_os_erase(&front, 0x2001, 0x1000), SPIFLASH_ERR_ERASE_UNALIGNED);
+
+  // sequences
+  TEST_RES(SPIFLASH_os_verify(&front, 0x2010, 1000, _wr), SPIFLASH_OK);
+  TEST_RES(SPIFLASH_os_crc32(&front, 0x2010, 1000, &crc), SPIFLASH_OK);
+  TEST_CHECK(crc == SPIFLASH_crc32_calc(0, _wr, 1000));
+  test_fill(_wr, 100, 23);
+  TEST_RES(SPIFLASH_os_update(&front, 0x2100, 100, _wr, _rd, 0x1000), SPIFLASH_OK);
+  TEST_CHECK(memcmp(&d->mem[0x2100], _wr, 100) == 0);
+  iov[0] = (spiflash_iov_t){ .addr = 0x3000, .len = 300, .buf = &_wr[0] };
+  iov[1] = (spiflash_iov_t){ .addr = 0x3200, .len = 50, .buf = &_wr[300] };
+  TEST_RES(SPIFLASH_os_erase(&front, 0x3000, 0x1000), SPIFLASH_OK);
+  TEST_RES(SPIFLASH_os_writev(&front, iov, 2), SPIFLASH_OK);
+  TEST_CHECK(memcmp(&d->mem[0x3000], &_wr[0], 300) == 0);
+  TEST_CHECK(memcmp(&d->mem[0x3200], &_wr[300], 50) == 0);
+  memset(_rd, 0, sizeof(_rd));
+  iov[0].buf = &_rd[0];
+  iov[1].buf = &_rd[300];
+  TEST_RES(SPIFLASH_os_readv(&front, iov, 2), SPIFLASH_OK);
+  TEST_CHECK(memcmp(_rd, _wr, 350) == 0);
+
+  // returning at once without transfer
+  SPIFLASH_wbuf_init(&d->spi, &wb, wb_buf, 0);
+  TEST_RES(SPIFLASH_os_flush(&front), SPIFLASH_OK);
+  TEST_RES(SPIFLASH_os_append(&front, 0x3400, 10, _wr), SPIFLASH_OK);
+  TEST_RES(SPIFLASH_os_append(&front, 0x340a, 10, &_wr[10]), SPIFLASH_OK);
+  TEST_RES(SPIFLASH_os_flush(&front), SPIFLASH_OK);
+  TEST_CHECK(memcmp(&d->mem[0x3400], _wr, 20) == 0);
+  TEST_RES(SPIFLASH_os_flush(&front), SPIFLASH_OK);
+  TEST_CHECK(_os_locked == 0);
+  TEST_CHECK(d->sim.errors == 0);
+
+  // one layer at a time
+  devs[0] = &d->spi;
+  TEST_RES(SPIFLASH_stripe_init(&st, devs, 1, 0), SPIFLASH_ERR_BAD_CONFIG);
+  TEST_RES(SPIFLASH_pool_init(&pool, &d->spi, secs, 0x10000, 4, 0x1000, 1),
+      SPIFLASH_ERR_BAD_CONFIG);
+  test_dev_start(d);
+  TEST_RES(SPIFLASH_stripe_init(&st, devs, 1, 0), SPIFLASH_OK);
+  TEST_RES(SPIFLASH_os_init(&front, &d->spi, &_test_os, 0, 0), SPIFLASH_ERR_BAD_CONFIG);
+  test_dev_free(d);
+}
+
+static uint8_t _sfdp[0x100];
+
+static void _test_sfdp_put(uint32_t dw, uint32_t v) {
+  uint8_t *p = &_sfdp[0x80 + (dw - 1) * 4];
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static void test_sfdp(uint8_t async) {
+  static const uint8_t hdr[16] = {
+      'S','F','D','P', 6, 1, 0, 0xff, 0x00, 6, 1, 16, 0x80, 0, 0, 0xff };
+  static spiflash_config_t cfg;
+  static spiflash_cmd_tbl_t cmd;
+  test_dev_t *d = &_devs[0];
+  uint8_t *bfpt = &_sfdp[0x80];
+  test_dev_init(d, async);
+  memset(_sfdp, 0xff, sizeof(_sfdp));
+  memcpy(_sfdp, hdr, sizeof(hdr));
+  // 128 Mbit, 4k/32k/64k erases, quad i/o with 6 dummy cycles, qe by sr2
+  _test_sfdp_put(1, 0xfff920e5);
+  _test_sfdp_put(2, 0x07ffffff);
+  _test_sfdp_put(3, 0x6b08eb44);
+  _test_sfdp_put(4, 0xbb423b08);
+  _test_sfdp_put(5, 0xfffffffe);
+  _test_sfdp_put(6, 0x0000ffff);
+  _test_sfdp_put(7, 0xeb44ffff);
+  _test_sfdp_put(8, 0x520f200c);
+  _test_sfdp_put(9, 0xff00d810);
+  _test_sfdp_put(10, (2 | 1 << 5) << 4 | (9 | 1 << 5) << 11 | (1 | 2 << 5) << 18 | 0x2);
+  _test_sfdp_put(11, 8 << 4 | (6 | 1 << 5) << 8 | (9 | 2 << 5) << 24);
+  _test_sfdp_put(15, 6 << 20);
+
+  cfg = d->cfg;
+  cmd = (spiflash_cmd_tbl_t)SPIFLASH_CMD_TBL_STANDARD;
+  TEST_RES(SPIFLASH_sfdp_parse(bfpt, 8, &cfg, &cmd), SPIFLASH_ERR_UNSUPPORTED);
+  TEST_RES(SPIFLASH_sfdp_parse(bfpt, 16, &cfg, &cmd), SPIFLASH_OK);
+  TEST_CHECK(cfg.sz == 16 * 1024 * 1024 && cfg.page_sz == 256 && cfg.addr_sz == 3);
+  TEST_CHECK(cmd.block_erase_4 == 0x20 && cmd.block_erase_32 == 0x52 &&
+      cmd.block_erase_64 == 0xd8 && cmd.block_erase_8 == 0);
+  TEST_CHECK(cfg.block_erase_4_ms == 48 && cfg.block_erase_32_ms == 160 &&
+      cfg.block_erase_64_ms == 256 && cfg.chip_erase_ms == 40000);
+  TEST_CHECK(cmd.read_data_quad_io == 0xeb && cmd.read_data_quad_io_dummy == 6);
+  TEST_CHECK(cmd.qe_bit == 0x02 && cmd.qe_read_reg == 0x35 && cmd.qe_write_reg == 0x31);
+
+  d->sim.sfdp = _sfdp;
+  d->sim.sfdp_len = sizeof(_sfdp);
+  cfg = d->cfg;
+  cmd = (spiflash_cmd_tbl_t)SPIFLASH_CMD_TBL_STANDARD;
+  if (async) {
+    TEST_RES(SPIFLASH_sfdp_discover(&d->spi, &cfg, &cmd), SPIFLASH_ERR_BAD_CONFIG);
+    test_dev_free(d);
+    return;
+  }
+  TEST_RES(SPIFLASH_sfdp_discover(&d->spi, &cfg, &cmd), SPIFLASH_OK);
+  TEST_CHECK(d->spi.cfg == &cfg && d->spi.cmd_tbl == &cmd);
+  TEST_CHECK(cfg.sz == 16 * 1024 * 1024 && cmd.block_erase_32 == 0x52);
+  // the simulated flash is smaller, stay within it
+  test_fill(_wr, 5000, 23);
+  TEST_RES(SPIFLASH_erase(&d->spi, 0x8000, 0x8000), SPIFLASH_OK);
+  TEST_RES(SPIFLASH_write(&d->spi, 0x8010, 5000, _wr), SPIFLASH_OK);
+  TEST_RES(SPIFLASH_read(&d->spi, 0x8010, 5000, _rd), SPIFLASH_OK);
+  TEST_CHECK(memcmp(_rd, _wr, 5000) == 0);
+
+  _sfdp[0] = 0xff;
+  SPIFLASH_init(&d->spi, &d->cfg, &d->cmd, &d->hal, 0, 0, &d->sim);
+  SPIFLASH_ctx_init(&d->spi, &d->pool);
+  cfg = d->cfg;
+  TEST_RES(SPIFLASH_sfdp_discover(&d->spi, &cfg, &cmd), SPIFLASH_ERR_UNSUPPORTED);
+  TEST_CHECK(d->sim.errors == 0);
+  test_dev_free(d);
+}
+
+const test_t test_layers[] = {
+  { "stripe", test_stripe },
+  { "pool", test_pool },
+  { "bus", test_bus },
+  { "os", test_os },
+  { "sfdp", test_sfdp },
+  { 0, 0 },
+};
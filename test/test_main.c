@@ -0,0 +1,133 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Peter Andersson (pelleplutt1976<at>gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * test_main.c
+ *
+ * Runs the host tests, each once synchronous and once asynchronous.
+ *
+ * @author: petera
+ */
+
+#include "test.h"
+#include <stdlib.h>
+
+static int _test_failed;
+static int _test_skipped;
+
+static void _test_async_cb(spiflash_t *spi, spiflash_op_t op, int err_code) {
+  test_dev_t *d = (test_dev_t *)spi->user_data;
+  (void)op;
+  d->cb_cnt++;
+  d->cb_res = err_code;
+}
+
+void test_dev_init(test_dev_t *d, uint8_t async) {
+  memset(d, 0, sizeof(test_dev_t));
+  d->cfg = TEST_CFG;
+  d->cmd = TEST_CMD;
+  d->hal = SPIFLASH_sim_hal;
+  d->mem = malloc(TEST_FLASH_SZ);
+  SPIFLASH_sim_init(&d->sim, &d->cfg, &d->cmd, d->mem);
+  d->spi.async = async;
+  test_dev_start(d);
+}
+
+void test_dev_start(test_dev_t *d) {
+  SPIFLASH_init(&d->spi, &d->cfg, &d->cmd, &d->hal, _test_async_cb,
+      d->spi.async, &d->sim);
+  SPIFLASH_ctx_pool_init(&d->pool, &d->ctx, 1);
+  SPIFLASH_suspend_init(&d->ctx, &d->sus);
+  SPIFLASH_seq_init(&d->ctx, &d->sq);
+  SPIFLASH_ctx_init(&d->spi, &d->pool);
+}
+
+void test_dev_free(test_dev_t *d) {
+  free(d->mem);
+  d->mem = 0;
+}
+
+int test_done(test_dev_t *d, int res) {
+  uint32_t cnt;
+  if (res != SPIFLASH_OK) return res;
+  SPIFLASH_sim_run(&d->spi);
+  if (!d->spi.async) return SPIFLASH_OK;
+  cnt = d->cb_cnt;
+  d->cb_cnt = 0;
+  if (cnt != 1) {
+    printf("  %u asynchronous callbacks\n", (unsigned)cnt);
+    return SPIFLASH_ERR_INTERNAL;
+  }
+  return d->cb_res;
+}
+
+void test_fill(uint8_t *buf, uint32_t len, uint32_t seed) {
+  while (len--) {
+    seed = seed * 1103515245 + 12345;
+    *buf++ = seed >> 16;
+  }
+}
+
+void test_fail(const char *file, int line, const char *what, int res,
+    int expected) {
+  _test_failed = 1;
+  if (res != expected) {
+    printf("  %s:%i: %s gave %i, expected %i\n", file, line, what, res, expected);
+  } else {
+    printf("  %s:%i: %s failed\n", file, line, what);
+  }
+}
+
+void test_skip(void) {
+  _test_skipped = 1;
+}
+
+#ifndef TEST_NO_MAIN
+
+static int _test_run(const test_t *tests) {
+  int fails = 0;
+  uint8_t async;
+  for (; tests->name; tests++) {
+    for (async = 0; async < 2; async++) {
+      _test_failed = 0;
+      _test_skipped = 0;
+      tests->fn(async);
+      printf("%-4s %-24s %s\n", _test_failed ? "FAIL" : (_test_skipped ? "skip" : "ok"),
+          tests->name, async ? "async" : "sync");
+      fails += _test_failed;
+    }
+  }
+  return fails;
+}
+
+int main(void) {
+  int fails = _test_run(test_core) + _test_run(test_layers);
+  if (fails) {
+    printf("%i failed\n", fails);
+    return 1;
+  }
+  printf("all passed\n");
+  return 0;
+}
+
+#endif // TEST_NO_MAIN